@@ -0,0 +1,115 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <iostream>
+#include <chrono>
+#include <ftl.h>
+
+using namespace ftl;
+
+#define N 10000000
+
+struct guest {
+    u64 pc;
+    u64 acc;
+    u64 n;
+};
+
+guest state;
+
+// two blocks calling each other until n reaches zero; they either return
+// to C++ after each block, jump to the resident dispatch loop or are
+// linked to each other directly
+static func gen_block(cbuf& buffer, dispatcher* d, u64 pc, bool link) {
+    func code(pc == 0 ? "even" : "odd", buffer, &state);
+    label done = code.gen_label("done");
+
+    value vpc = code.gen_global_i64("pc", &state.pc);
+    value acc = code.gen_global_i64("acc", &state.acc);
+    value n = code.gen_global_i64("n", &state.n);
+
+    code.gen_add(acc, pc == 0 ? 1 : 3);
+    code.gen_mov(vpc, pc ^ 4);
+    code.gen_sub(n, 1);
+    code.gen_jz(done);
+
+    if (d == nullptr)
+        code.gen_ret(EXIT_NONE);
+    else if (link)
+        code.gen_exit(*d, EXIT_JUMP, pc ^ 4);
+    else
+        code.gen_dispatch(*d);
+
+    done.place();
+    code.gen_ret(EXIT_USER);
+    code.finish();
+    return code;
+}
+
+static double run_native() {
+    cbuf buffer(4 * KiB);
+    func even = gen_block(buffer, nullptr, 0, false);
+    func odd = gen_block(buffer, nullptr, 4, false);
+
+    state = { 0, 0, N };
+    auto start = std::chrono::steady_clock::now();
+    while (invoke(buffer, state.pc ? odd.entry() : even.entry(), &state)
+           != EXIT_USER) {
+        // next block is looked up in C++
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> ns = end - start;
+    return ns.count() / N;
+}
+
+static double run_dispatch(bool link) {
+    cbuf buffer(4 * KiB);
+    dispatcher d(buffer, &state, &state.pc);
+    d.insert(0, gen_block(buffer, &d, 0, link).entry());
+    d.insert(4, gen_block(buffer, &d, 4, link).entry());
+
+    state = { 0, 0, N };
+    auto start = std::chrono::steady_clock::now();
+    d.run_until(EXIT_USER);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> ns = end - start;
+    return ns.count() / N;
+}
+
+int main() {
+    double t_native = run_native();
+    u64 r_native = state.acc;
+    double t_dispatch = run_dispatch(false);
+    u64 r_dispatch = state.acc;
+    double t_linked = run_dispatch(true);
+    u64 r_linked = state.acc;
+
+    std::cout << "block transition: " << t_native << "ns (exec) vs "
+              << t_dispatch << "ns (dispatcher) vs " << t_linked
+              << "ns (linked)" << std::endl;
+
+    for (u64 r : { r_dispatch, r_linked }) {
+        if (r_native != r) {
+            std::cout << "result mismatch: " << r_native << " != " << r
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
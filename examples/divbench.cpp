@@ -0,0 +1,97 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <iostream>
+#include <chrono>
+#include <ftl.h>
+
+using namespace ftl;
+
+#define N 10000000
+
+u64 divisor = 10;
+u64 result;
+
+// sums up i / 10 for all i < N, either using a constant divisor, which
+// gets turned into a multiplication, or reading it from memory, which
+// requires a real div instruction
+static func gen_bench(bool constant, bool sign) {
+    func code(constant ? "const" : "hw", 4 * KiB);
+    label loop = code.gen_label("loop");
+
+    value sum = code.gen_global_i64("result", &result);
+    value d = code.gen_global_i64("divisor", &divisor);
+    value i = code.gen_local_i64("i", N);
+    value q = code.gen_local_i64("q");
+    code.gen_mov(sum, 0);
+
+    loop.place();
+    code.gen_mov(q, i);
+    if (constant && sign)
+        code.gen_idiv(q, 10);
+    else if (constant)
+        code.gen_udiv(q, 10);
+    else if (sign)
+        code.gen_idiv(q, d);
+    else
+        code.gen_udiv(q, d);
+    code.gen_add(sum, q);
+    code.gen_sub(i, 1);
+    code.gen_jnz(loop);
+
+    code.gen_ret();
+    code.free_value(q);
+    code.free_value(i);
+    code.free_value(d);
+    code.free_value(sum);
+    code.finish();
+
+    return code;
+}
+
+static double run(func& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> ns = end - start;
+    return ns.count() / N;
+}
+
+int main() {
+    for (bool sign : { false, true }) {
+        func hw = gen_bench(false, sign);
+        func constant = gen_bench(true, sign);
+
+        double t_hw = run(hw);
+        u64 r_hw = result;
+        double t_const = run(constant);
+        u64 r_const = result;
+
+        std::cout << (sign ? "idiv" : "udiv") << " by 10: "
+                  << t_hw << "ns/iter (div) vs " << t_const
+                  << "ns/iter (const)" << std::endl;
+
+        if (r_hw != r_const) {
+            std::cout << "result mismatch: " << r_hw << " != " << r_const
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -22,10 +22,9 @@
 
 using namespace ftl;
 
-// helper to move immediate value into XMM register
-void helper_movs(emitter& e, reg temp, xmm dest, double val) {
-    e.movi(64, temp, f64_raw(val));
-    e.movx(64, dest, temp);
+// helper to load an immediate value from the literal pool into XMM register
+void helper_movs(emitter& e, xmm dest, double val) {
+    e.movs(64, dest, e.literal(f64_raw(val)));
 }
 
 
@@ -38,8 +37,8 @@ int main() {
     typedef double (func)(double a, double b, double t, double p, int n);
     func* calc = (func*)code.get_code_ptr();
 
-    helper_movs(emitter, RDX, XMM4, 2.0);
-    helper_movs(emitter, RDX, XMM5, 4.0);
+    helper_movs(emitter, XMM4, 2.0);
+    helper_movs(emitter, XMM5, 4.0);
 
     entry = code.get_code_ptr();
 
@@ -0,0 +1,196 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <iostream>
+#include <chrono>
+#include <math.h>
+#include <ftl.h>
+
+using namespace ftl;
+
+#define N 20000   // prime: count primes below N
+#define ITER 3    // gauss: number of iterations
+#define REPEAT 20000
+
+#define Q 28      // gauss: fixed point fraction bits
+
+i64 iterations = ITER;
+i64 result;
+
+// counts primes below N by trial division, same as prime.cpp but for all
+// numbers at once; the loop counter update is independent of the remainder
+static void gen_prime(func& code, u32 passes) {
+    irbuf ir(code, passes);
+    label outer = code.gen_label("outer");
+    label inner = code.gen_label("inner");
+    label found = code.gen_label("found");
+    label next = code.gen_label("next");
+    label done = code.gen_label("done");
+
+    value count = code.gen_local_i64("count");
+    value n = code.gen_local_i64("n");
+    value i = code.gen_local_i64("i");
+    value sq = code.gen_local_i64("sq");
+    value r = code.gen_local_i64("r");
+
+    ir.gen_mov(count, 0);
+    ir.gen_mov(n, 2);
+    ir.place(outer);
+    ir.gen_cmp(n, N);
+    ir.gen_jcc(IR_GE, done);
+    ir.gen_mov(i, 2);
+
+    ir.place(inner);
+    ir.gen_mov(sq, i);
+    ir.gen_imul(sq, i);
+    ir.gen_cmp(sq, n);
+    ir.gen_jcc(IR_G, found);
+    ir.gen_mov(r, n);
+    ir.gen_umod(r, i);
+    ir.gen_inc(i);
+    ir.gen_tst(r, r);
+    ir.gen_jcc(IR_Z, next);
+    ir.gen_jmp(inner);
+
+    ir.place(found);
+    ir.gen_inc(count);
+    ir.place(next);
+    ir.gen_inc(n);
+    ir.gen_jmp(outer);
+
+    ir.place(done);
+    ir.gen_ret(count);
+    ir.free_value(count);
+    ir.free_value(n);
+    ir.free_value(i);
+    ir.free_value(sq);
+    ir.free_value(r);
+    ir.lower();
+}
+
+// the Gauss-Legendre iteration from gauss.cpp in fixed point arithmetic,
+// the square root is computed using Newton steps: a lot of independent
+// divides and multiplications within a single block
+static void gen_gauss(func& code, u32 passes) {
+    irbuf ir(code, passes);
+    label loop = code.gen_label("loop");
+
+    value k = code.gen_global_i64("iterations", &iterations);
+    value res = code.gen_global_i64("result", &result);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+    value t = code.gen_local_i64("t");
+    value p = code.gen_local_i64("p");
+    value n = code.gen_local_i64("n");
+    value a2 = code.gen_local_i64("a2");
+    value ab = code.gen_local_i64("ab");
+    value g = code.gen_local_i64("g");
+    value q = code.gen_local_i64("q");
+    value d = code.gen_local_i64("d");
+
+    ir.gen_mov(a, 1ll << Q);
+    ir.gen_mov(b, (i64)((1ll << Q) / sqrt(2.0)));
+    ir.gen_mov(t, 1ll << (Q - 2));
+    ir.gen_mov(p, 1);
+    ir.gen_mov(n, k);
+
+    ir.place(loop);
+    ir.gen_mov(a2, a); // a2 = (a + b) / 2
+    ir.gen_add(a2, b);
+    ir.gen_shr(a2, 1);
+
+    ir.gen_mov(ab, a); // b2 = sqrt(a * b)
+    ir.gen_imul(ab, b);
+    ir.gen_mov(g, a2);
+    for (int step = 0; step < 4; step++) {
+        ir.gen_mov(q, ab);
+        ir.gen_udiv(q, g);
+        ir.gen_add(g, q);
+        ir.gen_shr(g, 1);
+    }
+
+    ir.gen_mov(d, a); // t2 = p * (a - a2)^2
+    ir.gen_sub(d, a2);
+    ir.gen_imul(d, d);
+    ir.gen_sha(d, Q);
+    ir.gen_imul(d, p);
+
+    ir.gen_mov(a, a2);
+    ir.gen_mov(b, g);
+    ir.gen_sub(t, d);
+    ir.gen_shl(p, 1);
+    ir.gen_dec(n);
+    ir.gen_jcc(IR_NZ, loop, true);
+
+    ir.gen_add(a, b); // return (a + b)^2 / (4 * t)
+    ir.gen_imul(a, a);
+    ir.gen_shl(t, 2);
+    ir.gen_udiv(a, t);
+    ir.gen_mov(res, a);
+    ir.gen_ret(a);
+
+    for (value* v : { &a, &b, &t, &p, &n, &a2, &ab, &g, &q, &d })
+        ir.free_value(*v);
+    ir.lower();
+}
+
+static func gen_bench(void (*gen)(func&, u32), u32 passes) {
+    func code(passes & IR_SCHED ? "sched" : "plain", 4 * KiB);
+    gen(code, passes);
+    code.finish();
+    return code;
+}
+
+static double run(func& fn, int repeat, i64& ret) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+        ret = fn();
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> ns = end - start;
+    return ns.count() / repeat;
+}
+
+static bool bench(const char* name, void (*gen)(func&, u32), int repeat) {
+    func plain = gen_bench(gen, IR_ALLPASSES & ~IR_SCHED);
+    func sched = gen_bench(gen, IR_ALLPASSES);
+
+    i64 r_plain = 0, r_sched = 0;
+    double t_plain = run(plain, repeat, r_plain);
+    double t_sched = run(sched, repeat, r_sched);
+
+    std::cout << name << ": " << t_plain << "ns/call (in order) vs "
+              << t_sched << "ns/call (scheduled), result " << r_sched
+              << std::endl;
+
+    if (r_plain != r_sched) {
+        std::cout << "result mismatch: " << r_plain << " != " << r_sched
+                  << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    if (!bench("prime", gen_prime, 10) || !bench("gauss", gen_gauss, REPEAT))
+        return 1;
+
+    double pi = (double)result / (1ll << Q);
+    std::cout << "pi = " << pi << std::endl;
+    return fabs(pi - M_PI) < 1e-6 ? 0 : 1;
+}
@@ -30,11 +30,16 @@
 #include "ftl/scalar.h"
 #include "ftl/fixup.h"
 #include "ftl/cbuf.h"
+#include "ftl/fault.h"
+#include "ftl/cpuinfo.h"
 #include "ftl/emitter.h"
 #include "ftl/label.h"
 #include "ftl/ralloc.h"
 #include "ftl/alloc.h"
 #include "ftl/func.h"
+#include "ftl/dispatch.h"
+#include "ftl/irbuf.h"
+#include "ftl/lazyflags.h"
 #include "ftl/jitdump.h"
 
 #include "ftl/version.h"
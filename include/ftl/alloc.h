@@ -32,6 +32,32 @@
 
 namespace ftl {
 
+    class regstate;
+
+    // Locals are addressed relative to the stack pointer, starting in the
+    // red zone below it. Only the part of the frame exceeding the red zone
+    // needs to be reserved by the prologue, calls skip the red zone.
+    const size_t STACK_RED_ZONE = 128;
+    const size_t STACK_ALIGNMENT = 32;
+    const size_t STACK_FRAME_MAX = 64 * KiB;
+
+    // Guest state that lives in a callee-saved register for the lifetime of
+    // a code buffer. It is loaded once when entering generated code and only
+    // written back when leaving it again.
+    struct pinned {
+        reg   r;
+        int   bits;
+        void* addr;
+    };
+
+    // Store of a dirty register to the memory home of its value, deferred
+    // to the recovery code of an instruction that may fault.
+    struct writeback {
+        reg r;
+        int bits;
+        rm  mem;
+    };
+
     class alloc
     {
     private:
@@ -39,12 +65,38 @@ namespace ftl {
         ralloc<reg> m_regs;
         ralloc<xmm> m_xmms;
 
-        u64         m_locals;
+        vector<bool> m_slots;
+        size_t      m_frame;
         u64         m_base;
+        bool        m_reachable;
+        value*      m_addr; // base address of far globals, if any
+        bool        m_xmm_spill;
+
+        // integer values spilled to otherwise unused xmm registers
+        const value* m_spills[NXMM];
+
+        vector<regstate*> m_states;
+        vector<pinned>    m_pins;
+
+        void forget(const value* val);
+        void forget(const scalar* val);
+        void flush_scratch_regs();
+
+        bool near_code(u64 addr) const;
+        bool can_materialize(int bits, i64 val) const;
+        void materialize(reg r, int bits, i64 val);
+
+        bool spill(reg r);
+        void unspill(xmm r);
+        void unspill_all();
+        void drop_spill(xmm r);
+        void drop_spills();
+        xmm  lookup_spill(const value* val) const;
+        xmm  select_fp(const scalar* val);
 
     public:
         alloc(emitter& e);
-        alloc(alloc&&) = default;
+        alloc(alloc&& other);
         ~alloc();
 
         alloc() = delete;
@@ -58,14 +110,14 @@ namespace ftl {
         bool is_dirty(reg r) const { return m_regs.is_dirty(r); }
         bool is_dirty(xmm r) const { return m_xmms.is_dirty(r); }
 
-        void mark_dirty(reg r) { m_regs.mark_dirty(r); }
+        void mark_dirty(reg r);
         void mark_dirty(xmm r) { m_xmms.mark_dirty(r); }
 
         void mark_clean(reg r) { m_regs.mark_clean(r); }
         void mark_clean(xmm r) { m_xmms.mark_clean(r); }
 
         void block(reg r) { m_regs.block(r); }
-        void block(xmm r) { m_xmms.block(r); }
+        void block(xmm r) { unspill(r); m_xmms.block(r); }
 
         void unblock(reg r) { m_regs.unblock(r); }
         void unblock(xmm r) { m_xmms.unblock(r); }
@@ -73,9 +125,21 @@ namespace ftl {
         bool is_blocked(reg r) const { return m_regs.is_blocked(r); }
         bool is_blocked(xmm r) const { return m_xmms.is_blocked(r); }
 
+        bool is_pinned(reg r) const { return m_regs.is_pinned(r); }
+        bool is_pinned(const value* val) const;
+
+        void pin(const pinned& p);
+        const vector<pinned>& get_pins() const { return m_pins; }
+
         reg  select()     const { return m_regs.select(); }
         xmm  select_xmm() const { return m_xmms.select(); }
 
+        reg  select(const value* val)  const { return m_regs.select(val); }
+        xmm  select(const scalar* val) const { return m_xmms.select(val); }
+
+        void set_plan(const regplan<reg>* plan) { m_regs.set_plan(plan); }
+        void set_plan(const regplan<xmm>* plan) { m_xmms.set_plan(plan); }
+
         reg  lookup(const value* val) { return m_regs.lookup(val); }
         xmm  lookup(const scalar* val) { return m_xmms.lookup(val); }
 
@@ -91,16 +155,38 @@ namespace ftl {
         void flush(reg r);
         void flush(xmm r);
 
+        reg  relocate(reg r);
+        xmm  relocate(xmm r);
+
+        bool xmm_spill() const { return m_xmm_spill; }
+        void set_xmm_spill(bool enable);
+
+        bool is_spilled(const value* val) const;
+        void unspill(const value* val);
+        size_t count_spills() const;
+
         void register_value(value* val) { m_regs.register_value(val); }
         void register_value(scalar* val) { m_xmms.register_value(val); }
 
-        void unregister_value(value* val) { m_regs.unregister_value(val); }
-        void unregister_value(scalar* val) { m_xmms.unregister_value(val); }
+        void unregister_value(value* val);
+        void unregister_value(scalar* val);
+
+        void register_state(regstate* state);
+        void unregister_state(regstate* state);
 
+        void save_state(regstate& state);
+        void load_state(const regstate& state);
+        void merge_state(const regstate& state);
+
+        bool is_reachable() const { return m_reachable; }
+        void mark_reachable() { m_reachable = true; }
+        void mark_unreachable();
 
         u64  get_base_addr() const { return m_base; }
         void set_base_addr(u64 addr);
 
+        rm   address(u64 addr);
+
         value new_local_noinit(const string& name, int bits, reg r = NREGS);
         value new_local(const string& name, int bits, i64 val, reg r = NREGS);
         value new_global(const string& name, int bits, u64 addr);
@@ -116,6 +202,13 @@ namespace ftl {
         void free_value(value& val);
         void free_scalar(scalar& val);
 
+        i32  new_slot(size_t size, size_t align);
+        void free_slot(i32 offset, size_t size);
+
+        size_t frame_size() const;
+        size_t frame_peak() const { return m_frame; }
+        size_t red_zone_used() const;
+
         size_t count_active_regs() const;
         size_t count_dirty_regs() const;
 
@@ -125,6 +218,15 @@ namespace ftl {
         void store_volatile_regs();
         void flush_volatile_regs();
 
+        void store_pinned_regs();
+        void load_pinned_regs();
+
+        void store_global_regs(bool imprecise);
+        void flush_global_regs();
+        vector<writeback> fault_writebacks();
+
+        void forget_known(bool globals_only = false);
+
         void reset();
     };
 
@@ -133,6 +235,86 @@ namespace ftl {
         m_base = addr;
     }
 
+    inline size_t alloc::frame_size() const {
+        size_t sz = m_frame > STACK_RED_ZONE ? m_frame - STACK_RED_ZONE : 0;
+        return (sz + STACK_ALIGNMENT - 1) & ~(STACK_ALIGNMENT - 1);
+    }
+
+    inline size_t alloc::red_zone_used() const {
+        // slots are handed out from the bottom of the red zone upwards, so
+        // any slot in use means all of it needs skipping
+        return m_frame > 0 ? STACK_RED_ZONE : 0;
+    }
+
+    inline bool alloc::is_spilled(const value* val) const {
+        return xmm_valid(lookup_spill(val));
+    }
+
+    inline void alloc::mark_dirty(reg r) {
+        // the register has been written, so its old contents are unknown
+        const value* val = m_regs.lookup(r);
+        if (val != nullptr)
+            val->forget_known();
+        m_regs.mark_dirty(r);
+    }
+
+    inline void alloc::unregister_value(value* val) {
+        forget(val);
+        m_regs.unregister_value(val);
+    }
+
+    inline void alloc::unregister_value(scalar* val) {
+        forget(val);
+        m_xmms.unregister_value(val);
+    }
+
+    // Register assignment expected at a label. The first edge arriving at a
+    // label defines its state, all other edges must reconcile with it.
+    class regstate
+    {
+    private:
+        friend class alloc;
+
+        alloc&                m_alloc;
+        bool                  m_valid;
+        ralloc<reg>::snapshot m_regs;
+        ralloc<xmm>::snapshot m_xmms;
+
+    public:
+        bool is_valid() const { return m_valid; }
+        bool is_empty() const;
+
+        void clear();
+
+        regstate(alloc& al);
+        regstate(regstate&& other);
+        ~regstate();
+
+        regstate() = delete;
+        regstate(const regstate&) = delete;
+        regstate& operator = (const regstate&) = delete;
+    };
+
+    inline regstate::regstate(alloc& al):
+        m_alloc(al),
+        m_valid(false),
+        m_regs(),
+        m_xmms() {
+        m_alloc.register_state(this);
+    }
+
+    inline regstate::regstate(regstate&& other):
+        m_alloc(other.m_alloc),
+        m_valid(other.m_valid),
+        m_regs(other.m_regs),
+        m_xmms(other.m_xmms) {
+        m_alloc.register_state(this);
+    }
+
+    inline regstate::~regstate() {
+        m_alloc.unregister_state(this);
+    }
+
 }
 
 #endif
@@ -104,6 +104,14 @@ namespace ftl {
         return __builtin_ctzl(val); // works only if val is power of two!
     }
 
+    static inline int ctz(u32 val) {
+        return __builtin_ctz(val); // undefined for zero
+    }
+
+    static inline int popcount(u32 val) {
+        return __builtin_popcount(val);
+    }
+
     static inline u32 f32_raw(f32 val) {
         union { f32 f; u32 u; } helper;
         helper.f = val;
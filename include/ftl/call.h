@@ -25,206 +25,222 @@
 
 #include "ftl/reg.h"
 #include "ftl/value.h"
+#include "ftl/scalar.h"
 #include "ftl/alloc.h"
 #include "ftl/emitter.h"
 
 namespace ftl {
 
-    template <typename T>
-    struct arg_traits;
-
-    template <> struct arg_traits<bool> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, bool val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(8, r, val);
-        }
+    // Tells gen_call whether a helper accesses guest state that is pinned to
+    // registers; pinned values are only synchronized with memory on request.
+    enum call_state : u32 {
+        CALL_STATE_NONE  = 0,
+        CALL_STATE_READ  = 1 << 0, // helper reads pinned guest state
+        CALL_STATE_WRITE = 1 << 1, // helper modifies pinned guest state
+        CALL_STATE_RW    = CALL_STATE_READ | CALL_STATE_WRITE,
     };
 
-    template <> struct arg_traits<i8> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, i8 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(8, r, val);
-        }
-    };
+    // scratch register used to move stack arguments from memory to memory
+    const reg CALL_TEMP = R11;
 
-    template <> struct arg_traits<i16> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, i16 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(16, r, val);
-        }
-    };
+    struct call_slots {
+        size_t nregs;
+        size_t nxmms;
+        size_t nstack;
 
-    template <> struct arg_traits<i32> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, i32 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(32, r, val);
+        call_slots(): nregs(1), nxmms(0), nstack(0) {} // arg0 is data ptr
+
+        bool assign(reg& r) {
+            if (nregs >= param_regs.size()) {
+                nstack++;
+                return false;
+            }
+
+            r = param_regs[nregs++];
+            return true;
         }
-    };
 
-    template <> struct arg_traits<i64> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, i64 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(64, r, val);
+        bool assign(xmm& r) {
+            if (nxmms >= param_xmms.size()) {
+                nstack++;
+                return false;
+            }
+
+            r = param_xmms[nxmms++];
+            return true;
         }
-    };
 
-    template <> struct arg_traits<u8> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, u8 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(8, r, val);
+        i32 frame_size() const {
+            return (i32)((nstack * sizeof(u64) + 15) & ~15);
         }
     };
 
-    template <> struct arg_traits<u16> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, u16 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(16, r, val);
+    static inline void store_imm(alloc& a, int bits, const rm& slot, i64 v) {
+        emitter& e = a.get_emitter();
+        if (bits < 64 || fits_i32(v)) {
+            e.movi(bits, slot, v);
+        } else {
+            e.movi(64, CALL_TEMP, v);
+            e.movr(64, slot, CALL_TEMP);
         }
-    };
+    }
 
-    template <> struct arg_traits<u32> {
+    static inline void load_ext(emitter& e, reg r, const value& val) {
+        if (val.bits >= 32)
+            e.movr(val.bits, r, val);
+        else if (val.sign)
+            e.movsx(32, val.bits, r, val);
+        else
+            e.movzx(32, val.bits, r, val);
+    }
+
+    template <typename T, typename = void>
+    struct arg_traits;
+
+    template <typename T>
+    struct arg_traits<T, typename std::enable_if<std::is_integral<T>::value ||
+                                                 std::is_pointer<T>::value>::type> {
         typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, u32 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(32, r, val);
+
+        static void load(alloc& a, reg r, const T& val) {
+            a.relocate(r);
+            a.get_emitter().movi(64, r, (i64)(uintptr_t)val);
         }
-    };
 
-    template <> struct arg_traits<u64> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, u64 val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(64, r, (i64)val);
+        static void store(alloc& a, const rm& slot, const T& val) {
+            store_imm(a, 64, slot, (i64)(uintptr_t)val);
         }
     };
 
-    template <> struct arg_traits<f32> {
+    template <typename T>
+    struct arg_traits<T, typename std::enable_if<
+                                std::is_floating_point<T>::value>::type> {
         typedef xmm target_register_type;
-        static void fetch(alloc& a, unsigned int n, f32 val) {
-            emitter& e = a.get_emitter();
-            xmm r = argxmm(n);
-            a.flush(r);
-            a.flush(RAX);
-            e.movi(32, RAX, f32_raw(val));
-            e.movs(32, r, RAX);
+
+        static i64 raw(const T& val) {
+            return sizeof(T) == sizeof(f32) ? f32_raw(val) : f64_raw(val);
         }
-    };
 
-    template <> struct arg_traits<f64> {
-        typedef xmm target_register_type;
-        static void fetch(alloc& a, unsigned int n, f64 val) {
+        static void load(alloc& a, xmm r, const T& val) {
             emitter& e = a.get_emitter();
-            xmm r = argxmm(n);
-            a.flush(r);
-            a.flush(RAX);
-            e.movi(64, RAX, f64_raw(val));
-            e.movs(64, r, RAX);
+            a.relocate(r);
+            if (raw(val) == 0)
+                e.pxor(sizeof(T) * 8, r, r);
+            else
+                e.movs(sizeof(T) * 8, r, e.literal(raw(val)));
         }
-    };
 
-    template <typename T>
-    struct arg_traits<T*> {
-        typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, T* val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movi(64, r, (uintptr_t)val);
+        static void store(alloc& a, const rm& slot, const T& val) {
+            store_imm(a, sizeof(T) * 8, slot, raw(val));
         }
     };
 
-    template <> struct arg_traits<value> {
+    template <>
+    struct arg_traits<value> {
         typedef reg target_register_type;
-        static void fetch(alloc& a, unsigned int n, const value& val) {
-            emitter& e = a.get_emitter();
-            reg r = argreg(n + 1);
-            a.flush(r);
-            e.movr(val.bits, r, val);
+
+        static void load(alloc& a, reg r, const value& val) {
+            if (a.lookup(&val) != r)
+                a.relocate(r);
+            load_ext(a.get_emitter(), r, val);
+        }
+
+        static void store(alloc& a, const rm& slot, const value& val) {
+            load_ext(a.get_emitter(), CALL_TEMP, val);
+            a.get_emitter().movr(max(val.bits, 32), slot, CALL_TEMP);
         }
     };
 
-    template <> struct arg_traits<scalar> {
+    template <>
+    struct arg_traits<scalar> {
         typedef xmm target_register_type;
-        static void fetch(alloc& a, unsigned int n, const scalar& val) {
+
+        static void load(alloc& a, xmm r, const scalar& val) {
+            if (a.lookup(&val) == r)
+                return;
+
+            a.relocate(r);
+            a.get_emitter().movs(val.bits, r, val);
+        }
+
+        static void store(alloc& a, const rm& slot, const scalar& val) {
             emitter& e = a.get_emitter();
-            xmm r = argxmm(n);
-            a.flush(r);
-            e.movs(val.bits, r, val);
+            if (val.is_reg()) {
+                e.movs(val.bits, slot, val);
+            } else {
+                e.movr(val.bits, CALL_TEMP, val);
+                e.movr(val.bits, slot, CALL_TEMP);
+            }
         }
     };
 
-    template <typename T, typename A>
-    inline constexpr unsigned int argno() {
-        typedef typename arg_traits<T>::target_register_type this_reg_type;
-        typedef typename arg_traits<A>::target_register_type other_reg_type;
-        return std::is_same<this_reg_type,other_reg_type>() ? 1 : 0;
-    }
-
-    template <typename T, typename A, typename B>
-    inline constexpr unsigned int argno() {
-        return argno<T,A>() + argno<T,B>();
-    }
+    template <typename... ARGS>
+    struct call_args;
 
-    template <typename T, typename A, typename B, typename C>
-    inline constexpr unsigned int argno() {
-        return argno<T,A,B>() + argno<T,C>();
-    }
+    template <>
+    struct call_args<> {
+        static void count(call_slots& s) {}
+        static void store(alloc& a, call_slots& s, i32 frame) {}
+        static void load(alloc& a, call_slots& s) {}
+    };
 
-    template <typename T, typename A, typename B, typename C, typename D>
-    inline constexpr unsigned int argno() {
-        return argno<T,A,B,C>() + argno<T,D>();
-    }
+    template <typename T, typename... ARGS>
+    struct call_args<T, ARGS...> {
+        typedef typename arg_traits<T>::target_register_type reg_type;
 
-    template <typename T>
-    struct arg {
-        static void fetch(alloc& a, const T& val) {
-            arg_traits<T>::fetch(a, 0, val);
+        static void count(call_slots& s) {
+            reg_type r;
+            s.assign(r);
+            call_args<ARGS...>::count(s);
         }
 
-        template <typename A>
-        static void fetch(alloc& a, const T& val) {
-            arg_traits<T>::fetch(a, argno<T,A>(), val);
+        static void store(alloc& a, call_slots& s, i32 frame, const T& val,
+                          const ARGS&... args) {
+            reg_type r;
+            i32 offset = s.nstack * sizeof(u64) - frame;
+            if (!s.assign(r))
+                arg_traits<T>::store(a, memop(STACK_POINTER, offset), val);
+            call_args<ARGS...>::store(a, s, frame, args...);
         }
 
-        template <typename A, typename B>
-        static void fetch(alloc& a, const T& val) {
-            arg_traits<T>::fetch(a, argno<T,A,B>(), val);
-        }
+        static void load(alloc& a, call_slots& s, const T& val,
+                         const ARGS&... args) {
+            reg_type r;
+            if (s.assign(r)) {
+                arg_traits<T>::load(a, r, val);
+                a.block(r);
+            }
 
-        template <typename A, typename B, typename C>
-        static void fetch(alloc& a, const T& val) {
-            arg_traits<T>::fetch(a, argno<T,A,B,C>(), val);
+            call_args<ARGS...>::load(a, s, args...);
         }
+    };
 
-        template <typename A, typename B, typename C, typename D>
-        static void fetch(alloc& a, const T& val) {
-            arg_traits<T>::fetch(a, argno<T,A,B,C,D>(), val);
-        }
+    template <typename FUNC>
+    struct call_result {
+        typedef value type;
+        enum : int { bits = 64 };
+        enum : bool { variadic = false };
+    };
+
+    template <typename RET, typename... ARGS>
+    struct call_result<RET(ARGS..., ...)> {
+        typedef value type;
+        enum : int { bits = 64 };
+        enum : bool { variadic = true };
+    };
+
+    template <typename... ARGS>
+    struct call_result<f32(ARGS...)> {
+        typedef scalar type;
+        enum : int { bits = 32 };
+        enum : bool { variadic = false };
+    };
+
+    template <typename... ARGS>
+    struct call_result<f64(ARGS...)> {
+        typedef scalar type;
+        enum : int { bits = 64 };
+        enum : bool { variadic = false };
     };
 
 }
@@ -21,6 +21,7 @@
 
 #include "ftl/common.h"
 #include "ftl/error.h"
+#include "ftl/fixup.h"
 
 namespace ftl {
 
@@ -42,7 +43,21 @@ namespace ftl {
         u8* m_code_ptr;
         u8* m_code_end;
 
+        // stack frame reserved by the prologue, shared by all functions
+        fixup  m_frame_enter;
+        fixup  m_frame_leave;
+        size_t m_frame_size;
+
+        // literal pool, grows downwards from the end of the buffer
+        map<u64, const u8*> m_literals64;
+        map<std::pair<u64, u64>, const u8*> m_literals128;
+
+        // host instructions that may fault and the code recovering from
+        // their faults, sorted by instruction address
+        vector<std::pair<const u8*, const u8*>> m_faults;
+
         size_t write(const void* ptr, size_t sz);
+        u8* alloc_literal(size_t sz);
 
     public:
         const u8* get_code_entry() const { return m_code_head; }
@@ -56,11 +71,17 @@ namespace ftl {
         size_t size() const { return m_code_ptr - m_code_head; }
         size_t size_remaining() const { return m_code_end - m_code_ptr; }
         size_t capacity() const { return m_capacity; }
+        size_t pool_size() const;
+        size_t frame_size() const { return m_frame_size; }
 
         bool is_empty() const { return m_code_ptr == m_code_head; }
         bool is_full() const { return m_code_ptr >= m_code_end; }
 
+        bool contains(const u8* ptr) const;
+
         u8* mark_exit();
+        void mark_frame(const fixup& enter, const fixup& leave);
+        void reserve_frame(size_t size);
         u8* align(size_t alignment);
 
         cbuf(size_t capacity);
@@ -74,6 +95,13 @@ namespace ftl {
         void reset(u8* addr);
         void reset();
 
+        const u8* literal(u64 val);
+        const u8* literal(u64 lo, u64 hi);
+
+        size_t count_faults() const { return m_faults.size(); }
+        void add_fault(const u8* insn, const u8* stub);
+        const u8* find_fault(const u8* insn) const;
+
         template <typename T>
         size_t write(const T& val);
     };
@@ -87,6 +115,14 @@ namespace ftl {
         return n;
     }
 
+    inline size_t cbuf::pool_size() const {
+        return m_code_head + m_capacity - m_code_end;
+    }
+
+    inline bool cbuf::contains(const u8* ptr) const {
+        return ptr >= m_code_head && ptr < m_code_head + m_capacity;
+    }
+
     template <typename T>
     inline size_t cbuf::write(const T& val) {
         return write(&val, sizeof(T));
@@ -29,7 +29,11 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <array>
+#include <functional>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
@@ -70,7 +74,11 @@ namespace ftl {
     using std::string;
     using std::vector;
     using std::set;
+    using std::map;
+    using std::unordered_map;
+    using std::unordered_set;
     using std::array;
+    using std::function;
     using std::stringstream;
 
     using std::atomic;
@@ -0,0 +1,126 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef FTL_CPUINFO_H
+#define FTL_CPUINFO_H
+
+#include "ftl/common.h"
+#include "ftl/error.h"
+
+namespace ftl {
+
+    enum cpu_feature : u32 {
+        CPU_SSE2 = 0,
+        CPU_SSE3,
+        CPU_SSSE3,
+        CPU_SSE41,
+        CPU_SSE42,
+        CPU_POPCNT,
+        CPU_CX16,
+        CPU_LAHF,
+        CPU_AVX,
+        CPU_AVX2,
+        CPU_BMI1,
+        CPU_BMI2,
+        CPU_FMA,
+        CPU_F16C,
+        CPU_LZCNT,
+        CPU_MOVBE,
+        CPU_AVX512F,
+        CPU_AVX512BW,
+        CPU_AVX512CD,
+        CPU_AVX512DQ,
+        CPU_AVX512VL,
+        CPU_ERMS,
+        CPU_FSRM,
+        CPU_CLFLUSHOPT,
+        CPU_CLWB,
+        CPU_RDTSCP,
+        NFEATURES
+    };
+
+    // Instruction set levels as defined by the x86-64 psABI. Features that
+    // are not part of any level (e.g. ERMS or CLWB) are only used in native
+    // mode, so that code generated for a fixed level does not depend on the
+    // particular machine it was generated on.
+    enum isa_level : u32 {
+        ISA_BASELINE = 0, // x86-64: SSE2
+        ISA_X86_64_V2,    // + SSE3, SSSE3, SSE4.1, SSE4.2, POPCNT, CX16, LAHF
+        ISA_X86_64_V3,    // + AVX, AVX2, BMI1, BMI2, FMA, F16C, LZCNT, MOVBE
+        ISA_X86_64_V4,    // + AVX512F, AVX512BW, AVX512CD, AVX512DQ, AVX512VL
+        ISA_NATIVE,       // everything the host supports
+    };
+
+    const char* cpu_feature_name(cpu_feature f);
+    const char* isa_level_name(isa_level l);
+
+    class cpuinfo // singleton
+    {
+    private:
+        u64       m_detected;
+        u64       m_enabled;
+        u64       m_forced_on;  // set_feature overrides, these persist
+        u64       m_forced_off; // across changes of the ISA level
+        isa_level m_level;
+        string    m_vendor;
+
+        void detect();
+        void update();
+
+        cpuinfo();
+        ~cpuinfo();
+
+        cpuinfo(const cpuinfo&) = delete;
+        cpuinfo& operator = (const cpuinfo&) = delete;
+
+    public:
+        const char* vendor() const { return m_vendor.c_str(); }
+
+        bool detected(cpu_feature f) const;
+        bool has(cpu_feature f) const;
+
+        isa_level level() const { return m_level; }
+        isa_level host_level() const;
+
+        void set_level(isa_level l);
+        void set_feature(cpu_feature f, bool enable);
+        void reset();
+
+        // Pretends the host does or does not support a feature, so that
+        // code generation can be tested independent of the machine. Code
+        // using mocked features must not be executed; reset undoes this.
+        void mock_feature(cpu_feature f, bool present);
+
+        static cpuinfo& instance();
+    };
+
+    inline bool cpuinfo::detected(cpu_feature f) const {
+        return (m_detected >> f) & 1;
+    }
+
+    inline bool cpuinfo::has(cpu_feature f) const {
+        return (m_enabled >> f) & 1;
+    }
+
+    inline bool cpu_has(cpu_feature f) {
+        return cpuinfo::instance().has(f);
+    }
+
+}
+
+#endif
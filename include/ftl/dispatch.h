@@ -0,0 +1,192 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef FTL_DISPATCH_H
+#define FTL_DISPATCH_H
+
+#include "ftl/common.h"
+#include "ftl/bitops.h"
+#include "ftl/error.h"
+
+#include "ftl/cbuf.h"
+#include "ftl/fixup.h"
+#include "ftl/emitter.h"
+#include "ftl/alloc.h"
+
+namespace ftl {
+
+    // Reasons for generated code to return to the C++ side. Embedders may
+    // define their own, starting at EXIT_USER.
+    enum exit_reason : u32 {
+        EXIT_NONE    = 0,
+        EXIT_LOOKUP  = 1, // next block is missing from the lookup table
+        EXIT_JUMP    = 2, // continue at a known pc, never leaves the loop
+        EXIT_REQUEST = 3, // request_exit was called
+        EXIT_FAULT   = 4, // guest memory access faulted, see fault_address
+        EXIT_USER    = 16,
+    };
+
+    struct exit_info {
+        exit_reason reason;
+        u64         pc;
+    };
+
+    // Shadow stack of guest return addresses and the host code continuing
+    // after the corresponding guest call. It must be part of guest state,
+    // where generated code reaches it using the data pointer.
+    struct retstack {
+        static const size_t SIZE = 16;
+
+        struct entry {
+            u64       pc;
+            const u8* code;
+        };
+
+        u64   top;
+        entry ring[SIZE];
+    };
+
+    // Returns the code for the block at a guest address, nullptr if there
+    // is none.
+    typedef function<const u8*(u64 pc)> translator;
+
+    // Resident dispatch loop within a code buffer. Blocks end by jumping to
+    // the loop, which looks up the block at the guest program counter in a
+    // direct mapped table and jumps to it. Generated code only returns to
+    // C++ on lookup misses or when a block explicitly exits.
+    //
+    // Side exits jump to a stub that records the pc and exit reason. Stubs
+    // are shared by all exits with the same reason and pc. Exits to a known
+    // pc (EXIT_JUMP) get linked directly to the target block once it has
+    // been inserted. Linked jumps skip writing the pc, so blocks must not
+    // rely on the pc in memory being up to date on entry.
+    //
+    // Guest calls push their return address onto a shadow stack, so that
+    // the matching guest return can jump straight back into the calling
+    // block instead of going through the lookup table.
+    //
+    // Once an exit flag has been set, the loop and all linked exits test it
+    // before moving on to the next block, so that request_exit also stops
+    // blocks that have been chained into a loop. The flag regenerates the
+    // loop, so it must be set before generating any further code into the
+    // buffer, which might refer to the old loop otherwise.
+    class dispatcher
+    {
+    private:
+        struct entry {
+            u64       pc;
+            const u8* code;
+        };
+
+        struct link {
+            fixup     jump;
+            const u8* stub;
+            bool      linked;
+        };
+
+        cbuf&         m_buffer;
+        void*         m_data;
+        u64*          m_pc;
+        i32           m_pcoff;
+        vector<entry> m_table;
+        u8*           m_loop;
+        u8*           m_miss;
+        const u8*     m_end;
+        translator    m_translate;
+        u64           m_misses;
+
+        map<std::pair<u32, u64>, const u8*> m_stubs;
+        map<u64, vector<link>> m_links;
+
+        retstack*     m_rs;
+        i32           m_rsoff;
+
+        atomic<u8>*   m_flag;
+        i32           m_flagoff;
+        vector<pinned> m_pins;
+
+        entry& slot(u64 pc);
+        const entry& slot(u64 pc) const;
+
+        void gen_loop();
+        const u8* gen_stub(emitter& e, exit_reason reason, u64 pc);
+
+        void patch(vector<link>& links, const u8* code);
+        void unpatch(vector<link>& links);
+
+        fixup gen_push(emitter& e, u64 ret);
+
+    public:
+        static const size_t DEFAULT_ENTRIES = 4096;
+
+        cbuf& get_cbuffer() const { return m_buffer; }
+        void* get_data_ptr() const { return m_data; }
+        u64*  get_pc() const { return m_pc; }
+
+        const u8* get_code() const { return m_loop; }
+
+        size_t entries() const { return m_table.size(); }
+        size_t stubs() const { return m_stubs.size(); }
+        size_t count_links() const;
+        u64 misses() const { return m_misses; }
+
+        void set_translator(const translator& fn) { m_translate = fn; }
+
+        retstack* get_return_stack() const { return m_rs; }
+        void set_return_stack(retstack* rs);
+
+        atomic<u8>* get_exit_flag() const { return m_flag; }
+        void set_exit_flag(atomic<u8>* flag);
+
+        void request_exit();
+
+        dispatcher(cbuf& buffer, void* data, u64* pc,
+                   size_t entries = DEFAULT_ENTRIES);
+        dispatcher(cbuf& buffer, void* data, u64* pc,
+                   const vector<pinned>& pins,
+                   size_t entries = DEFAULT_ENTRIES);
+        ~dispatcher();
+
+        dispatcher() = delete;
+        dispatcher(const dispatcher&) = delete;
+
+        const u8* lookup(u64 pc) const;
+        void insert(u64 pc, const u8* code);
+        void remove(u64 pc);
+        void invalidate();
+
+        void gen_exit(emitter& e, exit_reason reason, u64 pc);
+
+        void gen_call(emitter& e, u64 target, u64 ret);
+        void gen_call_indirect(emitter& e, u64 ret);
+        void gen_return(emitter& e);
+
+        exit_info run_until(exit_reason reason);
+    };
+
+    inline dispatcher::entry& dispatcher::slot(u64 pc) {
+        return m_table[(pc >> 2) & (m_table.size() - 1)];
+    }
+
+    inline const dispatcher::entry& dispatcher::slot(u64 pc) const {
+        return m_table[(pc >> 2) & (m_table.size() - 1)];
+    }
+
+}
+
+#endif
@@ -26,14 +26,64 @@
 #include "ftl/reg.h"
 #include "ftl/fixup.h"
 #include "ftl/cbuf.h"
+#include "ftl/cpuinfo.h"
 
 namespace ftl {
 
+    enum peephole_rule {
+        PEEPHOLE_SELFMOV = 0, // mov r, r
+        PEEPHOLE_RELOAD,      // mov [m], r; mov r', [m] -> mov r', r
+        PEEPHOLE_ZEROEXT,     // xor r, r; cmp a, b; setcc r; movzx r, r
+        PEEPHOLE_FLAGS,       // and/or/xor x, y; test x, x
+        NPEEPHOLES
+    };
+
+    const char* peephole_name(peephole_rule rule);
+
     class emitter
     {
     private:
+        enum peephole_kind {
+            PH_STORE, // mov [mem], reg
+            PH_ZERO,  // xor reg, reg
+            PH_LOGIC, // and/or/xor, leaves CF and OF cleared
+            PH_CMP,   // cmp/test, does not write any operand
+            PH_SETCC, // setcc reg
+        };
+
+        // an instruction the peephole rules know about, located at
+        // [start, end) within the code buffer
+        struct peephole_insn {
+            peephole_kind kind;
+            int  bits;
+            bool mem;
+            bool rip;
+            int  r;
+            i64  offset;
+            int  src;
+            u8*  start;
+            u8*  end;
+        };
+
+        static const size_t PEEPHOLE_WINDOW = 4;
+
         cbuf& m_buffer;
 
+        // bytes the stack pointer is currently lowered by, e.g. during a
+        // call sequence; stack operands are adjusted to keep their meaning
+        i32           m_stack_adjust;
+
+        bool          m_peephole;
+        u64           m_barriers;
+        size_t        m_nwindow;
+        peephole_insn m_window[PEEPHOLE_WINDOW];
+        u64           m_hits[NPEEPHOLES];
+
+        const peephole_insn* recent(size_t i) const;
+        bool same_operand(const peephole_insn* insn, const rm& op) const;
+        void record(peephole_kind k, int bits, const rm& op, int src,
+                    u8* start);
+
         inline void setup_fixup(fixup* fix, int size);
 
         size_t rex(bool is64, bool rexr, bool rexx, bool rexb);
@@ -42,7 +92,8 @@ namespace ftl {
 
         size_t prefix(int dbits, int sbits, int r, const rm& rm);
         size_t prefix(int bits, int r, const rm& rm);
-        size_t modrm(int r, const rm& rm);
+        size_t modrm(int r, const rm& rm, int trail = 0);
+        i64    displacement(const rm& rm) const;
 
         size_t immop(int op, int bits, const rm& dest, i32 imm);
         size_t aluop(int op, int bits, const rm& dest, const rm& src);
@@ -63,9 +114,26 @@ namespace ftl {
         emitter() = delete;
         emitter(const emitter&) = delete;
 
+        cbuf& get_buffer() const { return m_buffer; }
+
+        rm literal(u64 val) { return ripop(m_buffer.literal(val)); }
+        rm literal(u64 lo, u64 hi) { return ripop(m_buffer.literal(lo, hi)); }
+
+        bool peephole() const { return m_peephole; }
+        void set_peephole(bool enable);
+        void barrier() { m_nwindow = 0; m_barriers++; }
+        u64  barriers() const { return m_barriers; }
+
+        i32  stack_adjust() const { return m_stack_adjust; }
+        void set_stack_adjust(i32 adjust) { m_stack_adjust = adjust; }
+
+        u64  peephole_hits(peephole_rule rule) const;
+        void reset_peephole_hits();
+
         size_t ret();
 
         size_t lock();
+        size_t rep();
 
         size_t push(reg src);
         size_t pop(reg dest);
@@ -99,6 +167,9 @@ namespace ftl {
 
         size_t lear(int bits, const rm& dest, const rm& src);
         size_t lear(int bits, const rm& dest, const rm& src, i32 val);
+        size_t leaip(reg dest, i32 offset, fixup* fix = nullptr);
+        size_t leasib(int bits, reg dest, reg base, reg index, int scale,
+                      i32 disp = 0);
 
         size_t btr (int bits, const rm& dest, const rm& src);
         size_t btsr(int bits, const rm& dest, const rm& src);
@@ -144,6 +215,21 @@ namespace ftl {
         size_t sfence();
         size_t mfence();
 
+        size_t movsb();
+        size_t stosb();
+        size_t movsq();
+        size_t stosq();
+        size_t movnti(int bits, const rm& dest, const rm& src);
+
+        size_t prefetcht0(const rm& src);
+        size_t prefetchnta(const rm& src);
+        size_t clflushopt(const rm& dest);
+        size_t clwb(const rm& dest);
+
+        size_t rdtsc();
+        size_t rdtscp();
+        size_t rdpmc();
+
         size_t call(u8* fn, fixup* fix = nullptr);
         size_t call(const rm& dest);
 
@@ -217,6 +303,7 @@ namespace ftl {
         size_t maxs(int bits, const rm& dest, const rm& src);
         size_t sqrt(int bits, const rm& dest, const rm& src);
         size_t pxor(int bits, const rm& dest, const rm& src);
+        size_t pand(int bits, const rm& dest, const rm& src);
 
         size_t comis(int bits, const rm& op1, const rm& op2);
         size_t ucomis(int bits, const rm& op1, const rm& op2);
@@ -227,6 +314,11 @@ namespace ftl {
         size_t cvtts2i(int dbits, int sbits, const rm& dest, const rm& src);
     };
 
+    inline u64 emitter::peephole_hits(peephole_rule rule) const {
+        FTL_ERROR_ON(rule >= NPEEPHOLES, "invalid peephole rule %d", rule);
+        return m_hits[rule];
+    }
+
 }
 
 #endif
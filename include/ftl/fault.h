@@ -0,0 +1,44 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef FTL_FAULT_H
+#define FTL_FAULT_H
+
+#include "ftl/common.h"
+#include "ftl/error.h"
+#include "ftl/cbuf.h"
+
+namespace ftl {
+
+    // Recovery from host faults raised by guest memory accesses. Code
+    // buffers holding recovery code register themselves with a handler for
+    // SIGSEGV and SIGBUS, which looks up the faulting instruction and
+    // resumes execution at its recovery code. Faults anywhere else are left
+    // to the handler installed before. Recovery tables must not change
+    // while code from the same buffer is running on another thread.
+    const size_t MAX_FAULT_BUFFERS = 64;
+
+    void register_faults(cbuf& buffer);
+    void unregister_faults(cbuf& buffer);
+
+    // Data address of the last recovered fault on the calling thread.
+    const void* fault_address();
+
+}
+
+#endif
@@ -41,6 +41,23 @@ namespace ftl {
         patch_jump(fix, target);
     }
 
+    // stack frame adjustments are encoded as 'add rsp, imm32' and replaced
+    // by a nop of the same length as long as no frame needs to be reserved
+    const int FRAME_FIXUP_SIZE = 7;
+
+    static inline void patch_frame(const fixup& fix, i32 delta) {
+        static const u8 nop[] = { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 };
+        static const u8 add[] = { 0x48, 0x81, 0xc4 };
+
+        FTL_ERROR_ON(fix.size != FRAME_FIXUP_SIZE, "invalid frame fixup");
+        if (delta == 0) {
+            memcpy(fix.code, nop, sizeof(nop));
+        } else {
+            memcpy(fix.code, add, sizeof(add));
+            memcpy(fix.code + sizeof(add), &delta, sizeof(delta));
+        }
+    }
+
     template <typename FUNC>
     static inline bool can_call_directly(u8* origin, FUNC* target) {
         i64 offset = (u8*)target - origin - 5;
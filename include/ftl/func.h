@@ -34,6 +34,9 @@
 
 namespace ftl {
 
+    class dispatcher;
+    enum exit_reason : u32;
+
     class func
     {
     private:
@@ -52,7 +55,45 @@ namespace ftl {
         label   m_entry;
         label   m_exit;
 
+        // flags left behind by a compare of two known values, only valid
+        // as long as no other code has been emitted after it
+        struct flagstate {
+            u8* ptr;
+            u64 barriers;
+            u32 flags;
+        };
+
+        flagstate m_flags;
+
+        // guest memory accesses that may fault, their recovery code is
+        // emitted when the function is finished
+        struct faultsite {
+            const u8*         insn;
+            vector<writeback> wb;
+            dispatcher*       disp;
+            u64               pc;
+        };
+
+        vector<faultsite> m_faults;
+
         void gen_prologue_epilogue();
+        void gen_recovery();
+
+        void set_known_flags(int bits, u64 kmask1, u64 op1, u64 kmask2,
+                             u64 op2, bool sub);
+        bool known_cond(int cc, bool& result) const;
+
+        void gen_const(value& dest, i64 val);
+        void gen_mulhi(value& hi, const value& src, i64 magic, bool sign);
+        void gen_mul_imm(value& dest, i64 val);
+        void gen_result(value& dest, reg r);
+
+        bool fold_jcc(int cc, label& l, bool far);
+        bool fold_setcc(int cc, value& dest);
+        bool fold_cmov(int cc, value& dest, const value& src);
+
+        value  gen_retval(value* tag, int bits);
+        scalar gen_retval(scalar* tag, int bits);
 
     public:
         const char* name() const { return m_name.c_str(); }
@@ -73,6 +114,8 @@ namespace ftl {
 
         func(const string& name, size_t bufsz = 4 * KiB);
         func(const string& name, cbuf& buffer, void* dataptr = nullptr);
+        func(const string& name, cbuf& buffer, void* dataptr,
+             const vector<pinned>& pins);
         func(func&& other);
         ~func();
 
@@ -149,6 +192,15 @@ namespace ftl {
         void gen_ret(i64 val);
         void gen_ret(value& val);
 
+        void gen_dispatch(const dispatcher& d);
+        void gen_exit(dispatcher& d, exit_reason reason, u64 pc);
+
+        void gen_guest_call(dispatcher& d, u64 target, u64 ret);
+        void gen_guest_call(dispatcher& d, u64 ret);
+        void gen_guest_ret(dispatcher& d);
+
+        void gen_observe();
+
         void gen_jmp(label& l, bool far = false);
         void gen_jo(label& l, bool far = false);
         void gen_jno(label& l, bool far = false);
@@ -169,6 +221,8 @@ namespace ftl {
         void gen_jle(label& l, bool far = false);
         void gen_jg(label& l, bool far = false);
 
+        void gen_switch(value& idx, const vector<label*>& targets);
+
         void gen_seto(value& dest);
         void gen_setno(value& dest);
         void gen_setb(value& dest);
@@ -298,6 +352,19 @@ namespace ftl {
         void gen_cmpxchg(value& dest, value& src, value& cmpv);
         void gen_fence(bool sync_loads = true, bool sync_stores = true);
 
+        void gen_memcpy(value& dest, value& src, value& count);
+        void gen_memset(value& dest, value& val, value& count);
+        void gen_prefetch(value& addr, bool nta = false);
+
+        void gen_load(value& dest, value& addr, dispatcher& d, u64 pc);
+        void gen_store(value& addr, value& src, dispatcher& d, u64 pc);
+
+        void gen_rdtsc(value& dest);
+        void gen_rdtscp(value& dest, value& aux);
+        void gen_rdpmc(value& dest, value& counter);
+        void gen_rdpmc(value& dest, u32 counter);
+        void gen_icount_add(value& counter, i32 n);
+
         void gen_mov(scalar& dest, const value& src);
         void gen_mov(value& dest, scalar& src);
 
@@ -310,32 +377,19 @@ namespace ftl {
         void gen_max(scalar& dest, const scalar& src);
         void gen_sqrt(scalar& dest, const scalar& src);
         void gen_pxor(scalar& dest, const scalar& src);
+        void gen_abs(scalar& dest);
+        void gen_neg(scalar& dest);
         void gen_cmp(scalar& op1, const scalar& op2, bool signal_qnan = false);
         void gen_cvt(scalar& dest, const value& src);
         void gen_cvt(value& dest, const scalar& src);
 
-        template <typename FUNC>
-        value gen_call(FUNC* fn);
-
-        template <typename FUNC, typename T1>
-        value gen_call(FUNC* fn, const T1& arg1);
-
-        template <typename FUNC, typename T1, typename T2>
-        value gen_call(FUNC* fn, const T1& arg1, const T2& arg2);
-
-        template <typename FUNC, typename T1, typename T2, typename T3>
-        value gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                       const T3& arg3);
+        template <typename FUNC, typename... ARGS>
+        typename call_result<FUNC>::type gen_call(FUNC* fn,
+                                                  const ARGS&... args);
 
-        template <typename FUNC, typename T1, typename T2, typename T3,
-                  typename T4>
-        value gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                       const T3& arg3, const T4& arg4);
-
-        template <typename FUNC, typename T1, typename T2, typename T3,
-                  typename T4, typename T5>
-        value gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                       const T3& arg3, const T4& arg4, const T5& arg5);
+        template <typename FUNC, typename... ARGS>
+        typename call_result<FUNC>::type gen_call(call_state state, FUNC* fn,
+                                                  const ARGS&... args);
     };
 
     inline size_t func::size() const {
@@ -344,6 +398,8 @@ namespace ftl {
     }
 
     inline u8* func::finish() {
+        gen_recovery();
+        m_buffer.reserve_frame(m_alloc.frame_size());
         return m_last = m_buffer.get_code_ptr();
     }
 
@@ -517,59 +573,84 @@ namespace ftl {
         m_alloc.free_value(val);
     }
 
-    template <typename FUNC>
-    inline value func::gen_call(FUNC* fn) {
-        m_alloc.flush_volatile_regs();
-        m_alloc.store_all_regs();
+    template <typename FUNC, typename... ARGS>
+    inline typename call_result<FUNC>::type
+    func::gen_call(FUNC* fn, const ARGS&... args) {
+        return gen_call(CALL_STATE_NONE, fn, args...);
+    }
+
+    template <typename FUNC, typename... ARGS>
+    inline typename call_result<FUNC>::type
+    func::gen_call(call_state state, FUNC* fn, const ARGS&... args) {
+        call_slots slots;
+        call_args<ARGS...>::count(slots);
+
+        // the callee may use the red zone, so skip the part holding locals
+        const i32 frame = slots.frame_size();
+        const i32 adjust = frame + (i32)m_alloc.red_zone_used();
+
+        m_emitter.subi(64, STACK_POINTER, adjust);
+        m_emitter.set_stack_adjust(adjust);
+
+        if (frame > 0) {
+            call_slots s;
+            m_alloc.relocate(CALL_TEMP);
+            m_alloc.block(CALL_TEMP);
+            call_args<ARGS...>::store(m_alloc, s, adjust, args...);
+            m_alloc.unblock(CALL_TEMP);
+        }
+
+        m_alloc.relocate(argreg(0));
         m_emitter.movr(64, argreg(0), BASE_POINTER);
+        m_alloc.block(argreg(0));
+
+        call_slots s;
+        call_args<ARGS...>::load(m_alloc, s, args...);
+
+        m_alloc.flush_volatile_regs();
+        m_alloc.store_global_regs(state & CALL_STATE_READ);
+        if (state & CALL_STATE_READ)
+            m_alloc.store_pinned_regs();
+
+        if (call_result<FUNC>::variadic)
+            m_emitter.movi(32, RAX, s.nxmms);
 
         if (can_call_directly(m_buffer.get_code_ptr(), fn)) {
             m_emitter.call((u8*)fn);
-            value ret = gen_scratch_i64("retval", RAX);
-            m_alloc.mark_dirty(RAX);
-            return ret;
         } else {
-            value ret = gen_scratch_i64("retval", (i64)fn, RAX);
-            m_emitter.call(RAX);
-            m_alloc.mark_dirty(RAX);
-            return ret;
+            m_emitter.movi(64, CALL_TEMP, (i64)fn);
+            m_emitter.call(CALL_TEMP);
         }
-    }
 
-    template <typename FUNC, typename T1>
-    inline value func::gen_call(FUNC* fn, const T1& arg1) {
-        arg<T1>::fetch(m_alloc, arg1);
-        return gen_call(fn);
-    }
+        m_emitter.addi(64, STACK_POINTER, adjust);
+        m_emitter.set_stack_adjust(0);
 
-    template <typename FUNC, typename T1, typename T2>
-    inline value func::gen_call(FUNC* fn, const T1& arg1, const T2& arg2) {
-        arg<T2>::template fetch<T1>(m_alloc, arg2);
-        return gen_call(fn, arg1);
-    }
+        // pinned registers are callee-saved, so they survive the call
+        if (state & CALL_STATE_WRITE)
+            m_alloc.load_pinned_regs();
+
+        // helpers may have changed any global behind our back
+        m_alloc.forget_known(true);
+
+        for (size_t i = 0; i < s.nregs; i++)
+            m_alloc.unblock(param_regs[i]);
+        for (size_t i = 0; i < s.nxmms; i++)
+            m_alloc.unblock(param_xmms[i]);
 
-    template <typename FUNC, typename T1, typename T2, typename T3>
-    inline value func::gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                                const T3& arg3) {
-        arg<T3>::template fetch<T1,T2>(m_alloc, arg3);
-        return gen_call(fn, arg1, arg2);
+        typedef typename call_result<FUNC>::type result_type;
+        return gen_retval((result_type*)nullptr, call_result<FUNC>::bits);
     }
 
-    template <typename FUNC, typename T1, typename T2, typename T3,
-              typename T4>
-    inline value func::gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                                const T3& arg3, const T4& arg4) {
-        arg<T4>::template fetch<T1,T2,T3>(m_alloc, arg4);
-        return gen_call(fn, arg1, arg2, arg3);
+    inline value func::gen_retval(value* tag, int bits) {
+        value ret = gen_scratch_val("retval", bits, RAX);
+        m_alloc.mark_dirty(RAX);
+        return ret;
     }
 
-    template <typename FUNC, typename T1, typename T2, typename T3,
-              typename T4, typename T5>
-    inline value func::gen_call(FUNC* fn, const T1& arg1, const T2& arg2,
-                                const T3& arg3, const T4& arg4,
-                                const T5& arg5) {
-        arg<T5>::template fetch<T1,T2,T3,T4>(m_alloc, arg5);
-        return gen_call(fn, arg1, arg2, arg3, arg4);
+    inline scalar func::gen_retval(scalar* tag, int bits) {
+        scalar ret = gen_scratch_fp("retval", bits, XMM0);
+        m_alloc.mark_dirty(XMM0);
+        return ret;
     }
 
     static inline i64 invoke(const cbuf& buffer, void* code, void* data) {
@@ -0,0 +1,327 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef FTL_IRBUF_H
+#define FTL_IRBUF_H
+
+#include "ftl/common.h"
+#include "ftl/bitops.h"
+#include "ftl/error.h"
+
+#include "ftl/label.h"
+#include "ftl/value.h"
+#include "ftl/scalar.h"
+#include "ftl/ralloc.h"
+#include "ftl/func.h"
+
+namespace ftl {
+
+    enum ir_opcode : u8 {
+        IR_NOP = 0,
+        IR_MOV,
+        IR_ADD,
+        IR_SUB,
+        IR_AND,
+        IR_OR,
+        IR_XOR,
+        IR_IMUL,
+        IR_UDIV,
+        IR_IDIV,
+        IR_UMOD,
+        IR_IMOD,
+        IR_SHL,
+        IR_SHR,
+        IR_SHA,
+        IR_NOT,
+        IR_NEG,
+        IR_CMP,
+        IR_TST,
+        IR_SETCC,
+        IR_LABEL,
+        IR_JMP,
+        IR_JCC,
+        IR_RET,
+        IR_CALL,
+        IR_FREE,
+    };
+
+    enum ir_cond : u8 {
+        IR_O = 0,
+        IR_NO,
+        IR_B,
+        IR_AE,
+        IR_Z,
+        IR_NZ,
+        IR_BE,
+        IR_A,
+        IR_S,
+        IR_NS,
+        IR_P,
+        IR_NP,
+        IR_L,
+        IR_GE,
+        IR_LE,
+        IR_G,
+        IR_E  = IR_Z,
+        IR_NE = IR_NZ,
+    };
+
+    enum ir_passes : u32 {
+        IR_FOLD     = 1 << 0, // constant folding
+        IR_COPYPROP = 1 << 1, // copy propagation, redundant move removal
+        IR_CSE      = 1 << 2, // local common subexpression elimination
+        IR_DCE      = 1 << 3, // dead code and dead store elimination
+        IR_MEMOPT   = 1 << 4, // track globals, removes redundant loads/stores
+        IR_SCHED    = 1 << 5, // list scheduling of blocks for the host model
+        IR_NOPASSES = 0,
+        IR_ALLPASSES = IR_FOLD | IR_COPYPROP | IR_CSE | IR_DCE | IR_MEMOPT |
+                       IR_SCHED,
+    };
+
+    enum ir_unit : u8 {
+        IR_UNIT_ALU = 0, // moves, arithmetic, logic, compares and setcc
+        IR_UNIT_SHIFT,
+        IR_UNIT_MUL,
+        IR_UNIT_DIV,
+        IR_UNIT_LOAD,    // reading globals from memory
+        IR_UNIT_STORE,   // writing globals to memory
+        IR_NUNITS
+    };
+
+    // Host model used for scheduling: how many operations can be issued per
+    // cycle, and for each class of operation its result latency in cycles
+    // and the number of execution ports that can run it.
+    struct ir_model {
+        u32 width;
+        u32 latency[IR_NUNITS];
+        u32 ports[IR_NUNITS];
+    };
+
+    // close enough for recent Intel and AMD cores
+    const ir_model ir_generic_model = {
+        4, { 1, 1, 3, 26, 5, 1 }, { 4, 2, 1, 1, 2, 1 },
+    };
+
+    struct ir_insn {
+        ir_opcode op;
+        ir_cond   cc;
+        bool      immop; // source operand is 'imm' instead of 'src'
+        bool      flags; // flags are consumed after this instruction
+        value*    dest;
+        union {
+            const value* src;
+            label*       target;
+            size_t       call;
+        };
+        i64       imm;
+    };
+
+    struct ir_call {
+        function<void(func&)> fn;
+        vector<const value*>  uses;
+    };
+
+    template <typename T>
+    struct ir_arg {
+        T val;
+        ir_arg(const T& v): val(v) {}
+        const T& get() const { return val; }
+    };
+
+    template <>
+    struct ir_arg<value> {
+        const value* val;
+        ir_arg(const value& v): val(&v) {}
+        const value& get() const { return *val; }
+    };
+
+    template <>
+    struct ir_arg<scalar> {
+        const scalar* val;
+        ir_arg(const scalar& v): val(&v) {}
+        const scalar& get() const { return *val; }
+    };
+
+    // Records integer operations of a func into a linear IR, optimizes them
+    // and lowers the result through the regular gen_* interface. All values
+    // and labels referenced by recorded operations must stay alive until
+    // lower() has been called, and they must not be used directly meanwhile.
+    class irbuf
+    {
+    private:
+        func&    m_func;
+        u32      m_passes;
+        ir_model m_model;
+
+        vector<ir_insn> m_code;
+        vector<ir_call> m_calls;
+        regplan<reg>    m_plan;
+
+        ir_insn& append(ir_opcode op, value* dest);
+        ir_insn& append(ir_opcode op, value* dest, const value& src);
+        ir_insn& append(ir_opcode op, value* dest, i64 imm);
+
+        void record_call(value* result, const ir_call& call);
+
+        void analyze_flags();
+        void number_values();
+        void eliminate_dead_code();
+        void schedule(size_t lo, size_t hi);
+        void schedule();
+        void plan_registers();
+
+        void lower(const ir_insn& insn);
+
+    public:
+        u32  passes() const { return m_passes; }
+        size_t size() const;
+
+        const regplan<reg>& get_plan() const { return m_plan; }
+
+        const ir_model& get_model() const { return m_model; }
+        void set_model(const ir_model& model);
+
+        irbuf(func& fn, u32 passes = IR_ALLPASSES);
+        ~irbuf();
+
+        irbuf() = delete;
+        irbuf(const irbuf&) = delete;
+        irbuf& operator = (const irbuf&) = delete;
+
+        void optimize();
+        void lower();
+
+        void place(label& l);
+        void free_value(value& val);
+
+        void gen_ret();
+        void gen_ret(i64 val);
+        void gen_ret(value& val);
+
+        void gen_jmp(label& l, bool far = false);
+        void gen_jcc(ir_cond cc, label& l, bool far = false);
+        void gen_setcc(ir_cond cc, value& dest);
+
+        void gen_mov(value& dest, const value& src);
+        void gen_add(value& dest, const value& src);
+        void gen_sub(value& dest, const value& src);
+        void gen_and(value& dest, const value& src);
+        void gen_or (value& dest, const value& src);
+        void gen_xor(value& dest, const value& src);
+        void gen_imul(value& dest, const value& src);
+        void gen_idiv(value& dest, const value& src);
+        void gen_udiv(value& dest, const value& src);
+        void gen_imod(value& dest, const value& src);
+        void gen_umod(value& dest, const value& src);
+        void gen_cmp(value& op1, const value& op2);
+        void gen_tst(value& op1, const value& op2);
+
+        void gen_mov(value& dest, i64 val);
+        void gen_add(value& dest, i32 val);
+        void gen_sub(value& dest, i32 val);
+        void gen_and(value& dest, i32 val);
+        void gen_or (value& dest, i32 val);
+        void gen_xor(value& dest, i32 val);
+        void gen_imul(value& dest, i64 val);
+        void gen_idiv(value& dest, i64 val);
+        void gen_imod(value& dest, i64 val);
+        void gen_udiv(value& dest, u64 val);
+        void gen_umod(value& dest, u64 val);
+        void gen_cmp(value& op1, i32 val);
+        void gen_tst(value& op1, i32 val);
+
+        void gen_shl(value& dest, value& src);
+        void gen_shr(value& dest, value& src);
+        void gen_sha(value& dest, value& src);
+
+        void gen_shl(value& dest, u8 shift);
+        void gen_shr(value& dest, u8 shift);
+        void gen_sha(value& dest, u8 shift);
+
+        void gen_inc(value& dest);
+        void gen_dec(value& dest);
+        void gen_not(value& dest);
+        void gen_neg(value& dest);
+
+        template <typename FUNC, typename... ARGS>
+        void gen_call(FUNC* fn, const ARGS&... args);
+
+        template <typename FUNC, typename... ARGS>
+        void gen_call(value& result, FUNC* fn, const ARGS&... args);
+    };
+
+    static inline void ir_use(vector<const value*>& uses, const value& v) {
+        uses.push_back(&v);
+    }
+
+    template <typename T>
+    static inline void ir_use(vector<const value*>& uses, const T& arg) {
+        // only values take part in register planning
+    }
+
+    static inline void ir_uses(vector<const value*>& uses) {
+        // nothing to do
+    }
+
+    template <typename T, typename... ARGS>
+    static inline void ir_uses(vector<const value*>& uses, const T& arg,
+                               const ARGS&... args) {
+        ir_use(uses, arg);
+        ir_uses(uses, args...);
+    }
+
+    template <typename FUNC, typename... WRAPPED>
+    static inline function<void(func&)> ir_callfn(FUNC* fn, WRAPPED... args) {
+        return [=](func& f) -> void {
+            f.gen_call(fn, args.get()...);
+        };
+    }
+
+    template <typename FUNC, typename... WRAPPED>
+    static inline function<void(func&)> ir_callfn_ret(value* result,
+                                                      FUNC* fn,
+                                                      WRAPPED... args) {
+        return [=](func& f) -> void {
+            value ret = f.gen_call(fn, args.get()...);
+            f.gen_mov(*result, ret);
+            f.free_value(ret);
+        };
+    }
+
+    template <typename FUNC, typename... ARGS>
+    inline void irbuf::gen_call(FUNC* fn, const ARGS&... args) {
+        ir_call call;
+        call.fn = ir_callfn(fn,
+            ir_arg<typename std::decay<ARGS>::type>(args)...);
+        ir_uses(call.uses, args...);
+        record_call(nullptr, call);
+    }
+
+    template <typename FUNC, typename... ARGS>
+    inline void irbuf::gen_call(value& result, FUNC* fn,
+                                const ARGS&... args) {
+        ir_call call;
+        call.fn = ir_callfn_ret(&result, fn,
+            ir_arg<typename std::decay<ARGS>::type>(args)...);
+        ir_uses(call.uses, args...);
+        record_call(&result, call);
+    }
+
+}
+
+#endif
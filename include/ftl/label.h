@@ -36,6 +36,7 @@ namespace ftl {
         vector<fixup> m_fixups;
         cbuf& m_buffer;
         alloc& m_alloc;
+        regstate m_state;
         string m_name;
 
         void patch();
@@ -56,8 +57,11 @@ namespace ftl {
         label(const label&) = delete;
         label& operator = (const label&) = delete;
 
+        const regstate& get_state() const { return m_state; }
+
         void add(const fixup& fix);
-        void place(bool flush = true);
+        void merge();
+        void place(bool flush = false);
         void place(u8* location, bool flush);
     };
 
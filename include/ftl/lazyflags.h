@@ -0,0 +1,123 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef FTL_LAZYFLAGS_H
+#define FTL_LAZYFLAGS_H
+
+#include "ftl/common.h"
+#include "ftl/bitops.h"
+#include "ftl/error.h"
+
+#include "ftl/label.h"
+#include "ftl/value.h"
+#include "ftl/func.h"
+
+namespace ftl {
+
+    // Same encoding as the x86 condition codes. Parity is not available,
+    // since it cannot be reconstructed from recorded operations.
+    enum lazy_cond : u8 {
+        LAZY_O  = 0x0,
+        LAZY_NO = 0x1,
+        LAZY_B  = 0x2,
+        LAZY_AE = 0x3,
+        LAZY_Z  = 0x4,
+        LAZY_NZ = 0x5,
+        LAZY_BE = 0x6,
+        LAZY_A  = 0x7,
+        LAZY_S  = 0x8,
+        LAZY_NS = 0x9,
+        LAZY_L  = 0xc,
+        LAZY_GE = 0xd,
+        LAZY_LE = 0xe,
+        LAZY_G  = 0xf,
+    };
+
+    enum lazy_flag : u8 {
+        LAZY_CF, // carry, i.e. borrow for sub/cmp
+        LAZY_ZF, // zero
+        LAZY_SF, // sign (negative)
+        LAZY_OF, // signed overflow
+    };
+
+    // Guest condition flags that are evaluated only when needed. Each flag
+    // producing operation records its kind and operands in three 64bit
+    // guest state slots. Consumers use the host flags directly while they
+    // are still intact and otherwise regenerate them from the slots. For
+    // and/or/xor, the result is recorded as an addition with zero, so
+    // that carry and overflow read as zero.
+    class lazyflags
+    {
+    private:
+        func&  m_func;
+        value& m_kind;
+        value& m_op1;
+        value& m_op2;
+
+        bool   m_known; // kind of last operation known at this point
+        bool   m_sub;
+        int    m_bits;
+        u8*    m_ptr;   // end of last flag producing host instruction
+        u64    m_barriers;
+
+        void prepare(bool sub, const value& dest);
+        void produced(bool sub, const value& dest, u8* start);
+
+        void gen_record(bool sub, value& dest, const value& src);
+        void gen_record(bool sub, value& dest, i32 src);
+        void gen_record_logic(value& dest, u8* start);
+
+        void gen_replay();
+        void gen_flags();
+
+    public:
+        bool host_flags_live() const;
+        bool is_known() const;
+
+        lazyflags(func& fn, value& kind, value& op1, value& op2);
+        ~lazyflags();
+
+        lazyflags() = delete;
+        lazyflags(const lazyflags&) = delete;
+        lazyflags& operator = (const lazyflags&) = delete;
+
+        void invalidate();
+
+        void gen_add(value& dest, const value& src);
+        void gen_sub(value& dest, const value& src);
+        void gen_cmp(value& op1, const value& op2);
+        void gen_and(value& dest, const value& src);
+        void gen_or (value& dest, const value& src);
+        void gen_xor(value& dest, const value& src);
+
+        void gen_add(value& dest, i32 val);
+        void gen_sub(value& dest, i32 val);
+        void gen_cmp(value& op1, i32 val);
+        void gen_and(value& dest, i32 val);
+        void gen_or (value& dest, i32 val);
+        void gen_xor(value& dest, i32 val);
+
+        void gen_jcc(lazy_cond cc, label& l, bool far = false);
+        void gen_setcc(lazy_cond cc, value& dest);
+        void gen_cmov(lazy_cond cc, value& dest, const value& src);
+        void gen_flag(lazy_flag flag, value& dest);
+    };
+
+}
+
+#endif
@@ -31,6 +31,9 @@
 
 namespace ftl {
 
+    // Registers are tracked in bitmasks ordered by allocation preference,
+    // i.e. bit n refers to the register at position n in alloc_order. This
+    // way, the lowest set bit of a mask is always the preferred candidate.
     template <typename REG>
     struct reg_traits;
 
@@ -39,6 +42,31 @@ namespace ftl {
         typedef reg   reg_type;
         typedef value val_type;
         static const reg NREGS = ftl::NREGS;
+
+        static reg order(unsigned int rank) {
+            static const reg alloc_order[NREGS] = {
+                RBX, RCX, RDX, RAX, RDI, RSI,  R8,  R9,
+                R10, R11, R14, R15, R12, R13, RSP, RBP,
+            };
+
+            return alloc_order[rank];
+        }
+
+        static unsigned int rank(reg r) {
+            static const u8 alloc_rank[NREGS] = {
+                 3,  1,  2,  0, 14, 15,  5,  4,
+                 6,  7,  8,  9, 12, 13, 10, 11,
+            };
+
+            return alloc_rank[r];
+        }
+
+        static u32 callee_saved() {
+            u32 mask = 0;
+            for (reg r : callee_saved_regs)
+                mask |= 1u << rank(r);
+            return mask;
+        }
     };
 
     template <>
@@ -46,8 +74,158 @@ namespace ftl {
         typedef xmm    reg_type;
         typedef scalar val_type;
         static const xmm NREGS = ftl::NXMM;
+
+        static xmm order(unsigned int rank) {
+            static const xmm alloc_order[NREGS] = {
+                XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+                XMM7, XMM6, XMM5,  XMM4,  XMM3,  XMM2,  XMM1,  XMM0,
+            };
+
+            return alloc_order[rank];
+        }
+
+        static unsigned int rank(xmm r) {
+            static const u8 alloc_rank[NREGS] = {
+                15, 14, 13, 12, 11, 10,  9,  8,
+                 0,  1,  2,  3,  4,  5,  6,  7,
+            };
+
+            return alloc_rank[r];
+        }
+
+        static u32 callee_saved() {
+            u32 mask = 0;
+            for (xmm r : callee_saved_xmms)
+                mask |= 1u << rank(r);
+            return mask;
+        }
     };
 
+    // Live intervals of values over a block of code that is known ahead of
+    // time, e.g. recorded by irbuf. While a plan is attached, ralloc evicts
+    // the register whose value is needed furthest in the future, places
+    // values that live across calls into callee-saved registers and honors
+    // register hints where the target register is free.
+    template <typename REG>
+    class regplan {
+    public:
+        typedef typename reg_traits<REG>::val_type val_type;
+
+        static const REG NREGS = reg_traits<REG>::NREGS;
+        static const u64 NEVER = ~0ull;
+
+        u64  position() const { return m_pos; }
+        void advance(u64 pos) { m_pos = pos; }
+
+        void use(const val_type* val, u64 pos);
+        void hint(const val_type* val, REG r);
+        void call(u64 pos);
+        void loop(u64 head, u64 tail);
+
+        u64  next_use(const val_type* val) const;
+        REG  hint(const val_type* val) const;
+        bool crosses_call(const val_type* val) const;
+
+        void clear();
+
+        regplan(): m_pos(0), m_intervals(), m_calls() {}
+
+    private:
+        struct interval {
+            u64         start;
+            u64         end;
+            REG         hint;
+            vector<u64> uses;
+        };
+
+        u64 m_pos;
+        unordered_map<const val_type*, interval> m_intervals;
+        vector<u64> m_calls;
+
+        const interval* find(const val_type* val) const;
+    };
+
+    template <typename REG>
+    inline void regplan<REG>::use(const val_type* val, u64 pos) {
+        auto it = m_intervals.find(val);
+        if (it == m_intervals.end()) {
+            interval iv = { pos, pos, NREGS, { pos } };
+            m_intervals.emplace(val, std::move(iv));
+            return;
+        }
+
+        interval& iv = it->second;
+        iv.start = min(iv.start, pos);
+        iv.end = max(iv.end, pos);
+        if (iv.uses.empty() || iv.uses.back() < pos)
+            iv.uses.push_back(pos);
+    }
+
+    template <typename REG>
+    inline void regplan<REG>::hint(const val_type* val, REG r) {
+        auto it = m_intervals.find(val);
+        if (it != m_intervals.end() && it->second.hint == NREGS)
+            it->second.hint = r;
+    }
+
+    template <typename REG>
+    inline void regplan<REG>::call(u64 pos) {
+        m_calls.push_back(pos);
+    }
+
+    template <typename REG>
+    inline void regplan<REG>::loop(u64 head, u64 tail) {
+        // everything live somewhere within the loop is live throughout
+        for (auto& it : m_intervals) {
+            interval& iv = it.second;
+            if (iv.start <= tail && iv.end >= head) {
+                iv.start = min(iv.start, head);
+                iv.end = max(iv.end, tail);
+            }
+        }
+    }
+
+    template <typename REG>
+    inline const typename regplan<REG>::interval*
+    regplan<REG>::find(const val_type* val) const {
+        auto it = m_intervals.find(val);
+        return it != m_intervals.end() ? &it->second : nullptr;
+    }
+
+    template <typename REG>
+    inline u64 regplan<REG>::next_use(const val_type* val) const {
+        const interval* iv = find(val);
+        if (iv == nullptr || iv->end < m_pos)
+            return NEVER;
+
+        auto it = std::lower_bound(iv->uses.begin(), iv->uses.end(), m_pos);
+        return it != iv->uses.end() ? *it : iv->end;
+    }
+
+    template <typename REG>
+    inline REG regplan<REG>::hint(const val_type* val) const {
+        const interval* iv = find(val);
+        return iv ? iv->hint : NREGS;
+    }
+
+    template <typename REG>
+    inline bool regplan<REG>::crosses_call(const val_type* val) const {
+        const interval* iv = find(val);
+        if (iv == nullptr)
+            return false;
+
+        u64 from = max(iv->start, m_pos);
+        auto it = std::lower_bound(m_calls.begin(), m_calls.end(), from);
+        return it != m_calls.end() && *it < iv->end;
+    }
+
+    template <typename REG>
+    inline void regplan<REG>::clear() {
+        m_pos = 0;
+        m_intervals.clear();
+        m_calls.clear();
+    }
+
     template <typename REG>
     class ralloc {
     public:
@@ -56,6 +234,11 @@ namespace ftl {
 
         static const REG NREGS = reg_traits<REG>::NREGS;
 
+        struct snapshot {
+            const val_type* owner[NREGS];
+            bool            dirty[NREGS];
+        };
+
         bool is_valid(REG r) const;
         bool is_empty(REG r) const;
         bool is_dirty(REG r) const;
@@ -64,14 +247,21 @@ namespace ftl {
         void mark_clean(REG r);
 
         REG  select() const;
+        REG  select(const val_type* val) const;
         REG  lookup(const val_type* val) const;
         REG  assign(REG r, const val_type* val);
         REG  fetch(const val_type* val, REG r = NREGS);
 
         const val_type* lookup(REG r) const;
 
+        void save(snapshot& s) const;
+        void restore(const snapshot& s);
+
         void reset();
 
+        const regplan<REG>* get_plan() const { return m_plan; }
+        void set_plan(const regplan<REG>* plan) { m_plan = plan; }
+
         ralloc(emitter& e);
         ralloc(ralloc<REG>&&) = default;
         ralloc() = delete;
@@ -80,28 +270,37 @@ namespace ftl {
         void register_value(val_type* v);
         void unregister_value(val_type* v);
 
-        void block(REG r)            { m_blocked.insert(r); }
-        void unblock(REG r)          { m_blocked.erase(r); }
-        bool is_blocked(REG r) const { return m_blocked.count(r) > 0; }
+        const vector<val_type*>& values() const { return m_values; }
+
+        void block(REG r)            { m_blocked |= bit(r); }
+        void unblock(REG r)          { m_blocked &= ~bit(r); }
+        bool is_blocked(REG r) const { return m_blocked & bit(r); }
+
+        void pin(REG r);
+        void unpin(REG r);
+        bool is_pinned(REG r) const  { return m_pinned & bit(r); }
 
         size_t count_active_regs() const;
         size_t count_dirty_regs() const;
 
     private:
         struct reginfo {
-            REG             regid;
             const val_type* owner;
-            bool            dirty;
             mutable u64     count;
         };
 
-        reginfo         m_regmap[NREGS];
-        mutable u64     m_usecnt;
-        emitter&        m_emitter;
-        set<val_type*>  m_values;
-        set<REG>        m_blocked;
-
-        REG select(const vector<REG>& order) const;
+        reginfo             m_regmap[NREGS];
+        u32                 m_used;
+        u32                 m_dirty;
+        u32                 m_blocked;
+        u32                 m_pinned;
+        mutable u64         m_usecnt;
+        const regplan<REG>* m_plan;
+        emitter&            m_emitter;
+        vector<val_type*>   m_values;
+
+        static u32 bit(REG r) { return 1u << reg_traits<REG>::rank(r); }
+        static REG order(int rank) { return reg_traits<REG>::order(rank); }
     };
 
     template <typename REG>
@@ -124,63 +323,135 @@ namespace ftl {
         FTL_ERROR_ON(!is_valid(r), "invalid register specified");
         if (is_empty(r))
             return false;
-        return m_regmap[r].dirty;
+        return m_dirty & bit(r);
     }
 
     template <typename REG>
     inline void ralloc<REG>::mark_dirty(REG r) {
         FTL_ERROR_ON(!is_valid(r), "invalid register specified");
-        m_regmap[r].dirty = true;
+        m_dirty |= bit(r);
     }
 
     template <typename REG>
     inline void ralloc<REG>::mark_clean(REG r) {
         FTL_ERROR_ON(!is_valid(r), "invalid register specified");
-        m_regmap[r].dirty = false;
+        m_dirty &= ~bit(r);
     }
 
-    template <>
-    inline reg ralloc<reg>::select() const {
-        static const vector<reg> alloc_order = {
-            RBX, RCX, RDX, RAX, RDI, RSI,  R8,  R9,
-            R10, R11, R14, R15, R12, R13, RSP, RBP,
-        };
+    template <typename REG>
+    inline REG ralloc<REG>::select() const {
+        const u32 avail = ~m_blocked & ((1ull << NREGS) - 1);
 
-        return select(alloc_order);
-    }
+        // try unused registers first
+        if (u32 empty = avail & ~m_used)
+            return order(ctz(empty));
+
+        // next, try registers that do not need to be flushed, preferably
+        // those holding values that are cheaper to recreate than to load
+        if (u32 clean = avail & ~m_dirty) {
+            for (u32 mask = clean; mask != 0; mask &= mask - 1) {
+                REG r = order(ctz(mask));
+                if (m_regmap[r].owner->can_remat())
+                    return r;
+            }
 
-    template <>
-    inline xmm ralloc<xmm>::select() const {
-        static const vector<xmm> alloc_order = {
-            XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
-            XMM7, XMM6, XMM5,  XMM4,  XMM3,  XMM2,  XMM1,  XMM0,
-        };
+            return order(ctz(clean));
+        }
 
-        return select(alloc_order);
+        // pick least recently used
+        REG lru = NREGS;
+        u64 min = ~0ull;
+        for (u32 mask = avail; mask != 0; mask &= mask - 1) {
+            REG r = order(ctz(mask));
+            if (m_regmap[r].count < min) {
+                min = m_regmap[r].count;
+                lru = r;
+            }
+        }
+
+        FTL_ERROR_ON(!is_valid(lru), "failed to select a register");
+        return lru;
     }
 
     template <typename REG>
-    inline REG ralloc<REG>::lookup(const val_type* v) const {
-        if (v == nullptr)
-            return NREGS;
+    inline REG ralloc<REG>::select(const val_type* val) const {
+        if (m_plan == nullptr || val == nullptr)
+            return select();
+
+        const u32 avail = ~m_blocked & ((1ull << NREGS) - 1);
+        const u32 empty = avail & ~m_used;
+        const u32 saved = reg_traits<REG>::callee_saved();
+        const bool call = m_plan->crosses_call(val);
+
+        // take the hinted register if it is free and survives long enough
+        REG hint = m_plan->hint(val);
+        if (is_valid(hint) && (empty & bit(hint)) &&
+            (!call || (saved & bit(hint)))) {
+            return hint;
+        }
 
-        for (auto info : m_regmap) {
-            if (info.owner == v) {
-                info.count = m_usecnt++;
-                return info.regid;
+        // values live across calls go into callee-saved registers, all
+        // others try to leave those alone
+        const u32 pref = call ? saved : ~saved;
+        if (empty & pref)
+            return order(ctz(empty & pref));
+        if (empty)
+            return order(ctz(empty));
+
+        // evict the value needed furthest in the future, prefer clean ones
+        // and among those the ones that can be rematerialized
+        REG best = NREGS;
+        u64 dist = 0;
+        int cost = 0;
+        for (u32 mask = avail; mask != 0; mask &= mask - 1) {
+            REG r = order(ctz(mask));
+            const val_type* owner = m_regmap[r].owner;
+            u64 next = m_plan->next_use(owner);
+            int c = (m_dirty & bit(r)) ? 2 : owner->can_remat() ? 0 : 1;
+            if (!is_valid(best) || next > dist || (next == dist && c < cost)) {
+                best = r;
+                dist = next;
+                cost = c;
             }
         }
 
-        return NREGS;
+        FTL_ERROR_ON(!is_valid(best), "failed to select a register");
+        return best;
+    }
+
+    template <typename REG>
+    inline REG ralloc<REG>::lookup(const val_type* v) const {
+        if (v == nullptr || !is_valid(v->m_reg))
+            return NREGS;
+
+        m_regmap[v->m_reg].count = m_usecnt++;
+        return v->m_reg;
     }
 
     template <typename REG>
     inline REG ralloc<REG>::assign(REG r, const val_type* val) {
         FTL_ERROR_ON(!is_valid(r), "invalid register specified");
 
+        const val_type* prev = m_regmap[r].owner;
+        if (prev != nullptr)
+            prev->m_reg = NREGS;
+
+        if (val != nullptr && is_valid(val->m_reg) && val->m_reg != r) {
+            m_regmap[val->m_reg].owner = nullptr;
+            m_used &= ~bit(val->m_reg);
+            m_dirty &= ~bit(val->m_reg);
+        }
+
         m_regmap[r].owner = val;
-        m_regmap[r].dirty = false;
         m_regmap[r].count = val ? m_usecnt++ : 0;
+        m_dirty &= ~bit(r);
+
+        if (val != nullptr) {
+            val->m_reg = r;
+            m_used |= bit(r);
+        } else {
+            m_used &= ~bit(r);
+        }
 
         return r;
     }
@@ -214,101 +485,133 @@ namespace ftl {
     template <typename REG>
     inline ralloc<REG>::ralloc(emitter& e):
         m_regmap(),
+        m_used(0),
+        m_dirty(0),
+        m_blocked(0),
+        m_pinned(0),
         m_usecnt(0),
-        m_emitter(e) {
+        m_plan(nullptr),
+        m_emitter(e),
+        m_values() {
         reset();
     }
 
     template <>
     inline ralloc<reg>::ralloc(emitter& e):
         m_regmap(),
+        m_used(0),
+        m_dirty(0),
+        m_blocked(0),
+        m_pinned(0),
         m_usecnt(0),
-        m_emitter(e) {
+        m_plan(nullptr),
+        m_emitter(e),
+        m_values() {
         reset();
         block(BASE_POINTER);
         block(STACK_POINTER);
     }
 
+    template <typename REG>
+    inline void ralloc<REG>::save(snapshot& s) const {
+        for (int r = 0; r < NREGS; r++) {
+            const val_type* owner = m_regmap[r].owner;
+            if (owner != nullptr && (owner->is_dead() || owner->is_scratch()))
+                owner = nullptr;
+
+            s.owner[r] = owner;
+            s.dirty[r] = owner != nullptr && (m_dirty & bit((REG)r));
+        }
+    }
+
+    template <typename REG>
+    inline void ralloc<REG>::pin(REG r) {
+        FTL_ERROR_ON(!is_valid(r), "invalid register specified");
+        m_pinned |= bit(r);
+        block(r);
+    }
+
+    template <typename REG>
+    inline void ralloc<REG>::unpin(REG r) {
+        FTL_ERROR_ON(!is_valid(r), "invalid register specified");
+        m_pinned &= ~bit(r);
+        unblock(r);
+    }
+
+    template <typename REG>
+    inline void ralloc<REG>::restore(const snapshot& s) {
+        // pinned registers hold the same value on every path
+        for (int r = 0; r < NREGS; r++)
+            if (m_regmap[r].owner != nullptr && !is_pinned((REG)r))
+                m_regmap[r].owner->m_reg = NREGS;
+
+        m_used &= m_pinned;
+        m_dirty &= m_pinned;
+
+        for (int r = 0; r < NREGS; r++) {
+            if (is_pinned((REG)r))
+                continue;
+
+            const val_type* owner = s.owner[r];
+            if (owner != nullptr && owner->m_dead)
+                owner = nullptr;
+
+            m_regmap[r].owner = owner;
+            m_regmap[r].count = owner ? m_usecnt++ : 0;
+
+            if (owner != nullptr) {
+                owner->m_reg = (REG)r;
+                m_used |= bit((REG)r);
+                if (s.dirty[r])
+                    m_dirty |= bit((REG)r);
+            }
+        }
+    }
 
     template <typename REG>
     inline void ralloc<REG>::reset() {
-        for (auto val : m_values)
+        for (auto val : m_values) {
             val->mark_dead();
+            val->m_reg = NREGS;
+        }
 
         m_values.clear();
         m_usecnt = 0;
+        m_used = 0;
+        m_dirty = 0;
 
         for (int r = 0; r < NREGS; r++) {
-           m_regmap[r].regid = (REG)r;
            m_regmap[r].owner = nullptr;
-           m_regmap[r].dirty = false;
            m_regmap[r].count = 0;
        }
     }
 
     template <typename REG>
     inline void ralloc<REG>::register_value(val_type* v) {
+#ifdef FTL_DEBUG
         if (stl_contains(m_values, v))
             FTL_ERROR("attempt to register value '%s' twice", v->name());
-        m_values.insert(v);
+#endif
+        m_values.push_back(v);
     }
 
     template <typename REG>
     inline void ralloc<REG>::unregister_value(val_type* v) {
-        if (!stl_contains(m_values, v))
+        // values mostly live on the stack, so search from the back
+        auto it = std::find(m_values.rbegin(), m_values.rend(), v);
+        if (it == m_values.rend())
             FTL_ERROR("attempt to unregister unknown value '%s'", v->name());
-        m_values.erase(v);
+        m_values.erase(std::next(it).base());
     }
 
     template <typename REG>
     inline size_t ralloc<REG>::count_active_regs() const {
-        size_t count = 0;
-        for (int i = 0; i < NREGS; i++)
-            if (m_regmap[i].owner != nullptr)
-                count++;
-        return count;
+        return popcount(m_used);
     }
 
     template <typename REG>
     inline size_t ralloc<REG>::count_dirty_regs() const {
-        size_t count = 0;
-        for (int i = 0; i < NREGS; i++)
-            if (m_regmap[i].owner != nullptr && m_regmap[i].dirty)
-                count++;
-        return count;
-    }
-
-    template <typename REG>
-    inline REG ralloc<REG>::select(const vector<REG>& order) const {
-        vector<REG> regs;
-        regs.reserve(order.size());
-        std::copy_if(order.begin(), order.end(), std::back_inserter(regs),
-                     [this](REG r) -> bool {
-            return !is_blocked(r);
-        });
-
-        // try unused registers first
-        for (REG r : regs)
-            if (is_empty(r))
-                return r;
-
-        // next, try registers that do not need to be flushed
-        for (REG r : regs)
-            if (!is_dirty(r))
-                return r;
-
-        // pick least recently used
-        REG lru = NREGS;
-        u64 min = ~0ull;
-        for (REG r : regs) {
-            if (m_regmap[r].count < min) {
-                min = m_regmap[r].count;
-                lru = r;
-            }
-        }
-
-        FTL_ERROR_ON(!is_valid(lru), "failed to select a register");
-        return lru;
+        return popcount(m_used & m_dirty);
     }
 
 }
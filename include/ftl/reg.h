@@ -137,18 +137,28 @@ namespace ftl {
     struct rm {
         const bool is_mem;
         const bool is_xmm;
+        const bool is_rip; // offset holds the absolute target address
 
         const int  r;
         const i64  offset;
 
         bool is_reg() const { return !is_mem && !is_xmm; }
-        bool is_addressable() const { return fits_i32(offset); }
+        bool is_addressable() const { return is_rip || fits_i32(offset); }
 
-        rm(reg _r): is_mem(false), is_xmm(false), r(_r), offset(0) {}
-        rm(xmm _r): is_mem(false), is_xmm(true),  r((reg)_r), offset(0) {}
+        rm(reg _r): is_mem(false), is_xmm(false), is_rip(false), r(_r),
+                offset(0) {
+        }
+
+        rm(xmm _r): is_mem(false), is_xmm(true), is_rip(false), r((reg)_r),
+                offset(0) {
+        }
 
-        rm(reg base, i64 off): is_mem(true), is_xmm(false), r(base),
-                offset(off) {
+        rm(reg base, i64 off): is_mem(true), is_xmm(false), is_rip(false),
+                r(base), offset(off) {
+        }
+
+        explicit rm(const void* addr): is_mem(true), is_xmm(false),
+                is_rip(true), r(RBP), offset((i64)(uintptr_t)addr) {
         }
 
         bool operator == (const rm& other) const;
@@ -160,7 +170,7 @@ namespace ftl {
 
     inline bool rm::operator == (const rm& o) const {
         return is_mem == o.is_mem && r == o.r && offset == o.offset &&
-               is_xmm == o.is_xmm;
+               is_xmm == o.is_xmm && is_rip == o.is_rip;
     }
 
     inline bool rm::operator != (const rm& o) const {
@@ -177,6 +187,13 @@ namespace ftl {
         return rm(base, offset);
     }
 
+    // memory operand addressed relative to the instruction pointer, the
+    // target must be within +/-2GiB of the code referencing it
+    static inline rm ripop(const void* addr) {
+        FTL_ERROR_ON(addr == nullptr, "invalid rip-relative address");
+        return rm(addr);
+    }
+
 }
 
 std::ostream& operator << (std::ostream& os, const ftl::reg& r);
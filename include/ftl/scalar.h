@@ -36,6 +36,9 @@ namespace ftl {
         bool   m_dead;
         rm     m_mem;
 
+        template <typename REG> friend class ralloc;
+        mutable xmm m_reg; // register currently holding this value, if any
+
     public:
         int  bits;
         u64  addr;
@@ -47,6 +50,7 @@ namespace ftl {
         i32 offset() const { return m_mem.offset; }
 
         bool is_dead() const;
+        bool can_remat() const { return false; }
         void mark_dead() { m_dead = true; }
 
         bool is_dirty() const;
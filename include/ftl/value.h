@@ -34,8 +34,15 @@ namespace ftl {
         alloc& m_allocator;
         string m_name;
         bool   m_dead;
+        bool   m_precise;
         rm     m_mem;
 
+        template <typename REG> friend class ralloc;
+        mutable reg m_reg; // register currently holding this value, if any
+
+        mutable u64 m_kmask; // bits whose contents are known
+        mutable u64 m_kbits; // contents of the known bits
+
     public:
         int  bits;
         bool sign;
@@ -53,6 +60,29 @@ namespace ftl {
         bool is_dirty() const;
         void mark_dirty();
 
+        // Imprecise globals are only written back to memory at observation
+        // points (see func::gen_observe), on exit or when evicted, but not
+        // before every helper call.
+        bool is_precise() const { return m_precise; }
+        void mark_precise() { m_precise = true; }
+        void mark_imprecise() { m_precise = false; }
+
+        // Contents known at code generation time. Every write from a source
+        // that is not known itself (i.e. mark_dirty) forgets them again.
+        u64  mask() const;
+        u64  known_mask() const { return m_kmask & mask(); }
+        u64  known_bits() const { return m_kbits & known_mask(); }
+        bool is_const() const { return known_mask() == mask(); }
+        i64  const_val() const;
+
+        // Constants need no memory home, the allocator drops them without a
+        // store when evicting and recreates them on their next use.
+        bool can_remat() const { return is_const(); }
+
+        void set_known(u64 kmask, u64 kbits) const;
+        void set_const(i64 val) const { set_known(~0ull, val); }
+        void forget_known() const { m_kmask = m_kbits = 0; }
+
         bool is_local() const;
         bool is_global() const;
         bool is_scratch() const;
@@ -82,7 +112,22 @@ namespace ftl {
     };
 
     inline bool value::is_dead() const {
-        return m_dead || (is_scratch() && r() == NREGS);
+        return m_dead || (is_scratch() && r() == NREGS && !can_remat());
+    }
+
+    inline u64 value::mask() const {
+        return bits == 64 ? ~0ull : (1ull << bits) - 1;
+    }
+
+    inline i64 value::const_val() const {
+        FTL_ERROR_ON(!is_const(), "value %s is not constant", name());
+        u64 sign = 1ull << (bits - 1);
+        return (i64)((m_kbits & mask()) ^ sign) - (i64)sign;
+    }
+
+    inline void value::set_known(u64 kmask, u64 kbits) const {
+        m_kmask = kmask & mask();
+        m_kbits = kbits & m_kmask;
     }
 
     inline bool value::is_directly_addressable() const {
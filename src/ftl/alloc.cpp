@@ -20,17 +20,118 @@
 
 namespace ftl {
 
+    // Suspends spilling to xmm registers while memory must be made coherent,
+    // otherwise evictions along the way would create new spills.
+    struct spill_guard {
+        bool& enabled;
+        bool  saved;
+
+        spill_guard(bool& flag): enabled(flag), saved(flag) { flag = false; }
+        ~spill_guard() { enabled = saved; }
+    };
+
     alloc::alloc(emitter& e):
         m_emitter(e),
         m_regs(e),
         m_xmms(e),
-        m_locals(~0ull),
-        m_base(0) {
+        m_slots(),
+        m_frame(0),
+        m_base(0),
+        m_reachable(true),
+        m_addr(nullptr),
+        m_xmm_spill(false),
+        m_spills(),
+        m_states(),
+        m_pins() {
         reset();
     }
 
+    alloc::alloc(alloc&& other):
+        m_emitter(other.m_emitter),
+        m_regs(std::move(other.m_regs)),
+        m_xmms(std::move(other.m_xmms)),
+        m_slots(std::move(other.m_slots)),
+        m_frame(other.m_frame),
+        m_base(other.m_base),
+        m_reachable(other.m_reachable),
+        m_addr(nullptr),
+        m_xmm_spill(other.m_xmm_spill),
+        m_spills(),
+        m_states(std::move(other.m_states)),
+        m_pins(std::move(other.m_pins)) {
+        for (xmm r : all_xmms)
+            m_spills[r] = other.m_spills[r];
+
+        // the address value refers to its allocator, so it stays behind and
+        // gets recreated on demand
+        if (other.m_addr != nullptr) {
+            reg r = m_regs.lookup(other.m_addr);
+            if (reg_valid(r))
+                m_regs.assign(r, nullptr);
+            m_regs.unregister_value(other.m_addr);
+            other.m_regs.register_value(other.m_addr);
+            other.m_addr->mark_dead();
+        }
+    }
+
     alloc::~alloc() {
-        // nothing to do
+        if (m_addr != nullptr)
+            delete m_addr;
+    }
+
+    bool alloc::near_code(u64 addr) const {
+        // must hold for any instruction within the buffer
+        const cbuf& buffer = m_emitter.get_buffer();
+        const u64 head = (u64)buffer.get_code_entry();
+        const u64 tail = head + buffer.capacity();
+        return fits_i32((i64)(addr - head)) && fits_i32((i64)(addr - tail));
+    }
+
+    bool alloc::can_materialize(int bits, i64 val) const {
+        if (bits < 64 || fits_i32(val) || fits_u32(val))
+            return true;
+        if (m_base != 0 && fits_i32((i64)((u64)val - m_base)))
+            return true;
+        return near_code(val);
+    }
+
+    void alloc::materialize(reg r, int bits, i64 val) {
+        // neither of these touches the flags; 32bit moves zero-extend and
+        // have the shortest encoding
+        if (bits == 64 && fits_u32(val))
+            m_emitter.movi(32, r, val);
+        else if (bits < 64 || fits_i32(val))
+            m_emitter.movi(bits, r, val);
+        else if (m_base != 0 && fits_i32((i64)((u64)val - m_base)))
+            m_emitter.lear(64, r, memop(BASE_POINTER, (u64)val - m_base));
+        else if (near_code(val))
+            m_emitter.lear(64, r, ripop((const void*)val));
+        else
+            m_emitter.movi(64, r, val);
+    }
+
+    rm alloc::address(u64 addr) {
+        if (near_code(addr))
+            return ripop((const void*)addr);
+
+        // globals outside of the data pointer reach share a base register,
+        // which is dropped without a store when evicted
+        if (m_addr == nullptr)
+            m_addr = new value(*this, "address", 64, false, 0, NREGS, 0);
+
+        reg base = m_regs.lookup(m_addr);
+        if (reg_valid(base) && m_addr->is_const()) {
+            i64 offset = (i64)(addr - (u64)m_addr->const_val());
+            if (fits_i32(offset))
+                return memop(base, offset);
+        }
+
+        if (!reg_valid(base))
+            base = assign(m_addr);
+
+        materialize(base, 64, addr);
+        m_addr->set_const(addr);
+        return memop(base, 0);
     }
 
     reg alloc::assign(const value* val, reg r) {
@@ -39,24 +140,45 @@ namespace ftl {
         if (r == NREGS)
             r = m_regs.lookup(val);
         if (r == NREGS)
-            r = m_regs.select();
+            r = m_regs.select(val);
 
         FTL_ERROR_ON(!reg_valid(r), "invalid register selected: %d", r);
         FTL_ERROR_ON(r == STACK_POINTER, "cannot assign to stack pointer");
         FTL_ERROR_ON(r == BASE_POINTER, "cannot assign to base pointer");
-        FTL_ERROR_ON(is_blocked(r), "cannot assign to blocked register %s",
-                     reg_names[r]);
 
         if (m_regs.lookup(r) == val)
             return r;
 
+        reg curr = m_regs.lookup(val);
+        FTL_ERROR_ON(curr < NREGS && is_pinned(curr),
+                     "cannot move pinned value %s to %s", val->name(),
+                     reg_names[r]);
+
+        if (is_pinned(r)) {
+            FTL_ERROR_ON(!is_pinned(val), "cannot assign %s to pinned "
+                         "register %s", val->name(), reg_names[r]);
+            m_regs.assign(r, val);
+            return r;
+        }
+
+        FTL_ERROR_ON(is_blocked(r), "cannot assign to blocked register %s",
+                     reg_names[r]);
+
         flush(r);
 
-        reg curr = m_regs.lookup(val);
         if (curr < NREGS)
             m_regs.assign(curr, nullptr);
 
         m_regs.assign(r, val);
+
+        // a spilled value is more recent than its memory copy
+        xmm spilled = lookup_spill(val);
+        if (xmm_valid(spilled)) {
+            m_emitter.movx(val->bits, r, spilled);
+            m_regs.mark_dirty(r);
+            drop_spill(spilled);
+        }
+
         return r;
     }
 
@@ -66,7 +188,9 @@ namespace ftl {
         if (r == NXMM)
             r = m_xmms.lookup(val);
         if (r == NXMM)
-            r = m_xmms.select();
+            r = select_fp(val);
+        else
+            unspill(r);
 
         FTL_ERROR_ON(!reg_valid(r), "invalid register selected: %d", r);
         FTL_ERROR_ON(is_blocked(r), "cannot assign to blocked register %s",
@@ -93,13 +217,37 @@ namespace ftl {
         if ((curr < NREGS) && (curr == r || r == NREGS))
             return curr;
 
+        // pinned values never leave their register, callers needing them in
+        // a fixed register get a copy that nobody owns
+        if (curr < NREGS && is_pinned(curr)) {
+            FTL_ERROR_ON(is_pinned(r), "cannot copy %s to pinned register %s",
+                         val->name(), reg_names[r]);
+            flush(r);
+            m_emitter.movr(val->bits, r, curr);
+            return r;
+        }
+
+        if (is_spilled(val))
+            return assign(val, r);
+
+        bool dirty = curr < NREGS && is_dirty(curr);
         r = assign(val, r);
 
         if (curr < NREGS) {
             m_emitter.movr(val->bits, r, curr);
+            if (dirty)
+                m_regs.mark_dirty(r);
+        } else if (val->can_remat() && (val->is_scratch() ||
+                   can_materialize(val->bits, val->const_val()))) {
+            // known contents are cheaper to recreate than to load
+            materialize(r, val->bits, val->const_val());
         } else {
             FTL_ERROR_ON(val->is_scratch(), "attempt to fetch scratch value");
+            bool blocked = is_blocked(r);
+            block(r); // far globals may need a base register
             m_emitter.movr(val->bits, r, val->mem());
+            if (!blocked)
+                unblock(r);
         }
 
         return r;
@@ -112,10 +260,13 @@ namespace ftl {
         if ((curr < NXMM) && (curr == r || r == NXMM))
             return curr;
 
+        bool dirty = curr < NXMM && is_dirty(curr);
         r = assign(val, r);
 
         if (curr < NXMM) {
             m_emitter.movs(val->bits, r, curr);
+            if (dirty)
+                mark_dirty(r);
         } else {
             FTL_ERROR_ON(val->is_scratch(), "attempt to fetch scratch value");
             m_emitter.movs(val->bits, r, val->mem());
@@ -127,7 +278,8 @@ namespace ftl {
     void alloc::store(reg r) {
         FTL_ERROR_ON(!reg_valid(r), "invalid register specified");
 
-        if (!is_dirty(r))
+        // pinned values are written back when leaving generated code
+        if (!is_dirty(r) || is_pinned(r))
             return;
 
         const value* val = m_regs.lookup(r);
@@ -136,7 +288,11 @@ namespace ftl {
         if (val->is_scratch())
             return;
 
+        bool blocked = is_blocked(r);
+        block(r);
         m_emitter.movr(val->bits, val->mem(), r);
+        if (!blocked)
+            unblock(r);
         mark_clean(r);
     }
 
@@ -158,25 +314,234 @@ namespace ftl {
 
     void alloc::flush(reg r) {
         FTL_ERROR_ON(!reg_valid(r), "invalid register specified");
-        store(r);
+        if (is_pinned(r))
+            return;
+
+        if (!spill(r))
+            store(r);
         m_regs.assign(r, nullptr);
     }
 
     void alloc::flush(xmm r) {
         FTL_ERROR_ON(!xmm_valid(r), "invalid register specified");
+        unspill(r);
         store(r);
         m_xmms.assign(r, nullptr);
     }
 
+    bool alloc::spill(reg r) {
+        if (!m_xmm_spill || !is_dirty(r))
+            return false;
+
+        // only values that would otherwise go to their home location
+        const value* val = m_regs.lookup(r);
+        if (val == nullptr || val->is_dead() || val->is_scratch() ||
+            val->bits < 32) {
+            return false;
+        }
+
+        // use the registers floating point code is least likely to want
+        for (int rank = NXMM - 1; rank >= 0; rank--) {
+            xmm x = reg_traits<xmm>::order(rank);
+            if (!m_xmms.is_empty(x) || m_xmms.is_blocked(x))
+                continue;
+
+            m_xmms.assign(x, nullptr);
+            m_xmms.block(x);
+            m_emitter.movx(val->bits, x, r);
+            m_spills[x] = val;
+            mark_clean(r);
+            return true;
+        }
+
+        return false;
+    }
+
+    void alloc::unspill(xmm r) {
+        const value* val = m_spills[r];
+        if (val == nullptr)
+            return;
+
+        // the register stays blocked in case a far global needs a base
+        m_emitter.movx(val->bits, val->mem(), r);
+        drop_spill(r);
+    }
+
+    void alloc::unspill_all() {
+        for (xmm r : all_xmms)
+            unspill(r);
+    }
+
+    void alloc::drop_spill(xmm r) {
+        if (m_spills[r] == nullptr)
+            return;
+
+        m_spills[r] = nullptr;
+        m_xmms.unblock(r);
+    }
+
+    void alloc::drop_spills() {
+        for (xmm r : all_xmms)
+            drop_spill(r);
+    }
+
+    xmm alloc::lookup_spill(const value* val) const {
+        for (xmm r : all_xmms)
+            if (m_spills[r] == val)
+                return r;
+        return NXMM;
+    }
+
+    xmm alloc::select_fp(const scalar* val) {
+        // floating point values take precedence over spilled integers, so
+        // give back a spill register before evicting any scalar
+        for (xmm r : all_xmms)
+            if (m_xmms.is_empty(r) && !m_xmms.is_blocked(r))
+                return m_xmms.select(val);
+
+        for (unsigned int rank = 0; rank < NXMM; rank++) {
+            xmm r = reg_traits<xmm>::order(rank);
+            if (m_spills[r] != nullptr) {
+                unspill(r);
+                break;
+            }
+        }
+
+        return m_xmms.select(val);
+    }
+
+    void alloc::set_xmm_spill(bool enable) {
+        if (!enable)
+            unspill_all();
+        m_xmm_spill = enable;
+    }
+
+    void alloc::unspill(const value* val) {
+        xmm r = lookup_spill(val);
+        if (xmm_valid(r))
+            unspill(r);
+    }
+
+    size_t alloc::count_spills() const {
+        size_t count = 0;
+        for (xmm r : all_xmms)
+            if (m_spills[r] != nullptr)
+                count++;
+        return count;
+    }
+
+    reg alloc::relocate(reg r) {
+        FTL_ERROR_ON(!reg_valid(r), "invalid register specified");
+
+        const value* val = m_regs.lookup(r);
+        if (val == nullptr || val->is_dead())
+            return NREGS;
+
+        FTL_ERROR_ON(is_pinned(r), "cannot relocate pinned register %s",
+                     reg_names[r]);
+
+        bool blocked = is_blocked(r);
+        if (!blocked)
+            block(r);
+
+        reg target = m_regs.select(val);
+        flush(target);
+
+        bool dirty = is_dirty(r);
+        m_emitter.movr(64, target, r);
+        m_regs.assign(r, nullptr);
+        m_regs.assign(target, val);
+        if (dirty)
+            m_regs.mark_dirty(target);
+
+        if (!blocked)
+            unblock(r);
+
+        return target;
+    }
+
+    xmm alloc::relocate(xmm r) {
+        FTL_ERROR_ON(!xmm_valid(r), "invalid register specified");
+        unspill(r);
+
+        const scalar* val = m_xmms.lookup(r);
+        if (val == nullptr || val->is_dead())
+            return NXMM;
+
+        bool blocked = is_blocked(r);
+        if (!blocked)
+            block(r);
+
+        xmm target = select_fp(val);
+        flush(target);
+
+        bool dirty = is_dirty(r);
+        m_emitter.movs(64, target, r);
+        m_xmms.assign(r, nullptr);
+        m_xmms.assign(target, val);
+        if (dirty)
+            mark_dirty(target);
+
+        if (!blocked)
+            unblock(r);
+
+        return target;
+    }
+
+    i32 alloc::new_slot(size_t size, size_t align) {
+        FTL_ERROR_ON(size == 0 || size % sizeof(u64), "invalid slot size");
+        FTL_ERROR_ON(align > STACK_ALIGNMENT || !is_pow2(align),
+                     "invalid slot alignment %zu", align);
+
+        // first fit, so that freed slots are reused before growing the frame
+        const size_t n = size / sizeof(u64);
+        const size_t step = max(align, sizeof(u64)) / sizeof(u64);
+
+        auto is_free = [this, n](size_t idx) -> bool {
+            for (size_t i = idx; i < idx + n && i < m_slots.size(); i++) {
+                if (m_slots[i])
+                    return false;
+            }
+            return true;
+        };
+
+        size_t idx = 0;
+        while (!is_free(idx))
+            idx += step;
+
+        const size_t end = (idx + n) * sizeof(u64);
+        FTL_ERROR_ON(end > STACK_FRAME_MAX, "out of stack frame memory");
+
+        if (m_slots.size() < idx + n)
+            m_slots.resize(idx + n, false);
+        for (size_t i = 0; i < n; i++)
+            m_slots[idx + i] = true;
+
+        m_frame = max(m_frame, end);
+        return (i32)(idx * sizeof(u64)) - (i32)STACK_RED_ZONE;
+    }
+
+    void alloc::free_slot(i32 offset, size_t size) {
+        i64 pos = (i64)offset + (i64)STACK_RED_ZONE;
+        FTL_ERROR_ON(pos < 0 || pos % sizeof(u64), "corrupt stack offset");
+
+        size_t idx = pos / sizeof(u64);
+        size_t n = size / sizeof(u64);
+        FTL_ERROR_ON(idx + n > m_slots.size(), "corrupt stack offset");
+
+        for (size_t i = 0; i < n; i++) {
+            FTL_ERROR_ON(!m_slots[idx + i], "double free stack slot");
+            m_slots[idx + i] = false;
+        }
+    }
+
     value alloc::new_local_noinit(const string& name, int bits, reg r) {
-        int idx = ffs(m_locals) - 1;
-        FTL_ERROR_ON(idx < 0, "out of stack frame memory");
-        m_locals &= ~(1ull << idx);
+        i32 offset = new_slot(sizeof(u64), sizeof(u64));
 
         if (r == NREGS)
             r = select();
 
-        value v(*this, name, bits, true, 0, STACK_POINTER, idx * sizeof(u64));
+        value v(*this, name, bits, true, 0, STACK_POINTER, offset);
 
         flush(r);
         assign(&v, r);
@@ -188,7 +553,8 @@ namespace ftl {
         value v = new_local_noinit(name, bits, r);
         r = v.r();
         m_emitter.movi(bits, r, val);
-        mark_dirty(r);
+        m_regs.mark_dirty(r);
+        v.set_const(val);
         return v;
     }
 
@@ -200,6 +566,18 @@ namespace ftl {
 
         i64 offset = addr - m_base;
         value v(*this, name, bits, true, addr, BASE_POINTER, offset);
+
+        for (const pinned& p : m_pins) {
+            if ((u64)p.addr != addr)
+                continue;
+
+            FTL_ERROR_ON(p.bits != bits, "pinned value %s must be %d bits",
+                         name.c_str(), p.bits);
+            FTL_ERROR_ON(!m_regs.is_empty(p.r), "pinned value %s already "
+                         "in use", name.c_str());
+            m_regs.assign(p.r, &v);
+        }
+
         return v;
     }
 
@@ -217,19 +595,28 @@ namespace ftl {
         value v = new_scratch_noinit(name, bits, r);
         r = v.r();
         m_emitter.movi(bits, r, val);
-        mark_dirty(r);
+        m_regs.mark_dirty(r);
+        v.set_const(val);
         return v;
     }
 
+    static void load_fp(emitter& e, int bits, xmm r, f64 f) {
+        // floating point constants come from the literal pool, which saves
+        // us the detour through a general purpose register
+        u64 raw = (bits == 32) ? f32_raw(f) : f64_raw(f);
+        if (raw == 0)
+            e.pxor(bits, r, r);
+        else
+            e.movs(bits, r, e.literal(raw));
+    }
+
     scalar alloc::new_local_scalar_noinit(const string& nm, int bits, xmm r) {
-        int idx = ffs(m_locals) - 1;
-        FTL_ERROR_ON(idx < 0, "out of stack frame memory");
-        m_locals &= ~(1ull << idx);
+        i32 offset = new_slot(sizeof(u64), sizeof(u64));
 
         if (r == NXMM)
-            r = m_xmms.select();
+            r = select_fp(nullptr);
 
-        scalar s(*this, nm, bits, 0, STACK_POINTER, idx * sizeof(u64));
+        scalar s(*this, nm, bits, 0, STACK_POINTER, offset);
 
         flush(r);
         assign(&s, r);
@@ -239,16 +626,8 @@ namespace ftl {
 
     scalar alloc::new_local_scalar(const string& nm, int bits, f64 f, xmm r) {
         scalar s = new_local_scalar_noinit(nm, bits, r);
-        r = s.r();
-
-        reg dummy = m_regs.select();
-        flush(dummy);
-
-        u64 raw = (bits == 32) ? f32_raw(f) : f64_raw(f);
-        m_emitter.movi(bits, dummy, raw);
-        m_emitter.movx(bits, r, dummy);
-
-        mark_dirty(r);
+        load_fp(m_emitter, bits, s.r(), f);
+        mark_dirty(s.r());
         return s;
     }
 
@@ -265,7 +644,7 @@ namespace ftl {
 
     scalar alloc::new_scratch_scalar_noinit(const string& n, int bits, xmm r) {
         if (r == NXMM)
-            r = m_xmms.select();
+            r = select_fp(nullptr);
         flush(r);
 
         scalar s(*this, n, bits, ~0ull, NREGS, 0);
@@ -275,48 +654,45 @@ namespace ftl {
 
     scalar alloc::new_scratch_scalar(const string& n, int bits, f64 f, xmm r) {
         scalar s = new_scratch_scalar_noinit(n, bits, r);
-        r = s.r();
-
-        reg dummy = m_regs.select();
-        flush(dummy);
-
-        u64 raw = (bits == 32) ? f32_raw(f) : f64_raw(f);
-        m_emitter.movi(bits, dummy, raw);
-        m_emitter.movx(bits, r, dummy);
-
-        mark_dirty(r);
+        load_fp(m_emitter, bits, s.r(), f);
+        mark_dirty(s.r());
         return s;
     }
 
     void alloc::free_value(value& val) {
         FTL_ERROR_ON(val.is_dead(), "double free value %s", val.name());
 
-        if (val.is_local()) {
-            int idx = val.offset() / sizeof(u64);
-            FTL_ERROR_ON(idx < 0 || idx > 64, "corrupt stack offset");
-            m_locals |= (1 << idx);
-        }
+        if (val.is_local())
+            free_slot(val.offset(), sizeof(u64));
 
         reg r = lookup(&val);
         if (r < NREGS)
             m_regs.assign(r, nullptr);
 
+        // others may still observe globals, so those need writing back
+        xmm spilled = lookup_spill(&val);
+        if (xmm_valid(spilled)) {
+            if (val.is_global())
+                unspill(spilled);
+            else
+                drop_spill(spilled);
+        }
+
+        forget(&val);
         val.mark_dead();
     }
 
     void alloc::free_scalar(scalar& val) {
         FTL_ERROR_ON(val.is_dead(), "double free scalar %s", val.name());
 
-        if (val.is_local()) {
-            int idx = val.offset() / sizeof(u64);
-            FTL_ERROR_ON(idx < 0 || idx > 64, "corrupt stack offset");
-            m_locals |= (1 << idx);
-        }
+        if (val.is_local())
+            free_slot(val.offset(), sizeof(u64));
 
         xmm r = lookup(&val);
         if (r < NXMM)
             m_xmms.assign(r, nullptr);
 
+        forget(&val);
         val.mark_dead();
     }
 
@@ -335,6 +711,8 @@ namespace ftl {
     }
 
     void alloc::store_all_regs() {
+        spill_guard guard(m_xmm_spill);
+        unspill_all();
         for (reg r : all_regs)
             store(r);
         for (xmm r : all_xmms)
@@ -342,6 +720,8 @@ namespace ftl {
     }
 
     void alloc::flush_all_regs() {
+        spill_guard guard(m_xmm_spill);
+        unspill_all();
         for (reg r : all_regs)
             flush(r);
         for (xmm r : all_xmms)
@@ -349,6 +729,8 @@ namespace ftl {
     }
 
     void alloc::store_volatile_regs() {
+        spill_guard guard(m_xmm_spill);
+        unspill_all();
         for (reg r : caller_saved_regs)
             store(r);
         for (xmm r : caller_saved_xmms)
@@ -356,17 +738,331 @@ namespace ftl {
     }
 
     void alloc::flush_volatile_regs() {
+        // values spilled to xmm registers do not survive a call either
+        spill_guard guard(m_xmm_spill);
+        unspill_all();
         for (reg r : caller_saved_regs)
             flush(r);
         for (xmm r : caller_saved_xmms)
             flush(r);
     }
 
+    void alloc::store_global_regs(bool imprecise) {
+        spill_guard guard(m_xmm_spill);
+
+        // locals cannot be observed by anyone else and callee-saved
+        // registers survive calls, so only globals need writing back
+        for (reg r : all_regs) {
+            const value* val = m_regs.lookup(r);
+            if (val == nullptr || val->is_dead() || !val->is_global())
+                continue;
+            if (imprecise || val->is_precise())
+                store(r);
+        }
+
+        for (xmm r : all_xmms) {
+            const value* val = m_spills[r];
+            if (val != nullptr && val->is_global() &&
+                (imprecise || val->is_precise())) {
+                unspill(r);
+            }
+        }
+
+        for (xmm r : all_xmms) {
+            const scalar* val = m_xmms.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global())
+                store(r);
+        }
+    }
+
+    void alloc::flush_global_regs() {
+        spill_guard guard(m_xmm_spill);
+
+        // pinned registers stay, see store_pinned_regs/load_pinned_regs
+        for (reg r : all_regs) {
+            const value* val = m_regs.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global())
+                flush(r);
+        }
+
+        for (xmm r : all_xmms) {
+            const value* val = m_spills[r];
+            if (val != nullptr && val->is_global())
+                unspill(r);
+        }
+
+        for (xmm r : all_xmms) {
+            const scalar* val = m_xmms.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global())
+                flush(r);
+        }
+    }
+
+    vector<writeback> alloc::fault_writebacks() {
+        spill_guard guard(m_xmm_spill);
+
+        // recovery code only moves registers to directly addressable memory,
+        // everything else needs to be in memory before the access already
+        for (reg r : all_regs) {
+            const value* val = m_regs.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global() &&
+                !val->is_directly_addressable()) {
+                store(r);
+            }
+        }
+
+        for (xmm r : all_xmms) {
+            const value* val = m_spills[r];
+            if (val != nullptr && val->is_global())
+                unspill(r);
+        }
+
+        for (xmm r : all_xmms) {
+            const scalar* val = m_xmms.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global())
+                store(r);
+        }
+
+        // pinned registers are written back when leaving generated code
+        vector<writeback> wb;
+        for (reg r : all_regs) {
+            const value* val = m_regs.lookup(r);
+            if (val != nullptr && !val->is_dead() && val->is_global() &&
+                m_regs.is_dirty(r) && !m_regs.is_pinned(r)) {
+                wb.push_back({ r, val->bits, val->mem() });
+            }
+        }
+
+        return wb;
+    }
+
+    void alloc::forget_known(bool globals_only) {
+        for (const value* val : m_regs.values())
+            if (!globals_only || val->is_global())
+                val->forget_known();
+    }
+
+    bool alloc::is_pinned(const value* val) const {
+        if (!val->is_global())
+            return false;
+
+        for (const pinned& p : m_pins)
+            if ((u64)p.addr == val->addr)
+                return true;
+
+        return false;
+    }
+
+    void alloc::pin(const pinned& p) {
+        FTL_ERROR_ON(m_base == 0, "pinning requires a data pointer");
+        FTL_ERROR_ON(p.r == STACK_POINTER || p.r == BASE_POINTER ||
+                     !stl_contains(callee_saved_regs, p.r),
+                     "cannot pin to register %s", reg_names[p.r]);
+        FTL_ERROR_ON(is_pinned(p.r), "register %s already pinned",
+                     reg_names[p.r]);
+        FTL_ERROR_ON(!fits_i32((i64)((u64)p.addr - m_base)),
+                     "pinned value out of reach of data pointer");
+
+        flush(p.r);
+        m_regs.pin(p.r);
+        m_pins.push_back(p);
+    }
+
+    void alloc::store_pinned_regs() {
+        for (const pinned& p : m_pins) {
+            rm mem = memop(BASE_POINTER, (u64)p.addr - m_base);
+            m_emitter.movr(p.bits, mem, p.r);
+        }
+    }
+
+    void alloc::load_pinned_regs() {
+        for (const pinned& p : m_pins) {
+            rm mem = memop(BASE_POINTER, (u64)p.addr - m_base);
+            m_emitter.movr(p.bits, p.r, mem);
+        }
+    }
+
+    void alloc::forget(const value* val) {
+        for (regstate* state : m_states) {
+            for (reg r : all_regs) {
+                if (state->m_regs.owner[r] == val) {
+                    state->m_regs.owner[r] = nullptr;
+                    state->m_regs.dirty[r] = false;
+                }
+            }
+        }
+    }
+
+    void alloc::forget(const scalar* val) {
+        for (regstate* state : m_states) {
+            for (xmm r : all_xmms) {
+                if (state->m_xmms.owner[r] == val) {
+                    state->m_xmms.owner[r] = nullptr;
+                    state->m_xmms.dirty[r] = false;
+                }
+            }
+        }
+    }
+
+    void alloc::flush_scratch_regs() {
+        // scratch values have no home location, so they cannot be carried
+        // across control flow edges
+        spill_guard guard(m_xmm_spill);
+        for (reg r : all_regs) {
+            const value* val = m_regs.lookup(r);
+            if (val != nullptr && val->is_scratch())
+                flush(r);
+        }
+
+        // neither can spilled values, as the label does not know about them
+        unspill_all();
+
+        for (xmm r : all_xmms) {
+            const scalar* val = m_xmms.lookup(r);
+            if (val != nullptr && val->is_scratch())
+                flush(r);
+        }
+    }
+
+    void alloc::register_state(regstate* state) {
+        m_states.push_back(state);
+    }
+
+    void alloc::unregister_state(regstate* state) {
+        auto it = std::find(m_states.rbegin(), m_states.rend(), state);
+        if (it == m_states.rend())
+            FTL_ERROR("attempt to unregister unknown register state");
+        m_states.erase(std::next(it).base());
+    }
+
+    void alloc::save_state(regstate& state) {
+        flush_scratch_regs();
+        m_regs.save(state.m_regs);
+        m_xmms.save(state.m_xmms);
+        state.m_valid = true;
+    }
+
+    void alloc::load_state(const regstate& state) {
+        FTL_ERROR_ON(!state.is_valid(), "attempt to load invalid state");
+        drop_spills();
+        m_regs.restore(state.m_regs);
+        m_xmms.restore(state.m_xmms);
+        m_reachable = true;
+    }
+
+    template <typename REG, typename VAL>
+    static void merge_regs(alloc& al, ralloc<REG>& ra,
+                           const typename ralloc<REG>::snapshot& target,
+                           const array<REG, ralloc<REG>::NREGS>& regs) {
+        const REG NONE = ralloc<REG>::NREGS;
+
+        auto expected = [&](const VAL* val) -> REG {
+            for (REG r : regs)
+                if (target.owner[r] == val)
+                    return r;
+            return NONE;
+        };
+
+        // evict everything that is not expected at the target
+        for (REG r : regs) {
+            const VAL* val = ra.lookup(r);
+            if (val == nullptr || val->is_dead())
+                continue;
+
+            REG dest = expected(val);
+            if (dest == NONE)
+                al.flush(r);
+            else if (dest == r && !target.dirty[r])
+                al.store(r);
+        }
+
+        // move or load the remaining values into their expected registers;
+        // cyclic dependencies are resolved by spilling one of the values
+        vector<REG> pending;
+        for (REG r : regs) {
+            const VAL* val = target.owner[r];
+            if (val != nullptr && !val->is_dead() && ra.lookup(val) != r)
+                pending.push_back(r);
+        }
+
+        while (!pending.empty()) {
+            bool progress = false;
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (!ra.is_empty(*it)) {
+                    ++it;
+                    continue;
+                }
+
+                const VAL* val = target.owner[*it];
+                REG curr = ra.lookup(val);
+                if (curr != NONE && !target.dirty[*it])
+                    al.store(curr);
+
+                al.fetch(val, *it);
+                it = pending.erase(it);
+                progress = true;
+            }
+
+            if (!progress)
+                al.flush(pending.front());
+        }
+
+        for (REG r : regs)
+            if (target.owner[r] != nullptr && target.dirty[r])
+                al.mark_dirty(r);
+    }
+
+    void alloc::merge_state(const regstate& state) {
+        FTL_ERROR_ON(!state.is_valid(), "attempt to merge invalid state");
+        flush_scratch_regs();
+
+        // evictions must go to memory, where the label expects values
+        spill_guard guard(m_xmm_spill);
+        merge_regs<reg, value>(*this, m_regs, state.m_regs, all_regs);
+        merge_regs<xmm, scalar>(*this, m_xmms, state.m_xmms, all_xmms);
+    }
+
+    void alloc::mark_unreachable() {
+        // code following an unconditional jump is only entered through a
+        // label, which will then provide the register state
+        drop_spills();
+        m_regs.restore(ralloc<reg>::snapshot());
+        m_xmms.restore(ralloc<xmm>::snapshot());
+        m_reachable = false;
+
+        // this includes scratch values that would be rematerialized
+        for (const value* val : m_regs.values())
+            if (val->is_scratch())
+                val->forget_known();
+    }
+
     void alloc::reset() {
-        m_locals = ~0ull;
+        m_slots.clear();
+        m_frame = 0;
+        m_reachable = true;
 
+        drop_spills();
         m_regs.reset();
         m_xmms.reset();
+
+        for (regstate* state : m_states)
+            state->clear();
+    }
+
+    bool regstate::is_empty() const {
+        for (reg r : all_regs)
+            if (m_regs.owner[r] != nullptr && !m_alloc.is_pinned(r))
+                return false;
+        for (xmm r : all_xmms)
+            if (m_xmms.owner[r] != nullptr)
+                return false;
+        return true;
+    }
+
+    void regstate::clear() {
+        m_regs = ralloc<reg>::snapshot();
+        m_xmms = ralloc<xmm>::snapshot();
+        m_valid = true;
     }
 
 }
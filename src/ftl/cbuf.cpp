@@ -17,6 +17,7 @@
  ******************************************************************************/
 
 #include "ftl/cbuf.h"
+#include "ftl/fault.h"
 
 namespace ftl {
 
@@ -27,12 +28,44 @@ namespace ftl {
     //static const u8 NOP = 0x90;
     static const u8 ILL = 0x06;
 
+    u8* cbuf::alloc_literal(size_t sz) {
+        // literals are naturally aligned, so that 128bit constants can be
+        // used as memory operands of SSE instructions
+        u8* ptr = (u8*)((uintptr_t)(m_code_end - sz) & ~(uintptr_t)(sz - 1));
+        if (ptr < m_code_ptr)
+            throw out_of_memory();
+
+        m_code_end = ptr;
+        return ptr;
+    }
+
     u8* cbuf::mark_exit() {
         FTL_ERROR_ON(m_code_exit, "code exit already marked");
         m_code_exit = m_code_ptr;
         return m_code_exit;
     }
 
+    void cbuf::mark_frame(const fixup& enter, const fixup& leave) {
+        FTL_ERROR_ON(m_frame_enter.code, "stack frame already marked");
+        m_frame_enter = enter;
+        m_frame_leave = leave;
+        m_frame_size = 0;
+        patch_frame(m_frame_enter, 0);
+        patch_frame(m_frame_leave, 0);
+    }
+
+    void cbuf::reserve_frame(size_t size) {
+        if (size <= m_frame_size)
+            return;
+
+        FTL_ERROR_ON(!m_frame_enter.code, "no stack frame marked");
+        FTL_ERROR_ON(!fits_i32(size), "stack frame too big: %zu", size);
+
+        m_frame_size = size;
+        patch_frame(m_frame_enter, -(i32)size);
+        patch_frame(m_frame_leave, (i32)size);
+    }
+
     u8* cbuf::align(size_t alignment) {
         if (alignment == 0)
             return m_code_ptr;
@@ -52,7 +85,13 @@ namespace ftl {
         m_code_head(nullptr),
         m_code_exit(nullptr),
         m_code_ptr(nullptr),
-        m_code_end(nullptr) {
+        m_code_end(nullptr),
+        m_frame_enter(),
+        m_frame_leave(),
+        m_frame_size(0),
+        m_literals64(),
+        m_literals128(),
+        m_faults() {
         int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
         int flags = MAP_PRIVATE | MAP_ANONYMOUS;
 
@@ -65,6 +104,8 @@ namespace ftl {
     }
 
     cbuf::~cbuf() {
+        unregister_faults(*this);
+
         if (m_code_head) {
             munmap(m_code_head, m_capacity);
         }
@@ -89,10 +130,78 @@ namespace ftl {
 
         if (m_code_ptr < m_code_exit)
             m_code_exit = nullptr;
+
+        if (m_code_ptr <= m_frame_enter.code) {
+            m_frame_enter = m_frame_leave = fixup();
+            m_frame_size = 0;
+        }
+
+        // recovery code goes along with the instructions it belongs to
+        auto it = std::lower_bound(m_faults.begin(), m_faults.end(),
+            std::make_pair((const u8*)m_code_ptr, (const u8*)nullptr));
+        m_faults.erase(it, m_faults.end());
     }
 
     void cbuf::reset() {
         reset(m_code_head);
+
+        // all code referring to the literal pool is gone now
+        memset(m_code_end, ILL, pool_size());
+        m_code_end = m_code_head + m_capacity;
+        m_literals64.clear();
+        m_literals128.clear();
+    }
+
+    const u8* cbuf::literal(u64 val) {
+        auto it = m_literals64.find(val);
+        if (it != m_literals64.end())
+            return it->second;
+
+        u8* ptr = alloc_literal(sizeof(val));
+        memcpy(ptr, &val, sizeof(val));
+        return m_literals64[val] = ptr;
+    }
+
+    const u8* cbuf::literal(u64 lo, u64 hi) {
+        auto key = std::make_pair(lo, hi);
+        auto it = m_literals128.find(key);
+        if (it != m_literals128.end())
+            return it->second;
+
+        u8* ptr = alloc_literal(2 * sizeof(u64));
+        memcpy(ptr, &lo, sizeof(lo));
+        memcpy(ptr + sizeof(lo), &hi, sizeof(hi));
+        return m_literals128[key] = ptr;
+    }
+
+    void cbuf::add_fault(const u8* insn, const u8* stub) {
+        FTL_ERROR_ON(!contains(insn), "instruction outside of code buffer");
+        FTL_ERROR_ON(!contains(stub), "recovery outside of code buffer");
+
+        if (m_faults.empty())
+            register_faults(*this);
+
+        auto entry = std::make_pair(insn, stub);
+        auto it = std::lower_bound(m_faults.begin(), m_faults.end(), entry);
+        FTL_ERROR_ON(it != m_faults.end() && it->first == insn,
+                     "instruction already has recovery code");
+        m_faults.insert(it, entry);
+    }
+
+    const u8* cbuf::find_fault(const u8* insn) const {
+        // called from signal handlers, so this must not allocate or lock
+        size_t lo = 0, hi = m_faults.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (m_faults[mid].first < insn)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo < m_faults.size() && m_faults[lo].first == insn)
+            return m_faults[lo].second;
+        return nullptr;
     }
 
 }
@@ -0,0 +1,261 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "ftl/cpuinfo.h"
+
+#include <cpuid.h>
+
+namespace ftl {
+
+    static const char* const feature_names[NFEATURES] = {
+        "sse2", "sse3", "ssse3", "sse4.1", "sse4.2", "popcnt", "cx16", "lahf",
+        "avx", "avx2", "bmi1", "bmi2", "fma", "f16c", "lzcnt", "movbe",
+        "avx512f", "avx512bw", "avx512cd", "avx512dq", "avx512vl",
+        "erms", "fsrm", "clflushopt", "clwb", "rdtscp",
+    };
+
+    static const char* const level_names[] = {
+        "baseline", "x86-64-v2", "x86-64-v3", "x86-64-v4", "native",
+    };
+
+    const char* cpu_feature_name(cpu_feature f) {
+        return f < NFEATURES ? feature_names[f] : "unknown";
+    }
+
+    const char* isa_level_name(isa_level l) {
+        return l <= ISA_NATIVE ? level_names[l] : "unknown";
+    }
+
+    static u64 feature_bit(cpu_feature f) {
+        return 1ull << f;
+    }
+
+    static u64 level_mask(isa_level l) {
+        u64 mask = feature_bit(CPU_SSE2);
+
+        if (l >= ISA_X86_64_V2) {
+            mask |= feature_bit(CPU_SSE3) | feature_bit(CPU_SSSE3) |
+                    feature_bit(CPU_SSE41) | feature_bit(CPU_SSE42) |
+                    feature_bit(CPU_POPCNT) | feature_bit(CPU_CX16) |
+                    feature_bit(CPU_LAHF);
+        }
+
+        if (l >= ISA_X86_64_V3) {
+            mask |= feature_bit(CPU_AVX) | feature_bit(CPU_AVX2) |
+                    feature_bit(CPU_BMI1) | feature_bit(CPU_BMI2) |
+                    feature_bit(CPU_FMA) | feature_bit(CPU_F16C) |
+                    feature_bit(CPU_LZCNT) | feature_bit(CPU_MOVBE);
+        }
+
+        if (l >= ISA_X86_64_V4) {
+            mask |= feature_bit(CPU_AVX512F) | feature_bit(CPU_AVX512BW) |
+                    feature_bit(CPU_AVX512CD) | feature_bit(CPU_AVX512DQ) |
+                    feature_bit(CPU_AVX512VL);
+        }
+
+        if (l >= ISA_NATIVE)
+            mask = ~0ull;
+
+        return mask;
+    }
+
+    static isa_level parse_level(const char* str) {
+        string s(str);
+        if (s == "baseline" || s == "x86-64" || s == "v1")
+            return ISA_BASELINE;
+        if (s == "x86-64-v2" || s == "v2")
+            return ISA_X86_64_V2;
+        if (s == "x86-64-v3" || s == "v3")
+            return ISA_X86_64_V3;
+        if (s == "x86-64-v4" || s == "v4")
+            return ISA_X86_64_V4;
+        if (s == "native")
+            return ISA_NATIVE;
+
+        FTL_ERROR("unknown ISA level '%s'", str);
+    }
+
+    static void cpuid(u32 leaf, u32 subleaf, u32 regs[4]) {
+        if (!__get_cpuid_count(leaf, subleaf, regs, regs + 1, regs + 2,
+                               regs + 3)) {
+            regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        }
+    }
+
+    static u64 xgetbv(u32 idx) {
+        u32 lo, hi;
+        asm volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(idx));
+        return (u64)hi << 32 | lo;
+    }
+
+    enum xcr0_bits : u64 {
+        XCR0_SSE    = 1ull << 1,
+        XCR0_AVX    = 1ull << 2,
+        XCR0_OPMASK = 1ull << 5,
+        XCR0_ZMM_HI = 1ull << 6,
+        XCR0_HI_ZMM = 1ull << 7,
+    };
+
+    void cpuinfo::detect() {
+        u32 regs[4] = { 0 };
+        enum { EAX, EBX, ECX, EDX };
+
+        cpuid(0, 0, regs);
+        char vendor[13] = { 0 };
+        memcpy(vendor + 0, &regs[EBX], 4);
+        memcpy(vendor + 4, &regs[EDX], 4);
+        memcpy(vendor + 8, &regs[ECX], 4);
+        m_vendor = vendor;
+
+        u32 max_leaf = regs[EAX];
+        m_detected = 0;
+
+        auto set = [this](cpu_feature f, u32 reg, int bit) -> void {
+            if ((reg >> bit) & 1)
+                m_detected |= feature_bit(f);
+        };
+
+        cpuid(1, 0, regs);
+        set(CPU_SSE2,   regs[EDX], 26);
+        set(CPU_SSE3,   regs[ECX],  0);
+        set(CPU_SSSE3,  regs[ECX],  9);
+        set(CPU_FMA,    regs[ECX], 12);
+        set(CPU_CX16,   regs[ECX], 13);
+        set(CPU_SSE41,  regs[ECX], 19);
+        set(CPU_SSE42,  regs[ECX], 20);
+        set(CPU_MOVBE,  regs[ECX], 22);
+        set(CPU_POPCNT, regs[ECX], 23);
+        set(CPU_AVX,    regs[ECX], 28);
+        set(CPU_F16C,   regs[ECX], 29);
+
+        // AVX state must be enabled by the OS before we may use any of the
+        // VEX/EVEX encoded instructions, otherwise they raise #UD
+        bool osxsave = (regs[ECX] >> 27) & 1;
+        u64 xcr0 = osxsave ? xgetbv(0) : 0;
+        bool avx_os = (xcr0 & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX);
+        bool avx512_os = avx_os &&
+            (xcr0 & (XCR0_OPMASK | XCR0_ZMM_HI | XCR0_HI_ZMM)) ==
+                    (XCR0_OPMASK | XCR0_ZMM_HI | XCR0_HI_ZMM);
+
+        if (max_leaf >= 7) {
+            cpuid(7, 0, regs);
+            set(CPU_BMI1,       regs[EBX],  3);
+            set(CPU_AVX2,       regs[EBX],  5);
+            set(CPU_BMI2,       regs[EBX],  8);
+            set(CPU_ERMS,       regs[EBX],  9);
+            set(CPU_AVX512F,    regs[EBX], 16);
+            set(CPU_AVX512DQ,   regs[EBX], 17);
+            set(CPU_CLFLUSHOPT, regs[EBX], 23);
+            set(CPU_CLWB,       regs[EBX], 24);
+            set(CPU_AVX512CD,   regs[EBX], 28);
+            set(CPU_AVX512BW,   regs[EBX], 30);
+            set(CPU_AVX512VL,   regs[EBX], 31);
+            set(CPU_FSRM,       regs[EDX],  4);
+        }
+
+        cpuid(0x80000001, 0, regs);
+        set(CPU_LAHF,   regs[ECX],  0);
+        set(CPU_LZCNT,  regs[ECX],  5);
+        set(CPU_RDTSCP, regs[EDX], 27);
+
+        if (!avx_os) {
+            m_detected &= ~(feature_bit(CPU_AVX) | feature_bit(CPU_AVX2) |
+                            feature_bit(CPU_FMA) | feature_bit(CPU_F16C));
+        }
+
+        if (!avx512_os) {
+            m_detected &= ~(feature_bit(CPU_AVX512F) |
+                            feature_bit(CPU_AVX512BW) |
+                            feature_bit(CPU_AVX512CD) |
+                            feature_bit(CPU_AVX512DQ) |
+                            feature_bit(CPU_AVX512VL));
+        }
+    }
+
+    void cpuinfo::update() {
+        m_enabled = m_detected & (level_mask(m_level) | m_forced_on);
+        m_enabled &= ~m_forced_off;
+    }
+
+    cpuinfo::cpuinfo():
+        m_detected(0),
+        m_enabled(0),
+        m_forced_on(0),
+        m_forced_off(0),
+        m_level(ISA_NATIVE),
+        m_vendor() {
+        detect();
+        reset();
+    }
+
+    cpuinfo::~cpuinfo() {
+        // nothing to do
+    }
+
+    isa_level cpuinfo::host_level() const {
+        isa_level l = ISA_BASELINE;
+        for (isa_level next : { ISA_X86_64_V2, ISA_X86_64_V3, ISA_X86_64_V4 }) {
+            if ((level_mask(next) & ~m_detected) != 0)
+                break;
+            l = next;
+        }
+
+        return l;
+    }
+
+    void cpuinfo::set_level(isa_level l) {
+        FTL_ERROR_ON(l > ISA_NATIVE, "invalid ISA level: %u", l);
+        m_level = l;
+        update();
+    }
+
+    void cpuinfo::set_feature(cpu_feature f, bool enable) {
+        FTL_ERROR_ON(f >= NFEATURES, "invalid cpu feature: %u", f);
+        if (enable) {
+            m_forced_on |= feature_bit(f);
+            m_forced_off &= ~feature_bit(f);
+        } else {
+            m_forced_off |= feature_bit(f);
+            m_forced_on &= ~feature_bit(f);
+        }
+
+        update();
+    }
+
+    void cpuinfo::mock_feature(cpu_feature f, bool present) {
+        FTL_ERROR_ON(f >= NFEATURES, "invalid cpu feature: %u", f);
+        if (present)
+            m_detected |= feature_bit(f);
+        else
+            m_detected &= ~feature_bit(f);
+        update();
+    }
+
+    void cpuinfo::reset() {
+        m_forced_on = m_forced_off = 0;
+        detect();
+        const char* env = getenv("FTL_ISA");
+        set_level(env ? parse_level(env) : ISA_NATIVE);
+    }
+
+    cpuinfo& cpuinfo::instance() {
+        static cpuinfo singleton;
+        return singleton;
+    }
+
+}
@@ -0,0 +1,380 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "ftl/dispatch.h"
+#include "ftl/func.h"
+
+namespace ftl {
+
+    static const i32 RS_TOP  = offsetof(retstack, top);
+    static const i32 RS_RING = offsetof(retstack, ring);
+    static const i32 RS_PC   = offsetof(retstack::entry, pc);
+    static const i32 RS_CODE = offsetof(retstack::entry, code);
+
+    void dispatcher::gen_loop() {
+        FTL_ERROR_ON(!is_pow2(m_table.size()), "entries must be power of 2");
+        FTL_ERROR_ON(m_table.size() > (1u << 26), "too many entries");
+
+
+        // creates the shared prologue and epilogue if not done yet
+        func fn("dispatch", m_buffer, m_data, m_pins);
+        emitter& e = fn.get_emitter();
+        const i32 mask = (i32)((m_table.size() - 1) * sizeof(entry));
+        fixup miss, leave, request;
+
+        // rax: pc, rcx: table entry; neither can be pinned
+        m_loop = m_buffer.get_code_ptr();
+        e.barrier();
+        if (m_flag != nullptr) {
+            e.cmpi(8, memop(BASE_POINTER, m_flagoff), 0);
+            e.jne(0, &request);
+        }
+
+        e.movr(64, RAX, memop(BASE_POINTER, m_pcoff));
+        e.movr(64, RCX, RAX);
+        e.shli(64, RCX, 2);
+        e.andi(64, RCX, mask);
+        e.addr(64, RCX, e.literal((u64)m_table.data()));
+        e.cmpr(64, RAX, memop(RCX, offsetof(entry, pc)));
+        e.jne(0, &miss);
+        e.jmpr(memop(RCX, offsetof(entry, code)));
+
+        m_miss = m_buffer.get_code_ptr();
+        patch_jump(miss, m_miss);
+        e.movi(32, RAX, EXIT_LOOKUP);
+        e.jmpi(128, &leave);
+        patch_jump(leave, m_buffer.get_code_exit());
+
+        if (m_flag != nullptr) {
+            patch_jump(request, m_buffer.get_code_ptr());
+            e.movi(32, RAX, EXIT_REQUEST);
+            e.jmpi(128, &leave);
+            patch_jump(leave, m_buffer.get_code_exit());
+        }
+
+        e.barrier();
+
+        m_end = fn.finish();
+        invalidate();
+    }
+
+    const u8* dispatcher::gen_stub(emitter& e, exit_reason reason, u64 pc) {
+        auto key = std::make_pair((u32)reason, pc);
+        auto it = m_stubs.find(key);
+        if (it != m_stubs.end())
+            return it->second;
+
+        e.barrier();
+        const u8* stub = m_buffer.get_code_ptr();
+        const rm mem = memop(BASE_POINTER, m_pcoff);
+
+        if (fits_i32(pc)) {
+            e.movi(64, mem, pc);
+        } else {
+            e.movi(64, RAX, pc);
+            e.movr(64, mem, RAX);
+        }
+
+        fixup fix;
+        if (reason == EXIT_JUMP) {
+            e.jmpi(128, &fix);
+            patch_jump(fix, m_loop);
+        } else {
+            e.movi(32, RAX, reason);
+            e.jmpi(128, &fix);
+            patch_jump(fix, m_buffer.get_code_exit());
+        }
+
+        e.barrier();
+        return m_stubs[key] = stub;
+    }
+
+    void dispatcher::patch(vector<link>& links, const u8* code) {
+        for (link& l : links) {
+            patch_jump(l.jump, code);
+            l.linked = true;
+        }
+    }
+
+    void dispatcher::unpatch(vector<link>& links) {
+        for (link& l : links) {
+            if (l.linked)
+                patch_jump(l.jump, l.stub);
+            l.linked = false;
+        }
+    }
+
+    dispatcher::dispatcher(cbuf& buffer, void* data, u64* pc,
+                           size_t entries):
+        dispatcher(buffer, data, pc, vector<pinned>(), entries) {
+    }
+
+    dispatcher::dispatcher(cbuf& buffer, void* data, u64* pc,
+                           const vector<pinned>& pins, size_t entries):
+        m_buffer(buffer),
+        m_data(data),
+        m_pc(pc),
+        m_pcoff((i32)((u64)pc - (u64)data)),
+        m_table(entries),
+        m_loop(nullptr),
+        m_miss(nullptr),
+        m_end(nullptr),
+        m_translate(),
+        m_misses(0),
+        m_stubs(),
+        m_links(),
+        m_rs(nullptr),
+        m_rsoff(0),
+        m_flag(nullptr),
+        m_flagoff(0),
+        m_pins(pins) {
+        FTL_ERROR_ON(data == nullptr, "dispatcher needs a data pointer");
+        FTL_ERROR_ON(pc == nullptr, "dispatcher needs a program counter");
+        FTL_ERROR_ON(!fits_i32((i64)((u64)pc - (u64)data)),
+                     "pc out of reach of data pointer");
+        gen_loop();
+    }
+
+    dispatcher::~dispatcher() {
+        // nothing to do
+    }
+
+    const u8* dispatcher::lookup(u64 pc) const {
+        const entry& e = slot(pc);
+        if (e.pc != pc || e.code == m_miss)
+            return nullptr;
+        return e.code;
+    }
+
+    void dispatcher::insert(u64 pc, const u8* code) {
+        FTL_ERROR_ON(code == nullptr, "attempt to insert nullptr block");
+        entry& e = slot(pc);
+        e.pc = pc;
+        e.code = code;
+
+        auto it = m_links.find(pc);
+        if (it != m_links.end())
+            patch(it->second, code);
+    }
+
+    void dispatcher::remove(u64 pc) {
+        entry& e = slot(pc);
+        if (e.pc == pc)
+            e.code = m_miss;
+
+        auto it = m_links.find(pc);
+        if (it != m_links.end())
+            unpatch(it->second);
+    }
+
+    void dispatcher::invalidate() {
+        // unused entries also lead to the miss handler, so that no pc ever
+        // needs to be reserved as a marker for empty slots
+        for (entry& e : m_table) {
+            e.pc = 0;
+            e.code = m_miss;
+        }
+
+        for (auto& it : m_links)
+            unpatch(it.second);
+
+        // stale return predictions fall back to the lookup table
+        if (m_rs != nullptr) {
+            m_rs->top = 0;
+            for (retstack::entry& e : m_rs->ring) {
+                e.pc = 0;
+                e.code = m_loop;
+            }
+        }
+    }
+
+    void dispatcher::set_return_stack(retstack* rs) {
+        const i64 offset = (i64)((u64)rs - (u64)m_data);
+        FTL_ERROR_ON(!fits_i32(offset + sizeof(retstack)),
+                     "return stack out of reach of data pointer");
+        FTL_ERROR_ON(m_rs != nullptr, "return stack already set");
+
+        m_rs = rs;
+        m_rsoff = (i32)offset;
+        invalidate();
+    }
+
+    void dispatcher::set_exit_flag(atomic<u8>* flag) {
+        const i64 offset = (i64)((u64)flag - (u64)m_data);
+        FTL_ERROR_ON(!fits_i32(offset), "exit flag out of reach of data");
+        FTL_ERROR_ON(m_flag != nullptr, "exit flag already set");
+        FTL_ERROR_ON(m_buffer.get_code_ptr() != m_end,
+                     "exit flag must be set before generating code");
+
+        m_flag = flag;
+        m_flagoff = (i32)offset;
+        m_flag->store(0);
+
+        // nothing refers to the old loop yet, it just becomes dead code
+        gen_loop();
+    }
+
+    void dispatcher::request_exit() {
+        FTL_ERROR_ON(m_flag == nullptr, "no exit flag set");
+        m_flag->store(1, std::memory_order_release);
+    }
+
+    size_t dispatcher::count_links() const {
+        size_t count = 0;
+        for (auto& it : m_links)
+            for (const link& l : it.second)
+                count += l.linked ? 1 : 0;
+        return count;
+    }
+
+    void dispatcher::gen_exit(emitter& e, exit_reason reason, u64 pc) {
+        FTL_ERROR_ON(&e.get_buffer() != &m_buffer,
+                     "exit generated into a different code buffer");
+
+        // linked exits bypass the loop, so they need to poll the exit flag
+        // themselves; the stub leads back to the loop, which then exits
+        fixup poll;
+        const bool polling = reason == EXIT_JUMP && m_flag != nullptr;
+        if (polling) {
+            e.cmpi(8, memop(BASE_POINTER, m_flagoff), 0);
+            e.jne(128, &poll);
+        }
+
+        // the first exit to a stub places it right behind its jump
+        fixup jump;
+        e.jmpi(128, &jump);
+        const u8* stub = gen_stub(e, reason, pc);
+        patch_jump(jump, stub);
+        if (polling)
+            patch_jump(poll, stub);
+
+        if (reason != EXIT_JUMP)
+            return;
+
+        vector<link>& links = m_links[pc];
+        links.push_back({ jump, stub, false });
+
+        const u8* code = lookup(pc);
+        if (code != nullptr) {
+            patch_jump(jump, code);
+            links.back().linked = true;
+        }
+    }
+
+    fixup dispatcher::gen_push(emitter& e, u64 ret) {
+        FTL_ERROR_ON(m_rs == nullptr, "no return stack set");
+        FTL_ERROR_ON(&e.get_buffer() != &m_buffer,
+                     "call generated into a different code buffer");
+
+        const rm top = memop(BASE_POINTER, m_rsoff + RS_TOP);
+        const i32 ring = m_rsoff + RS_RING;
+
+        // top = (top + 1) % SIZE, rax = &ring[top] - data
+        e.movr(64, RAX, top);
+        e.addi(64, RAX, 1);
+        e.andi(64, RAX, retstack::SIZE - 1);
+        e.movr(64, top, RAX);
+        e.shli(64, RAX, 4);
+        e.addr(64, RAX, BASE_POINTER);
+
+        const rm pc = memop(RAX, ring + RS_PC);
+        const rm code = memop(RAX, ring + RS_CODE);
+
+        if (fits_i32(ret)) {
+            e.movi(64, pc, ret);
+        } else {
+            e.movi(64, RCX, ret);
+            e.movr(64, pc, RCX);
+        }
+
+        // the continuation is only known once the call has been emitted
+        fixup cont;
+        e.leaip(RCX, 0, &cont);
+        e.movr(64, code, RCX);
+        return cont;
+    }
+
+    void dispatcher::gen_call(emitter& e, u64 target, u64 ret) {
+        fixup cont = gen_push(e, ret);
+        gen_exit(e, EXIT_JUMP, target);
+
+        // returns matching the prediction continue here
+        patch_jump(cont, m_buffer.get_code_ptr());
+        gen_exit(e, EXIT_JUMP, ret);
+    }
+
+    void dispatcher::gen_call_indirect(emitter& e, u64 ret) {
+        fixup cont = gen_push(e, ret);
+
+        fixup jump;
+        e.jmpi(128, &jump);
+        patch_jump(jump, m_loop);
+
+        patch_jump(cont, m_buffer.get_code_ptr());
+        gen_exit(e, EXIT_JUMP, ret);
+    }
+
+    void dispatcher::gen_return(emitter& e) {
+        FTL_ERROR_ON(m_rs == nullptr, "no return stack set");
+        FTL_ERROR_ON(&e.get_buffer() != &m_buffer,
+                     "return generated into a different code buffer");
+
+        const rm top = memop(BASE_POINTER, m_rsoff + RS_TOP);
+        const i32 ring = m_rsoff + RS_RING;
+
+        // rax = &ring[top] - data, top = (top - 1) % SIZE
+        e.movr(64, RAX, top);
+        e.movr(64, RCX, RAX);
+        e.subi(64, RCX, 1);
+        e.andi(64, RCX, retstack::SIZE - 1);
+        e.movr(64, top, RCX);
+        e.shli(64, RAX, 4);
+        e.addr(64, RAX, BASE_POINTER);
+
+        // mispredicted returns take the regular way through the loop
+        fixup miss;
+        e.movr(64, RCX, memop(BASE_POINTER, m_pcoff));
+        e.cmpr(64, RCX, memop(RAX, ring + RS_PC));
+        e.jne(128, &miss);
+        patch_jump(miss, m_loop);
+        e.jmpr(memop(RAX, ring + RS_CODE));
+        e.barrier();
+    }
+
+    exit_info dispatcher::run_until(exit_reason reason) {
+        while (true) {
+            exit_info info;
+            info.reason = (exit_reason)invoke(m_buffer, m_loop, m_data);
+            info.pc = *m_pc;
+
+            if (info.reason == EXIT_REQUEST)
+                m_flag->store(0);
+
+            if (info.reason == reason || info.reason != EXIT_LOOKUP)
+                return info;
+
+            m_misses++;
+            const u8* code = m_translate ? m_translate(info.pc) : nullptr;
+            if (code == nullptr)
+                return info;
+
+            insert(info.pc, code);
+        }
+    }
+
+}
@@ -25,6 +25,7 @@ namespace ftl {
         PREFIX_LOCK   = 0xf0,
         PREFIX_DOUBLE = 0xf2,
         PREFIX_SINGLE = 0xf3,
+        PREFIX_REP    = 0xf3,
     };
 
     enum opcode {
@@ -73,6 +74,11 @@ namespace ftl {
 
         OPCODE_FENCE  = 0xae,
 
+        OPCODE_MOVSB  = 0xa4,
+        OPCODE_STOSB  = 0xaa,
+        OPCODE_MOVSQ  = 0xa5,
+        OPCODE_STOSQ  = 0xab,
+
         OPCODE_ESCAPE = 0x0f,
     };
 
@@ -111,6 +117,14 @@ namespace ftl {
         OPCODE2_COMIS   = 0x2f,
 
         OPCODE2_PXOR    = 0xef,
+        OPCODE2_PAND    = 0xdb,
+
+        OPCODE2_PREFETCH = 0x18,
+        OPCODE2_MOVNTI   = 0xc3,
+
+        OPCODE2_RDTSC    = 0x31,
+        OPCODE2_RDPMC    = 0x33,
+        OPCODE2_SYSTEM   = 0x01, // rdtscp is 0f 01 f9
     };
 
     enum opcode_imm {
@@ -151,6 +165,13 @@ namespace ftl {
         OPCODE_BIT_COMP  = 7,
     };
 
+    enum opcode_cache {
+        OPCODE_CACHE_NTA   = 0, // prefetch, non-temporal
+        OPCODE_CACHE_T0    = 1, // prefetch into all cache levels
+        OPCODE_CACHE_CLWB  = 6, // write back cache line
+        OPCODE_CACHE_FLUSH = 7, // flush cache line
+    };
+
     enum branch_condition {
         BRCOND_O  = 0x0, // jump if overflow
         BRCOND_NO = 0x1, // jump if no overflow
@@ -192,6 +213,70 @@ namespace ftl {
         SCALE8 = 3,
     };
 
+    const char* peephole_name(peephole_rule rule) {
+        switch (rule) {
+        case PEEPHOLE_SELFMOV: return "selfmov";
+        case PEEPHOLE_RELOAD:  return "reload";
+        case PEEPHOLE_ZEROEXT: return "zeroext";
+        case PEEPHOLE_FLAGS:   return "flags";
+        default:
+            return "unknown";
+        }
+    }
+
+    const emitter::peephole_insn* emitter::recent(size_t i) const {
+        if (!m_peephole || i >= m_nwindow)
+            return nullptr;
+
+        // the window is only valid as long as nothing else has been emitted
+        // in between, which would leave gaps between the recorded insns
+        const u8* ptr = m_buffer.get_code_ptr();
+        for (size_t k = 0; k <= i; k++) {
+            if (m_window[k].end != ptr)
+                return nullptr;
+            ptr = m_window[k].start;
+        }
+
+        return &m_window[i];
+    }
+
+    bool emitter::same_operand(const peephole_insn* insn, const rm& op) const {
+        if (insn->mem != op.is_mem || insn->rip != op.is_rip ||
+            insn->r != op.r || op.is_xmm) {
+            return false;
+        }
+
+        return !op.is_mem || insn->offset == op.offset;
+    }
+
+    void emitter::record(peephole_kind k, int bits, const rm& op, int src,
+                         u8* start) {
+        if (!m_peephole || start == m_buffer.get_code_ptr())
+            return;
+
+        if (m_nwindow > 0 && m_window[0].end != start)
+            m_nwindow = 0;
+
+        size_t n = m_nwindow + 1;
+        if (n > PEEPHOLE_WINDOW)
+            n = PEEPHOLE_WINDOW;
+        for (size_t i = n - 1; i > 0; i--)
+            m_window[i] = m_window[i - 1];
+
+        peephole_insn& insn = m_window[0];
+        insn.kind = k;
+        insn.bits = bits;
+        insn.mem = op.is_mem;
+        insn.rip = op.is_rip;
+        insn.r = op.r;
+        insn.offset = op.offset;
+        insn.src = src;
+        insn.start = start;
+        insn.end = m_buffer.get_code_ptr();
+
+        m_nwindow = n;
+    }
+
     void emitter::setup_fixup(fixup* fix, int size) {
         if (fix) {
             fix->code = m_buffer.get_code_ptr();
@@ -241,21 +326,32 @@ namespace ftl {
         return len;
     }
 
-    size_t emitter::modrm(int r, const rm& rm) {
+    size_t emitter::modrm(int r, const rm& rm, int trail) {
         if (!rm.is_mem)
             return modrm(MODRM_DIRECT, r & 7, rm.r & 7);
 
         size_t len = 0;
+        if (rm.is_rip) {
+            // displacement is relative to the end of the instruction, which
+            // includes any immediate operand ('trail' bytes) following it
+            len += modrm(MODRM_INDIRECT, r & 7, 5);
+            i64 disp = rm.offset - (i64)(m_buffer.get_code_ptr() + 4 + trail);
+            FTL_ERROR_ON(!fits_i32(disp), "rip-relative target out of reach");
+            len += m_buffer.write<i32>(disp);
+            return len;
+        }
+
         modrm_bits mode;
+        i64 disp = displacement(rm);
 
-        if (rm.offset == 0 && ((rm.r & 7) != 5)) // rbp and r13 become rip
+        if (disp == 0 && ((rm.r & 7) != 5)) // rbp and r13 become rip
             mode = MODRM_INDIRECT;
-        else if (fits_i8(rm.offset))
+        else if (fits_i8(disp))
             mode = MODRM_DISP8;
-        else if (fits_i32(rm.offset))
+        else if (fits_i32(disp))
             mode = MODRM_DISP32;
         else
-            FTL_ERROR("operand offset too big to encode: %ld", rm.offset);
+            FTL_ERROR("operand offset too big to encode: %ld", disp);
 
         len += modrm(mode, r & 7, rm.r & 7);
 
@@ -263,13 +359,19 @@ namespace ftl {
             len += sib(SCALE1, rm.r & 7, rm.r & 7);
 
         if (mode == MODRM_DISP32)
-            len += m_buffer.write<i32>(rm.offset);
+            len += m_buffer.write<i32>(disp);
         if (mode == MODRM_DISP8)
-            len += m_buffer.write<i8>(rm.offset);
+            len += m_buffer.write<i8>(disp);
 
         return len;
     }
 
+    i64 emitter::displacement(const rm& rm) const {
+        if (rm.is_mem && rm.r == STACK_POINTER)
+            return rm.offset + m_stack_adjust;
+        return rm.offset;
+    }
+
     size_t emitter::immop(int op, int bits, const rm& dest, i32 imm) {
         int immlen = encode_size(imm); // 8, 16 or 32bits
         FTL_ERROR_ON(immlen > bits, "immediate operand too big");
@@ -284,7 +386,7 @@ namespace ftl {
         size_t len = 0;
         len += prefix(bits, (reg)0, dest);
         len += m_buffer.write(opcode);
-        len += modrm((reg)op, dest);
+        len += modrm((reg)op, dest, immlen / 8);
 
         switch (immlen) {
         case  8: len += m_buffer.write<i8>(imm);  break;
@@ -333,7 +435,7 @@ namespace ftl {
         size_t len = 0;
         len += prefix(bits, (reg)0, dest);
         len += m_buffer.write(opcode);
-        len += modrm((reg)op, dest);
+        len += modrm((reg)op, dest, imm != 1 ? 1 : 0);
 
         if (imm != 1)
             len += m_buffer.write(imm);
@@ -366,6 +468,7 @@ namespace ftl {
         len += m_buffer.write<u8>(OPCODE2_SET + op);
         len += modrm((reg)0, dest);
 
+        record(PH_SETCC, 8, dest, 0, m_buffer.get_code_ptr() - len);
         return len;
     }
 
@@ -428,7 +531,7 @@ namespace ftl {
         len += prefix(bits, 0, dest);
         len += m_buffer.write<u8>(OPCODE_ESCAPE);
         len += m_buffer.write<u8>(OPCODE2_BITIMM);
-        len += modrm(op, dest);
+        len += modrm(op, dest, 1);
         len += m_buffer.write(imm);
 
         return len;
@@ -448,7 +551,13 @@ namespace ftl {
     }
 
     emitter::emitter(cbuf& code):
-        m_buffer(code) {
+        m_buffer(code),
+        m_stack_adjust(0),
+        m_peephole(false),
+        m_barriers(0),
+        m_nwindow(0),
+        m_window(),
+        m_hits() {
 #ifndef __x86_64__
 #error Unsupported target architecture
 #endif
@@ -458,6 +567,16 @@ namespace ftl {
         // nothing to do
     }
 
+    void emitter::set_peephole(bool enable) {
+        m_peephole = enable;
+        m_nwindow = 0;
+    }
+
+    void emitter::reset_peephole_hits() {
+        for (u64& hits : m_hits)
+            hits = 0;
+    }
+
     size_t emitter::ret() {
         return m_buffer.write<u8>(OPCODE_RET);
     }
@@ -466,6 +585,10 @@ namespace ftl {
         return m_buffer.write<u8>(PREFIX_LOCK);
     }
 
+    size_t emitter::rep() {
+        return m_buffer.write<u8>(PREFIX_REP);
+    }
+
     size_t emitter::push(reg src) {
         size_t len = 0;
         if (src >= R8)
@@ -507,8 +630,9 @@ namespace ftl {
                 immlen = 32;
             FTL_ERROR_ON(immlen > 32, "immediate too big to move to memory");
             u8 opcode = (bits == 8) ? OPCODE_MOVIRM : (OPCODE_MOVIRM + 1);
+            len += prefix(bits, (reg)0, dest);
             len += m_buffer.write<u8>(opcode);
-            len += modrm((reg)0, dest);
+            len += modrm((reg)0, dest, immlen / 8);
         }
 
         switch (immlen) {
@@ -537,7 +661,10 @@ namespace ftl {
         if (imm == 0)
             return 0;
 
-        return immop(OPCODE_IMM_OR, bits, dest, imm);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = immop(OPCODE_IMM_OR, bits, dest, imm);
+        record(PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::adci(int bits, const rm& dest, i32 imm) {
@@ -552,7 +679,10 @@ namespace ftl {
         if (imm == -1)
             return 0;
 
-        return immop(OPCODE_IMM_AND, bits, dest, imm);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = immop(OPCODE_IMM_AND, bits, dest, imm);
+        record(PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::subi(int bits, const rm& dest, i32 imm) {
@@ -569,11 +699,26 @@ namespace ftl {
         if (imm == 0)
             return 0;
 
-        return immop(OPCODE_IMM_XOR, bits, dest, imm);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = immop(OPCODE_IMM_XOR, bits, dest, imm);
+        record(PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::cmpi(int bits, const rm& dest, i32 imm) {
-        return immop(OPCODE_IMM_CMP, bits, dest, imm);
+        // and, or and xor clear CF and OF, so their flags match cmp x, 0
+        const peephole_insn* prev = recent(0);
+        if (imm == 0 && prev && (prev->kind == PH_LOGIC ||
+            prev->kind == PH_ZERO) && prev->bits == bits &&
+            same_operand(prev, dest)) {
+            m_hits[PEEPHOLE_FLAGS]++;
+            return 0;
+        }
+
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = immop(OPCODE_IMM_CMP, bits, dest, imm);
+        record(PH_CMP, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::tsti(int bits, const rm& dest, i32 imm) {
@@ -590,7 +735,7 @@ namespace ftl {
         reg r = (reg)OPCODE_UNARY_TEST;
         len += prefix(bits, r, dest);
         len += m_buffer.write(opcode);
-        len += modrm(r, dest);
+        len += modrm(r, dest, min(bits, 32) / 8);
 
         switch (bits) {
         case  8: len += m_buffer.write<i8>(imm);  break;
@@ -601,6 +746,7 @@ namespace ftl {
             FTL_ERROR("cannot encode immediate with %d bits", immlen);
         }
 
+        record(PH_CMP, bits, dest, 0, m_buffer.get_code_ptr() - len);
         return len;
     }
 
@@ -621,11 +767,31 @@ namespace ftl {
     }
 
     size_t emitter::movr(int bits, const rm& dest, const rm& src) {
-        if (dest.is_reg() && src.is_reg() && dest.r == src.r)
+        if (dest.is_reg() && src.is_reg() && dest.r == src.r) {
+            m_hits[PEEPHOLE_SELFMOV]++;
             return 0;
+        }
+
         if (dest.is_mem && src.is_mem && dest.offset == src.offset)
             return 0;
-        return aluop(OPCODE_MOV, bits, dest, src);
+
+        // reloading what we just stored: take it from the register instead,
+        // unless a 32bit load would have to clear the upper half of it
+        const peephole_insn* prev = recent(0);
+        if (dest.is_reg() && prev && prev->kind == PH_STORE &&
+            prev->bits == bits && same_operand(prev, src) &&
+            (prev->src != dest.r || bits != 32)) {
+            m_hits[PEEPHOLE_RELOAD]++;
+            if (prev->src == dest.r)
+                return 0;
+            return aluop(OPCODE_MOV, bits, dest, rm((reg)prev->src));
+        }
+
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_MOV, bits, dest, src);
+        if (dest.is_mem && src.is_reg())
+            record(PH_STORE, bits, dest, src.r, start);
+        return len;
     }
 
     size_t emitter::addr(int bits, const rm& dest, const rm& src) {
@@ -633,7 +799,10 @@ namespace ftl {
     }
 
     size_t emitter::orr (int bits, const rm& dest, const rm& src) {
-        return aluop(OPCODE_OR, bits, dest, src);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_OR, bits, dest, src);
+        record(PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::adcr(int bits, const rm& dest, const rm& src) {
@@ -645,7 +814,10 @@ namespace ftl {
     }
 
     size_t emitter::andr(int bits, const rm& dest, const rm& src) {
-        return aluop(OPCODE_AND, bits, dest, src);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_AND, bits, dest, src);
+        record(PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::subr(int bits, const rm& dest, const rm& src) {
@@ -653,19 +825,38 @@ namespace ftl {
     }
 
     size_t emitter::xorr(int bits, const rm& dest, const rm& src) {
-        return aluop(OPCODE_XOR, bits, dest, src);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_XOR, bits, dest, src);
+        bool zero = dest.is_reg() && dest == src && bits >= 32;
+        record(zero ? PH_ZERO : PH_LOGIC, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::cmpr(int bits, const rm& dest, const rm& src) {
-        return aluop(OPCODE_CMP, bits, dest, src);
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_CMP, bits, dest, src);
+        record(PH_CMP, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::tstr(int bits, const rm& dest, const rm& src) {
+        const peephole_insn* prev = recent(0);
+        if (dest == src && prev && (prev->kind == PH_LOGIC ||
+            prev->kind == PH_ZERO) && prev->bits == bits &&
+            same_operand(prev, dest)) {
+            m_hits[PEEPHOLE_FLAGS]++;
+            return 0;
+        }
+
         // we must make sure that op2 is a register, otherwise aluop will
         // compute an invalid opcode
         const rm& op1(dest.is_mem ? dest : src);
         const rm& op2(dest.is_mem ? src : dest);
-        return aluop(OPCODE_TST, bits, op1, op2);
+
+        u8* start = m_buffer.get_code_ptr();
+        size_t len = aluop(OPCODE_TST, bits, op1, op2);
+        record(PH_CMP, bits, dest, 0, start);
+        return len;
     }
 
     size_t emitter::xchg(int bits, const rm& dest, const rm& src) {
@@ -679,7 +870,7 @@ namespace ftl {
         FTL_ERROR_ON(!src.is_mem, "source must be a memory operand");
         FTL_ERROR_ON(bits <= 16, "8bit lea not supported");
 
-        if (src.offset == 0)
+        if (displacement(src) == 0)
             return movr(bits, dest, (reg)src.r);
 
         size_t len = 0;
@@ -695,6 +886,58 @@ namespace ftl {
         return lear(bits, dest, memop((reg)src.r, val));
     }
 
+    size_t emitter::leaip(reg dest, i32 offset, fixup* fix) {
+        FTL_ERROR_ON(!reg_valid(dest), "invalid destination register");
+
+        size_t len = 0;
+        len += rex(true, dest >= R8, false, false);
+        len += m_buffer.write<u8>(OPCODE_LEA);
+        len += modrm(MODRM_INDIRECT, dest & 7, 5); // rip-relative
+        setup_fixup(fix, 4);
+        len += m_buffer.write<i32>(offset);
+        return len;
+    }
+
+    size_t emitter::leasib(int bits, reg dest, reg base, reg index,
+                           int scale, i32 disp) {
+        FTL_ERROR_ON(bits != 32 && bits != 64, "invalid lea width %d", bits);
+        FTL_ERROR_ON(!reg_valid(dest), "invalid destination register");
+        FTL_ERROR_ON(!reg_valid(base), "invalid base register");
+        FTL_ERROR_ON(!reg_valid(index), "invalid index register");
+        FTL_ERROR_ON(index == RSP, "rsp cannot be used as index");
+
+        int ss;
+        switch (scale) {
+        case 1: ss = SCALE1; break;
+        case 2: ss = SCALE2; break;
+        case 4: ss = SCALE4; break;
+        case 8: ss = SCALE8; break;
+        default:
+            FTL_ERROR("invalid lea scale %d", scale);
+        }
+
+        // rbp and r13 cannot be encoded as base without a displacement
+        modrm_bits mode = MODRM_DISP32;
+        if (disp == 0 && (base & 7) != 5)
+            mode = MODRM_INDIRECT;
+        else if (fits_i8(disp))
+            mode = MODRM_DISP8;
+
+        size_t len = 0;
+        if (bits == 64 || dest >= R8 || base >= R8 || index >= R8)
+            len += rex(bits == 64, dest >= R8, index >= R8, base >= R8);
+        len += m_buffer.write<u8>(OPCODE_LEA);
+        len += modrm(mode, dest & 7, 4); // sib follows
+        len += sib(ss, index & 7, base & 7);
+
+        if (mode == MODRM_DISP8)
+            len += m_buffer.write<i8>(disp);
+        if (mode == MODRM_DISP32)
+            len += m_buffer.write<i32>(disp);
+
+        return len;
+    }
+
     size_t emitter::btr(int bits, const rm& dest, const rm& src) {
         return bitop(OPCODE2_BT, bits, dest, src);
     }
@@ -753,7 +996,7 @@ namespace ftl {
 
         u8 opcode = (immlen == 8) ? OPCODE_IMUL8 : OPCODE_IMUL32;
         len += m_buffer.write(opcode);
-        len += modrm(dest, src);
+        len += modrm(dest, src, immlen == 8 ? 1 : 4);
 
         if (immlen == 8)
             len += m_buffer.write<i8>(imm);
@@ -850,6 +1093,22 @@ namespace ftl {
         if (sbits == dbits || sbits == 32)
             return movr(sbits, dest, src);
 
+        // setcc into a register cleared before the compare needs no movzx
+        if (sbits == 8 && dest == src) {
+            const peephole_insn* prev = recent(0);
+            if (prev && prev->kind == PH_SETCC && same_operand(prev, dest)) {
+                for (size_t i = 1; (prev = recent(i)) != nullptr; i++) {
+                    if (prev->kind == PH_ZERO && same_operand(prev, dest)) {
+                        m_hits[PEEPHOLE_ZEROEXT]++;
+                        return 0;
+                    }
+
+                    if (prev->kind != PH_CMP)
+                        break;
+                }
+            }
+        }
+
         size_t len = 0;
         len += prefix(dbits, sbits, dest.r, src);
 
@@ -944,6 +1203,113 @@ namespace ftl {
         return len;
     }
 
+    size_t emitter::movsb() {
+        return m_buffer.write<u8>(OPCODE_MOVSB);
+    }
+
+    size_t emitter::stosb() {
+        return m_buffer.write<u8>(OPCODE_STOSB);
+    }
+
+    size_t emitter::movsq() {
+        size_t len = 0;
+        len += rex(true, false, false, false);
+        len += m_buffer.write<u8>(OPCODE_MOVSQ);
+        return len;
+    }
+
+    size_t emitter::stosq() {
+        size_t len = 0;
+        len += rex(true, false, false, false);
+        len += m_buffer.write<u8>(OPCODE_STOSQ);
+        return len;
+    }
+
+    size_t emitter::movnti(int bits, const rm& dest, const rm& src) {
+        FTL_ERROR_ON(bits != 32 && bits != 64, "unsupported width: %d", bits);
+        FTL_ERROR_ON(!dest.is_mem, "destination must be a memory operand");
+        FTL_ERROR_ON(!src.is_reg(), "source must be an integer register");
+
+        size_t len = 0;
+        len += prefix(bits, src.r, dest);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_MOVNTI);
+        len += modrm(src.r, dest);
+        return len;
+    }
+
+    size_t emitter::prefetcht0(const rm& src) {
+        FTL_ERROR_ON(!src.is_mem, "prefetch operand must be in memory");
+
+        size_t len = 0;
+        len += prefix(32, (reg)0, src);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_PREFETCH);
+        len += modrm((reg)OPCODE_CACHE_T0, src);
+        return len;
+    }
+
+    size_t emitter::prefetchnta(const rm& src) {
+        FTL_ERROR_ON(!src.is_mem, "prefetch operand must be in memory");
+
+        size_t len = 0;
+        len += prefix(32, (reg)0, src);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_PREFETCH);
+        len += modrm((reg)OPCODE_CACHE_NTA, src);
+        return len;
+    }
+
+    size_t emitter::clflushopt(const rm& dest) {
+        FTL_ERROR_ON(!dest.is_mem, "flush operand must be in memory");
+
+        size_t len = 0;
+        if (cpu_has(CPU_CLFLUSHOPT)) // otherwise fall back to clflush
+            len += m_buffer.write<u8>(PREFIX_16BIT);
+        len += prefix(32, (reg)0, dest);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE_FENCE);
+        len += modrm((reg)OPCODE_CACHE_FLUSH, dest);
+        return len;
+    }
+
+    size_t emitter::clwb(const rm& dest) {
+        FTL_ERROR_ON(!dest.is_mem, "writeback operand must be in memory");
+
+        if (!cpu_has(CPU_CLWB)) // flushing also writes back the cache line
+            return clflushopt(dest);
+
+        size_t len = 0;
+        len += m_buffer.write<u8>(PREFIX_16BIT);
+        len += prefix(32, (reg)0, dest);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE_FENCE);
+        len += modrm((reg)OPCODE_CACHE_CLWB, dest);
+        return len;
+    }
+
+    size_t emitter::rdtsc() {
+        size_t len = 0;
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_RDTSC);
+        return len;
+    }
+
+    size_t emitter::rdtscp() {
+        size_t len = 0;
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_SYSTEM);
+        len += modrm(MODRM_DIRECT, 7, 1);
+        return len;
+    }
+
+    size_t emitter::rdpmc() {
+        size_t len = 0;
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_RDPMC);
+        return len;
+    }
+
     size_t emitter::call(u8* fn, fixup* fix) {
         if (fn == nullptr && fix != nullptr)
             fn = m_buffer.get_code_ptr();
@@ -1294,6 +1660,21 @@ namespace ftl {
         return len;
     }
 
+    size_t emitter::pand(int bits, const rm& dest, const rm& src) {
+        FTL_ERROR_ON(!dest.is_xmm, "destination must be a FP-register");
+        (void)bits;
+
+        size_t len = 0;
+
+        len += m_buffer.write<u8>(PREFIX_16BIT);
+        len += prefix(32, dest.r, src);
+        len += m_buffer.write<u8>(OPCODE_ESCAPE);
+        len += m_buffer.write<u8>(OPCODE2_PAND);
+        len += modrm(dest.r, src);
+
+        return len;
+    }
+
     size_t emitter::comis(int bits, const rm& op1, const rm& op2) {
         return mmxcmp(OPCODE2_COMIS, bits, op1, op2);
     }
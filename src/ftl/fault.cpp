@@ -0,0 +1,120 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "ftl/fault.h"
+
+#include <signal.h>
+#include <ucontext.h>
+
+namespace ftl {
+
+    static atomic<cbuf*> buffers[MAX_FAULT_BUFFERS];
+    static thread_local const void* last_fault = nullptr;
+
+    static const int signals[] = { SIGSEGV, SIGBUS };
+    static struct sigaction previous[FTL_ARRAY_SIZE(signals)];
+    static std::mutex install_lock;
+    static bool installed = false;
+
+    static void chain(int sig, siginfo_t* info, void* context) {
+        for (size_t i = 0; i < FTL_ARRAY_SIZE(signals); i++) {
+            if (signals[i] != sig)
+                continue;
+
+            const struct sigaction& prev = previous[i];
+            if (prev.sa_flags & SA_SIGINFO) {
+                prev.sa_sigaction(sig, info, context);
+            } else if (prev.sa_handler != SIG_DFL &&
+                       prev.sa_handler != SIG_IGN) {
+                prev.sa_handler(sig);
+            } else {
+                // the faulting instruction runs again and ends the process
+                signal(sig, SIG_DFL);
+            }
+        }
+    }
+
+    static void handle_fault(int sig, siginfo_t* info, void* context) {
+        ucontext_t* uc = (ucontext_t*)context;
+        greg_t& rip = uc->uc_mcontext.gregs[REG_RIP];
+        const u8* insn = (const u8*)rip;
+
+        for (atomic<cbuf*>& slot : buffers) {
+            cbuf* buffer = slot.load(std::memory_order_acquire);
+            if (buffer == nullptr || !buffer->contains(insn))
+                continue;
+
+            const u8* stub = buffer->find_fault(insn);
+            if (stub == nullptr)
+                break;
+
+            last_fault = info->si_addr;
+            rip = (greg_t)stub;
+            return;
+        }
+
+        chain(sig, info, context);
+    }
+
+    static void install_handler() {
+        std::lock_guard<std::mutex> guard(install_lock);
+        if (installed)
+            return;
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = handle_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+
+        for (size_t i = 0; i < FTL_ARRAY_SIZE(signals); i++) {
+            if (sigaction(signals[i], &sa, &previous[i]) < 0)
+                FTL_ERROR("sigaction: %s", strerror(errno));
+        }
+
+        installed = true;
+    }
+
+    void register_faults(cbuf& buffer) {
+        install_handler();
+
+        for (atomic<cbuf*>& slot : buffers)
+            if (slot.load() == &buffer)
+                return;
+
+        for (atomic<cbuf*>& slot : buffers) {
+            cbuf* empty = nullptr;
+            if (slot.compare_exchange_strong(empty, &buffer))
+                return;
+        }
+
+        FTL_ERROR("too many code buffers with recovery code");
+    }
+
+    void unregister_faults(cbuf& buffer) {
+        for (atomic<cbuf*>& slot : buffers) {
+            cbuf* expected = &buffer;
+            slot.compare_exchange_strong(expected, nullptr);
+        }
+    }
+
+    const void* fault_address() {
+        return last_fault;
+    }
+
+}
@@ -17,28 +17,241 @@
  ******************************************************************************/
 
 #include "ftl/func.h"
+#include "ftl/dispatch.h"
 
 namespace ftl {
 
+    // condition codes as encoded in jcc, setcc and cmovcc
+    enum cond_code : int {
+        CC_O  = 0x0,
+        CC_NO = 0x1,
+        CC_B  = 0x2,
+        CC_AE = 0x3,
+        CC_Z  = 0x4,
+        CC_NZ = 0x5,
+        CC_BE = 0x6,
+        CC_A  = 0x7,
+        CC_S  = 0x8,
+        CC_NS = 0x9,
+        CC_P  = 0xa,
+        CC_NP = 0xb,
+        CC_L  = 0xc,
+        CC_GE = 0xd,
+        CC_LE = 0xe,
+        CC_G  = 0xf,
+    };
+
+    enum eflags : u32 {
+        EFLAGS_CF = 1u << 0,
+        EFLAGS_PF = 1u << 2,
+        EFLAGS_ZF = 1u << 6,
+        EFLAGS_SF = 1u << 7,
+        EFLAGS_OF = 1u << 11,
+    };
+
+    static bool eval_cond(u32 flags, int cc) {
+        bool cf = flags & EFLAGS_CF;
+        bool pf = flags & EFLAGS_PF;
+        bool zf = flags & EFLAGS_ZF;
+        bool sf = flags & EFLAGS_SF;
+        bool of = flags & EFLAGS_OF;
+
+        bool res;
+        switch (cc >> 1) {
+        case 0: res = of; break;
+        case 1: res = cf; break;
+        case 2: res = zf; break;
+        case 3: res = cf || zf; break;
+        case 4: res = sf; break;
+        case 5: res = pf; break;
+        case 6: res = sf != of; break;
+        default: res = zf || sf != of; break;
+        }
+
+        return (cc & 1) ? !res : res;
+    }
+
+    static u64 width_mask(int bits) {
+        return bits == 64 ? ~0ull : (1ull << bits) - 1;
+    }
+
+    static i64 sign_extend(u64 val, int bits) {
+        u64 sign = 1ull << (bits - 1);
+        return (i64)((val & width_mask(bits)) ^ sign) - (i64)sign;
+    }
+
+    // contents of a value known at generation time, captured before the
+    // value gets written and thereby forgets them
+    struct knowledge {
+        u64 mask;
+        u64 bits;
+
+        knowledge(const value& v):
+            mask(v.known_mask()), bits(v.known_bits()) {}
+        knowledge(i64 imm): mask(~0ull), bits(imm) {}
+
+        bool covers(int n) const {
+            return (mask & width_mask(n)) == width_mask(n);
+        }
+    };
+
+    enum known_op {
+        KNOWN_ADD,
+        KNOWN_SUB,
+        KNOWN_AND,
+        KNOWN_OR,
+        KNOWN_XOR,
+    };
+
+    static void fold_known(const value& dest, known_op op,
+                           const knowledge& a, const knowledge& b) {
+        switch (op) {
+        case KNOWN_ADD:
+            if (a.covers(dest.bits) && b.covers(dest.bits))
+                dest.set_const(a.bits + b.bits);
+            break;
+
+        case KNOWN_SUB:
+            if (a.covers(dest.bits) && b.covers(dest.bits))
+                dest.set_const(a.bits - b.bits);
+            break;
+
+        case KNOWN_AND:
+            dest.set_known((a.mask & b.mask) | (a.mask & ~a.bits) |
+                           (b.mask & ~b.bits), a.bits & b.bits);
+            break;
+
+        case KNOWN_OR:
+            dest.set_known((a.mask & b.mask) | (a.mask & a.bits) |
+                           (b.mask & b.bits), a.bits | b.bits);
+            break;
+
+        case KNOWN_XOR:
+            dest.set_known(a.mask & b.mask, a.bits ^ b.bits);
+            break;
+        }
+    }
+
+    // Reciprocals for division by constants following Granlund/Montgomery
+    // and libdivide: x / d == mulhi(x, magic) >> shift for all N bit x. If
+    // the magic number needs N + 1 bits, its top bit is dropped and added
+    // back using an extra fixup step (add).
+    struct divmagic {
+        i64  magic;
+        int  shift;
+        bool add;
+    };
+
+    static int floor_log2(u64 val) {
+        return 63 - __builtin_clzll(val);
+    }
+
+    static divmagic udiv_magic(u64 d, int bits) {
+        typedef unsigned __int128 u128;
+
+        const int l = floor_log2(d);
+        const u128 num = (u128)1 << (bits + l);
+        u64 m = (u64)(num / d);
+        u64 rem = (u64)(num % d);
+
+        divmagic res;
+        res.shift = l;
+        res.add = d - rem >= (1ull << l);
+        if (res.add) {
+            u64 twice = rem + rem;
+            m += m;
+            if (twice >= d || twice < rem)
+                m++;
+        }
+
+        res.magic = (m + 1) & width_mask(bits);
+        return res;
+    }
+
+    static divmagic sdiv_magic(i64 d, int bits) {
+        typedef unsigned __int128 u128;
+
+        const u64 absd = d < 0 ? -(u64)d : d;
+        const int l = floor_log2(absd);
+        const u128 num = (u128)1 << (bits - 1 + l);
+        u64 m = (u64)(num / absd);
+        u64 rem = (u64)(num % absd);
+
+        divmagic res;
+        res.add = absd - rem >= (1ull << l);
+        res.shift = res.add ? l : l - 1;
+        if (res.add) {
+            u64 twice = rem + rem;
+            m += m;
+            if (twice >= absd || twice < rem)
+                m++;
+        }
+
+        m++;
+        res.magic = sign_extend(d < 0 ? -m : m, bits);
+        return res;
+    }
+
+    // shifts by a known count use the immediate form, which masks the
+    // count in the same way as the variant using cl
+    static bool known_count(const value& dest, const value& src, u8& count) {
+        const u64 mask = dest.bits == 64 ? 63 : 31;
+        knowledge k(src);
+        if ((k.mask & mask) != mask)
+            return false;
+
+        count = k.bits & mask;
+        return true;
+    }
+
+    // a known source operand can be encoded as an immediate instead; the
+    // caller must avoid immediates the emitter would rewrite or drop
+    static bool known_imm(const value& dest, const value& src, i32& imm) {
+        knowledge k(src);
+        if (src.bits < dest.bits || !k.covers(dest.bits))
+            return false;
+
+        i64 val = sign_extend(k.bits, dest.bits);
+        if (!fits_i32(val))
+            return false;
+
+        imm = (i32)val;
+        return true;
+    }
+
+    static fixup gen_frame_fixup(cbuf& buffer) {
+        fixup fix = { buffer.get_code_ptr(), FRAME_FIXUP_SIZE };
+        buffer.skip(fix.size);
+        return fix;
+    }
+
     void func::gen_prologue_epilogue() {
+        // align the stack for 32 byte frame slots, the original stack
+        // pointer is pushed first and restored by the final pop
+        m_emitter.movr(64, R11, STACK_POINTER);
+        m_emitter.andi(64, STACK_POINTER, -(i32)STACK_ALIGNMENT);
+        m_emitter.push(R11);
         for (reg r : callee_saved_regs)
             m_emitter.push(r);
 
-        i32 frame_size = 64 * sizeof(u64);
-
-        m_emitter.subi(64, STACK_POINTER, frame_size);
+        // the frame size is only known once functions have been finished
+        fixup enter = gen_frame_fixup(m_buffer);
         m_emitter.movr(64, BASE_POINTER, argreg(1));
+        m_alloc.load_pinned_regs();
         m_emitter.jmpr(argreg(0));
         m_buffer.align(4);
 
         m_buffer.mark_exit();
         m_exit.place(false);
 
-        m_emitter.addi(64, STACK_POINTER, frame_size);
+        m_alloc.store_pinned_regs();
+        fixup leave = gen_frame_fixup(m_buffer);
         for (size_t i = FTL_ARRAY_SIZE(callee_saved_regs); i != 0; i--)
             m_emitter.pop(callee_saved_regs[i-1]);
 
+        m_emitter.pop(STACK_POINTER);
         m_emitter.ret();
+        m_buffer.mark_frame(enter, leave);
         m_buffer.align(4);
 
         m_code = m_buffer.get_code_ptr();
@@ -54,9 +267,12 @@ namespace ftl {
         m_code(m_buffer.get_code_ptr()),
         m_last(nullptr),
         m_entry(nm + ".entry", m_buffer, m_alloc, m_buffer.get_code_entry()),
-        m_exit(nm + ".exit", m_buffer, m_alloc, m_buffer.get_code_exit()) {
+        m_exit(nm + ".exit", m_buffer, m_alloc, m_buffer.get_code_exit()),
+        m_flags(),
+        m_faults() {
         if (m_buffer.is_empty())
             gen_prologue_epilogue();
+        m_emitter.set_peephole(true);
     }
 
     func::func(const string& nm, cbuf& buffer, void* dataptr):
@@ -69,11 +285,39 @@ namespace ftl {
         m_code(m_buffer.get_code_ptr()),
         m_last(nullptr),
         m_entry(nm + ".entry", m_buffer, m_alloc, m_buffer.get_code_entry()),
-        m_exit(nm + ".exit", m_buffer, m_alloc, m_buffer.get_code_exit()) {
+        m_exit(nm + ".exit", m_buffer, m_alloc, m_buffer.get_code_exit()),
+        m_flags(),
+        m_faults() {
         if (m_buffer.is_empty())
             gen_prologue_epilogue();
         if (dataptr != nullptr)
             set_data_ptr(dataptr);
+        m_emitter.set_peephole(true);
+    }
+
+    func::func(const string& nm, cbuf& buffer, void* dataptr,
+               const vector<pinned>& pins):
+        m_name(nm),
+        m_bufptr(nullptr),
+        m_buffer(buffer),
+        m_emitter(m_buffer),
+        m_alloc(m_emitter),
+        m_head(m_buffer.get_code_entry()),
+        m_code(m_buffer.get_code_ptr()),
+        m_last(nullptr),
+        m_entry(nm + ".entry", m_buffer, m_alloc, m_buffer.get_code_entry()),
+        m_exit(nm + ".exit", m_buffer, m_alloc, m_buffer.get_code_exit()),
+        m_flags(),
+        m_faults() {
+        // the prologue loads and the epilogue stores pinned values, hence
+        // all functions sharing a buffer must use the same set of pins
+        FTL_ERROR_ON(dataptr == nullptr, "pinning requires a data pointer");
+        set_data_ptr(dataptr);
+        for (const pinned& p : pins)
+            m_alloc.pin(p);
+        if (m_buffer.is_empty())
+            gen_prologue_epilogue();
+        m_emitter.set_peephole(true);
     }
 
     func::func(func&& other):
@@ -86,7 +330,9 @@ namespace ftl {
         m_code(other.m_code),
         m_last(other.m_last),
         m_entry(std::move(other.m_entry)),
-        m_exit(std::move(other.m_exit)) {
+        m_exit(std::move(other.m_exit)),
+        m_flags(other.m_flags),
+        m_faults(std::move(other.m_faults)) {
         other.m_bufptr = nullptr;
     }
 
@@ -135,164 +381,451 @@ namespace ftl {
     }
 
     void func::gen_ret(value& val) {
+        if (m_alloc.lookup(&val) != RAX)
+            m_alloc.flush(RAX);
         m_emitter.movsx(64, val.bits, RAX, val);
         m_alloc.flush_all_regs();
         gen_ret();
     }
 
+    void func::gen_dispatch(const dispatcher& d) {
+        FTL_ERROR_ON(&d.get_cbuffer() != &m_buffer,
+                     "dispatcher uses a different code buffer");
+
+        // the next block is looked up using the program counter in memory
+        m_alloc.flush_all_regs();
+
+        fixup fix;
+        m_emitter.jmpi(128, &fix);
+        patch_jump(fix, d.get_code());
+        m_alloc.mark_unreachable();
+    }
+
+    void func::gen_exit(dispatcher& d, exit_reason reason, u64 pc) {
+        FTL_ERROR_ON(&d.get_cbuffer() != &m_buffer,
+                     "dispatcher uses a different code buffer");
+
+        // stubs are shared between blocks, so nothing may be left behind
+        // in registers when jumping to one
+        m_alloc.flush_all_regs();
+        d.gen_exit(m_emitter, reason, pc);
+        m_alloc.mark_unreachable();
+    }
+
+    void func::gen_guest_call(dispatcher& d, u64 target, u64 ret) {
+        m_alloc.flush_all_regs();
+        d.gen_call(m_emitter, target, ret);
+        m_alloc.mark_unreachable();
+    }
+
+    void func::gen_guest_call(dispatcher& d, u64 ret) {
+        // the target has been written to the pc by the caller
+        m_alloc.flush_all_regs();
+        d.gen_call_indirect(m_emitter, ret);
+        m_alloc.mark_unreachable();
+    }
+
+    void func::gen_guest_ret(dispatcher& d) {
+        // the return address has been written to the pc by the caller
+        m_alloc.flush_all_regs();
+        d.gen_return(m_emitter);
+        m_alloc.mark_unreachable();
+    }
+
+    void func::gen_observe() {
+        m_alloc.store_global_regs(true);
+        m_alloc.store_pinned_regs();
+    }
+
+    void func::set_known_flags(int bits, u64 kmask1, u64 op1, u64 kmask2,
+                               u64 op2, bool sub) {
+        const u64 mask = width_mask(bits);
+        m_flags.ptr = nullptr;
+        if ((kmask1 & mask) != mask || (kmask2 & mask) != mask)
+            return;
+
+        op1 &= mask;
+        op2 &= mask;
+        u64 res = (sub ? op1 - op2 : op1 & op2) & mask;
+
+        u32 flags = 0;
+        if (sub && op1 < op2)
+            flags |= EFLAGS_CF;
+        if (!(popcount((u32)(res & 0xff)) & 1))
+            flags |= EFLAGS_PF;
+        if (res == 0)
+            flags |= EFLAGS_ZF;
+        if ((res >> (bits - 1)) & 1)
+            flags |= EFLAGS_SF;
+        if (sub && (((op1 ^ op2) & (op1 ^ res)) >> (bits - 1)) & 1)
+            flags |= EFLAGS_OF;
+
+        m_flags.ptr = m_buffer.get_code_ptr();
+        m_flags.barriers = m_emitter.barriers();
+        m_flags.flags = flags;
+    }
+
+    bool func::known_cond(int cc, bool& result) const {
+        if (m_flags.ptr != m_buffer.get_code_ptr() ||
+            m_flags.barriers != m_emitter.barriers()) {
+            return false;
+        }
+
+        result = eval_cond(m_flags.flags, cc);
+        return true;
+    }
+
+    void func::gen_const(value& dest, i64 val) {
+        // unlike gen_mov this never uses xor, so the flags stay intact
+        if (dest.is_const() && !dest.is_dead() &&
+            dest.known_bits() == ((u64)val & dest.mask())) {
+            return;
+        }
+
+        if (dest.is_mem())
+            dest.assign();
+
+        m_emitter.movi(dest.bits, dest, val);
+        dest.mark_dirty();
+        dest.set_const(val);
+    }
+
+    bool func::fold_jcc(int cc, label& l, bool far) {
+        bool taken;
+        if (!known_cond(cc, taken))
+            return false;
+
+        if (taken)
+            gen_jmp(l, far);
+        return true;
+    }
+
+    bool func::fold_setcc(int cc, value& dest) {
+        bool set;
+        if (!known_cond(cc, set))
+            return false;
+
+        gen_const(dest, set ? 1 : 0);
+        m_flags.ptr = m_buffer.get_code_ptr();
+        return true;
+    }
+
+    bool func::fold_cmov(int cc, value& dest, const value& src) {
+        bool move;
+        if (!known_cond(cc, move))
+            return false;
+
+        if (move)
+            gen_mov(dest, src);
+
+        m_flags.ptr = m_buffer.get_code_ptr();
+        return true;
+    }
+
     void func::gen_jmp(label& l, bool far) {
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jmpi(offset, &fix);
         l.add(fix);
+        m_alloc.mark_unreachable();
     }
 
     void func::gen_jo(label& l, bool far) {
+        if (fold_jcc(CC_O, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jo(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jno(label& l, bool far) {
+        if (fold_jcc(CC_NO, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jno(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jb(label& l, bool far) {
+        if (fold_jcc(CC_B, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jb(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jae(label& l, bool far) {
+        if (fold_jcc(CC_AE, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jae(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jz(label& l, bool far) {
+        if (fold_jcc(CC_Z, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jz(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jnz(label& l, bool far) {
+        if (fold_jcc(CC_NZ, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jnz(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_je(label& l, bool far) {
+        if (fold_jcc(CC_Z, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.je(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jne(label& l, bool far) {
+        if (fold_jcc(CC_NZ, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jne(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jbe(label& l, bool far) {
+        if (fold_jcc(CC_BE, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jbe(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_ja(label& l, bool far) {
+        if (fold_jcc(CC_A, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.ja(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_js(label& l, bool far) {
+        if (fold_jcc(CC_S, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.js(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jns(label& l, bool far) {
+        if (fold_jcc(CC_NS, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jns(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jp(label& l, bool far) {
+        if (fold_jcc(CC_P, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jp(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jnp(label& l, bool far) {
+        if (fold_jcc(CC_NP, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jnp(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jl(label& l, bool far) {
+        if (fold_jcc(CC_L, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jl(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jge(label& l, bool far) {
+        if (fold_jcc(CC_GE, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jge(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jle(label& l, bool far) {
+        if (fold_jcc(CC_LE, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jle(offset, &fix);
         l.add(fix);
     }
 
     void func::gen_jg(label& l, bool far) {
+        if (fold_jcc(CC_G, l, far))
+            return;
+
         fixup fix;
         i32 offset = far ? 128 : 0;
-        m_alloc.flush_all_regs();
+        l.merge();
         m_emitter.jg(offset, &fix);
         l.add(fix);
     }
 
+    void func::gen_switch(value& idx, const vector<label*>& targets) {
+        // below this many cases, or with too many holes, a compare chain is
+        // cheaper than a bounds check, table load and indirect jump
+        const size_t chain_max = 3;
+        const size_t min_density = 4;
+
+        const size_t n = targets.size();
+        const size_t used = n - std::count(targets.begin(), targets.end(),
+                                           nullptr);
+        FTL_ERROR_ON(!fits_i32(n), "too many switch targets");
+
+        reg r = m_alloc.select();
+        m_alloc.flush(r);
+        m_emitter.movzx(64, idx.bits, r, idx);
+        m_alloc.flush_all_regs();
+
+        // dispatch happens with all registers flushed, targets expecting
+        // values in registers are entered via a stub that loads them first
+        vector<label> stubs;
+        vector<label*> stub_targets;
+        vector<label*> edges(targets);
+        stubs.reserve(n);
+
+        for (label*& edge : edges) {
+            if (edge == nullptr)
+                continue;
+
+            const regstate& state = edge->get_state();
+            if (state.is_valid() && !state.is_empty()) {
+                stub_targets.push_back(edge);
+                stubs.push_back(gen_label("switch.stub"));
+                edge = &stubs.back();
+            }
+
+            edge->merge();
+        }
+
+        label end = gen_label("switch.end");
+        fixup fix;
+
+        if (used <= chain_max || used * min_density < n) {
+            for (size_t i = 0; i < n; i++) {
+                if (edges[i] == nullptr)
+                    continue;
+
+                m_emitter.cmpi(64, r, (i32)i);
+                m_emitter.je(128, &fix);
+                edges[i]->add(fix);
+            }
+
+            if (stubs.empty())
+                return;
+
+            gen_jmp(end, true);
+        } else {
+            m_alloc.block(r);
+            reg base = m_alloc.select();
+            m_alloc.unblock(r);
+
+            // table entries hold the target offset relative to their own end
+            fixup table;
+            m_emitter.cmpi(64, r, (i32)n);
+            end.merge();
+            m_emitter.jae(128, &fix);
+            end.add(fix);
+            m_emitter.leaip(base, 0, &table);
+            m_emitter.shli(64, r, 2);
+            m_emitter.addr(64, r, base);
+            m_emitter.movsx(64, 32, base, memop(r, 0));
+            m_emitter.lear(64, r, r, 4);
+            m_emitter.addr(64, r, base);
+            m_emitter.jmpr(r);
+            m_alloc.mark_unreachable();
+
+            m_buffer.align(2);
+            patch_jump(table, m_buffer.get_code_ptr());
+
+            for (label* edge : edges) {
+                fix.code = m_buffer.get_code_ptr();
+                fix.size = sizeof(i32);
+                m_buffer.write<i32>(0);
+                (edge ? edge : &end)->add(fix);
+            }
+        }
+
+        for (size_t i = 0; i < stubs.size(); i++) {
+            stubs[i].place();
+            gen_jmp(*stub_targets[i], true);
+        }
+
+        end.place();
+    }
+
     void func::gen_seto(value& dest) {
+        if (fold_setcc(CC_O, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -302,6 +835,9 @@ namespace ftl {
     }
 
     void func::gen_setno(value& dest) {
+        if (fold_setcc(CC_NO, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -311,6 +847,9 @@ namespace ftl {
     }
 
     void func::gen_setb(value& dest) {
+        if (fold_setcc(CC_B, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -320,6 +859,9 @@ namespace ftl {
     }
 
     void func::gen_setae(value& dest) {
+        if (fold_setcc(CC_AE, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -329,6 +871,9 @@ namespace ftl {
     }
 
     void func::gen_setz(value& dest) {
+        if (fold_setcc(CC_Z, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -338,6 +883,9 @@ namespace ftl {
     }
 
     void func::gen_setnz(value& dest) {
+        if (fold_setcc(CC_NZ, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -347,6 +895,9 @@ namespace ftl {
     }
 
     void func::gen_sete(value& dest) {
+        if (fold_setcc(CC_Z, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -356,6 +907,9 @@ namespace ftl {
     }
 
     void func::gen_setne(value& dest) {
+        if (fold_setcc(CC_NZ, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -365,6 +919,9 @@ namespace ftl {
     }
 
     void func::gen_setbe(value& dest) {
+        if (fold_setcc(CC_BE, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -374,6 +931,9 @@ namespace ftl {
     }
 
     void func::gen_seta(value& dest) {
+        if (fold_setcc(CC_A, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -383,6 +943,9 @@ namespace ftl {
     }
 
     void func::gen_sets(value& dest) {
+        if (fold_setcc(CC_S, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -392,6 +955,9 @@ namespace ftl {
     }
 
     void func::gen_setns(value& dest) {
+        if (fold_setcc(CC_NS, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -401,6 +967,9 @@ namespace ftl {
     }
 
     void func::gen_setp(value& dest) {
+        if (fold_setcc(CC_P, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -410,6 +979,9 @@ namespace ftl {
     }
 
     void func::gen_setnp(value& dest) {
+        if (fold_setcc(CC_NP, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -419,6 +991,9 @@ namespace ftl {
     }
 
     void func::gen_setl(value& dest) {
+        if (fold_setcc(CC_L, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -428,6 +1003,9 @@ namespace ftl {
     }
 
     void func::gen_setge(value& dest) {
+        if (fold_setcc(CC_GE, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -437,6 +1015,9 @@ namespace ftl {
     }
 
     void func::gen_setle(value& dest) {
+        if (fold_setcc(CC_LE, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -446,6 +1027,9 @@ namespace ftl {
     }
 
     void func::gen_setg(value& dest) {
+        if (fold_setcc(CC_G, dest))
+            return;
+
         if (dest.is_mem())
             dest.assign();
 
@@ -455,6 +1039,9 @@ namespace ftl {
     }
 
     void func::gen_cmovo(value& dest, const value& src) {
+        if (fold_cmov(CC_O, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -466,6 +1053,9 @@ namespace ftl {
     }
 
     void func::gen_cmovno(value& dest, const value& src) {
+        if (fold_cmov(CC_NO, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -477,6 +1067,9 @@ namespace ftl {
     }
 
     void func::gen_cmovb(value& dest, const value& src) {
+        if (fold_cmov(CC_B, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -488,6 +1081,9 @@ namespace ftl {
     }
 
     void func::gen_cmovae(value& dest, const value& src) {
+        if (fold_cmov(CC_AE, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -499,6 +1095,9 @@ namespace ftl {
     }
 
     void func::gen_cmovz(value& dest, const value& src) {
+        if (fold_cmov(CC_Z, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -510,6 +1109,9 @@ namespace ftl {
     }
 
     void func::gen_cmovnz(value& dest, const value& src) {
+        if (fold_cmov(CC_NZ, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -521,6 +1123,9 @@ namespace ftl {
     }
 
     void func::gen_cmove(value& dest, const value& src) {
+        if (fold_cmov(CC_Z, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -532,6 +1137,9 @@ namespace ftl {
     }
 
     void func::gen_cmovne(value& dest, const value& src) {
+        if (fold_cmov(CC_NZ, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -543,6 +1151,9 @@ namespace ftl {
     }
 
     void func::gen_cmovbe(value& dest, const value& src) {
+        if (fold_cmov(CC_BE, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -554,6 +1165,9 @@ namespace ftl {
     }
 
     void func::gen_cmova(value& dest, const value& src) {
+        if (fold_cmov(CC_A, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -565,6 +1179,9 @@ namespace ftl {
     }
 
     void func::gen_cmovs(value& dest, const value& src) {
+        if (fold_cmov(CC_S, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -576,6 +1193,9 @@ namespace ftl {
     }
 
     void func::gen_cmovns(value& dest, const value& src) {
+        if (fold_cmov(CC_NS, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -587,6 +1207,9 @@ namespace ftl {
     }
 
     void func::gen_cmovp(value& dest, const value& src) {
+        if (fold_cmov(CC_P, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -598,6 +1221,9 @@ namespace ftl {
     }
 
     void func::gen_cmovnp(value& dest, const value& src) {
+        if (fold_cmov(CC_NP, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -609,6 +1235,9 @@ namespace ftl {
     }
 
     void func::gen_cmovl(value& dest, const value& src) {
+        if (fold_cmov(CC_L, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -620,6 +1249,9 @@ namespace ftl {
     }
 
     void func::gen_cmovge(value& dest, const value& src) {
+        if (fold_cmov(CC_GE, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -631,6 +1263,9 @@ namespace ftl {
     }
 
     void func::gen_cmovle(value& dest, const value& src) {
+        if (fold_cmov(CC_LE, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -642,6 +1277,9 @@ namespace ftl {
     }
 
     void func::gen_cmovg(value& dest, const value& src) {
+        if (fold_cmov(CC_G, dest, src))
+            return;
+
         if (dest == src)
             return;
 
@@ -657,7 +1295,14 @@ namespace ftl {
         if (dest == src)
             return;
 
-        if (dest.is_mem() && src.is_mem())
+        knowledge k(src);
+        if (dest.is_const() && !dest.is_dead() && k.covers(dest.bits) &&
+            dest.known_bits() == (k.bits & dest.mask())) {
+            return;
+        }
+
+        // a full overwrite of an imprecise value need not reach memory yet
+        if (dest.is_mem() && (src.is_mem() || !dest.is_precise()))
             dest.assign();
 
         if (dest.bits > src.bits && src.bits < 32)
@@ -666,67 +1311,144 @@ namespace ftl {
             m_emitter.movr(min(dest.bits, src.bits), dest, src);
 
         dest.mark_dirty();
+
+        // narrower sources get zero-extended when moved into a register
+        u64 ext = dest.is_reg() ? dest.mask() & ~width_mask(src.bits) : 0;
+        dest.set_known(k.mask | ext, k.bits);
     }
 
     void func::gen_add(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.addr(dest.bits, dest, src);
+        knowledge a(dest), b(src);
+
+        i32 imm;
+        if (known_imm(dest, src, imm) && imm > 0) {
+            m_emitter.addi(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.addr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
+        fold_known(dest, KNOWN_ADD, a, b);
     }
 
     void func::gen_or(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.orr(dest.bits, dest, src);
+        knowledge a(dest), b(src);
+
+        i32 imm;
+        if (known_imm(dest, src, imm) && imm != 0) {
+            m_emitter.ori(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.orr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
+        fold_known(dest, KNOWN_OR, a, b);
     }
 
     void func::gen_adc(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.adcr(dest.bits, dest, src);
+        i32 imm;
+        if (known_imm(dest, src, imm)) {
+            m_emitter.adci(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.adcr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
     }
 
     void func::gen_sbb(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.sbbr(dest.bits, dest, src);
+        i32 imm;
+        if (known_imm(dest, src, imm)) {
+            m_emitter.sbbi(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.sbbr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
     }
 
     void func::gen_and(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.andr(dest.bits, dest, src);
+        knowledge a(dest), b(src);
+
+        i32 imm;
+        if (known_imm(dest, src, imm) && imm != -1) {
+            m_emitter.andi(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.andr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
+        fold_known(dest, KNOWN_AND, a, b);
     }
 
     void func::gen_sub(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.subr(dest.bits, dest, src);
+        knowledge a(dest), b(src);
+
+        i32 imm;
+        if (known_imm(dest, src, imm) && imm > 0) {
+            m_emitter.subi(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.subr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
+        fold_known(dest, KNOWN_SUB, a, b);
     }
 
     void func::gen_xor(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.xorr(dest.bits, dest, src);
+        knowledge a(dest), b(src);
+
+        i32 imm;
+        if (known_imm(dest, src, imm) && imm != 0) {
+            m_emitter.xori(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.xorr(dest.bits, dest, src);
+        }
+
         dest.mark_dirty();
+        fold_known(dest, KNOWN_XOR, a, b);
     }
 
     void func::gen_cmp(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.cmpr(dest.bits, dest, src);
+        i32 imm;
+        if (known_imm(dest, src, imm)) {
+            m_emitter.cmpi(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.cmpr(dest.bits, dest, src);
+        }
+
+        set_known_flags(dest.bits, dest.known_mask(), dest.known_bits(),
+                        src.known_mask(), src.known_bits(), true);
     }
 
     void func::gen_tst(value& dest, const value& src) {
-        if (dest.is_mem() && src.is_mem())
-            dest.fetch();
-        m_emitter.tstr(dest.bits, dest, src);
+        i32 imm;
+        if (dest != src && known_imm(dest, src, imm)) {
+            m_emitter.tsti(dest.bits, dest, imm);
+        } else {
+            if (dest.is_mem() && src.is_mem())
+                dest.fetch();
+            m_emitter.tstr(dest.bits, dest, src);
+        }
+
+        set_known_flags(dest.bits, dest.known_mask(), dest.known_bits(),
+                        src.known_mask(), src.known_bits(), false);
     }
 
     void func::gen_xchg(value& dest, value& src) {
@@ -738,6 +1460,7 @@ namespace ftl {
     }
 
     void func::gen_add(value& dest, const value& src1, const value& src2) {
+        // no lea or constant folding here, callers may consume the flags
         if (dest == src1) {
             gen_add(dest, src2);
         } else if (dest == src2) {
@@ -819,8 +1542,13 @@ namespace ftl {
     }
 
     void func::gen_mov(value& dest, i64 val) {
+        if (dest.is_const() && !dest.is_dead() &&
+            dest.known_bits() == ((u64)val & dest.mask())) {
+            return;
+        }
+
         int immlen = max(encode_size(val), dest.bits);
-        if (dest.is_mem() && immlen > 32)
+        if (dest.is_mem() && (immlen > 32 || !dest.is_precise()))
             dest.assign();
 
         if (val == 0 && dest.is_reg())
@@ -829,9 +1557,11 @@ namespace ftl {
             m_emitter.movi(dest.bits, dest, val);
 
         dest.mark_dirty();
+        dest.set_const(val);
     }
 
     void func::gen_add(value& dest, i32 val) {
+        knowledge a(dest);
         switch (val) {
         case  0: return;
         case  1: m_emitter.incr(dest.bits, dest); break;
@@ -840,14 +1570,17 @@ namespace ftl {
         }
 
         dest.mark_dirty();
+        fold_known(dest, KNOWN_ADD, a, val);
     }
 
     void func::gen_or(value& dest, i32 val) {
         if (val == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.ori(dest.bits, dest, val);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_OR, a, val);
     }
 
     void func::gen_adc(value& dest, i32 val) {
@@ -864,14 +1597,17 @@ namespace ftl {
         if (val == -1)
             return;
 
+        knowledge a(dest);
         if (val == 0 && dest.is_reg())
             m_emitter.xorr(dest.bits, dest, dest);
         else
             m_emitter.andi(dest.bits, dest, val);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_AND, a, val);
     }
 
     void func::gen_sub(value& dest, i32 val) {
+        knowledge a(dest);
         switch (val) {
         case  0: return;
         case  1: m_emitter.decr(dest.bits, dest); break;
@@ -880,14 +1616,17 @@ namespace ftl {
         }
 
         dest.mark_dirty();
+        fold_known(dest, KNOWN_SUB, a, val);
     }
 
     void func::gen_xor(value& dest, i32 val) {
         if (val == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.xori(dest.bits, dest, val);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_XOR, a, val);
     }
 
     void func::gen_cmp(value& dest, i32 val) {
@@ -896,6 +1635,8 @@ namespace ftl {
             gen_tst(dest, dest);
         } else {
             m_emitter.cmpi(dest.bits, dest, val);
+            set_known_flags(dest.bits, dest.known_mask(), dest.known_bits(),
+                            ~0ull, val, true);
         }
     }
 
@@ -905,10 +1646,17 @@ namespace ftl {
             gen_tst(dest, dest);
         } else {
             m_emitter.tsti(dest.bits, dest, val);
+            set_known_flags(dest.bits, dest.known_mask(), dest.known_bits(),
+                            ~0ull, val, false);
         }
     }
 
     void func::gen_lea(value& dest, value& src, i32 val) {
+        if (src.is_const() && src.bits >= dest.bits) {
+            gen_const(dest, src.const_val() + val);
+            return;
+        }
+
         src.fetch();
         if (dest != src)
             dest.assign();
@@ -923,6 +1671,11 @@ namespace ftl {
             return;
         }
 
+        if (src.is_const() && src.bits >= dest.bits) {
+            gen_const(dest, src.const_val() + val);
+            return;
+        }
+
         if (dest.is_mem())
             dest.assign();
 
@@ -966,21 +1719,25 @@ namespace ftl {
     }
 
     void func::gen_imul(value& hi, value& dest, const value& src) {
+        FTL_ERROR_ON(&hi == &dest, "imul needs separate values for hi and lo");
         m_alloc.fetch(&dest, RAX);
+        m_alloc.block(RAX);
         m_alloc.flush(RDX);
         m_emitter.imul(dest.bits, src);
-        m_alloc.assign(&hi, RDX);
-        m_alloc.mark_dirty(RAX);
-        m_alloc.mark_dirty(RDX);
+        m_alloc.unblock(RAX);
+        gen_result(hi, RDX);
+        gen_result(dest, RAX);
     }
 
     void func::gen_umul(value& hi, value& dest, const value& src) {
+        FTL_ERROR_ON(&hi == &dest, "umul needs separate values for hi and lo");
         m_alloc.fetch(&dest, RAX);
+        m_alloc.block(RAX);
         m_alloc.flush(RDX);
         m_emitter.mulr(dest.bits, src);
-        m_alloc.assign(&hi, RDX);
-        m_alloc.mark_dirty(RAX);
-        m_alloc.mark_dirty(RDX);
+        m_alloc.unblock(RAX);
+        gen_result(hi, RDX);
+        gen_result(dest, RAX);
     }
 
     void func::gen_imul(value& dest, const value& src) {
@@ -995,31 +1752,129 @@ namespace ftl {
         free_value(dummy);
     }
 
+    void func::gen_result(value& dest, reg r) {
+        // pinned values only received a copy of their register
+        if (m_alloc.is_pinned(&dest))
+            m_emitter.movr(dest.bits, dest.r(), r);
+        else
+            m_alloc.assign(&dest, r);
+        dest.mark_dirty();
+    }
+
     void func::gen_idiv(value& dest, const value& src) {
         m_alloc.fetch(&dest, RAX);
+        m_alloc.block(RAX);
         m_alloc.flush(RDX);
         m_emitter.cwd(dest.bits);
         m_emitter.idiv(dest.bits, src);
-        m_alloc.mark_dirty(RAX);
+        m_alloc.unblock(RAX);
+        gen_result(dest, RAX);
     }
 
     void func::gen_imod(value& dest, const value& src) {
         gen_idiv(dest, src);
-        m_alloc.assign(&dest, RDX);
-        m_alloc.mark_dirty(RDX);
+        gen_result(dest, RDX);
     }
 
     void func::gen_udiv(value& dest, const value& src) {
         m_alloc.fetch(&dest, RAX);
+        m_alloc.block(RAX);
         m_alloc.flush(RDX);
         m_emitter.xorr(32, RDX, RDX);
         m_emitter.divr(dest.bits, src);
-        dest.mark_dirty();
+        m_alloc.unblock(RAX);
+        gen_result(dest, RAX);
     }
 
     void func::gen_umod(value& dest, const value& src) {
         gen_udiv(dest, src);
-        dest.assign(RDX);
+        gen_result(dest, RDX);
+    }
+
+    void func::gen_mulhi(value& hi, const value& src, i64 magic, bool sign) {
+        if (src.bits == 64) {
+            m_alloc.relocate(RAX);
+            m_alloc.block(RAX);
+            m_alloc.relocate(RDX);
+            m_alloc.block(RDX);
+
+            m_emitter.movr(64, RAX, src);
+            if (sign)
+                m_emitter.imul(64, m_emitter.literal(magic));
+            else
+                m_emitter.mulr(64, m_emitter.literal(magic));
+
+            m_alloc.unblock(RAX);
+            m_alloc.unblock(RDX);
+            hi.assign(RDX);
+            hi.mark_dirty();
+            return;
+        }
+
+        // the full product of two values up to 32 bits fits into 64 bits
+        reg r = src.is_reg() ? src.r() : NREGS;
+        if (r != NREGS)
+            m_alloc.block(r);
+
+        hi.assign();
+        m_alloc.block(hi.r());
+        if (sign)
+            m_emitter.movsx(64, src.bits, hi, src);
+        else
+            m_emitter.movzx(64, src.bits, hi, src);
+
+        if (fits_i32(magic))
+            m_emitter.imuli(64, hi.r(), hi, magic);
+        else
+            m_emitter.imulr(64, hi.r(), m_emitter.literal(magic));
+
+        if (sign)
+            m_emitter.sari(64, hi, src.bits);
+        else
+            m_emitter.shri(64, hi, src.bits);
+
+        m_alloc.unblock(hi.r());
+        if (r != NREGS)
+            m_alloc.unblock(r);
+        hi.mark_dirty();
+    }
+
+    void func::gen_mul_imm(value& dest, i64 val) {
+        // only the low half of the product is kept, so signed and unsigned
+        // multiplication are the same and narrow values may use 32 bits
+        const int bits = max(dest.bits, 32);
+        val = sign_extend(val, dest.bits);
+
+        u64 mag = val < 0 ? -(u64)val : val;
+        int shift = __builtin_ctzll(mag);
+        u64 odd = mag >> shift;
+
+        // up to two lea of the form x + x * {2, 4, 8}, e.g. 45 = 5 * 9
+        int factors[2];
+        int nfactors = 0;
+        for (int f : { 9, 5, 3 }) {
+            while (nfactors < 2 && odd % f == 0) {
+                factors[nfactors++] = f;
+                odd /= f;
+            }
+        }
+
+        dest.fetch();
+        reg r = dest.r();
+
+        if (odd == 1) {
+            for (int i = 0; i < nfactors; i++)
+                m_emitter.leasib(bits, r, r, r, factors[i] - 1);
+            if (shift > 0)
+                m_emitter.shli(bits, r, shift);
+            if (val < 0)
+                m_emitter.negr(bits, r);
+        } else if (fits_i32(val)) {
+            m_emitter.imuli(bits, r, r, val);
+        } else {
+            m_emitter.imulr(bits, r, m_emitter.literal(val));
+        }
+
         dest.mark_dirty();
     }
 
@@ -1044,9 +1899,7 @@ namespace ftl {
             return;
         }
 
-        value src = gen_local_val("temp_imul_imm", dest.bits, val);
-        gen_imul(dest, src);
-        m_alloc.free_value(src);
+        gen_mul_imm(dest, val);
     }
 
     void func::gen_idiv(value& dest, i64 val) {
@@ -1061,13 +1914,42 @@ namespace ftl {
             return;
         }
 
-        if (is_pow2(val)) {
-            gen_sha(dest, log2i(val));
-            return;
+        const u64 absd = val < 0 ? -(u64)val : val;
+        value q = gen_scratch_i64("idiv.q");
+        value t = gen_scratch_i64("idiv.t");
+
+        if (is_pow2(absd)) {
+            // bias negative dividends by d - 1 to round towards zero
+            int k = log2i(absd);
+            gen_sxt(q, dest);
+            gen_mov(t, q);
+            gen_sha(t, 63);
+            gen_shr(t, 64 - k);
+            gen_add(q, t);
+            gen_sha(q, k);
+            if (val < 0)
+                gen_neg(q);
+        } else {
+            divmagic m = sdiv_magic(val, dest.bits);
+            gen_mulhi(q, dest, m.magic, true);
+            if (m.add) {
+                gen_sxt(t, dest);
+                if (val > 0)
+                    gen_add(q, t);
+                else
+                    gen_sub(q, t);
+            }
+
+            // negative quotients have been rounded down, not towards zero
+            gen_sha(q, m.shift);
+            gen_mov(t, q);
+            gen_shr(t, 63);
+            gen_add(q, t);
         }
 
-        value src = gen_local_val("temp_idiv_imm", dest.bits, val);
-        gen_idiv(dest, src);
+        gen_mov(dest, q);
+        free_value(t);
+        free_value(q);
     }
 
     void func::gen_imod(value& dest, i64 val) {
@@ -1079,8 +1961,12 @@ namespace ftl {
             return;
         }
 
-        value src = gen_local_val("temp_imod_imm", dest.bits, val);
-        gen_imod(dest, src);
+        value q = gen_scratch_val("imod.q", dest.bits);
+        gen_mov(q, dest);
+        gen_idiv(q, val);
+        gen_mul_imm(q, val);
+        gen_sub(dest, q);
+        free_value(q);
     }
 
     void func::gen_umul(value& dest, u64 val) {
@@ -1099,9 +1985,7 @@ namespace ftl {
             return;
         }
 
-        value src = gen_local_val("temp_umul_imm", dest.bits, val);
-        gen_umul(dest, src);
-        m_alloc.free_value(src);
+        gen_mul_imm(dest, val);
     }
 
     void func::gen_udiv(value& dest, u64 val) {
@@ -1116,8 +2000,23 @@ namespace ftl {
             return;
         }
 
-        value src = gen_local_val("temp_udiv_imm", dest.bits, val);
-        gen_udiv(dest, src);
+        divmagic m = udiv_magic(val, dest.bits);
+        value q = gen_scratch_i64("udiv.q");
+        gen_mulhi(q, dest, m.magic, false);
+
+        if (m.add) {
+            // q + ((x - q) >> 1) cannot overflow, unlike x + q
+            value t = gen_scratch_i64("udiv.t");
+            gen_zxt(t, dest);
+            gen_sub(t, q);
+            gen_shr(t, 1);
+            gen_add(q, t);
+            free_value(t);
+        }
+
+        gen_shr(q, m.shift);
+        gen_mov(dest, q);
+        free_value(q);
     }
 
     void func::gen_umod(value& dest, u64 val) {
@@ -1134,57 +2033,109 @@ namespace ftl {
             return;
         }
 
-        value src = gen_local_val("temp_umod_imm", dest.bits, val);
-        gen_umod(dest, src);
+        value q = gen_scratch_val("umod.q", dest.bits);
+        gen_mov(q, dest);
+        gen_udiv(q, val);
+        gen_mul_imm(q, val);
+        gen_sub(dest, q);
+        free_value(q);
     }
 
     void func::gen_inc(value& dest) {
+        knowledge a(dest);
         m_emitter.incr(dest.bits, dest);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_ADD, a, 1);
     }
 
     void func::gen_dec(value& dest) {
+        knowledge a(dest);
         m_emitter.decr(dest.bits, dest);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_SUB, a, 1);
     }
 
     void func::gen_not(value& dest) {
+        knowledge a(dest);
         m_emitter.notr(dest.bits, dest);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_XOR, a, -1);
     }
 
     void func::gen_neg(value& dest) {
+        knowledge a(dest);
         m_emitter.negr(dest.bits, dest);
         dest.mark_dirty();
+        fold_known(dest, KNOWN_SUB, 0, a);
     }
 
     void func::gen_shl(value& dest, value& src) {
+        u8 count;
+        if (known_count(dest, src, count)) {
+            gen_shl(dest, count);
+            return;
+        }
+
         src.fetch(RCX);
+        m_alloc.block(RCX);
         m_emitter.shlr(dest.bits, dest);
+        m_alloc.unblock(RCX);
         dest.mark_dirty();
     }
 
     void func::gen_shr(value& dest, value& src) {
+        u8 count;
+        if (known_count(dest, src, count)) {
+            gen_shr(dest, count);
+            return;
+        }
+
         src.fetch(RCX);
+        m_alloc.block(RCX);
         m_emitter.shrr(dest.bits, dest);
+        m_alloc.unblock(RCX);
         dest.mark_dirty();
     }
 
     void func::gen_sha(value& dest, value& src) {
+        u8 count;
+        if (known_count(dest, src, count)) {
+            gen_sha(dest, count);
+            return;
+        }
+
         src.fetch(RCX);
+        m_alloc.block(RCX);
         m_emitter.sarr(dest.bits, dest);
+        m_alloc.unblock(RCX);
         dest.mark_dirty();
     }
 
     void func::gen_rol(value& dest, value& src) {
+        u8 count;
+        if (known_count(dest, src, count)) {
+            gen_rol(dest, count);
+            return;
+        }
+
         src.fetch(RCX);
+        m_alloc.block(RCX);
         m_emitter.rolr(dest.bits, dest);
+        m_alloc.unblock(RCX);
         dest.mark_dirty();
     }
 
     void func::gen_ror(value& dest, value& src) {
+        u8 count;
+        if (known_count(dest, src, count)) {
+            gen_ror(dest, count);
+            return;
+        }
+
         src.fetch(RCX);
+        m_alloc.block(RCX);
         m_emitter.rorr(dest.bits, dest);
+        m_alloc.unblock(RCX);
         dest.mark_dirty();
     }
 
@@ -1192,40 +2143,64 @@ namespace ftl {
         if (shift == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.shli(dest.bits, dest, shift);
         dest.mark_dirty();
+        if (shift < dest.bits) {
+            dest.set_known(a.mask << shift | width_mask(shift),
+                           a.bits << shift);
+        }
     }
 
     void func::gen_shr(value& dest, u8 shift) {
         if (shift == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.shri(dest.bits, dest, shift);
         dest.mark_dirty();
+        if (shift < dest.bits) {
+            u64 mask = dest.mask();
+            dest.set_known((a.mask & mask) >> shift | ~(mask >> shift),
+                           (a.bits & mask) >> shift);
+        }
     }
 
     void func::gen_sha(value& dest, u8 shift) {
         if (shift == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.sari(dest.bits, dest, shift);
         dest.mark_dirty();
+        if (shift < dest.bits && a.covers(dest.bits))
+            dest.set_const(sign_extend(a.bits, dest.bits) >> shift);
     }
 
     void func::gen_rol(value& dest, u8 shift) {
         if (shift == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.roli(dest.bits, dest, shift);
         dest.mark_dirty();
+        if (shift < dest.bits && a.covers(dest.bits)) {
+            u64 val = a.bits & dest.mask();
+            dest.set_const(val << shift | val >> (dest.bits - shift));
+        }
     }
 
     void func::gen_ror(value& dest, u8 shift) {
         if (shift == 0)
             return;
 
+        knowledge a(dest);
         m_emitter.rori(dest.bits, dest, shift);
         dest.mark_dirty();
+        if (shift < dest.bits && a.covers(dest.bits)) {
+            u64 val = a.bits & dest.mask();
+            dest.set_const(val >> shift | val << (dest.bits - shift));
+        }
     }
 
     void func::gen_bt(value& dest, value& src) {
@@ -1278,6 +2253,9 @@ namespace ftl {
     void func::gen_zxt(value& dest, value& src, int dbits, int sbits) {
         FTL_ERROR_ON(dbits < sbits, "target width too narrow");
 
+        knowledge k(src);
+        u64 ext = width_mask(dbits) & ~width_mask(sbits);
+
         if (dest != src) {
             dest.assign();
             m_emitter.movzx(dbits, sbits, dest, src);
@@ -1289,6 +2267,9 @@ namespace ftl {
         }
 
         dest.mark_dirty();
+        if (dbits == dest.bits)
+            dest.set_known((k.mask & width_mask(sbits)) | ext,
+                           k.bits & width_mask(sbits));
     }
 
     void func::gen_sxt(value& dest, value& src) {
@@ -1317,6 +2298,12 @@ namespace ftl {
         cmpv.fetch(RAX);
 
         m_emitter.cmpxchg(dest.bits, dest, src);
+        dest.forget_known();
+        cmpv.forget_known();
+
+        // rax holds the old contents of dest now, also when pinned
+        if (m_alloc.is_pinned(&cmpv))
+            m_emitter.movr(cmpv.bits, cmpv.r(), RAX);
     }
 
     void func::gen_fence(bool sync_loads, bool sync_stores) {
@@ -1328,6 +2315,237 @@ namespace ftl {
             m_emitter.sfence();
     }
 
+    void func::gen_memcpy(value& dest, value& src, value& count) {
+        const reg fixed[] = { RDI, RSI, RCX };
+
+        // the target may overlap any global, so none may stay cached
+        m_alloc.flush_global_regs();
+        m_alloc.store_pinned_regs();
+
+        for (reg r : fixed)
+            m_alloc.block(r);
+        for (reg r : fixed)
+            m_alloc.relocate(r);
+
+        m_emitter.movzx(64, dest.bits, RDI, dest);
+        m_emitter.movzx(64, src.bits, RSI, src);
+        m_emitter.movzx(64, count.bits, RCX, count);
+
+        if (!cpu_has(CPU_ERMS)) {
+            m_emitter.shri(64, RCX, 3);
+            m_emitter.rep();
+            m_emitter.movsq();
+            m_emitter.movzx(64, count.bits, RCX, count);
+            m_emitter.andi(64, RCX, 7);
+        }
+
+        m_emitter.rep();
+        m_emitter.movsb();
+
+        for (reg r : fixed)
+            m_alloc.unblock(r);
+
+        m_alloc.load_pinned_regs();
+        m_alloc.forget_known(true);
+    }
+
+    void func::gen_memset(value& dest, value& val, value& count) {
+        const reg fixed[] = { RDI, RAX, RCX };
+
+        // the target may overlap any global, so none may stay cached
+        m_alloc.flush_global_regs();
+        m_alloc.store_pinned_regs();
+
+        for (reg r : fixed)
+            m_alloc.block(r);
+        for (reg r : fixed)
+            m_alloc.relocate(r);
+
+        m_emitter.movzx(64, dest.bits, RDI, dest);
+
+        if (!cpu_has(CPU_ERMS)) {
+            // replicate fill byte into all eight bytes of rax
+            m_emitter.movzx(32, 8, RAX, val);
+            m_emitter.imuli(32, RAX, RAX, 0x01010101);
+            m_emitter.movr(32, RCX, RAX);
+            m_emitter.shli(64, RCX, 32);
+            m_emitter.orr(64, RAX, RCX);
+            m_emitter.movzx(64, count.bits, RCX, count);
+            m_emitter.shri(64, RCX, 3);
+            m_emitter.rep();
+            m_emitter.stosq();
+            m_emitter.movzx(64, count.bits, RCX, count);
+            m_emitter.andi(64, RCX, 7);
+        } else {
+            m_emitter.movr(8, RAX, val);
+            m_emitter.movzx(64, count.bits, RCX, count);
+        }
+
+        m_emitter.rep();
+        m_emitter.stosb();
+
+        for (reg r : fixed)
+            m_alloc.unblock(r);
+
+        m_alloc.load_pinned_regs();
+        m_alloc.forget_known(true);
+    }
+
+    void func::gen_prefetch(value& addr, bool nta) {
+        FTL_ERROR_ON(addr.bits != 64, "prefetch address must be 64 bits");
+
+        reg r = addr.fetch();
+        if (nta)
+            m_emitter.prefetchnta(memop(r, 0));
+        else
+            m_emitter.prefetcht0(memop(r, 0));
+    }
+
+    void func::gen_load(value& dest, value& addr, dispatcher& d, u64 pc) {
+        FTL_ERROR_ON(addr.bits != 64, "load address must be 64 bits");
+        FTL_ERROR_ON(&d.get_cbuffer() != &m_buffer,
+                     "dispatcher uses a different code buffer");
+
+        reg base = addr.fetch();
+        m_alloc.block(base);
+        reg r = dest.assign();
+        m_alloc.block(r);
+
+        // no branch on the way, faults are recovered from out of line
+        vector<writeback> wb = m_alloc.fault_writebacks();
+        m_alloc.unblock(base);
+        m_alloc.unblock(r);
+
+        m_emitter.barrier();
+        const u8* insn = m_buffer.get_code_ptr();
+        m_emitter.movr(dest.bits, r, memop(base, 0));
+        m_emitter.barrier();
+        m_faults.push_back({ insn, std::move(wb), &d, pc });
+
+        dest.mark_dirty();
+    }
+
+    void func::gen_store(value& addr, value& src, dispatcher& d, u64 pc) {
+        FTL_ERROR_ON(addr.bits != 64, "store address must be 64 bits");
+        FTL_ERROR_ON(&d.get_cbuffer() != &m_buffer,
+                     "dispatcher uses a different code buffer");
+
+        // guest memory may alias the data block, see gen_memcpy
+        m_alloc.flush_global_regs();
+        m_alloc.store_pinned_regs();
+
+        reg base = addr.fetch();
+        m_alloc.block(base);
+        reg r = src.fetch();
+        m_alloc.block(r);
+
+        vector<writeback> wb = m_alloc.fault_writebacks();
+        m_alloc.unblock(base);
+        m_alloc.unblock(r);
+
+        m_emitter.barrier();
+        const u8* insn = m_buffer.get_code_ptr();
+        m_emitter.movr(src.bits, memop(base, 0), r);
+        m_emitter.barrier();
+        m_faults.push_back({ insn, std::move(wb), &d, pc });
+
+        // addr and src may have been overwritten themselves
+        m_alloc.flush_global_regs();
+        m_alloc.load_pinned_regs();
+        m_alloc.forget_known(true);
+    }
+
+    void func::gen_recovery() {
+        // registers are still as they were when the access faulted, so all
+        // that is left is to write back dirty guest state and exit
+        for (const faultsite& site : m_faults) {
+            m_emitter.barrier();
+            const u8* stub = m_buffer.get_code_ptr();
+            for (const writeback& w : site.wb)
+                m_emitter.movr(w.bits, w.mem, w.r);
+            site.disp->gen_exit(m_emitter, EXIT_FAULT, site.pc);
+            m_buffer.add_fault(site.insn, stub);
+        }
+
+        m_faults.clear();
+    }
+
+    void func::gen_rdtsc(value& dest) {
+        FTL_ERROR_ON(dest.bits != 64, "timestamp must be 64 bits wide");
+
+        m_alloc.flush(RAX);
+        m_alloc.flush(RDX);
+        m_emitter.rdtsc();
+        m_emitter.shli(64, RDX, 32);
+        m_emitter.orr(64, RAX, RDX);
+        gen_result(dest, RAX);
+    }
+
+    void func::gen_rdtscp(value& dest, value& aux) {
+        FTL_ERROR_ON(dest.bits != 64, "timestamp must be 64 bits wide");
+        FTL_ERROR_ON(aux.bits < 32, "aux value must be at least 32 bits");
+        FTL_ERROR_ON(dest == aux, "timestamp and aux need separate values");
+
+        m_alloc.flush(RAX);
+        m_alloc.flush(RDX);
+        m_alloc.flush(RCX);
+
+        if (cpu_has(CPU_RDTSCP)) {
+            m_emitter.rdtscp();
+        } else { // wait for prior instructions, but aux is not available
+            m_emitter.lfence();
+            m_emitter.rdtsc();
+            m_emitter.xorr(32, RCX, RCX);
+        }
+
+        m_emitter.shli(64, RDX, 32);
+        m_emitter.orr(64, RAX, RDX);
+        gen_result(dest, RAX);
+        gen_result(aux, RCX);
+    }
+
+    void func::gen_rdpmc(value& dest, value& counter) {
+        FTL_ERROR_ON(dest.bits != 64, "counter value must be 64 bits wide");
+        FTL_ERROR_ON(dest == counter, "counter index would be overwritten");
+
+        m_alloc.fetch(&counter, RCX);
+        m_alloc.flush(RAX);
+        m_alloc.flush(RDX);
+        m_emitter.rdpmc();
+        m_emitter.shli(64, RDX, 32);
+        m_emitter.orr(64, RAX, RDX);
+        gen_result(dest, RAX);
+    }
+
+    void func::gen_rdpmc(value& dest, u32 counter) {
+        FTL_ERROR_ON(dest.bits != 64, "counter value must be 64 bits wide");
+
+        m_alloc.flush(RAX);
+        m_alloc.flush(RCX);
+        m_alloc.flush(RDX);
+        m_emitter.movi(32, RCX, counter);
+        m_emitter.rdpmc();
+        m_emitter.shli(64, RDX, 32);
+        m_emitter.orr(64, RAX, RDX);
+        gen_result(dest, RAX);
+    }
+
+    void func::gen_icount_add(value& counter, i32 n) {
+        FTL_ERROR_ON(counter.bits < 32, "instruction counter too narrow");
+
+        if (n == 0)
+            return;
+
+        // lea leaves the flags intact; memory counters are updated in place
+        // to avoid a load and a register for values we rarely need
+        if (counter.is_reg())
+            m_emitter.lear(counter.bits, counter, counter.r(), n);
+        else
+            m_emitter.addi(counter.bits, counter, n);
+
+        counter.mark_dirty();
+    }
+
     void func::gen_mov(scalar& dest, const value& src) {
         FTL_ERROR_ON(src.bits < 32, "integer value too narrow");
 
@@ -1343,7 +2561,6 @@ namespace ftl {
         FTL_ERROR_ON(dest.bits < 32, "integer value too narrow");
 
         src.fetch(); // fp value must be in a register
-        dest.mark_dirty();
 
         int bits = min(dest.bits, src.bits);
         if (dest.bits > src.bits) {
@@ -1352,6 +2569,7 @@ namespace ftl {
         }
 
         m_emitter.movx(bits, dest, src);
+        dest.mark_dirty(); // forgets the zero from widening
     }
 
     void func::gen_mov(scalar& dest, const scalar& src) {
@@ -1490,6 +2708,29 @@ namespace ftl {
         m_emitter.pxor(dest.bits, dest, src);
     }
 
+    static u64 fp_sign_mask(int bits) {
+        // sign bits of all lanes, to be used as a 128bit memory operand
+        return bits == 32 ? 0x8000000080000000ull : 0x8000000000000000ull;
+    }
+
+    void func::gen_abs(scalar& dest) {
+        if (dest.is_mem())
+            dest.fetch();
+        dest.mark_dirty();
+
+        u64 mask = ~fp_sign_mask(dest.bits);
+        m_emitter.pand(dest.bits, dest, m_emitter.literal(mask, mask));
+    }
+
+    void func::gen_neg(scalar& dest) {
+        if (dest.is_mem())
+            dest.fetch();
+        dest.mark_dirty();
+
+        u64 mask = fp_sign_mask(dest.bits);
+        m_emitter.pxor(dest.bits, dest, m_emitter.literal(mask, mask));
+    }
+
     void func::gen_cmp(scalar& op1, const scalar& op2, bool signal_qnan) {
         if (op1.is_mem())
             op1.fetch();
@@ -0,0 +1,1329 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "ftl/irbuf.h"
+
+#include <tuple>
+
+namespace ftl {
+
+    typedef void (func::*jcc_fn)(label&, bool);
+    typedef void (func::*setcc_fn)(value&);
+
+    static const jcc_fn jcc_fns[] = {
+        &func::gen_jo,  &func::gen_jno, &func::gen_jb,  &func::gen_jae,
+        &func::gen_jz,  &func::gen_jnz, &func::gen_jbe, &func::gen_ja,
+        &func::gen_js,  &func::gen_jns, &func::gen_jp,  &func::gen_jnp,
+        &func::gen_jl,  &func::gen_jge, &func::gen_jle, &func::gen_jg,
+    };
+
+    static const setcc_fn setcc_fns[] = {
+        &func::gen_seto,  &func::gen_setno, &func::gen_setb,  &func::gen_setae,
+        &func::gen_setz,  &func::gen_setnz, &func::gen_setbe, &func::gen_seta,
+        &func::gen_sets,  &func::gen_setns, &func::gen_setp,  &func::gen_setnp,
+        &func::gen_setl,  &func::gen_setge, &func::gen_setle, &func::gen_setg,
+    };
+
+    static bool writes_flags(ir_opcode op) {
+        switch (op) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_IMUL:
+        case IR_UDIV:
+        case IR_IDIV:
+        case IR_UMOD:
+        case IR_IMOD:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_SHA:
+        case IR_NEG:
+        case IR_CMP:
+        case IR_TST:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool is_division(ir_opcode op) {
+        return op == IR_UDIV || op == IR_IDIV || op == IR_UMOD ||
+               op == IR_IMOD;
+    }
+
+    static bool is_boundary(ir_opcode op) {
+        switch (op) {
+        case IR_LABEL:
+        case IR_JMP:
+        case IR_JCC:
+        case IR_RET:
+        case IR_CALL:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool is_shift(ir_opcode op) {
+        return op == IR_SHL || op == IR_SHR || op == IR_SHA;
+    }
+
+    static bool is_unary(ir_opcode op) {
+        return op == IR_NOT || op == IR_NEG;
+    }
+
+    static i64 sext(u64 val, int bits) {
+        if (bits >= 64)
+            return (i64)val;
+        return (i64)(val << (64 - bits)) >> (64 - bits);
+    }
+
+    static u64 zext(u64 val, int bits) {
+        if (bits >= 64)
+            return val;
+        return val & ((1ull << bits) - 1);
+    }
+
+    static bool overlaps(const value* a, const value* b) {
+        if (!a->is_global() || !b->is_global())
+            return false;
+        return a->addr < b->addr + b->bits / 8 &&
+               b->addr < a->addr + a->bits / 8;
+    }
+
+    static bool fold(ir_opcode op, int bits, i64 x, i64 y, i64& res) {
+        const int mask = bits == 64 ? 63 : 31;
+        const int n = (int)(y & mask);
+        u64 a = x, b = y, r = 0;
+
+        switch (op) {
+        case IR_ADD:  r = a + b; break;
+        case IR_SUB:  r = a - b; break;
+        case IR_AND:  r = a & b; break;
+        case IR_OR:   r = a | b; break;
+        case IR_XOR:  r = a ^ b; break;
+        case IR_IMUL: r = a * b; break;
+        case IR_NOT:  r = ~a; break;
+        case IR_NEG:  r = -a; break;
+        case IR_SHL:  r = n >= bits ? 0 : a << n; break;
+        case IR_SHR:  r = n >= bits ? 0 : zext(a, bits) >> n; break;
+        case IR_SHA:  r = sext(a, bits) >> min(n, bits - 1); break;
+
+        case IR_UDIV:
+        case IR_UMOD:
+            a = zext(a, bits);
+            b = zext(b, bits);
+            if (b == 0)
+                return false;
+            r = op == IR_UDIV ? a / b : a % b;
+            break;
+
+        case IR_IDIV:
+        case IR_IMOD:
+            x = sext(a, bits);
+            y = sext(b, bits);
+            if (y == 0 || (y == -1 && x == sext(1ull << (bits - 1), bits)))
+                return false; // leave the trap to the host
+            if (y == -1)
+                r = op == IR_IDIV ? -a : 0;
+            else
+                r = op == IR_IDIV ? x / y : x % y;
+            break;
+
+        default:
+            return false;
+        }
+
+        res = sext(r, bits);
+        return true;
+    }
+
+    static bool encode_immop(ir_opcode op, int bits, i64 val, i64& imm) {
+        switch (op) {
+        case IR_MOV:
+            imm = val;
+            return true;
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_CMP:
+        case IR_TST:
+            imm = val;
+            return fits_i32(val);
+
+        case IR_IMUL:
+            imm = val;
+            return encode_size(val) <= bits;
+
+        case IR_IDIV:
+        case IR_IMOD:
+            imm = val;
+            return val != 0 && encode_size(val) <= bits;
+
+        case IR_UDIV:
+        case IR_UMOD:
+            imm = zext(val, bits);
+            return imm != 0;
+
+        case IR_SHL:
+        case IR_SHR:
+        case IR_SHA:
+            imm = val & (bits == 64 ? 63 : 31);
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    ir_insn& irbuf::append(ir_opcode op, value* dest) {
+        FTL_ERROR_ON(dest && dest->is_dead(), "operation on dead value");
+
+        ir_insn insn;
+        insn.op = op;
+        insn.cc = IR_O;
+        insn.immop = false;
+        insn.flags = true;
+        insn.dest = dest;
+        insn.src = nullptr;
+        insn.imm = 0;
+
+        m_code.push_back(insn);
+        return m_code.back();
+    }
+
+    ir_insn& irbuf::append(ir_opcode op, value* dest, const value& src) {
+        FTL_ERROR_ON(src.is_dead(), "operation on dead value");
+        ir_insn& insn = append(op, dest);
+        insn.src = &src;
+        return insn;
+    }
+
+    ir_insn& irbuf::append(ir_opcode op, value* dest, i64 imm) {
+        ir_insn& insn = append(op, dest);
+        insn.immop = true;
+        insn.imm = imm;
+        return insn;
+    }
+
+    void irbuf::record_call(value* result, const ir_call& call) {
+        for (const value* arg : call.uses)
+            FTL_ERROR_ON(arg->is_dead(), "operation on dead value");
+
+        ir_insn& insn = append(IR_CALL, result);
+        insn.call = m_calls.size();
+        m_calls.push_back(call);
+    }
+
+    void irbuf::analyze_flags() {
+        bool live = true; // conservative, code after us might use them
+        for (size_t i = m_code.size(); i-- > 0;) {
+            ir_insn& insn = m_code[i];
+            insn.flags = live;
+
+            switch (insn.op) {
+            case IR_LABEL:
+            case IR_JMP:
+            case IR_JCC:
+            case IR_SETCC:
+                live = true;
+                break;
+
+            case IR_CALL:
+            case IR_RET:
+                live = false;
+                break;
+
+            default:
+                if (writes_flags(insn.op))
+                    live = false;
+                break;
+            }
+        }
+    }
+
+    void irbuf::number_values() {
+        // value numbering: every value is mapped to a number that identifies
+        // its contents; equal numbers mean equal contents at that point
+        struct vninfo {
+            bool known;
+            i64  val;
+            int  bits;
+        };
+
+        typedef std::tuple<int, int, u32, u32> expr;
+        const u32 NONE = ~0u;
+
+        vector<vninfo> info;
+        vector<std::pair<const value*, u32>> bindings;
+        map<std::pair<i64, int>, u32> consts;
+        map<expr, u32> exprs;
+
+        const bool memopt = m_passes & IR_MEMOPT;
+        const bool dofold = m_passes & IR_FOLD;
+        const bool docopy = m_passes & IR_COPYPROP;
+        const bool docse  = m_passes & IR_CSE;
+
+        auto tracked = [&](const value* v) -> bool {
+            return memopt || !v->is_global();
+        };
+
+        auto fresh = [&](int bits) -> u32 {
+            info.push_back({ false, 0, bits });
+            return info.size() - 1;
+        };
+
+        auto constant = [&](i64 val, int bits) -> u32 {
+            val = sext(val, bits);
+            auto it = consts.find(std::make_pair(val, bits));
+            if (it != consts.end())
+                return it->second;
+
+            info.push_back({ true, val, bits });
+            return consts[std::make_pair(val, bits)] = info.size() - 1;
+        };
+
+        auto find = [&](const value* v) -> u32 {
+            for (auto& b : bindings)
+                if (b.first == v)
+                    return b.second;
+            return NONE;
+        };
+
+        auto number = [&](const value* v) -> u32 {
+            u32 n = find(v);
+            if (n != NONE)
+                return n;
+
+            n = fresh(v->bits);
+            if (tracked(v))
+                bindings.push_back(std::make_pair(v, n));
+            return n;
+        };
+
+        auto leader = [&](u32 n, const value* except) -> const value* {
+            for (auto& b : bindings)
+                if (b.second == n && b.first != except)
+                    return b.first;
+            return nullptr;
+        };
+
+        auto unbind = [&](const value* v) -> void {
+            bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+                [v](const std::pair<const value*, u32>& b) -> bool {
+                    return b.first == v || overlaps(b.first, v);
+            }), bindings.end());
+        };
+
+        auto define = [&](const value* v, u32 n) -> void {
+            unbind(v);
+            if (tracked(v))
+                bindings.push_back(std::make_pair(v, n));
+        };
+
+        auto propagate = [&](ir_insn& insn, u32 n) -> void {
+            const value* h = leader(n, nullptr);
+            if (docopy && h && h != insn.src && h->bits == insn.src->bits)
+                insn.src = h;
+        };
+
+        for (ir_insn& insn : m_code) {
+            value* dest = insn.dest;
+
+            switch (insn.op) {
+            case IR_NOP:
+                break;
+
+            case IR_LABEL:
+            case IR_JMP:
+            case IR_RET:
+                bindings.clear();
+                break;
+
+            case IR_JCC:
+                // scratch values do not survive branches
+                bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+                    [](const std::pair<const value*, u32>& b) -> bool {
+                        return b.first->is_scratch();
+                }), bindings.end());
+                break;
+
+            case IR_CALL:
+                bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+                    [](const std::pair<const value*, u32>& b) -> bool {
+                        return b.first->is_global() || b.first->is_scratch();
+                }), bindings.end());
+                if (dest != nullptr)
+                    define(dest, fresh(dest->bits));
+                break;
+
+            case IR_FREE:
+                unbind(dest);
+                break;
+
+            case IR_SETCC:
+                define(dest, fresh(dest->bits));
+                break;
+
+            case IR_CMP:
+            case IR_TST:
+                if (!insn.immop) {
+                    u32 n = number(insn.src);
+                    propagate(insn, n);
+                    if (dofold && info[n].known &&
+                        insn.src->bits == dest->bits &&
+                        encode_immop(insn.op, dest->bits, info[n].val,
+                                     insn.imm)) {
+                        insn.immop = true;
+                    }
+                }
+                break;
+
+            case IR_MOV: {
+                u32 n;
+                if (insn.immop) {
+                    n = constant(insn.imm, dest->bits);
+                } else {
+                    u32 s = number(insn.src);
+                    propagate(insn, n = s);
+
+                    if (insn.src->bits != dest->bits) {
+                        n = fresh(dest->bits);
+                    } else if (dofold && !insn.flags && info[s].known) {
+                        insn.immop = true;
+                        insn.imm = info[s].val;
+                    }
+                }
+
+                if (docopy && tracked(dest) && find(dest) == n) {
+                    insn.op = IR_NOP; // already holds that value
+                    break;
+                }
+
+                define(dest, n);
+                break;
+            }
+
+            default: {
+                const int bits = dest->bits;
+                u32 a = number(dest);
+                u32 b = NONE;
+
+                if (is_unary(insn.op)) {
+                    b = NONE;
+                } else if (insn.immop) {
+                    b = constant(insn.imm, is_shift(insn.op) ? 64 : bits);
+                } else {
+                    b = number(insn.src);
+                    propagate(insn, b);
+
+                    bool width = is_shift(insn.op) || insn.src->bits == bits;
+                    i64 imm = 0;
+                    if (dofold && !insn.flags && width && info[b].known &&
+                        encode_immop(insn.op, bits, info[b].val, imm)) {
+                        insn.immop = true;
+                        insn.imm = imm;
+                        b = constant(imm, is_shift(insn.op) ? 64 : bits);
+                    } else if (!width) {
+                        define(dest, fresh(bits));
+                        break;
+                    }
+                }
+
+                u32 n = NONE;
+                i64 res = 0;
+                if (info[a].known && (b == NONE || info[b].known) &&
+                    fold(insn.op, bits, info[a].val,
+                         b == NONE ? 0 : info[b].val, res)) {
+                    n = constant(res, bits);
+                } else {
+                    expr e = std::make_tuple((int)insn.op, bits, a, b);
+                    auto it = exprs.find(e);
+                    if (it != exprs.end() && docse)
+                        n = it->second;
+                    else
+                        n = exprs[e] = fresh(bits);
+                }
+
+                if (!insn.flags && info[n].known && (dofold || docse)) {
+                    insn.op = IR_MOV;
+                    insn.immop = true;
+                    insn.imm = info[n].val;
+                } else if (!insn.flags && docse) {
+                    const value* h = leader(n, dest);
+                    if (h != nullptr) {
+                        insn.op = IR_MOV;
+                        insn.immop = false;
+                        insn.src = h;
+                    }
+                }
+
+                define(dest, n);
+                break;
+            }
+            }
+        }
+    }
+
+    void irbuf::eliminate_dead_code() {
+        // values in 'dead' are overwritten or freed before being read again
+        // past a return, all locals and scratch values not in 'live' are dead
+        set<const value*> dead;
+        set<const value*> live;
+        bool exiting = false;
+        bool flags = true;
+
+        auto removable = [&](const value* v) -> bool {
+            if (v->is_global())
+                return (m_passes & IR_MEMOPT) && dead.count(v) > 0;
+            return dead.count(v) > 0 || (exiting && !live.count(v));
+        };
+
+        auto kill = [&](const value* v) -> void {
+            dead.insert(v);
+            live.erase(v);
+        };
+
+        auto use = [&](const value* v) -> void {
+            for (auto it = dead.begin(); it != dead.end();) {
+                if (*it == v || overlaps(*it, v))
+                    it = dead.erase(it);
+                else
+                    ++it;
+            }
+
+            live.insert(v);
+        };
+
+        auto barrier = [&](bool exit) -> void {
+            dead.clear();
+            live.clear();
+            exiting = exit;
+        };
+
+        for (size_t i = m_code.size(); i-- > 0;) {
+            ir_insn& insn = m_code[i];
+            value* dest = insn.dest;
+
+            switch (insn.op) {
+            case IR_NOP:
+                break;
+
+            case IR_LABEL:
+            case IR_JMP:
+            case IR_JCC:
+                barrier(false);
+                flags = true;
+                break;
+
+            case IR_CALL:
+                barrier(false);
+                flags = false;
+                break;
+
+            case IR_RET:
+                barrier(true);
+                flags = false;
+                if (dest != nullptr)
+                    use(dest);
+                break;
+
+            case IR_FREE:
+                kill(dest);
+                break;
+
+            case IR_SETCC:
+                if (removable(dest)) {
+                    insn.op = IR_NOP;
+                    break;
+                }
+
+                kill(dest);
+                flags = true;
+                break;
+
+            case IR_MOV:
+                if (removable(dest)) {
+                    insn.op = IR_NOP;
+                    break;
+                }
+
+                kill(dest);
+                if (!insn.immop)
+                    use(insn.src);
+                break;
+
+            case IR_CMP:
+            case IR_TST:
+                if (!flags) {
+                    insn.op = IR_NOP;
+                    break;
+                }
+
+                flags = false;
+                use(dest);
+                if (!insn.immop)
+                    use(insn.src);
+                break;
+
+            default:
+                if (removable(dest) && !(writes_flags(insn.op) && flags)) {
+                    insn.op = IR_NOP;
+                    break;
+                }
+
+                if (writes_flags(insn.op))
+                    flags = false;
+                use(dest);
+                if (!insn.immop && insn.src != nullptr)
+                    use(insn.src);
+                break;
+            }
+        }
+    }
+
+    struct ir_access {
+        const value* reads[2];
+        const value* write;
+    };
+
+    static ir_access accesses(const ir_insn& insn) {
+        ir_access acc = { { nullptr, nullptr }, nullptr };
+        const value* src = insn.immop ? nullptr : insn.src;
+
+        switch (insn.op) {
+        case IR_MOV:
+            acc.reads[0] = src;
+            acc.write = insn.dest;
+            break;
+
+        case IR_SETCC:
+        case IR_FREE:
+            acc.write = insn.dest;
+            break;
+
+        case IR_CMP:
+        case IR_TST:
+            acc.reads[0] = insn.dest;
+            acc.reads[1] = src;
+            break;
+
+        default:
+            acc.reads[0] = insn.dest;
+            acc.reads[1] = is_unary(insn.op) ? nullptr : src;
+            acc.write = insn.dest;
+            break;
+        }
+
+        return acc;
+    }
+
+    static bool conflicts(const value* a, const value* b) {
+        return a != nullptr && b != nullptr && (a == b || overlaps(a, b));
+    }
+
+    static bool reads(const ir_access& acc, const value* v) {
+        return conflicts(acc.reads[0], v) || conflicts(acc.reads[1], v);
+    }
+
+    static bool reads_memory(const ir_access& acc) {
+        return (acc.reads[0] && acc.reads[0]->is_global()) ||
+               (acc.reads[1] && acc.reads[1]->is_global());
+    }
+
+    static ir_unit unit_of(const ir_insn& insn, const ir_access& acc) {
+        switch (insn.op) {
+        case IR_SHL:
+        case IR_SHR:
+        case IR_SHA:
+            return IR_UNIT_SHIFT;
+
+        case IR_IMUL:
+            return IR_UNIT_MUL;
+
+        case IR_UDIV:
+        case IR_IDIV:
+        case IR_UMOD:
+        case IR_IMOD:
+            return IR_UNIT_DIV;
+
+        case IR_MOV:
+            if (reads_memory(acc))
+                return IR_UNIT_LOAD;
+            if (insn.dest->is_global())
+                return IR_UNIT_STORE;
+            return IR_UNIT_ALU;
+
+        case IR_FREE:
+            return IR_NUNITS; // does not execute anything
+
+        default:
+            return IR_UNIT_ALU;
+        }
+    }
+
+    struct ir_node {
+        ir_access acc;
+        ir_unit   unit;
+        bool      load;  // needs a load port besides its own unit
+        bool      store; // needs a store port besides its own unit
+        u32       latency;
+        u64       height;
+        u64       ready;
+        size_t    npreds;
+        vector<std::pair<size_t, u32>> succs;
+    };
+
+    void irbuf::schedule(size_t lo, size_t hi) {
+        // list scheduling of the straight-line block [lo, hi): operations
+        // are issued cycle by cycle according to the host model, preferring
+        // those with the longest latency path to the end of the block
+        const size_t n = hi - lo;
+        if (n < 2)
+            return;
+
+        vector<ir_node> nodes(n);
+        for (size_t i = 0; i < n; i++) {
+            ir_node& node = nodes[i];
+            const ir_insn& insn = m_code[lo + i];
+
+            node.acc = accesses(insn);
+            node.unit = unit_of(insn, node.acc);
+            node.load = node.unit != IR_UNIT_LOAD && reads_memory(node.acc);
+            node.store = node.unit != IR_UNIT_STORE && node.acc.write &&
+                         node.acc.write->is_global();
+            node.latency = node.unit < IR_NUNITS ?
+                           m_model.latency[node.unit] : 0;
+            if (node.load)
+                node.latency += m_model.latency[IR_UNIT_LOAD];
+            node.height = 0;
+            node.ready = 0;
+            node.npreds = 0;
+        }
+
+        auto edge = [&](size_t from, size_t to, u32 latency) -> void {
+            nodes[from].succs.push_back(std::make_pair(to, latency));
+            nodes[to].npreds++;
+        };
+
+        // data dependencies, memory is only touched through globals
+        for (size_t j = 1; j < n; j++) {
+            const ir_access& b = nodes[j].acc;
+            for (size_t i = 0; i < j; i++) {
+                const ir_access& a = nodes[i].acc;
+                if (a.write && reads(b, a.write))
+                    edge(i, j, nodes[i].latency);
+                else if (b.write && (reads(a, b.write) ||
+                                     conflicts(a.write, b.write)))
+                    edge(i, j, 0);
+            }
+        }
+
+        // flag dependencies: nothing may move into the range between a
+        // flag producer and its consumers, and operations that were in there
+        // already (e.g. moves) must stay there
+        for (size_t d = 0; d < n; d++) {
+            const ir_insn& def = m_code[lo + d];
+            if (!writes_flags(def.op) || !def.flags)
+                continue;
+
+            vector<size_t> users;
+            size_t end = d + 1;
+            for (; end < n && !writes_flags(m_code[lo + end].op); end++)
+                if (m_code[lo + end].op == IR_SETCC)
+                    users.push_back(end);
+
+            bool liveout = end == n && m_code[hi - 1].flags;
+            if (!liveout && users.empty())
+                continue;
+
+            size_t last = liveout ? n : users.back() + 1;
+            for (size_t x = 0; x < n; x++) {
+                if (x == d || m_code[lo + x].op == IR_FREE)
+                    continue;
+
+                if (x < d) {
+                    edge(x, d, 0);
+                } else if (x < last) {
+                    edge(d, x, nodes[d].latency);
+                    for (size_t u : users)
+                        if (u > x)
+                            edge(x, u, 0);
+                } else {
+                    edge(users.back(), x, 0);
+                }
+            }
+        }
+
+        // all edges point forward, so heights can be computed backwards
+        for (size_t i = n; i-- > 0;) {
+            ir_node& node = nodes[i];
+            node.height = node.latency;
+            for (auto& s : node.succs) {
+                u64 h = s.second + nodes[s.first].height;
+                node.height = max(node.height, h);
+            }
+        }
+
+        vector<size_t> ready;
+        vector<size_t> order;
+        order.reserve(n);
+
+        for (size_t i = 0; i < n; i++)
+            if (nodes[i].npreds == 0)
+                ready.push_back(i);
+
+        for (u64 cycle = 0; order.size() < n; cycle++) {
+            u32 used[IR_NUNITS] = { 0 };
+            u32 issued = 0;
+
+            auto fits = [&](const ir_node& node) -> bool {
+                if (node.unit == IR_NUNITS)
+                    return true;
+                if (issued >= m_model.width)
+                    return false;
+                if (used[node.unit] >= m_model.ports[node.unit])
+                    return false;
+                if (node.load &&
+                    used[IR_UNIT_LOAD] >= m_model.ports[IR_UNIT_LOAD])
+                    return false;
+                if (node.store &&
+                    used[IR_UNIT_STORE] >= m_model.ports[IR_UNIT_STORE])
+                    return false;
+                return true;
+            };
+
+            while (true) {
+                size_t best = n;
+                size_t slot = 0;
+                for (size_t k = 0; k < ready.size(); k++) {
+                    size_t i = ready[k];
+                    if (nodes[i].ready > cycle || !fits(nodes[i]))
+                        continue;
+                    if (best == n || nodes[i].height > nodes[best].height ||
+                        (nodes[i].height == nodes[best].height && i < best)) {
+                        best = i;
+                        slot = k;
+                    }
+                }
+
+                if (best == n)
+                    break;
+
+                ir_node& node = nodes[best];
+                ready.erase(ready.begin() + slot);
+                order.push_back(best);
+
+                if (node.unit < IR_NUNITS) {
+                    used[node.unit]++;
+                    issued++;
+                }
+
+                if (node.load)
+                    used[IR_UNIT_LOAD]++;
+                if (node.store)
+                    used[IR_UNIT_STORE]++;
+
+                for (auto& s : node.succs) {
+                    ir_node& succ = nodes[s.first];
+                    succ.ready = max(succ.ready, cycle + s.second);
+                    if (--succ.npreds == 0)
+                        ready.push_back(s.first);
+                }
+            }
+
+            // skip cycles in which nothing can be issued anyway
+            if (issued == 0 && !ready.empty()) {
+                u64 next = ~0ull;
+                for (size_t i : ready)
+                    next = min(next, nodes[i].ready);
+                if (next > cycle + 1)
+                    cycle = next - 1;
+            }
+        }
+
+        vector<ir_insn> block;
+        block.reserve(n);
+        for (size_t i : order)
+            block.push_back(m_code[lo + i]);
+        std::copy(block.begin(), block.end(), m_code.begin() + lo);
+    }
+
+    void irbuf::schedule() {
+        analyze_flags();
+
+        size_t lo = 0;
+        for (size_t i = 0; i <= m_code.size(); i++) {
+            if (i == m_code.size() || is_boundary(m_code[i].op)) {
+                schedule(lo, i);
+                lo = i + 1;
+            }
+        }
+    }
+
+    void irbuf::plan_registers() {
+        map<const label*, u64> heads;
+        vector<std::pair<u64, u64>> loops;
+
+        m_plan.clear();
+        for (u64 pos = 0; pos < m_code.size(); pos++) {
+            const ir_insn& insn = m_code[pos];
+
+            switch (insn.op) {
+            case IR_NOP:
+            case IR_FREE:
+                break;
+
+            case IR_LABEL:
+                heads[insn.target] = pos;
+                break;
+
+            case IR_JMP:
+            case IR_JCC:
+                if (heads.count(insn.target))
+                    loops.push_back(std::make_pair(heads[insn.target], pos));
+                break;
+
+            case IR_RET:
+                if (insn.dest != nullptr) {
+                    m_plan.use(insn.dest, pos);
+                    m_plan.hint(insn.dest, RAX);
+                }
+                break;
+
+            case IR_CALL:
+                m_plan.call(pos);
+                for (const value* arg : m_calls[insn.call].uses)
+                    m_plan.use(arg, pos);
+                if (insn.dest != nullptr) {
+                    m_plan.use(insn.dest, pos);
+                    m_plan.hint(insn.dest, RAX);
+                }
+                break;
+
+            default:
+                m_plan.use(insn.dest, pos);
+                if (!insn.immop && insn.src != nullptr) {
+                    m_plan.use(insn.src, pos);
+                    if (is_shift(insn.op))
+                        m_plan.hint(insn.src, RCX);
+                    if (insn.op == IR_IMUL || is_division(insn.op))
+                        m_plan.hint(insn.dest, RAX);
+                }
+                break;
+            }
+        }
+
+        // twice, so that loops nested inside each other see each other
+        for (int i = 0; i < 2; i++)
+            for (auto& l : loops)
+                m_plan.loop(l.first, l.second);
+    }
+
+    void irbuf::lower(const ir_insn& insn) {
+        func& f = m_func;
+        value& dest = *insn.dest;
+        value& src = const_cast<value&>(*insn.src);
+        const i64 imm = insn.imm;
+
+        switch (insn.op) {
+        case IR_NOP:
+            break;
+
+        case IR_MOV:
+            insn.immop ? f.gen_mov(dest, imm) : f.gen_mov(dest, src);
+            break;
+
+        case IR_ADD:
+            insn.immop ? f.gen_add(dest, (i32)imm) : f.gen_add(dest, src);
+            break;
+
+        case IR_SUB:
+            insn.immop ? f.gen_sub(dest, (i32)imm) : f.gen_sub(dest, src);
+            break;
+
+        case IR_AND:
+            insn.immop ? f.gen_and(dest, (i32)imm) : f.gen_and(dest, src);
+            break;
+
+        case IR_OR:
+            insn.immop ? f.gen_or(dest, (i32)imm) : f.gen_or(dest, src);
+            break;
+
+        case IR_XOR:
+            insn.immop ? f.gen_xor(dest, (i32)imm) : f.gen_xor(dest, src);
+            break;
+
+        case IR_IMUL:
+            insn.immop ? f.gen_imul(dest, imm) : f.gen_imul(dest, src);
+            break;
+
+        case IR_IDIV:
+            insn.immop ? f.gen_idiv(dest, imm) : f.gen_idiv(dest, src);
+            break;
+
+        case IR_UDIV:
+            insn.immop ? f.gen_udiv(dest, zext(imm, dest.bits))
+                       : f.gen_udiv(dest, src);
+            break;
+
+        case IR_IMOD:
+            insn.immop ? f.gen_imod(dest, imm) : f.gen_imod(dest, src);
+            break;
+
+        case IR_UMOD:
+            insn.immop ? f.gen_umod(dest, zext(imm, dest.bits))
+                       : f.gen_umod(dest, src);
+            break;
+
+        case IR_SHL:
+            insn.immop ? f.gen_shl(dest, (u8)imm) : f.gen_shl(dest, src);
+            break;
+
+        case IR_SHR:
+            insn.immop ? f.gen_shr(dest, (u8)imm) : f.gen_shr(dest, src);
+            break;
+
+        case IR_SHA:
+            insn.immop ? f.gen_sha(dest, (u8)imm) : f.gen_sha(dest, src);
+            break;
+
+        case IR_NOT:
+            f.gen_not(dest);
+            break;
+
+        case IR_NEG:
+            f.gen_neg(dest);
+            break;
+
+        case IR_CMP:
+            insn.immop ? f.gen_cmp(dest, (i32)imm) : f.gen_cmp(dest, src);
+            break;
+
+        case IR_TST:
+            insn.immop ? f.gen_tst(dest, (i32)imm) : f.gen_tst(dest, src);
+            break;
+
+        case IR_SETCC:
+            (f.*setcc_fns[insn.cc])(dest);
+            break;
+
+        case IR_LABEL:
+            insn.target->place();
+            break;
+
+        case IR_JMP:
+            f.gen_jmp(*insn.target, imm != 0);
+            break;
+
+        case IR_JCC:
+            (f.*jcc_fns[insn.cc])(*insn.target, imm != 0);
+            break;
+
+        case IR_RET:
+            if (insn.dest != nullptr)
+                f.gen_ret(dest);
+            else if (insn.immop)
+                f.gen_ret(imm);
+            else
+                f.gen_ret();
+            break;
+
+        case IR_CALL:
+            m_calls[insn.call].fn(f);
+            break;
+
+        case IR_FREE:
+            f.free_value(dest);
+            break;
+
+        default:
+            FTL_ERROR("unknown ir opcode %d", (int)insn.op);
+        }
+    }
+
+    size_t irbuf::size() const {
+        return m_code.size() - std::count_if(m_code.begin(), m_code.end(),
+            [](const ir_insn& insn) -> bool {
+                return insn.op == IR_NOP;
+        });
+    }
+
+    // Withdraws the plan from the allocator also when lowering throws, the
+    // plan goes away together with the irbuf.
+    struct plan_guard {
+        alloc& al;
+
+        plan_guard(alloc& a, const regplan<reg>* plan): al(a) {
+            al.set_plan(plan);
+        }
+
+        ~plan_guard() { al.set_plan((const regplan<reg>*)nullptr); }
+    };
+
+    irbuf::irbuf(func& fn, u32 passes):
+        m_func(fn),
+        m_passes(passes),
+        m_model(ir_generic_model),
+        m_code(),
+        m_calls(),
+        m_plan() {
+    }
+
+    irbuf::~irbuf() {
+        if (!m_code.empty() && std::uncaught_exceptions() == 0)
+            FTL_ERROR("%zu operations recorded but never lowered", size());
+    }
+
+    void irbuf::optimize() {
+        if (m_passes & (IR_FOLD | IR_COPYPROP | IR_CSE | IR_DCE))
+            analyze_flags();
+        if (m_passes & (IR_FOLD | IR_COPYPROP | IR_CSE))
+            number_values();
+        if (m_passes & IR_DCE)
+            eliminate_dead_code();
+
+        m_code.erase(std::remove_if(m_code.begin(), m_code.end(),
+            [](const ir_insn& insn) -> bool {
+                return insn.op == IR_NOP;
+        }), m_code.end());
+
+        if (m_passes & IR_SCHED)
+            schedule();
+    }
+
+    void irbuf::set_model(const ir_model& model) {
+        FTL_ERROR_ON(model.width == 0, "host model cannot issue anything");
+        for (u32 unit = 0; unit < IR_NUNITS; unit++)
+            FTL_ERROR_ON(model.ports[unit] == 0, "no ports for unit %u", unit);
+        m_model = model;
+    }
+
+    void irbuf::lower() {
+        optimize();
+        plan_registers();
+
+        {
+            plan_guard guard(m_func.get_alloc(), &m_plan);
+            for (u64 pos = 0; pos < m_code.size(); pos++) {
+                m_plan.advance(pos);
+                lower(m_code[pos]);
+            }
+        }
+
+        m_code.clear();
+        m_calls.clear();
+        m_plan.clear();
+    }
+
+    void irbuf::place(label& l) {
+        append(IR_LABEL, nullptr).target = &l;
+    }
+
+    void irbuf::free_value(value& val) {
+        append(IR_FREE, &val);
+    }
+
+    void irbuf::gen_ret() {
+        append(IR_RET, nullptr);
+    }
+
+    void irbuf::gen_ret(i64 val) {
+        append(IR_RET, nullptr, val);
+    }
+
+    void irbuf::gen_ret(value& val) {
+        append(IR_RET, &val);
+    }
+
+    void irbuf::gen_jmp(label& l, bool far) {
+        ir_insn& insn = append(IR_JMP, nullptr, far ? 1 : 0);
+        insn.target = &l;
+    }
+
+    void irbuf::gen_jcc(ir_cond cc, label& l, bool far) {
+        FTL_ERROR_ON(cc > IR_G, "invalid condition code %d", (int)cc);
+        ir_insn& insn = append(IR_JCC, nullptr, far ? 1 : 0);
+        insn.target = &l;
+        insn.cc = cc;
+    }
+
+    void irbuf::gen_setcc(ir_cond cc, value& dest) {
+        FTL_ERROR_ON(cc > IR_G, "invalid condition code %d", (int)cc);
+        append(IR_SETCC, &dest).cc = cc;
+    }
+
+    void irbuf::gen_mov(value& dest, const value& src) {
+        append(IR_MOV, &dest, src);
+    }
+
+    void irbuf::gen_add(value& dest, const value& src) {
+        append(IR_ADD, &dest, src);
+    }
+
+    void irbuf::gen_sub(value& dest, const value& src) {
+        append(IR_SUB, &dest, src);
+    }
+
+    void irbuf::gen_and(value& dest, const value& src) {
+        append(IR_AND, &dest, src);
+    }
+
+    void irbuf::gen_or(value& dest, const value& src) {
+        append(IR_OR, &dest, src);
+    }
+
+    void irbuf::gen_xor(value& dest, const value& src) {
+        append(IR_XOR, &dest, src);
+    }
+
+    void irbuf::gen_imul(value& dest, const value& src) {
+        append(IR_IMUL, &dest, src);
+    }
+
+    void irbuf::gen_idiv(value& dest, const value& src) {
+        append(IR_IDIV, &dest, src);
+    }
+
+    void irbuf::gen_udiv(value& dest, const value& src) {
+        append(IR_UDIV, &dest, src);
+    }
+
+    void irbuf::gen_imod(value& dest, const value& src) {
+        append(IR_IMOD, &dest, src);
+    }
+
+    void irbuf::gen_umod(value& dest, const value& src) {
+        append(IR_UMOD, &dest, src);
+    }
+
+    void irbuf::gen_cmp(value& op1, const value& op2) {
+        append(IR_CMP, &op1, op2);
+    }
+
+    void irbuf::gen_tst(value& op1, const value& op2) {
+        append(IR_TST, &op1, op2);
+    }
+
+    void irbuf::gen_mov(value& dest, i64 val) {
+        append(IR_MOV, &dest, val);
+    }
+
+    void irbuf::gen_add(value& dest, i32 val) {
+        append(IR_ADD, &dest, (i64)val);
+    }
+
+    void irbuf::gen_sub(value& dest, i32 val) {
+        append(IR_SUB, &dest, (i64)val);
+    }
+
+    void irbuf::gen_and(value& dest, i32 val) {
+        append(IR_AND, &dest, (i64)val);
+    }
+
+    void irbuf::gen_or(value& dest, i32 val) {
+        append(IR_OR, &dest, (i64)val);
+    }
+
+    void irbuf::gen_xor(value& dest, i32 val) {
+        append(IR_XOR, &dest, (i64)val);
+    }
+
+    void irbuf::gen_imul(value& dest, i64 val) {
+        FTL_ERROR_ON(encode_size(val) > dest.bits, "immediate too large");
+        append(IR_IMUL, &dest, val);
+    }
+
+    void irbuf::gen_idiv(value& dest, i64 val) {
+        FTL_ERROR_ON(encode_size(val) > dest.bits, "immediate too large");
+        FTL_ERROR_ON(val == 0, "division by zero");
+        append(IR_IDIV, &dest, val);
+    }
+
+    void irbuf::gen_imod(value& dest, i64 val) {
+        FTL_ERROR_ON(encode_size(val) > dest.bits, "immediate too large");
+        FTL_ERROR_ON(val == 0, "division by zero");
+        append(IR_IMOD, &dest, val);
+    }
+
+    void irbuf::gen_udiv(value& dest, u64 val) {
+        FTL_ERROR_ON(encode_size(val) > dest.bits, "immediate too large");
+        FTL_ERROR_ON(val == 0, "division by zero");
+        append(IR_UDIV, &dest, (i64)val);
+    }
+
+    void irbuf::gen_umod(value& dest, u64 val) {
+        FTL_ERROR_ON(encode_size(val) > dest.bits, "immediate too large");
+        FTL_ERROR_ON(val == 0, "division by zero");
+        append(IR_UMOD, &dest, (i64)val);
+    }
+
+    void irbuf::gen_cmp(value& op1, i32 val) {
+        append(IR_CMP, &op1, (i64)val);
+    }
+
+    void irbuf::gen_tst(value& op1, i32 val) {
+        append(IR_TST, &op1, (i64)val);
+    }
+
+    void irbuf::gen_shl(value& dest, value& src) {
+        append(IR_SHL, &dest, src);
+    }
+
+    void irbuf::gen_shr(value& dest, value& src) {
+        append(IR_SHR, &dest, src);
+    }
+
+    void irbuf::gen_sha(value& dest, value& src) {
+        append(IR_SHA, &dest, src);
+    }
+
+    void irbuf::gen_shl(value& dest, u8 shift) {
+        append(IR_SHL, &dest, (i64)shift);
+    }
+
+    void irbuf::gen_shr(value& dest, u8 shift) {
+        append(IR_SHR, &dest, (i64)shift);
+    }
+
+    void irbuf::gen_sha(value& dest, u8 shift) {
+        append(IR_SHA, &dest, (i64)shift);
+    }
+
+    void irbuf::gen_inc(value& dest) {
+        append(IR_ADD, &dest, (i64)1);
+    }
+
+    void irbuf::gen_dec(value& dest) {
+        append(IR_SUB, &dest, (i64)1);
+    }
+
+    void irbuf::gen_not(value& dest) {
+        append(IR_NOT, &dest);
+    }
+
+    void irbuf::gen_neg(value& dest) {
+        append(IR_NEG, &dest);
+    }
+
+}
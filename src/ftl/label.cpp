@@ -35,7 +35,10 @@ namespace ftl {
         m_fixups(),
         m_buffer(buffer),
         m_alloc(al),
+        m_state(al),
         m_name(name) {
+        if (is_placed())
+            m_state.clear();
     }
 
     label::label(label&& other):
@@ -43,6 +46,7 @@ namespace ftl {
         m_fixups(other.m_fixups),
         m_buffer(other.m_buffer),
         m_alloc(other.m_alloc),
+        m_state(std::move(other.m_state)),
         m_name(other.m_name) {
         other.m_fixups.clear();
     }
@@ -58,12 +62,30 @@ namespace ftl {
             patch();
     }
 
+    void label::merge() {
+        if (m_state.is_valid())
+            m_alloc.merge_state(m_state);
+        else
+            m_alloc.save_state(m_state);
+    }
+
     void label::place(bool flush) {
         FTL_ERROR_ON(m_location, "label '%s' has already been placed", name());
-        if (flush)
-            m_alloc.flush_all_regs();
+
+        if (!m_alloc.is_reachable() && m_state.is_valid())
+            m_alloc.load_state(m_state);
+        else
+            merge();
+
+        // contents known along one edge need not hold along the others
+        m_alloc.forget_known();
+        m_alloc.mark_reachable();
+        m_alloc.get_emitter().barrier();
         m_location = m_buffer.get_code_ptr();
         patch();
+
+        if (flush)
+            m_alloc.flush_all_regs();
     }
 
 }
@@ -0,0 +1,316 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "ftl/lazyflags.h"
+
+namespace ftl {
+
+    typedef void (func::*jcc_fn)(label&, bool);
+    typedef void (func::*setcc_fn)(value&);
+    typedef void (func::*cmov_fn)(value&, const value&);
+
+    static const jcc_fn jcc_fns[] = {
+        &func::gen_jo,  &func::gen_jno, &func::gen_jb,  &func::gen_jae,
+        &func::gen_jz,  &func::gen_jnz, &func::gen_jbe, &func::gen_ja,
+        &func::gen_js,  &func::gen_jns, &func::gen_jp,  &func::gen_jnp,
+        &func::gen_jl,  &func::gen_jge, &func::gen_jle, &func::gen_jg,
+    };
+
+    static const setcc_fn setcc_fns[] = {
+        &func::gen_seto,  &func::gen_setno, &func::gen_setb,  &func::gen_setae,
+        &func::gen_setz,  &func::gen_setnz, &func::gen_setbe, &func::gen_seta,
+        &func::gen_sets,  &func::gen_setns, &func::gen_setp,  &func::gen_setnp,
+        &func::gen_setl,  &func::gen_setge, &func::gen_setle, &func::gen_setg,
+    };
+
+    static const cmov_fn cmov_fns[] = {
+        &func::gen_cmovo,  &func::gen_cmovno, &func::gen_cmovb,
+        &func::gen_cmovae, &func::gen_cmovz,  &func::gen_cmovnz,
+        &func::gen_cmovbe, &func::gen_cmova,  &func::gen_cmovs,
+        &func::gen_cmovns, &func::gen_cmovp,  &func::gen_cmovnp,
+        &func::gen_cmovl,  &func::gen_cmovge, &func::gen_cmovle,
+        &func::gen_cmovg,
+    };
+
+    // Kind slot layout: bits [6:0] hold the amount by which both operands
+    // must be shifted left to place their sign bit at bit 63, bit 7 tells
+    // whether flags come from a subtraction or from an addition.
+    enum : u64 {
+        LAZY_KIND_SHIFT = 0x7f,
+        LAZY_KIND_SUB   = 0x80,
+    };
+
+    static u64 lazy_kind(bool sub, int bits) {
+        return (u64)(64 - bits) | (sub ? LAZY_KIND_SUB : 0);
+    }
+
+    static void check_cond(lazy_cond cc) {
+        FTL_ERROR_ON(cc > LAZY_G || cc == 0xa || cc == 0xb,
+                     "invalid lazy flags condition %u", cc);
+    }
+
+    static void store(func& fn, value& slot, const value& src) {
+        if (slot.is_mem() && src.bits < 32)
+            slot.assign();
+        fn.gen_mov(slot, src);
+    }
+
+    bool lazyflags::host_flags_live() const {
+        emitter& e = m_func.get_emitter();
+        return m_ptr != nullptr &&
+               m_ptr == m_func.get_cbuffer().get_code_ptr() &&
+               m_barriers == e.barriers();
+    }
+
+    bool lazyflags::is_known() const {
+        return m_known && m_barriers == m_func.get_emitter().barriers();
+    }
+
+    void lazyflags::prepare(bool sub, const value& dest) {
+        FTL_ERROR_ON(dest.bits != 8 && dest.bits != 16 && dest.bits != 32 &&
+                     dest.bits != 64, "invalid operand width %d", dest.bits);
+
+        // path merges only happen at labels, so unless one has been placed
+        // the kind slot still holds what we stored last time
+        if (!is_known() || m_sub != sub || m_bits != dest.bits)
+            m_func.gen_mov(m_kind, (i64)lazy_kind(sub, dest.bits));
+
+        m_known = false;
+        m_ptr = nullptr;
+    }
+
+    void lazyflags::produced(bool sub, const value& dest, u8* start) {
+        m_known = true;
+        m_sub = sub;
+        m_bits = dest.bits;
+        m_barriers = m_func.get_emitter().barriers();
+        m_ptr = start ? m_func.get_cbuffer().get_code_ptr() : nullptr;
+    }
+
+    void lazyflags::gen_record(bool sub, value& dest, const value& src) {
+        prepare(sub, dest);
+        store(m_func, m_op1, dest);
+        store(m_func, m_op2, src);
+    }
+
+    void lazyflags::gen_record(bool sub, value& dest, i32 src) {
+        prepare(sub, dest);
+        store(m_func, m_op1, dest);
+        m_func.gen_mov(m_op2, (i64)src);
+    }
+
+    void lazyflags::gen_record_logic(value& dest, u8* start) {
+        // result has already been computed, but the host flags are still
+        // intact, since the store below is a plain move
+        store(m_func, m_op1, dest);
+        produced(false, dest, start);
+    }
+
+    void lazyflags::gen_replay() {
+        value a = m_func.gen_scratch_i64("lazy_op1");
+        value b = m_func.gen_scratch_i64("lazy_op2");
+
+        m_func.gen_mov(a, m_op1);
+        m_func.gen_mov(b, m_op2);
+
+        if (is_known()) {
+            m_func.gen_shl(a, (u8)(64 - m_bits));
+            m_func.gen_shl(b, (u8)(64 - m_bits));
+            if (m_sub)
+                m_func.gen_cmp(a, b);
+            else
+                m_func.gen_add(a, b);
+        } else {
+            emitter& e = m_func.get_emitter();
+            cbuf& buffer = m_func.get_cbuffer();
+            value k = m_func.gen_scratch_i64("lazy_kind", RCX);
+
+            m_func.gen_mov(k, m_kind);
+            m_func.gen_shl(a, k);
+            m_func.gen_shl(b, k);
+
+            // both paths below use the same registers, so that their
+            // allocator state does not need to be reconciled afterwards
+            fixup sub, done;
+            e.tsti(8, k, (i8)LAZY_KIND_SUB);
+            e.jnz(0, &sub);
+            e.addr(64, a, b);
+            e.jmpi(0, &done);
+            patch_jump(sub, buffer.get_code_ptr());
+            e.barrier();
+            e.cmpr(64, a, b);
+            patch_jump(done, buffer.get_code_ptr());
+            e.barrier();
+
+            m_func.free_value(k);
+        }
+
+        m_func.free_value(b);
+        m_func.free_value(a);
+    }
+
+    void lazyflags::gen_flags() {
+        if (host_flags_live())
+            return;
+
+        gen_replay();
+
+        // consumers only ever emit moves, so the flags regenerated here
+        // remain usable until the next flag producing operation
+        m_ptr = m_func.get_cbuffer().get_code_ptr();
+        m_barriers = m_func.get_emitter().barriers();
+    }
+
+    lazyflags::lazyflags(func& fn, value& kind, value& op1, value& op2):
+        m_func(fn),
+        m_kind(kind),
+        m_op1(op1),
+        m_op2(op2),
+        m_known(false),
+        m_sub(false),
+        m_bits(64),
+        m_ptr(nullptr),
+        m_barriers(0) {
+        FTL_ERROR_ON(kind.bits != 64 || op1.bits != 64 || op2.bits != 64,
+                     "lazy flags state slots must be 64 bits wide");
+    }
+
+    lazyflags::~lazyflags() {
+        // nothing to do
+    }
+
+    void lazyflags::invalidate() {
+        m_known = false;
+        m_ptr = nullptr;
+    }
+
+    void lazyflags::gen_add(value& dest, const value& src) {
+        gen_record(false, dest, src);
+        m_func.gen_add(dest, src);
+        produced(false, dest, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_sub(value& dest, const value& src) {
+        gen_record(true, dest, src);
+        m_func.gen_sub(dest, src);
+        produced(true, dest, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_cmp(value& op1, const value& op2) {
+        gen_record(true, op1, op2);
+        m_func.gen_cmp(op1, op2);
+        produced(true, op1, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_and(value& dest, const value& src) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_and(dest, src);
+        gen_record_logic(dest, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_or(value& dest, const value& src) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_or(dest, src);
+        gen_record_logic(dest, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_xor(value& dest, const value& src) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_xor(dest, src);
+        gen_record_logic(dest, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    // func turns some immediates into inc/dec or drops the operation
+    // entirely, in which case the host flags do not match the guest flags
+    void lazyflags::gen_add(value& dest, i32 val) {
+        gen_record(false, dest, val);
+        m_func.gen_add(dest, val);
+        bool live = val != 0 && val != 1 && val != -1;
+        produced(false, dest, live ? m_func.get_cbuffer().get_code_ptr()
+                                   : nullptr);
+    }
+
+    void lazyflags::gen_sub(value& dest, i32 val) {
+        gen_record(true, dest, val);
+        m_func.gen_sub(dest, val);
+        bool live = val != 0 && val != 1 && val != -1;
+        produced(true, dest, live ? m_func.get_cbuffer().get_code_ptr()
+                                  : nullptr);
+    }
+
+    void lazyflags::gen_cmp(value& op1, i32 val) {
+        gen_record(true, op1, val);
+        m_func.gen_cmp(op1, val);
+        produced(true, op1, m_func.get_cbuffer().get_code_ptr());
+    }
+
+    void lazyflags::gen_and(value& dest, i32 val) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_and(dest, val);
+        gen_record_logic(dest, val != -1 ? m_func.get_cbuffer().get_code_ptr()
+                                         : nullptr);
+    }
+
+    void lazyflags::gen_or(value& dest, i32 val) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_or(dest, val);
+        gen_record_logic(dest, val != 0 ? m_func.get_cbuffer().get_code_ptr()
+                                        : nullptr);
+    }
+
+    void lazyflags::gen_xor(value& dest, i32 val) {
+        prepare(false, dest);
+        m_func.gen_mov(m_op2, 0);
+        m_func.gen_xor(dest, val);
+        gen_record_logic(dest, val != 0 ? m_func.get_cbuffer().get_code_ptr()
+                                        : nullptr);
+    }
+
+    void lazyflags::gen_jcc(lazy_cond cc, label& l, bool far) {
+        check_cond(cc);
+        gen_flags();
+        (m_func.*jcc_fns[cc])(l, far);
+        m_ptr = m_func.get_cbuffer().get_code_ptr();
+    }
+
+    void lazyflags::gen_setcc(lazy_cond cc, value& dest) {
+        check_cond(cc);
+        gen_flags();
+        (m_func.*setcc_fns[cc])(dest);
+        m_ptr = m_func.get_cbuffer().get_code_ptr();
+    }
+
+    void lazyflags::gen_cmov(lazy_cond cc, value& dest, const value& src) {
+        check_cond(cc);
+        gen_flags();
+        (m_func.*cmov_fns[cc])(dest, src);
+        m_ptr = m_func.get_cbuffer().get_code_ptr();
+    }
+
+    void lazyflags::gen_flag(lazy_flag flag, value& dest) {
+        static const lazy_cond conds[] = { LAZY_B, LAZY_Z, LAZY_S, LAZY_O };
+        FTL_ERROR_ON(flag > LAZY_OF, "invalid lazy flag %u", flag);
+        gen_setcc(conds[flag], dest);
+    }
+
+}
@@ -40,6 +40,9 @@ std::ostream& operator << (std::ostream& os, const ftl::rm& rm) {
         else           return os << (ftl::reg)rm.r;
     }
 
+    if (rm.is_rip)
+        return os << "[rip:" << (void*)rm.offset << "]";
+
     os << "[" << (ftl::reg)rm.r;
     if (rm.offset) {
         if (rm.offset > 0)
@@ -99,6 +99,7 @@ namespace ftl {
         m_name(nm),
         m_dead(false),
         m_mem(base, offset),
+        m_reg(NXMM),
         bits(bits),
         addr(addr) {
         if (!valid_width(bits))
@@ -111,13 +112,20 @@ namespace ftl {
         m_name(other.m_name),
         m_dead(other.m_dead),
         m_mem(other.m_mem),
+        m_reg(NXMM),
         bits(other.bits),
         addr(other.addr) {
         m_allocator.register_value(this);
 
+        xmm r = other.r();
+        bool dirty = xmm_valid(r) && m_allocator.is_dirty(r);
+
         other.mark_dead();
-        if (other.is_reg())
-            m_allocator.assign(this, other.r());
+        if (xmm_valid(r)) {
+            m_allocator.assign(this, r);
+            if (dirty)
+                m_allocator.mark_dirty(r);
+        }
     }
 
     scalar::~scalar() {
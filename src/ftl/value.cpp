@@ -33,21 +33,20 @@ namespace ftl {
         if (m_mem.is_addressable())
             return m_mem;
 
-        reg base = m_allocator.select();
-        m_allocator.flush(base);
-        m_allocator.get_emitter().movi(64, base, addr);
-        return memop(base, 0);
+        return m_allocator.address(addr);
     }
 
     bool value::is_dirty() const {
         reg curr = r();
         if (!reg_valid(curr))
-            return false;
+            return m_allocator.is_spilled(this);
 
         return m_allocator.is_dirty(curr);
     }
 
     void value::mark_dirty() {
+        forget_known();
+
         reg curr = r();
         if (reg_valid(curr))
             m_allocator.mark_dirty(curr);
@@ -85,12 +84,16 @@ namespace ftl {
         reg curr = r();
         if (reg_valid(curr))
             m_allocator.store(curr);
+        else
+            m_allocator.unspill(this);
     }
 
     void value::flush() {
         reg curr = r();
         if (reg_valid(curr))
             m_allocator.flush(curr);
+        else
+            m_allocator.unspill(this);
     }
 
     value::value(alloc& al, const string& nm, int bits, bool sign, u64 addr,
@@ -98,7 +101,11 @@ namespace ftl {
         m_allocator(al),
         m_name(nm),
         m_dead(false),
+        m_precise(true),
         m_mem(base, offset),
+        m_reg(NREGS),
+        m_kmask(0),
+        m_kbits(0),
         bits(bits),
         sign(sign),
         addr(addr) {
@@ -111,15 +118,30 @@ namespace ftl {
         m_allocator(other.m_allocator),
         m_name(other.m_name),
         m_dead(other.m_dead),
+        m_precise(other.m_precise),
         m_mem(other.m_mem),
+        m_reg(NREGS),
+        m_kmask(other.m_kmask),
+        m_kbits(other.m_kbits),
         bits(other.bits),
         sign(other.sign),
         addr(other.addr) {
         m_allocator.register_value(this);
 
+        if (m_allocator.is_spilled(&other))
+            m_allocator.fetch(&other);
+
+        reg r = other.r();
+        bool dirty = reg_valid(r) && m_allocator.is_dirty(r);
+
         other.mark_dead();
-        if (other.is_reg())
-            m_allocator.assign(this, other.r());
+        if (reg_valid(r)) {
+            m_allocator.assign(this, r);
+            if (dirty)
+                m_allocator.mark_dirty(r);
+        }
+
+        set_known(other.m_kmask, other.m_kbits);
     }
 
     value::~value() {
@@ -135,8 +157,12 @@ namespace ftl {
         if (reg_valid(curr))
             return curr;
 
-        FTL_ERROR_ON(is_scratch(), "attempt to get address of scratch value");
+        if (is_scratch())
+            return m_allocator.fetch(this);
 
+        // taking a register here could clobber another operand, so the
+        // spilled contents go back to memory instead
+        m_allocator.unspill(this);
         return mem();
     }
 
@@ -141,3 +141,113 @@ TEST(call, fp) {
 
     EXPECT_EQ(result, 1337);
 }
+
+static bool frame_aligned() {
+    return ((uintptr_t)__builtin_frame_address(0) & 15) == 0;
+}
+
+i64 test_many(void* bptr, i64 a, i32 b, i16 c, i8 d, u64 e, i64 f, i32 g,
+              u32 h, i64 i, i8 j) {
+    EXPECT_TRUE(frame_aligned());
+    EXPECT_EQ(a, 1);
+    EXPECT_EQ(b, -2);
+    EXPECT_EQ(c, 3);
+    EXPECT_EQ(d, -4);
+    EXPECT_EQ(e, 0x5555555555555555ull);
+    EXPECT_EQ(f, 6);
+    EXPECT_EQ(g, -7);
+    EXPECT_EQ(h, 0x88888888u);
+    EXPECT_EQ(i, 9);
+    EXPECT_EQ(j, -10);
+    return a + b + c + d + f + g + i + j;
+}
+
+TEST(call, stack) {
+    i64 global = 9;
+
+    func code("test", 4 * KiB);
+    value a = code.gen_local_i64("a", 1);
+    value b = code.gen_local_i32("b", -2, argreg(5));
+    value c = code.gen_scratch_i16("c", 3, R11);
+    value d = code.gen_local_i8("d", -4, argreg(1));
+    value g = code.gen_local_i32("g", -7);
+    value i = code.gen_global_i64("i", &global);
+    value ret = code.gen_call(test_many, a, b, c, d, 0x5555555555555555ull,
+                              (i64)6, g, 0x88888888u, i, (i8)-10);
+    code.gen_ret(ret);
+    code.finish();
+
+    EXPECT_EQ(code(), 1 - 2 + 3 - 4 + 6 - 7 + 9 - 10);
+}
+
+f64 test_fpmany(void* bptr, f64 a, f32 b, i64 x, f64 c, f64 d, f64 e, f64 f,
+                f64 g, f64 h, f32 i, f64 j) {
+    EXPECT_TRUE(frame_aligned());
+    EXPECT_EQ(x, 42);
+    EXPECT_FLOAT_EQ(b, 2.5f);
+    EXPECT_FLOAT_EQ(i, 9.5f);
+    return a + b + c + d + e + f + g + h + i + j;
+}
+
+TEST(call, fpstack) {
+    f64 result = 0.0;
+
+    func code("test", 4 * KiB);
+    scalar a = code.gen_local_f64("a", 1.0);
+    scalar b = code.gen_local_f32("b", 2.5f);
+    value  x = code.gen_local_i64("x", 42);
+    scalar j = code.gen_scratch_f64("j", 10.0, XMM0);
+    scalar r = code.gen_global_f64("result", &result);
+    scalar ret = code.gen_call(test_fpmany, a, b, x, 3.0, 4.0, 5.0, 6.0, 7.0,
+                               8.0, 9.5f, j);
+    code.gen_mov(r, ret);
+    code.gen_ret();
+    code.finish();
+
+    code();
+
+    EXPECT_DOUBLE_EQ(result, 1.0 + 2.5 + 3.0 + 4.0 + 5.0 + 6.0 + 7.0 + 8.0 +
+                             9.5 + 10.0);
+}
+
+f32 test_fpret(void* bptr, f32 a, i64 b) {
+    return a * b;
+}
+
+TEST(call, fpret) {
+    f32 result = 0.0f;
+
+    func code("test", 4 * KiB);
+    scalar r = code.gen_global_f32("result", &result);
+    value  b = code.gen_local_i64("b", 4);
+    scalar ret = code.gen_call(test_fpret, 1.5f, b);
+    code.gen_mov(r, ret);
+    code.gen_ret();
+    code.finish();
+
+    code();
+
+    EXPECT_FLOAT_EQ(result, 6.0f);
+}
+
+i64 test_varargs(void* bptr, int n, ...) {
+    va_list args;
+    va_start(args, n);
+
+    f64 sum = 0.0;
+    for (int i = 0; i < n; i++)
+        sum += va_arg(args, f64);
+
+    va_end(args);
+    return (i64)sum;
+}
+
+TEST(call, varargs) {
+    func code("test", 4 * KiB);
+    scalar a = code.gen_local_f64("a", 20.0);
+    value ret = code.gen_call(test_varargs, 3, 1.0, a, 300.0);
+    code.gen_ret(ret);
+    code.finish();
+
+    EXPECT_EQ(code(), 321);
+}
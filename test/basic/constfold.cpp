@@ -0,0 +1,216 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static i64 clobber(void* ptr) {
+    *(u64*)ptr = 99;
+    return 0;
+}
+
+TEST(constfold, arith) {
+    func code("fn");
+
+    value a = code.gen_local_i32("a", 2);
+    value b = code.gen_local_i32("b", 40);
+    EXPECT_TRUE(a.is_const());
+    EXPECT_EQ(a.const_val(), 2);
+
+    code.gen_add(b, a);
+    EXPECT_TRUE(b.is_const());
+    EXPECT_EQ(b.const_val(), 42);
+
+    // shift by a known count must not need rcx
+    code.get_alloc().block(RCX);
+    code.gen_shl(b, a);
+    code.get_alloc().unblock(RCX);
+    EXPECT_TRUE(b.is_const());
+    EXPECT_EQ(b.const_val(), 168);
+
+    code.gen_sub(b, 8);
+    code.gen_xor(b, a);
+    EXPECT_EQ(b.const_val(), 162);
+
+    code.gen_ret(b);
+    code.finish();
+    EXPECT_EQ(code(), 162);
+}
+
+TEST(constfold, lea) {
+    func code("fn");
+
+    value a = code.gen_local_i64("a", 0x12340000);
+    value b = code.gen_local_i64("b");
+
+    u8* start = code.get_cbuffer().get_code_ptr();
+    code.gen_add(b, a, 0x5678);
+    EXPECT_TRUE(b.is_const());
+    EXPECT_EQ(b.const_val(), 0x12345678);
+
+    // a single move of the combined constant instead of a lea
+    EXPECT_EQ(code.get_cbuffer().get_code_ptr() - start, 7);
+
+    code.gen_add(b, b, a);
+    EXPECT_EQ(b.const_val(), 0x24685678);
+
+    code.gen_ret(b);
+    code.finish();
+    EXPECT_EQ(code(), 0x24685678);
+}
+
+TEST(constfold, knownbits) {
+    u64 data = 0x123456789abcdef0;
+
+    func code("fn");
+    value x = code.gen_global_i64("x", &data);
+    EXPECT_EQ(x.known_mask(), 0);
+
+    code.gen_and(x, 0xff0);
+    EXPECT_EQ(x.known_mask(), ~0xff0ull);
+    EXPECT_EQ(x.known_bits(), 0);
+
+    code.gen_or(x, 0xf);
+    EXPECT_EQ(x.known_mask(), ~0xff0ull);
+    EXPECT_EQ(x.known_bits(), 0xf);
+
+    code.gen_shr(x, 4);
+    EXPECT_EQ(x.known_mask(), ~0xffull);
+    EXPECT_EQ(x.known_bits(), 0);
+
+    code.gen_ret(x);
+    code.finish();
+    EXPECT_EQ(code(), 0xef);
+}
+
+TEST(constfold, zxt) {
+    func code("fn");
+
+    value v = code.gen_local_i64("v", 0x1ff);
+    value d = code.gen_local_i64("d");
+    value r = code.gen_local_i64("r", 0);
+    label skip = code.gen_label("skip");
+
+    // only the low byte survives, even though more bits of v are known
+    code.gen_zxt(d, v, 64, 8);
+    EXPECT_TRUE(d.is_const());
+    EXPECT_EQ(d.const_val(), 0xff);
+
+    code.gen_cmp(d, 0xff);
+    code.gen_jne(skip);
+    code.gen_mov(r, 1);
+    skip.place();
+    code.gen_ret(r);
+    code.finish();
+    EXPECT_EQ(code(), 1);
+}
+
+TEST(constfold, branches) {
+    func code("fn");
+
+    value a = code.gen_local_i32("a", 3);
+    value r = code.gen_local_i32("r", 0);
+    label skip = code.gen_label("skip");
+
+    // a branch that is never taken disappears entirely
+    code.gen_cmp(a, 3);
+    u8* start = code.get_cbuffer().get_code_ptr();
+    code.gen_jne(skip);
+    EXPECT_EQ(code.get_cbuffer().get_code_ptr(), start);
+
+    // the moves emitted for folded conditions leave the flags intact
+    code.gen_setz(r);
+    EXPECT_TRUE(r.is_const());
+    EXPECT_EQ(r.const_val(), 1);
+    code.gen_cmovl(r, a);
+    EXPECT_EQ(r.const_val(), 1);
+    code.gen_cmovge(r, a);
+    EXPECT_EQ(r.const_val(), 3);
+
+    code.gen_add(r, 1);
+    skip.place();
+    code.gen_ret(r);
+    code.finish();
+    EXPECT_EQ(code(), 4);
+}
+
+TEST(constfold, invalidate) {
+    u64 data = 1;
+
+    func code("fn");
+    code.set_data_ptr(&data);
+
+    value x = code.gen_global_i64("x", &data);
+    value a = code.gen_local_i64("a", 5);
+    code.gen_mov(x, 7);
+    EXPECT_TRUE(x.is_const());
+
+    // helpers may write globals, but cannot see locals
+    value ret = code.gen_call(clobber);
+    code.free_value(ret);
+    EXPECT_FALSE(x.is_const());
+    EXPECT_TRUE(a.is_const());
+
+    // moving an unknown value makes the target unknown as well
+    code.gen_mov(a, x);
+    EXPECT_FALSE(a.is_const());
+
+    code.gen_mov(a, 5);
+    label l = code.gen_label("l");
+    l.place();
+    EXPECT_FALSE(a.is_const());
+
+    code.gen_add(a, x);
+    code.gen_ret(a);
+    code.finish();
+    EXPECT_EQ(code(), 104);
+}
+
+TEST(constfold, flags) {
+    func code("fn");
+
+    value a = code.gen_local_i32("a", 0xffffffff);
+    value one = code.gen_local_i32("one", 1);
+    value d = code.gen_local_i32("d");
+    value r = code.gen_local_i32("r", 0);
+
+    // adding two known values must still produce the carry
+    code.gen_add(d, a, one);
+    code.gen_setb(r);
+    code.gen_ret(r);
+    code.finish();
+    EXPECT_EQ(code(), 1);
+}
+
+TEST(constfold, scalar) {
+    func code("fn");
+
+    scalar s = code.gen_local_f32("s", 1.5f);
+    value v = code.gen_local_i64("v");
+
+    // widening zeroes v first, which must not remain known afterwards
+    code.gen_mov(v, s);
+    EXPECT_FALSE(v.is_const());
+
+    code.gen_ret(v);
+    code.finish();
+    EXPECT_EQ(code(), 0x3fc00000);
+}
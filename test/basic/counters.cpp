@@ -0,0 +1,150 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+TEST(counters, encoding) {
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    const u8* ptr = code.get_code_ptr();
+
+    const u8 expect[] = {
+        0x0f, 0x31,       // rdtsc
+        0x0f, 0x01, 0xf9, // rdtscp
+        0x0f, 0x33,       // rdpmc
+    };
+
+    size_t len = 0;
+    len += emitter.rdtsc();
+    len += emitter.rdtscp();
+    len += emitter.rdpmc();
+
+    ASSERT_EQ(len, sizeof(expect));
+    EXPECT_EQ(memcmp(ptr, expect, sizeof(expect)), 0);
+}
+
+TEST(counters, rdtsc) {
+    u64 stamps[2] = { 0, 0 };
+
+    func code("rdtsc");
+    value a = code.gen_global_i64("a", &stamps[0]);
+    value b = code.gen_global_i64("b", &stamps[1]);
+    value x = code.gen_local_i32("x", 42, RDX);
+    code.gen_rdtsc(a);
+    code.gen_rdtsc(b);
+    code.gen_ret(x);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), 42);
+    EXPECT_NE(stamps[0], 0);
+    EXPECT_GE(stamps[1], stamps[0]);
+}
+
+TEST(counters, rdtscp) {
+    for (isa_level level : { ISA_BASELINE, ISA_NATIVE }) {
+        cpuinfo::instance().set_level(level);
+
+        u64 stamp = 0;
+        u64 aux = ~0ull;
+
+        func code("rdtscp");
+        value t = code.gen_global_i64("t", &stamp);
+        value a = code.gen_global_i64("aux", &aux);
+        value x = code.gen_local_i64("x", 7, RCX);
+        code.gen_rdtscp(t, a);
+        code.gen_ret(x);
+        code.finish();
+
+        EXPECT_EQ(code.exec(), 7);
+        EXPECT_NE(stamp, 0);
+        EXPECT_LT(aux, 1ull << 32);
+        if (!cpu_has(CPU_RDTSCP))
+            EXPECT_EQ(aux, 0);
+    }
+
+    cpuinfo::instance().reset();
+}
+
+TEST(counters, rdpmc) {
+    func code("rdpmc");
+    value t = code.gen_local_i64("t");
+    value c = code.gen_local_i32("c", 1, RAX);
+    code.gen_rdpmc(t, c);
+    code.gen_rdpmc(t, 0);
+    code.finish();
+
+    // rdpmc faults unless the kernel grants user access, so only check
+    // that the counter index ends up in ecx
+    const u8* ptr = (const u8*)code.entry();
+    const u8* end = ptr + code.size();
+    const u8 rdpmc[] = { 0x0f, 0x33 };
+    EXPECT_NE(std::search(ptr, end, rdpmc, rdpmc + 2), end);
+}
+
+TEST(counters, pinned) {
+    struct { u64 stamp; u32 aux; } g = { 0, ~0u };
+    vector<pinned> pins = { { RBX, 64, &g.stamp }, { R12, 32, &g.aux } };
+
+    // results arrive in rax and rcx, pinned values are copied into place
+    cbuf buffer(4 * KiB);
+    func code("pinned", buffer, &g, pins);
+    value t = code.gen_global_i64("stamp", &g.stamp);
+    value a = code.gen_global_i32("aux", &g.aux);
+    code.gen_rdtsc(t);
+    code.gen_rdtscp(t, a);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_NE(g.stamp, 0);
+    EXPECT_NE(g.aux, ~0u);
+    if (!cpu_has(CPU_RDTSCP))
+        EXPECT_EQ(g.aux, 0);
+
+    func pmc("rdpmc", buffer, &g, pins);
+    value p = pmc.gen_global_i64("stamp", &g.stamp);
+    pmc.gen_rdpmc(p, 0);
+    pmc.finish();
+}
+
+TEST(counters, icount_add) {
+    u64 icount = 100;
+    u64 global = 1000;
+
+    func code("icount");
+    value g = code.gen_global_i64("global", &global);
+    value r = code.gen_global_i64("icount", &icount);
+    value x = code.gen_local_i32("x", 3);
+    value z = code.gen_local_i32("z", 0);
+    code.gen_icount_add(g, 5);
+    r.fetch();
+    code.gen_cmp(x, 3);
+    code.gen_icount_add(r, 17);
+    code.gen_icount_add(r, -2);
+    code.gen_setz(z);
+    code.gen_ret(z);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), 1);
+    EXPECT_EQ(icount, 115);
+    EXPECT_EQ(global, 1005);
+}
@@ -0,0 +1,175 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static const isa_level all_levels[] = {
+    ISA_BASELINE, ISA_X86_64_V2, ISA_X86_64_V3, ISA_X86_64_V4, ISA_NATIVE
+};
+
+TEST(cpuinfo, detect) {
+    cpuinfo& cpu = cpuinfo::instance();
+    EXPECT_TRUE(cpu.detected(CPU_SSE2));
+    EXPECT_NE(string(cpu.vendor()), "");
+    EXPECT_STREQ(cpu_feature_name(CPU_POPCNT), "popcnt");
+    EXPECT_STREQ(isa_level_name(ISA_X86_64_V3), "x86-64-v3");
+
+    if (cpu.detected(CPU_AVX2))
+        EXPECT_TRUE(cpu.detected(CPU_AVX));
+    if (cpu.host_level() >= ISA_X86_64_V2)
+        EXPECT_TRUE(cpu.detected(CPU_POPCNT));
+}
+
+TEST(cpuinfo, levels) {
+    cpuinfo& cpu = cpuinfo::instance();
+
+    cpu.set_level(ISA_BASELINE);
+    EXPECT_EQ(cpu.level(), ISA_BASELINE);
+    EXPECT_TRUE(cpu.has(CPU_SSE2));
+    EXPECT_FALSE(cpu.has(CPU_POPCNT));
+    EXPECT_FALSE(cpu.has(CPU_LZCNT));
+    EXPECT_FALSE(cpu.has(CPU_ERMS));
+
+    cpu.set_level(ISA_X86_64_V2);
+    EXPECT_EQ(cpu.has(CPU_POPCNT), cpu.detected(CPU_POPCNT));
+    EXPECT_FALSE(cpu.has(CPU_BMI1));
+
+    cpu.set_level(ISA_X86_64_V3);
+    EXPECT_EQ(cpu.has(CPU_BMI1), cpu.detected(CPU_BMI1));
+    EXPECT_FALSE(cpu.has(CPU_AVX512F));
+    EXPECT_FALSE(cpu.has(CPU_CLWB));
+
+    cpu.set_level(ISA_NATIVE);
+    for (u32 f = 0; f < NFEATURES; f++)
+        EXPECT_EQ(cpu.has((cpu_feature)f), cpu.detected((cpu_feature)f));
+
+    cpu.set_feature(CPU_ERMS, false);
+    EXPECT_FALSE(cpu.has(CPU_ERMS));
+    cpu.set_feature(CPU_ERMS, true);
+    EXPECT_EQ(cpu.has(CPU_ERMS), cpu.detected(CPU_ERMS));
+
+    cpu.reset();
+}
+
+TEST(cpuinfo, overrides) {
+    cpuinfo& cpu = cpuinfo::instance();
+
+    // overrides survive changing the level and mocking other features
+    cpu.set_level(ISA_NATIVE);
+    cpu.mock_feature(CPU_POPCNT, true);
+    cpu.set_feature(CPU_POPCNT, false);
+    cpu.mock_feature(CPU_ERMS, true);
+    cpu.set_feature(CPU_ERMS, true);
+
+    for (isa_level level : all_levels) {
+        cpu.set_level(level);
+        EXPECT_FALSE(cpu.has(CPU_POPCNT)) << isa_level_name(level);
+        EXPECT_TRUE(cpu.has(CPU_ERMS)) << isa_level_name(level);
+    }
+
+    cpu.mock_feature(CPU_CLWB, true);
+    EXPECT_FALSE(cpu.has(CPU_POPCNT));
+    EXPECT_TRUE(cpu.has(CPU_ERMS));
+
+    // features the host lacks cannot be forced on
+    cpu.mock_feature(CPU_ERMS, false);
+    EXPECT_FALSE(cpu.has(CPU_ERMS));
+
+    cpu.reset();
+    cpu.set_level(ISA_NATIVE);
+    EXPECT_EQ(cpu.has(CPU_POPCNT), cpu.detected(CPU_POPCNT));
+    cpu.reset();
+}
+
+TEST(cpuinfo, memops) {
+    u8 src[100], dest[160];
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (u8)(i * 13 + 1);
+
+    for (isa_level level : { ISA_BASELINE, ISA_NATIVE }) {
+        cpuinfo::instance().set_level(level);
+
+        for (u64 n : { 0, 1, 7, 8, 9, 63, 64, 77 }) {
+            memset(dest, 0, sizeof(dest));
+
+            func code("memops");
+            value d = code.gen_local_i64("dest", (i64)dest);
+            value s = code.gen_local_i64("src", (i64)src);
+            value c = code.gen_local_i64("count", n);
+            code.gen_memcpy(d, s, c);
+            code.gen_add(d, 80);
+            value v = code.gen_local_i8("val", 0xc5);
+            code.gen_add(c, -((i32)n / 2));
+            code.gen_memset(d, v, c);
+            code.gen_ret();
+            code.finish();
+            code.exec();
+
+            size_t fill = n - n / 2;
+            EXPECT_EQ(memcmp(dest, src, n), 0) << isa_level_name(level);
+            EXPECT_EQ(dest[n], 0) << isa_level_name(level);
+            for (size_t i = 0; i < fill; i++)
+                EXPECT_EQ(dest[80 + i], 0xc5) << isa_level_name(level);
+            EXPECT_EQ(dest[80 + fill], 0) << isa_level_name(level);
+        }
+    }
+
+    cpuinfo::instance().reset();
+}
+
+TEST(cpuinfo, cacheline) {
+    cpuinfo& cpu = cpuinfo::instance();
+
+    const u8 clflush[]    = { 0x0f, 0xae, 0x3f };       // clflush [rdi]
+    const u8 clflushopt[] = { 0x66, 0x0f, 0xae, 0x3f }; // clflushopt [rdi]
+    const u8 clwb[]       = { 0x66, 0x41, 0x0f, 0xae, 0x71, 0x10 };
+
+    cpu.set_level(ISA_BASELINE);
+
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    const u8* ptr = code.get_code_ptr();
+    ASSERT_EQ(emitter.clflushopt(memop(RDI, 0)), sizeof(clflush));
+    EXPECT_EQ(memcmp(ptr, clflush, sizeof(clflush)), 0);
+    ptr = code.get_code_ptr();
+    ASSERT_EQ(emitter.clwb(memop(RDI, 0)), sizeof(clflush));
+    EXPECT_EQ(memcmp(ptr, clflush, sizeof(clflush)), 0);
+
+    // the code is never run, so the host need not support any of this
+    cpu.set_level(ISA_NATIVE);
+    cpu.mock_feature(CPU_CLFLUSHOPT, true);
+    cpu.mock_feature(CPU_CLWB, false);
+
+    ptr = code.get_code_ptr();
+    ASSERT_EQ(emitter.clflushopt(memop(RDI, 0)), sizeof(clflushopt));
+    EXPECT_EQ(memcmp(ptr, clflushopt, sizeof(clflushopt)), 0);
+    ptr = code.get_code_ptr();
+    ASSERT_EQ(emitter.clwb(memop(RDI, 0)), sizeof(clflushopt));
+    EXPECT_EQ(memcmp(ptr, clflushopt, sizeof(clflushopt)), 0);
+
+    cpu.mock_feature(CPU_CLWB, true);
+    ptr = code.get_code_ptr();
+    ASSERT_EQ(emitter.clwb(memop(R9, 16)), sizeof(clwb));
+    EXPECT_EQ(memcmp(ptr, clwb, sizeof(clwb)), 0);
+
+    cpu.reset();
+}
@@ -0,0 +1,454 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 pc;
+    u64 acc;
+    u64 count;
+};
+
+// pc 0x100: acc += 1, continue at 0x200
+// pc 0x200: acc *= 3, continue at 0x100 until done, then exit
+static const u8* gen_block(dispatcher& d, guest& g, u64 pc) {
+    func code("block", d.get_cbuffer(), &g);
+    value vpc = code.gen_global_i64("pc", &g.pc);
+    value acc = code.gen_global_i64("acc", &g.acc);
+    value cnt = code.gen_global_i64("count", &g.count);
+
+    if (pc == 0x100) {
+        code.gen_add(acc, 1);
+        code.gen_mov(vpc, 0x200);
+        code.gen_dispatch(d);
+    } else if (pc == 0x200) {
+        label done = code.gen_label("done");
+        code.gen_imul(acc, 3);
+        code.gen_mov(vpc, 0x100);
+        code.gen_sub(cnt, 1);
+        code.gen_jz(done);
+        code.gen_dispatch(d);
+        done.place();
+        code.gen_ret(EXIT_USER);
+    } else {
+        return nullptr;
+    }
+
+    code.finish();
+    return code.entry();
+}
+
+static u64 expected(u64 n) {
+    u64 acc = 0;
+    while (n--)
+        acc = (acc + 1) * 3;
+    return acc;
+}
+
+TEST(dispatch, loop) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 1000 };
+    dispatcher d(buffer, &g, &g.pc, 256);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_block(d, g, pc);
+    });
+
+    // blocks chain through the dispatcher without returning to C++
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_USER);
+    EXPECT_EQ(d.misses(), 2);
+    EXPECT_EQ(g.acc, expected(1000));
+    EXPECT_EQ(g.pc, 0x100);
+
+    // the blocks are cached now
+    g.count = 10;
+    g.acc = 0;
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_USER);
+    EXPECT_EQ(d.misses(), 2);
+    EXPECT_EQ(g.acc, expected(10));
+}
+
+TEST(dispatch, miss) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 5 };
+    dispatcher d(buffer, &g, &g.pc);
+
+    // without a translator, misses are left to the caller
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_LOOKUP);
+    EXPECT_EQ(g.pc, 0x100);
+    EXPECT_EQ(d.lookup(0x100), nullptr);
+
+    d.insert(0x100, gen_block(d, g, 0x100));
+    EXPECT_NE(d.lookup(0x100), nullptr);
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_LOOKUP);
+    EXPECT_EQ(g.pc, 0x200);
+    EXPECT_EQ(g.acc, 1);
+
+    d.insert(0x200, gen_block(d, g, 0x200));
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_USER);
+    EXPECT_EQ(g.acc, expected(5));
+
+    // invalidated blocks are looked up again
+    d.remove(0x200);
+    EXPECT_EQ(d.lookup(0x200), nullptr);
+    EXPECT_NE(d.lookup(0x100), nullptr);
+    d.invalidate();
+    EXPECT_EQ(d.lookup(0x100), nullptr);
+}
+
+TEST(dispatch, collision) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 3 };
+    dispatcher d(buffer, &g, &g.pc, 16);
+
+    // 0x100 and 0x200 share a slot in a table with 16 entries
+    d.insert(0x100, gen_block(d, g, 0x100));
+    d.insert(0x200, gen_block(d, g, 0x200));
+    EXPECT_EQ(d.lookup(0x100), nullptr);
+
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_block(d, g, pc);
+    });
+
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_USER);
+    EXPECT_EQ(g.acc, expected(3));
+}
+
+static i64 bump(void* bptr) {
+    guest* g = (guest*)bptr;
+    return g->acc++;
+}
+
+TEST(dispatch, pinned) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 1 };
+    vector<pinned> pins = { { R12, 64, &g.count } };
+    dispatcher d(buffer, &g, &g.pc, pins);
+
+    // pinned state stays in its register while blocks are chained
+    func a("a", buffer, &g, pins);
+    value pc = a.gen_global_i64("pc", &g.pc);
+    value cnt = a.gen_global_i64("count", &g.count);
+    a.gen_add(cnt, 1);
+    a.gen_call(bump);
+    a.gen_mov(pc, 0x200);
+    a.gen_dispatch(d);
+    a.finish();
+    d.insert(0x100, a.entry());
+
+    func b("b", buffer, &g, pins);
+    value cnt2 = b.gen_global_i64("count", &g.count);
+    b.gen_add(cnt2, 10);
+    b.gen_ret(EXIT_USER);
+    b.finish();
+    d.insert(0x200, b.entry());
+
+    EXPECT_EQ(d.run_until(EXIT_USER).reason, EXIT_USER);
+    EXPECT_EQ(g.count, 12);
+    EXPECT_EQ(g.acc, 1);
+}
+
+enum : u32 {
+    EXIT_SYSCALL = EXIT_USER,
+};
+
+TEST(dispatch, stubs) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 0 };
+    dispatcher d(buffer, &g, &g.pc);
+
+    // both blocks exit for the same reason at the same pc
+    func a("a", buffer, &g);
+    value acc = a.gen_global_i64("acc", &g.acc);
+    label other = a.gen_label("other");
+    a.gen_add(acc, 1);
+    a.gen_cmp(acc, 2);
+    a.gen_je(other);
+    a.gen_exit(d, (exit_reason)EXIT_SYSCALL, 0x1234);
+    other.place();
+    a.gen_exit(d, (exit_reason)EXIT_SYSCALL, 0x1234);
+    a.finish();
+
+    func b("b", buffer, &g);
+    b.gen_exit(d, (exit_reason)EXIT_SYSCALL, 0x1234);
+    b.finish();
+
+    EXPECT_EQ(d.stubs(), 1);
+    EXPECT_EQ(d.count_links(), 0);
+
+    d.insert(0x100, a.entry());
+    d.insert(0x200, b.entry());
+
+    exit_info info = d.run_until(EXIT_NONE);
+    EXPECT_EQ(info.reason, EXIT_SYSCALL);
+    EXPECT_EQ(info.pc, 0x1234);
+    EXPECT_EQ(g.acc, 1);
+
+    g.pc = 0x100;
+    info = d.run_until(EXIT_NONE);
+    EXPECT_EQ(info.reason, EXIT_SYSCALL);
+    EXPECT_EQ(info.pc, 0x1234);
+    EXPECT_EQ(g.acc, 2);
+
+    g.pc = 0x200;
+    info = d.run_until(EXIT_NONE);
+    EXPECT_EQ(info.reason, EXIT_SYSCALL);
+    EXPECT_EQ(info.pc, 0x1234);
+}
+
+static const u8* gen_linked(dispatcher& d, guest& g, u64 pc) {
+    func code("linked", d.get_cbuffer(), &g);
+    value acc = code.gen_global_i64("acc", &g.acc);
+    value cnt = code.gen_global_i64("count", &g.count);
+
+    if (pc == 0x100) {
+        code.gen_add(acc, 1);
+        code.gen_exit(d, EXIT_JUMP, 0x200);
+    } else if (pc == 0x200) {
+        label done = code.gen_label("done");
+        code.gen_imul(acc, 3);
+        code.gen_sub(cnt, 1);
+        code.gen_jz(done);
+        code.gen_exit(d, EXIT_JUMP, 0x100);
+        done.place();
+        code.gen_exit(d, EXIT_USER, 0x100);
+    } else {
+        return nullptr;
+    }
+
+    code.finish();
+    return code.entry();
+}
+
+TEST(dispatch, links) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x100, 0, 1000 };
+    dispatcher d(buffer, &g, &g.pc);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_linked(d, g, pc);
+    });
+
+    // 0x100 exits to 0x200 before it exists, 0x200 links back right away
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(info.pc, 0x100);
+    EXPECT_EQ(g.acc, expected(1000));
+    EXPECT_EQ(d.misses(), 2);
+    EXPECT_EQ(d.count_links(), 2);
+    EXPECT_EQ(d.stubs(), 3);
+
+    // removing a block unlinks all jumps to it
+    d.remove(0x200);
+    EXPECT_EQ(d.count_links(), 1);
+
+    g.acc = 0;
+    g.count = 10;
+    info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(g.acc, expected(10));
+    EXPECT_EQ(d.misses(), 3);
+    EXPECT_EQ(d.count_links(), 3);
+
+    d.invalidate();
+    EXPECT_EQ(d.count_links(), 0);
+}
+
+struct cpu {
+    u64 pc;
+    u64 acc;
+    u64 count;
+    u64 lr;
+    retstack rs;
+};
+
+static const u8* gen_guest(dispatcher& d, cpu& c, u64 pc) {
+    func code("guest", d.get_cbuffer(), &c);
+    value vpc = code.gen_global_i64("pc", &c.pc);
+    value acc = code.gen_global_i64("acc", &c.acc);
+    value cnt = code.gen_global_i64("count", &c.count);
+    value lr = code.gen_global_i64("lr", &c.lr);
+    label done = code.gen_label("done");
+
+    switch (pc) {
+    case 0x100: // call 0x1010
+        code.gen_mov(lr, 0x104);
+        code.gen_guest_call(d, 0x1010, 0x104);
+        break;
+
+    case 0x104:
+        code.gen_sub(cnt, 1);
+        code.gen_jz(done);
+        code.gen_exit(d, EXIT_JUMP, 0x100);
+        done.place();
+        code.gen_exit(d, EXIT_USER, 0x104);
+        break;
+
+    case 0x110: // call 0x2020, which skips the next instruction
+        code.gen_mov(lr, 0x114);
+        code.gen_guest_call(d, 0x2020, 0x114);
+        break;
+
+    case 0x118:
+        code.gen_exit(d, (exit_reason)(EXIT_USER + 1), 0x118);
+        break;
+
+    case 0x120: // indirect call 0x1010
+        code.gen_mov(vpc, 0x1010);
+        code.gen_mov(lr, 0x124);
+        code.gen_guest_call(d, 0x124);
+        break;
+
+    case 0x124:
+        code.gen_exit(d, (exit_reason)(EXIT_USER + 2), 0x124);
+        break;
+
+    case 0x204: // shares a lookup table slot with 0x104
+        code.gen_exit(d, (exit_reason)(EXIT_USER + 3), 0x204);
+        break;
+
+    case 0x1010: // acc += 5; ret
+        code.gen_add(acc, 5);
+        code.gen_mov(vpc, lr);
+        code.gen_guest_ret(d);
+        break;
+
+    case 0x2020: // acc += 7; return to lr + 4
+        code.gen_add(acc, 7);
+        code.gen_add(vpc, lr, 4);
+        code.gen_guest_ret(d);
+        break;
+
+    default:
+        return nullptr;
+    }
+
+    code.finish();
+    return code.entry();
+}
+
+TEST(dispatch, returns) {
+    cbuf buffer(16 * KiB);
+    cpu c = { 0x100, 0, 100 };
+    dispatcher d(buffer, &c, &c.pc, 64);
+    d.set_return_stack(&c.rs);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_guest(d, c, pc);
+    });
+
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(info.pc, 0x104);
+    EXPECT_EQ(c.acc, 500);
+    EXPECT_EQ(c.rs.top, 0);
+    EXPECT_EQ(d.misses(), 3);
+
+    // evicting 0x104 from the table does not matter, returns do not need
+    // to look it up anymore
+    d.insert(0x204, gen_guest(d, c, 0x204));
+    EXPECT_EQ(d.lookup(0x104), nullptr);
+
+    c.pc = 0x100;
+    c.count = 10;
+    info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(c.acc, 550);
+    EXPECT_EQ(d.misses(), 3);
+}
+
+TEST(dispatch, mispredict) {
+    cbuf buffer(16 * KiB);
+    cpu c = { 0x110, 0, 0 };
+    dispatcher d(buffer, &c, &c.pc, 64);
+    d.set_return_stack(&c.rs);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_guest(d, c, pc);
+    });
+
+    // returning elsewhere than predicted goes through the lookup table
+    exit_info info = d.run_until(EXIT_NONE);
+    EXPECT_EQ(info.reason, EXIT_USER + 1);
+    EXPECT_EQ(info.pc, 0x118);
+    EXPECT_EQ(c.acc, 7);
+    EXPECT_EQ(c.rs.top, 0);
+
+    // indirect calls push their return address just the same
+    c.pc = 0x120;
+    info = d.run_until(EXIT_NONE);
+    EXPECT_EQ(info.reason, EXIT_USER + 2);
+    EXPECT_EQ(info.pc, 0x124);
+    EXPECT_EQ(c.acc, 12);
+    EXPECT_EQ(c.rs.top, 0);
+}
+
+struct vcpu {
+    u64 pc;
+    u64 acc;
+    atomic<u8> stop;
+};
+
+// pc 0x300: acc += 1, continue at 0x300 forever
+static const u8* gen_spin(dispatcher& d, vcpu& c, u64 pc) {
+    if (pc != 0x300)
+        return nullptr;
+
+    func code("spin", d.get_cbuffer(), &c);
+    value acc = code.gen_global_i64("acc", &c.acc);
+    code.gen_add(acc, 1);
+    code.gen_exit(d, EXIT_JUMP, 0x300);
+    code.finish();
+    return code.entry();
+}
+
+TEST(dispatch, request) {
+    cbuf buffer(16 * KiB);
+    vcpu c;
+    c.pc = 0x300;
+    c.acc = 0;
+
+    dispatcher d(buffer, &c, &c.pc, 64);
+    d.set_exit_flag(&c.stop);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_spin(d, c, pc);
+    });
+
+    // pending requests are served before running any block
+    d.request_exit();
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_REQUEST);
+    EXPECT_EQ(info.pc, 0x300);
+    EXPECT_EQ(c.acc, 0);
+    EXPECT_EQ(c.stop, 0);
+
+    // the block is linked to itself, only the exit flag can stop it
+    std::thread t([&]() -> void {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        d.request_exit();
+    });
+
+    info = d.run_until(EXIT_USER);
+    t.join();
+
+    EXPECT_EQ(info.reason, EXIT_REQUEST);
+    EXPECT_EQ(info.pc, 0x300);
+    EXPECT_GT(c.acc, 0);
+    EXPECT_EQ(c.stop, 0);
+    EXPECT_EQ(d.count_links(), 1);
+}
@@ -0,0 +1,227 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 x;
+    u64 q;
+    u64 r;
+};
+
+static u64 mask(int bits) {
+    return bits == 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+static i64 sext(u64 val, int bits) {
+    u64 sign = 1ull << (bits - 1);
+    return (i64)((val & mask(bits)) ^ sign) - (i64)sign;
+}
+
+static u64 lcg(u64& state) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return state >> 11 | state << 53;
+}
+
+class divtest
+{
+private:
+    cbuf  m_buffer;
+    u8*   m_start;
+    guest m_guest;
+
+public:
+    divtest(): m_buffer(64 * KiB), m_start(nullptr), m_guest() {}
+
+    // computes x / d and x % d for all dividends in xs using a function
+    // that has been generated for the constant divisor d
+    void check(int bits, bool sign, i64 d, const vector<u64>& xs) {
+        if (m_start != nullptr)
+            m_buffer.reset(m_start);
+
+        func code("divmod", m_buffer, &m_guest);
+        if (m_start == nullptr)
+            m_start = code.entry();
+
+        value x = code.gen_global_val("x", bits, &m_guest.x);
+        value q = code.gen_global_val("q", bits, &m_guest.q);
+        value r = code.gen_global_val("r", bits, &m_guest.r);
+
+        code.gen_mov(q, x);
+        code.gen_mov(r, x);
+        if (sign) {
+            code.gen_idiv(q, d);
+            code.gen_imod(r, d);
+        } else {
+            code.gen_udiv(q, (u64)d & mask(bits));
+            code.gen_umod(r, (u64)d & mask(bits));
+        }
+
+        code.gen_ret();
+        code.finish();
+
+        for (u64 val : xs) {
+            m_guest.x = val;
+            m_guest.q = m_guest.r = 0;
+            code.exec();
+
+            u64 quot, rem;
+            if (!sign) {
+                u64 a = val & mask(bits);
+                u64 b = (u64)d & mask(bits);
+                quot = a / b;
+                rem = a % b;
+            } else if (d == -1) {
+                quot = -(u64)val;
+                rem = 0;
+            } else {
+                i64 a = sext(val, bits);
+                quot = a / d;
+                rem = a % d;
+            }
+
+            ASSERT_EQ(m_guest.q, quot & mask(bits)) << (sign ? "i" : "u")
+                << bits << " " << sext(val, bits) << " / " << d;
+            ASSERT_EQ(m_guest.r, rem & mask(bits)) << (sign ? "i" : "u")
+                << bits << " " << sext(val, bits) << " % " << d;
+        }
+    }
+};
+
+static vector<u64> dividends(int bits, i64 d, size_t nrand) {
+    const u64 m = mask(bits);
+    const u64 ud = (u64)d & m;
+    vector<u64> xs = {
+        0, 1, 2, ud - 1, ud, ud + 1, 2 * ud - 1, 2 * ud, m, m - 1, m >> 1,
+        (m >> 1) + 1, (m >> 1) - 1, m - ud, m - ud + 1, -ud, -ud - 1,
+    };
+
+    u64 state = (u64)d;
+    for (size_t i = 0; i < nrand; i++)
+        xs.push_back(lcg(state));
+
+    for (u64& x : xs)
+        x &= m;
+    return xs;
+}
+
+static vector<i64> divisors(int bits, size_t nrand) {
+    vector<i64> ds;
+    for (i64 d = 1; d <= 130; d++) {
+        ds.push_back(d);
+        ds.push_back(-d);
+    }
+
+    const u64 m = mask(bits);
+    for (int k = 8; k < bits; k++) {
+        for (i64 d : { -1, 0, 1 }) {
+            ds.push_back(sext((1ull << k) + d, bits));
+            ds.push_back(sext(-(1ull << k) + d, bits));
+        }
+    }
+
+    for (u64 d : { m, m - 1, m - 2, m >> 1, (m >> 1) + 1, (m >> 1) + 2,
+                   m / 3, m / 7 + 1, m / 10 })
+        ds.push_back(sext(d, bits));
+
+    u64 state = bits;
+    for (size_t i = 0; i < nrand; i++)
+        ds.push_back(sext(lcg(state) >> (i % bits), bits));
+
+    return ds;
+}
+
+TEST(divconst, exhaustive8) {
+    divtest test;
+
+    vector<u64> xs;
+    for (u64 x = 0; x < 256; x++)
+        xs.push_back(x);
+
+    for (i64 d = 1; d < 256; d++)
+        test.check(8, false, d, xs);
+    for (i64 d = -128; d < 128; d++)
+        if (d != 0)
+            test.check(8, true, d, xs);
+}
+
+TEST(divconst, divisors16) {
+    divtest test;
+
+    for (i64 d = 1; d < 65536; d++)
+        test.check(16, false, d, dividends(16, d, 8));
+    for (i64 d = -32768; d < 32768; d++)
+        if (d != 0)
+            test.check(16, true, d, dividends(16, d, 8));
+}
+
+TEST(divconst, wide) {
+    divtest test;
+
+    for (int bits : { 32, 64 }) {
+        for (i64 d : divisors(bits, 2000)) {
+            if (d == 0)
+                continue;
+            test.check(bits, false, d, dividends(bits, d, 64));
+            test.check(bits, true, d, dividends(bits, d, 64));
+        }
+    }
+}
+
+TEST(divconst, mul) {
+    guest g = {};
+
+    vector<i64> factors;
+    for (i64 f = -130; f <= 130; f++)
+        factors.push_back(f);
+    for (i64 f : { 1000ll, 4095ll, 0x12345ll, 0x7fffffffll, -0x80000000ll,
+                   0x123456789ll, -0x123456789abll })
+        factors.push_back(f);
+
+    for (int bits : { 8, 16, 32, 64 }) {
+        for (i64 f : factors) {
+            if (encode_size(f) > bits)
+                continue;
+
+            for (bool sign : { false, true }) {
+                func code("mul", 4 * KiB);
+                code.set_data_ptr(&g);
+                value x = code.gen_global_val("x", bits, &g.x);
+                value dummy = code.gen_local_i64("dummy", 0x55);
+                if (sign)
+                    code.gen_imul(x, f);
+                else
+                    code.gen_umul(x, (u64)f & mask(bits));
+                code.gen_ret(dummy);
+                code.finish();
+
+                for (u64 val : { 0ull, 1ull, 3ull, 0x7full, 0xffull,
+                                 0x1234567890abcdefull, ~0ull }) {
+                    g.x = val;
+                    EXPECT_EQ(code(), 0x55) << "clobbered local";
+                    EXPECT_EQ(g.x & mask(bits), (val * f) & mask(bits))
+                        << "i" << bits << " " << val << " * " << f;
+                }
+            }
+        }
+    }
+}
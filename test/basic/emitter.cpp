@@ -172,3 +172,48 @@ TEST(emitter, xchg) {
 
     EXPECT_EQ(fn(), 5);
 }
+
+TEST(emitter, leasib) {
+    typedef i64 (lea_func)(void);
+
+    const reg bases[] = { RDX, RSI, RBP, R12, R13 };
+    const reg indices[] = { RCX, RBP, R9, R13 };
+    const int scales[] = { 1, 2, 4, 8 };
+    const i32 disps[] = { 0, -3, 100, 0x12345 };
+
+    cbuf code(64 * KiB);
+    emitter emitter(code);
+
+    for (reg base : bases) {
+        for (reg index : indices) {
+            if (base == index)
+                continue;
+
+            for (int scale : scales) {
+                for (i32 disp : disps) {
+                    lea_func* fn = (lea_func*)code.get_code_ptr();
+                    emitter.push(base);
+                    emitter.push(index);
+                    emitter.movi(64, base, 0x100000000ll);
+                    emitter.movi(64, index, 7ll);
+                    emitter.leasib(64, RAX, base, index, scale, disp);
+                    emitter.pop(index);
+                    emitter.pop(base);
+                    emitter.ret();
+
+                    EXPECT_EQ(fn(), 0x100000000ll + 7 * scale + disp)
+                        << "base " << reg_names[base] << " index "
+                        << reg_names[index] << " scale " << scale;
+                }
+            }
+        }
+    }
+
+    // 32bit results are zero extended
+    lea_func* fn = (lea_func*)code.get_code_ptr();
+    emitter.movi(64, RDX, -1ll);
+    emitter.movi(64, RCX, 1ll);
+    emitter.leasib(32, RAX, RDX, RCX, 1);
+    emitter.ret();
+    EXPECT_EQ(fn(), 0);
+}
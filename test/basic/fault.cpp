@@ -0,0 +1,145 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 pc;
+    u64 acc;
+    u64 ptr;
+};
+
+// pc 0x100: acc += 1, acc += [ptr], exit
+// pc 0x200: acc += 1, [ptr] = acc, exit
+// pc 0x300: acc += 1, [ptr] = ptr, acc += 1, exit
+static const u8* gen_block(dispatcher& d, guest& g, u64 pc) {
+    func code("block", d.get_cbuffer(), &g);
+    value acc = code.gen_global_i64("acc", &g.acc);
+    value ptr = code.gen_global_i64("ptr", &g.ptr);
+    value tmp = code.gen_scratch_i64("tmp");
+
+    // the increment stays in a register until the block exits
+    acc.fetch();
+    code.gen_add(acc, 1);
+
+    if (pc == 0x100) {
+        code.gen_load(tmp, ptr, d, pc);
+        code.gen_add(acc, tmp);
+    } else if (pc == 0x200) {
+        code.gen_store(ptr, acc, d, pc);
+    } else if (pc == 0x300) {
+        code.gen_store(ptr, ptr, d, pc);
+        code.gen_add(acc, 1);
+    } else {
+        return nullptr;
+    }
+
+    code.gen_exit(d, EXIT_USER, pc + 4);
+    code.finish();
+    return code.entry();
+}
+
+class fault: public ::testing::Test
+{
+protected:
+    u8* page;
+
+    virtual void SetUp() override {
+        page = (u8*)mmap(NULL, 4 * KiB, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT_NE(page, MAP_FAILED);
+    }
+
+    virtual void TearDown() override {
+        munmap(page, 4 * KiB);
+    }
+};
+
+TEST_F(fault, load) {
+    cbuf buffer(16 * KiB);
+    u64 mem = 41;
+    guest g = { 0x100, 0, (u64)&mem };
+    dispatcher d(buffer, &g, &g.pc);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_block(d, g, pc);
+    });
+
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(info.pc, 0x104);
+    EXPECT_EQ(g.acc, 42);
+    EXPECT_EQ(buffer.count_faults(), 1);
+
+    // the increment before the load reaches guest state, nothing after it
+    g.pc = 0x100;
+    g.acc = 0;
+    g.ptr = (u64)page + 8;
+    info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_FAULT);
+    EXPECT_EQ(info.pc, 0x100);
+    EXPECT_EQ(g.acc, 1);
+    EXPECT_EQ(fault_address(), page + 8);
+}
+
+TEST_F(fault, store) {
+    cbuf buffer(16 * KiB);
+    u64 mem = 0;
+    guest g = { 0x200, 6, (u64)&mem };
+    dispatcher d(buffer, &g, &g.pc);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_block(d, g, pc);
+    });
+
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(info.pc, 0x204);
+    EXPECT_EQ(mem, 7);
+    EXPECT_EQ(g.acc, 7);
+
+    g.pc = 0x200;
+    g.ptr = (u64)page;
+    info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_FAULT);
+    EXPECT_EQ(info.pc, 0x200);
+    EXPECT_EQ(g.acc, 8);
+    EXPECT_EQ(fault_address(), page);
+
+    // resetting the buffer drops the recovery table along with the code
+    buffer.reset();
+    EXPECT_EQ(buffer.count_faults(), 0);
+}
+
+TEST_F(fault, alias) {
+    cbuf buffer(16 * KiB);
+    guest g = { 0x300, 0, 0 };
+    g.ptr = (u64)&g.acc;
+    dispatcher d(buffer, &g, &g.pc);
+    d.set_translator([&](u64 pc) -> const u8* {
+        return gen_block(d, g, pc);
+    });
+
+    // the store overwrites the increment still held in a register
+    exit_info info = d.run_until(EXIT_USER);
+    EXPECT_EQ(info.reason, EXIT_USER);
+    EXPECT_EQ(info.pc, 0x304);
+    EXPECT_EQ(g.acc, (u64)&g.acc + 1);
+}
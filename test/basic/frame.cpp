@@ -0,0 +1,189 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static i64 scribble(void* bptr) {
+    volatile u8 buf[512];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = 0xff;
+    return buf[0];
+}
+
+TEST(frame, redzone) {
+    func code("redzone", 4 * KiB);
+    vector<value> locals;
+    locals.reserve(15);
+    for (i64 i = 0; i < 15; i++)
+        locals.push_back(code.gen_local_i64("l" + std::to_string(i), i));
+
+    value sum = code.gen_local_i64("sum", 0);
+    for (value& l : locals)
+        code.gen_add(sum, l);
+    code.gen_ret(sum);
+    code.finish();
+
+    // leaf functions that fit into the red zone do not need a frame
+    EXPECT_EQ(code.get_alloc().frame_peak(), STACK_RED_ZONE);
+    EXPECT_EQ(code.get_cbuffer().frame_size(), 0);
+    EXPECT_EQ(code(), 105);
+}
+
+TEST(frame, large) {
+    const i64 n = 200;
+
+    func code("large", 16 * KiB);
+    vector<value> locals;
+    locals.reserve(n);
+    for (i64 i = 0; i < n; i++)
+        locals.push_back(code.gen_local_i64("l" + std::to_string(i), i));
+
+    // locals must survive calls, both in the red zone and above it
+    code.gen_call(scribble);
+
+    value sum = code.gen_local_i64("sum", 0);
+    for (value& l : locals)
+        code.gen_add(sum, l);
+    code.gen_ret(sum);
+    code.finish();
+
+    size_t frame = code.get_cbuffer().frame_size();
+    EXPECT_GE(frame, (n + 1) * sizeof(u64) - STACK_RED_ZONE);
+    EXPECT_EQ(frame % STACK_ALIGNMENT, 0);
+    EXPECT_EQ(code(), n * (n - 1) / 2);
+}
+
+TEST(frame, reuse) {
+    func code("reuse", 4 * KiB);
+    alloc& al = code.get_alloc();
+
+    i32 first;
+    {
+        value a = code.gen_local_i64("a", 1);
+        value b = code.gen_local_i64("b", 2);
+        first = a.offset();
+        EXPECT_NE(a.offset(), b.offset());
+    }
+
+    value c = code.gen_local_i64("c", 3);
+    EXPECT_EQ(c.offset(), first) << "freed slot not reused";
+    EXPECT_EQ(al.frame_peak(), 2 * sizeof(u64));
+
+    // slots beyond the first 64 used to leak when freed
+    vector<value> locals;
+    locals.reserve(80);
+    for (int i = 0; i < 80; i++)
+        locals.push_back(code.gen_local_i64("l" + std::to_string(i), i));
+    size_t peak = al.frame_peak();
+    locals.clear();
+    for (int i = 0; i < 80; i++)
+        locals.push_back(code.gen_local_i64("m" + std::to_string(i), i));
+    EXPECT_EQ(al.frame_peak(), peak);
+
+    code.gen_ret(c);
+    code.finish();
+    EXPECT_EQ(code(), 3);
+}
+
+TEST(frame, aligned) {
+    func code("aligned", 4 * KiB);
+    alloc& al = code.get_alloc();
+    emitter& e = code.get_emitter();
+
+    i32 a = al.new_slot(8, 8);
+    i32 b = al.new_slot(16, 16);
+    i32 c = al.new_slot(32, 32);
+    i32 d = al.new_slot(8, 8);
+
+    EXPECT_EQ(d, a + 8) << "padding before aligned slot not reused";
+    EXPECT_EQ(b % 16, 0);
+    EXPECT_EQ(c % 32, 0);
+
+    al.free_slot(b, 16);
+    EXPECT_EQ(al.new_slot(16, 8), b);
+
+    // move the 32 byte slot out of the red zone
+    i32 far = al.new_slot(32, 32);
+    while (far < (i32)STACK_RED_ZONE)
+        far = al.new_slot(32, 32);
+
+    e.lear(64, RAX, memop(STACK_POINTER, c));
+    e.lear(64, RCX, memop(STACK_POINTER, far));
+    e.orr(64, RAX, RCX);
+    e.andi(64, RAX, STACK_ALIGNMENT - 1);
+    code.gen_ret();
+    code.finish();
+
+    EXPECT_GT(code.get_cbuffer().frame_size(), 0);
+    EXPECT_EQ(code(), 0) << "frame slots not aligned at runtime";
+}
+
+TEST(frame, shared) {
+    cbuf buffer(16 * KiB);
+    i64 data = 0;
+
+    func small("small", buffer, &data);
+    value x = small.gen_local_i64("x", 7);
+    small.gen_ret(x);
+    small.finish();
+    EXPECT_EQ(buffer.frame_size(), 0);
+
+    func big("big", buffer, &data);
+    vector<value> locals;
+    locals.reserve(40);
+    for (i64 i = 0; i < 40; i++)
+        locals.push_back(big.gen_local_i64("l" + std::to_string(i), i));
+    big.gen_call(scribble);
+    value sum = big.gen_local_i64("sum", 0);
+    for (value& l : locals)
+        big.gen_add(sum, l);
+    big.gen_ret(sum);
+    big.finish();
+
+    // the prologue is shared, so it reserves what the biggest one needs
+    EXPECT_EQ(buffer.frame_size(), big.get_alloc().frame_size());
+    EXPECT_EQ(small.exec(), 7);
+    EXPECT_EQ(big.exec(), 780);
+}
+
+static i64 stack_hungry(void* bptr) {
+    volatile u8 buf[256];
+    memset((void*)buf, 0xcc, sizeof(buf));
+    return buf[0];
+}
+
+TEST(frame, callee) {
+    func code("callee", 4 * KiB);
+    value a = code.gen_local_i64("a", 42);
+    value b = code.gen_local_i64("b", 7);
+    a.flush();
+    b.flush();
+
+    // both locals live at the bottom of the red zone during the call
+    code.gen_call(stack_hungry);
+    code.gen_add(a, b);
+    code.gen_ret(a);
+    code.finish();
+
+    EXPECT_EQ(code.get_alloc().frame_peak(), 2 * sizeof(u64));
+    EXPECT_EQ(code(), 49);
+}
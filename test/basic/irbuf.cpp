@@ -0,0 +1,430 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static i64 twice(void* ptr, i64 val) {
+    return val * 2;
+}
+
+TEST(irbuf, fold) {
+    func code("fn");
+    irbuf ir(code);
+
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+
+    ir.gen_mov(a, 6);
+    ir.gen_mov(b, 7);
+    ir.gen_imul(a, b);
+    ir.gen_add(a, 100);
+    ir.gen_shl(a, 1);
+    ir.gen_ret(a);
+    ir.free_value(a);
+    ir.free_value(b);
+
+    ir.optimize();
+    EXPECT_EQ(ir.size(), 4) << "constants not folded";
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), (6 * 7 + 100) << 1);
+}
+
+TEST(irbuf, copyprop) {
+    i64 x = 42, y = 0;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value gy = code.gen_global_i64("y", &y);
+    value t = code.gen_local_i64("t");
+    value u = code.gen_local_i64("u");
+
+    ir.gen_mov(t, gx);
+    ir.gen_mov(u, t);
+    ir.gen_mov(t, u); // redundant
+    ir.gen_add(u, t);
+    ir.gen_mov(gy, u);
+    ir.gen_ret(gy);
+    ir.free_value(t);
+    ir.free_value(u);
+
+    ir.optimize();
+    EXPECT_EQ(ir.size(), 6) << "copies not propagated";
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 84);
+    EXPECT_EQ(y, 84);
+}
+
+TEST(irbuf, cse) {
+    i64 x = 3, y = 4;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value gy = code.gen_global_i64("y", &y);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+
+    ir.gen_mov(a, gx);
+    ir.gen_add(a, gy);
+    ir.gen_mov(b, gx);
+    ir.gen_add(b, gy); // same as a
+    ir.gen_imul(a, b);
+    ir.gen_ret(a);
+    ir.free_value(a);
+    ir.free_value(b);
+
+    size_t before = ir.size();
+    ir.optimize();
+    EXPECT_EQ(ir.size(), before - 2) << "common expression not removed";
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 49);
+}
+
+TEST(irbuf, dce) {
+    i64 x = 5;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+
+    ir.gen_mov(b, gx);
+    ir.gen_add(b, 1);
+    ir.gen_mov(a, gx);
+    ir.gen_mov(a, b); // overwrites previous
+    ir.gen_ret(a);
+    ir.free_value(a);
+    ir.free_value(b);
+
+    ir.optimize();
+    EXPECT_EQ(ir.size(), 6) << "dead move not removed";
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 6);
+}
+
+TEST(irbuf, memopt) {
+    i64 x = 10;
+    i32 lo = 0;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value gl = code.gen_global_i32("lo", &lo);
+    value a = code.gen_local_i64("a");
+
+    ir.gen_mov(gx, 1); // dead store
+    ir.gen_mov(gx, 2);
+    ir.gen_mov(gl, 7);
+    ir.gen_mov(a, gx); // redundant load
+    ir.gen_ret(a);
+    ir.free_value(a);
+
+    ir.optimize();
+    EXPECT_EQ(ir.size(), 5);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 2);
+    EXPECT_EQ(x, 2);
+    EXPECT_EQ(lo, 7);
+}
+
+TEST(irbuf, nopasses) {
+    i64 x = 10;
+
+    func code("fn");
+    irbuf ir(code, IR_NOPASSES);
+
+    value gx = code.gen_global_i64("x", &x);
+    value a = code.gen_local_i64("a");
+
+    ir.gen_mov(gx, 1);
+    ir.gen_mov(gx, 2);
+    ir.gen_mov(a, gx);
+    ir.gen_add(a, gx);
+    ir.gen_ret(a);
+    ir.free_value(a);
+
+    ir.optimize();
+    EXPECT_EQ(ir.size(), 6);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 4);
+}
+
+TEST(irbuf, loop) {
+    func code("fn");
+    irbuf ir(code);
+
+    value i = code.gen_local_i64("i");
+    value s = code.gen_local_i64("s");
+    label loop = code.gen_label("loop");
+    label done = code.gen_label("done");
+
+    ir.gen_mov(i, 0);
+    ir.gen_mov(s, 0);
+    ir.place(loop);
+    ir.gen_cmp(i, 100);
+    ir.gen_jcc(IR_GE, done);
+    ir.gen_add(s, i);
+    ir.gen_inc(i);
+    ir.gen_jmp(loop);
+    ir.place(done);
+    ir.gen_ret(s);
+    ir.free_value(i);
+    ir.free_value(s);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 4950);
+}
+
+TEST(irbuf, flags) {
+    func code("fn");
+    irbuf ir(code);
+
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+    value r = code.gen_local_i64("r");
+
+    ir.gen_mov(a, 5);
+    ir.gen_mov(b, 5);
+    ir.gen_cmp(a, b);
+    ir.gen_mov(r, 0); // must not become xor
+    ir.gen_setcc(IR_E, r);
+    ir.gen_ret(r);
+    ir.free_value(a);
+    ir.free_value(b);
+    ir.free_value(r);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 1);
+}
+
+TEST(irbuf, call) {
+    i64 x = 21;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value a = code.gen_local_i64("a");
+    value r = code.gen_local_i64("r");
+
+    ir.gen_mov(a, gx);
+    ir.gen_call(r, twice, a);
+    ir.gen_add(r, gx);
+    ir.gen_ret(r);
+    ir.free_value(a);
+    ir.free_value(r);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), 63);
+}
+
+static i64 nop(void* ptr) {
+    return 0;
+}
+
+TEST(irbuf, callee_saved) {
+    i64 x = 4, y = 9;
+
+    func code("fn");
+    alloc& al = code.get_alloc();
+
+    value gx = code.gen_global_i64("x", &x);
+    value gy = code.gen_global_i64("y", &y);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+    al.flush_all_regs();
+
+    irbuf ir(code);
+    ir.gen_mov(b, gx);
+    ir.gen_add(b, 2);
+    ir.gen_mov(gx, b);
+    ir.gen_mov(a, gy);
+    ir.gen_add(a, 1);
+    ir.gen_call(nop);
+    ir.gen_add(a, 1);
+    ir.lower();
+
+    EXPECT_EQ(al.lookup(&b), NREGS) << "b should use a volatile register";
+    EXPECT_TRUE(stl_contains(callee_saved_regs, al.lookup(&a)))
+        << "a is live across a call, but not in a callee-saved register";
+
+    code.gen_ret(a);
+    code.finish();
+
+    EXPECT_EQ(code(), 11);
+    EXPECT_EQ(x, 6);
+}
+
+TEST(irbuf, shift_count) {
+    i64 x = 3;
+
+    func code("fn");
+    alloc& al = code.get_alloc();
+
+    value gx = code.gen_global_i64("x", &x);
+    value n = code.gen_local_i64("n");
+    value v = code.gen_local_i64("v");
+    al.flush_all_regs();
+
+    irbuf ir(code);
+    ir.gen_mov(n, gx);
+    ir.gen_sub(n, 1);
+    ir.gen_mov(v, 1);
+    ir.gen_shl(v, n);
+    ir.lower();
+
+    EXPECT_EQ(al.lookup(&n), RCX) << "shift count not placed in rcx";
+
+    code.gen_ret(v);
+    code.finish();
+
+    EXPECT_EQ(code(), 4);
+}
+
+TEST(irbuf, division) {
+    i64 x = 100;
+    i64 y = -9;
+
+    func code("fn");
+    irbuf ir(code);
+
+    value gx = code.gen_global_i64("x", &x);
+    value gy = code.gen_global_i64("y", &y);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+    value c = code.gen_local_i64("c");
+    value d = code.gen_local_i64("d");
+
+    ir.gen_mov(a, gx);
+    ir.gen_udiv(a, 7);     // 14
+    ir.gen_mov(b, gy);
+    ir.gen_imod(b, 4);     // -1
+    ir.gen_mov(c, gx);
+    ir.gen_mov(d, 45);
+    ir.gen_idiv(d, -4);    // -11, folded
+    ir.gen_umod(c, d);     // 100 % (2^64 - 11)
+    ir.gen_add(a, c);      // 114
+    ir.gen_mov(c, a);
+    ir.gen_idiv(c, gy);    // -12
+    ir.gen_sub(a, c);      // 126
+    ir.gen_imul(a, b);     // -126
+    ir.gen_ret(a);
+    ir.free_value(a);
+    ir.free_value(b);
+    ir.free_value(c);
+    ir.free_value(d);
+
+    ir.lower();
+    code.finish();
+    EXPECT_EQ(code(), -126);
+}
+
+static void gen_kernel(func& code, irbuf& ir, i64* x, i64* y) {
+    value gx = code.gen_global_i64("x", x);
+    value gy = code.gen_global_i64("y", y);
+    value alias = code.gen_global_i64("alias", x);
+    value a = code.gen_local_i64("a");
+    value b = code.gen_local_i64("b");
+    value r = code.gen_local_i64("r");
+
+    ir.gen_mov(a, gx);
+    ir.gen_udiv(a, gy);
+    ir.gen_mov(b, gy);
+    ir.gen_add(b, 5);
+    ir.gen_cmp(b, 8);
+    ir.gen_mov(r, 0);
+    ir.gen_setcc(IR_E, r);
+    ir.gen_imul(b, b);
+    ir.gen_mov(alias, b);  // x = 64
+    ir.gen_add(a, gx);     // 333 + 64
+    ir.gen_shl(r, 8);
+    ir.gen_add(a, r);      // + 256
+    ir.gen_ret(a);
+    ir.free_value(a);
+    ir.free_value(b);
+    ir.free_value(r);
+
+    ir.lower();
+    code.finish();
+}
+
+TEST(irbuf, schedule) {
+    i64 x = 1000, y = 3;
+
+    func plain("plain");
+    irbuf ir0(plain, IR_ALLPASSES & ~IR_SCHED);
+    gen_kernel(plain, ir0, &x, &y);
+    EXPECT_EQ(plain(), 653);
+    EXPECT_EQ(x, 64);
+
+    x = 1000;
+    func sched("sched");
+    irbuf ir1(sched);
+    gen_kernel(sched, ir1, &x, &y);
+    EXPECT_EQ(sched(), 653);
+    EXPECT_EQ(x, 64);
+
+    ASSERT_EQ(plain.size(), sched.size());
+    EXPECT_NE(memcmp(plain.entry(), sched.entry(), plain.size()), 0)
+        << "operations were not reordered";
+}
+
+TEST(irbuf, model) {
+    i64 x = 1000, y = 3;
+
+    func code("fn");
+    irbuf ir(code);
+
+    ir_model narrow = ir_generic_model;
+    narrow.width = 1;
+    for (u32 unit = 0; unit < IR_NUNITS; unit++)
+        narrow.ports[unit] = 1;
+    narrow.latency[IR_UNIT_DIV] = 80;
+
+    ir.set_model(narrow);
+    EXPECT_EQ(ir.get_model().latency[IR_UNIT_DIV], 80);
+
+    gen_kernel(code, ir, &x, &y);
+    EXPECT_EQ(code(), 653);
+    EXPECT_EQ(x, 64);
+}
@@ -0,0 +1,238 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 kind;
+    u64 op1;
+    u64 op2;
+    u64 a;
+    u64 b;
+    u64 flags[4];
+};
+
+enum test_op { OP_ADD, OP_SUB, OP_CMP, OP_AND };
+
+static void reference(test_op op, int bits, u64 a, u64 b, u64 flags[4]) {
+    u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+    u64 sign = 1ull << (bits - 1);
+    a &= mask;
+    b &= mask;
+
+    u64 r = 0;
+    switch (op) {
+    case OP_ADD:
+        r = (a + b) & mask;
+        flags[LAZY_CF] = r < a;
+        flags[LAZY_OF] = (~(a ^ b) & (a ^ r) & sign) != 0;
+        break;
+    case OP_SUB:
+    case OP_CMP:
+        r = (a - b) & mask;
+        flags[LAZY_CF] = a < b;
+        flags[LAZY_OF] = ((a ^ b) & (a ^ r) & sign) != 0;
+        break;
+    case OP_AND:
+        r = a & b;
+        flags[LAZY_CF] = 0;
+        flags[LAZY_OF] = 0;
+        break;
+    }
+
+    flags[LAZY_ZF] = r == 0;
+    flags[LAZY_SF] = (r & sign) != 0;
+}
+
+static void run(test_op op, int bits, u64 a, u64 b, bool replay) {
+    guest g = {};
+    g.a = a;
+    g.b = b;
+
+    func code("fn");
+    value kind = code.gen_global_i64("kind", &g.kind);
+    value op1 = code.gen_global_i64("op1", &g.op1);
+    value op2 = code.gen_global_i64("op2", &g.op2);
+    value va = code.gen_global_val("a", bits, &g.a);
+    value vb = code.gen_global_val("b", bits, &g.b);
+    lazyflags lf(code, kind, op1, op2);
+
+    switch (op) {
+    case OP_ADD: lf.gen_add(va, vb); break;
+    case OP_SUB: lf.gen_sub(va, vb); break;
+    case OP_CMP: lf.gen_cmp(va, vb); break;
+    case OP_AND: lf.gen_and(va, vb); break;
+    }
+
+    EXPECT_TRUE(lf.host_flags_live());
+
+    if (replay) {
+        label l = code.gen_label("l");
+        l.place();
+        EXPECT_FALSE(lf.host_flags_live());
+    }
+
+    for (int f = LAZY_CF; f <= LAZY_OF; f++) {
+        value flag = code.gen_global_i64("flag", &g.flags[f]);
+        lf.gen_flag((lazy_flag)f, flag);
+        EXPECT_TRUE(lf.host_flags_live());
+        flag.store();
+        code.free_value(flag);
+    }
+
+    code.gen_ret();
+    code.finish();
+    code.exec();
+
+    u64 expect[4];
+    reference(op, bits, a, b, expect);
+    for (int f = LAZY_CF; f <= LAZY_OF; f++) {
+        EXPECT_EQ(g.flags[f], expect[f]) << "op " << op << " bits " << bits
+            << " flag " << f << " a " << a << " b " << b << " replay "
+            << replay;
+    }
+}
+
+TEST(lazyflags, direct) {
+    const u64 vals[] = { 0, 1, 0x7f, 0x80, 0xffff, 0x7fffffff, 0x80000000,
+                         0xffffffffffffffff, 0x8000000000000000 };
+    for (int bits : { 8, 16, 32, 64 })
+        for (u64 a : vals)
+            for (u64 b : vals)
+                for (test_op op : { OP_ADD, OP_SUB, OP_CMP, OP_AND })
+                    run(op, bits, a, b, false);
+}
+
+TEST(lazyflags, replay) {
+    const u64 vals[] = { 0, 1, 0x7f, 0x80, 0xffff, 0x7fffffff, 0x80000000,
+                         0xffffffffffffffff, 0x8000000000000000 };
+    for (int bits : { 8, 16, 32, 64 })
+        for (u64 a : vals)
+            for (u64 b : vals)
+                for (test_op op : { OP_ADD, OP_SUB, OP_CMP, OP_AND })
+                    run(op, bits, a, b, true);
+}
+
+TEST(lazyflags, merge) {
+    guest g = {};
+
+    func code("fn");
+    value kind = code.gen_global_i64("kind", &g.kind);
+    value op1 = code.gen_global_i64("op1", &g.op1);
+    value op2 = code.gen_global_i64("op2", &g.op2);
+    value sel = code.gen_global_i64("sel", &g.a);
+    value x = code.gen_local_i32("x", 0x7fffffff);
+    value y = code.gen_local_i8("y", 0x10);
+    value carry = code.gen_global_i64("carry", &g.flags[LAZY_CF]);
+    value over = code.gen_global_i64("over", &g.flags[LAZY_OF]);
+    lazyflags lf(code, kind, op1, op2);
+
+    label other = code.gen_label("other");
+    label done = code.gen_label("done");
+
+    code.gen_cmp(sel, 0);
+    code.gen_jnz(other);
+    lf.gen_add(x, 1);  // signed overflow, no carry
+    code.gen_jmp(done);
+    other.place();
+    lf.gen_sub(y, 0x20); // borrow, no overflow
+    done.place();
+
+    EXPECT_FALSE(lf.is_known());
+    lf.gen_flag(LAZY_CF, carry);
+    lf.gen_flag(LAZY_OF, over);
+    code.gen_ret();
+    code.finish();
+
+    g.a = 0;
+    code.exec();
+    EXPECT_EQ(g.flags[LAZY_CF], 0);
+    EXPECT_EQ(g.flags[LAZY_OF], 1);
+
+    g.a = 1;
+    code.exec();
+    EXPECT_EQ(g.flags[LAZY_CF], 1);
+    EXPECT_EQ(g.flags[LAZY_OF], 0);
+}
+
+TEST(lazyflags, branch) {
+    guest g = {};
+
+    func code("fn");
+    value kind = code.gen_global_i64("kind", &g.kind);
+    value op1 = code.gen_global_i64("op1", &g.op1);
+    value op2 = code.gen_global_i64("op2", &g.op2);
+    value a = code.gen_global_i64("a", &g.a);
+    value b = code.gen_global_i64("b", &g.b);
+    value r = code.gen_local_i64("r", 1);
+    value z = code.gen_local_i64("z", 2);
+    lazyflags lf(code, kind, op1, op2);
+
+    label less = code.gen_label("less");
+    lf.gen_cmp(a, b);
+    lf.gen_cmov(LAZY_Z, r, z);
+    lf.gen_jcc(LAZY_L, less);
+    code.gen_add(r, 10);
+    less.place();
+    code.gen_ret(r);
+    code.finish();
+
+    g.a = 5; g.b = 5;
+    EXPECT_EQ(code.exec(), 12);
+    g.a = -3; g.b = 5;
+    EXPECT_EQ(code.exec(), 1);
+    g.a = 7; g.b = 5;
+    EXPECT_EQ(code.exec(), 11);
+}
+
+TEST(lazyflags, logic) {
+    guest g = {};
+
+    func code("fn");
+    value kind = code.gen_global_i64("kind", &g.kind);
+    value op1 = code.gen_global_i64("op1", &g.op1);
+    value op2 = code.gen_global_i64("op2", &g.op2);
+    value a = code.gen_global_i16("a", &g.a);
+    value zero = code.gen_global_i64("zero", &g.flags[LAZY_ZF]);
+    value sign = code.gen_global_i64("sign", &g.flags[LAZY_SF]);
+    lazyflags lf(code, kind, op1, op2);
+
+    lf.gen_xor(a, -0x8000);
+    label l = code.gen_label("l");
+    l.place();
+    lf.gen_flag(LAZY_ZF, zero);
+    lf.gen_flag(LAZY_SF, sign);
+    code.gen_ret();
+    code.finish();
+
+    g.a = 0x8000;
+    code.exec();
+    EXPECT_EQ(g.a, 0);
+    EXPECT_EQ(g.flags[LAZY_ZF], 1);
+    EXPECT_EQ(g.flags[LAZY_SF], 0);
+
+    g.a = 0x0001;
+    code.exec();
+    EXPECT_EQ(g.a, 0x8001);
+    EXPECT_EQ(g.flags[LAZY_ZF], 0);
+    EXPECT_EQ(g.flags[LAZY_SF], 1);
+}
@@ -0,0 +1,137 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+typedef i64 (entry_func)(void);
+
+TEST(literal, pool) {
+    cbuf code(1 * KiB);
+
+    const u8* a = code.literal(0x1122334455667788ull);
+    const u8* b = code.literal(42);
+    const u8* c = code.literal(0x8000000000000000ull, 0x8000000000000000ull);
+
+    EXPECT_EQ(code.literal(42), b) << "literal not deduplicated";
+    EXPECT_EQ(code.literal(0x8000000000000000ull, 0x8000000000000000ull), c);
+    EXPECT_NE(code.literal(42, 0), b);
+
+    EXPECT_EQ((uintptr_t)a % 8, 0);
+    EXPECT_EQ((uintptr_t)b % 8, 0);
+    EXPECT_EQ((uintptr_t)c % 16, 0);
+
+    EXPECT_EQ(*(const u64*)a, 0x1122334455667788ull);
+    EXPECT_EQ(*(const u64*)b, 42);
+    EXPECT_EQ(code.pool_size(), 48);
+    EXPECT_EQ(code.size_remaining(), 1 * KiB - 48);
+
+    code.reset();
+    EXPECT_EQ(code.pool_size(), 0);
+    EXPECT_EQ(code.size_remaining(), 1 * KiB);
+}
+
+TEST(literal, full) {
+    cbuf code(64);
+    code.skip(40);
+
+    code.literal(1, 2);
+    EXPECT_THROW(code.literal(3, 4), out_of_memory);
+    EXPECT_THROW(code.skip(16), out_of_memory);
+}
+
+TEST(literal, riprel) {
+    cbuf code(1 * KiB);
+    emitter emitter(code);
+
+    entry_func* fn1 = (entry_func*)code.get_code_ptr();
+    emitter.movr(64, RAX, emitter.literal(0x123456789abcdefull));
+    emitter.ret();
+    EXPECT_EQ(fn1(), 0x123456789abcdefll);
+
+    // immediate operands follow the displacement
+    entry_func* fn2 = (entry_func*)code.get_code_ptr();
+    emitter.imuli(64, RAX, emitter.literal(1000), 3);
+    emitter.imuli(64, RAX, RAX, 100000);
+    emitter.ret();
+    EXPECT_EQ(fn2(), 300000000ll);
+
+    entry_func* fn3 = (entry_func*)code.get_code_ptr();
+    emitter.movi(64, RAX, 0);
+    emitter.cmpi(64, emitter.literal(1000), 1000);
+    emitter.sete(RAX);
+    emitter.tsti(32, emitter.literal(0xff00), 0x100);
+    emitter.setnz(RCX);
+    emitter.addr(8, RAX, RCX);
+    emitter.ret();
+    EXPECT_EQ(fn3(), 2);
+
+    EXPECT_EQ(code.pool_size(), 24);
+}
+
+TEST(literal, fpconst) {
+    f64 x = 0.0;
+    f32 y = 0.0f;
+
+    func code("fpconst");
+    scalar gx = code.gen_global_f64("x", &x);
+    scalar gy = code.gen_global_f32("y", &y);
+    scalar a = code.gen_local_f64("a", 1.5);
+    scalar b = code.gen_scratch_f64("b", 1.5);
+    scalar c = code.gen_local_f32("c", 0.25f);
+    scalar z = code.gen_local_f64("z", 0.0);
+
+    code.gen_mov(gx, a);
+    code.gen_add(gx, b);
+    code.gen_add(gx, z);
+    code.gen_mov(gy, c);
+    code.gen_ret();
+    code.finish();
+
+    code();
+    EXPECT_EQ(x, 3.0);
+    EXPECT_EQ(y, 0.25f);
+    EXPECT_EQ(code.get_cbuffer().pool_size(), 16) << "1.5 not deduplicated";
+}
+
+TEST(literal, absneg) {
+    f64 x = -2.5, y = 4.0;
+    f32 u = -0.5f, v = 8.0f;
+
+    func code("absneg");
+    scalar gx = code.gen_global_f64("x", &x);
+    scalar gy = code.gen_global_f64("y", &y);
+    scalar gu = code.gen_global_f32("u", &u);
+    scalar gv = code.gen_global_f32("v", &v);
+
+    code.gen_abs(gx);
+    code.gen_neg(gy);
+    code.gen_abs(gu);
+    code.gen_neg(gv);
+    code.gen_ret();
+    code.finish();
+
+    code();
+    EXPECT_EQ(x, 2.5);
+    EXPECT_EQ(y, -4.0);
+    EXPECT_EQ(u, 0.5f);
+    EXPECT_EQ(v, -8.0f);
+}
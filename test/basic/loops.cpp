@@ -60,3 +60,73 @@ TEST(loops, simple) {
     EXPECT_EQ(ss.str(), "0123456789");
     EXPECT_EQ(sum, 45);
 }
+
+TEST(loops, registers) {
+    func code("fn");
+
+    value i = code.gen_local_i64("i", 0);
+    value s = code.gen_local_i64("s", 0);
+    reg ri = i.r();
+    reg rs = s.r();
+
+    label loop = code.gen_label("loop");
+    loop.place();
+
+    EXPECT_EQ(i.r(), ri) << "value flushed at label";
+    EXPECT_EQ(s.r(), rs) << "value flushed at label";
+
+    code.gen_add(s, i);
+    code.gen_add(i, 1);
+    code.gen_cmp(i, 100);
+    code.gen_jl(loop);
+
+    EXPECT_EQ(i.r(), ri) << "value flushed at branch";
+    EXPECT_EQ(s.r(), rs) << "value flushed at branch";
+
+    code.gen_ret(s);
+    code.finish();
+
+    EXPECT_EQ(code(), 4950);
+}
+
+TEST(loops, merge) {
+    func code("fn");
+
+    value a = code.gen_local_i64("a", 1, RBX);
+    value b = code.gen_local_i64("b", 2, RCX);
+    scalar f = code.gen_local_f64("f", 1.5, XMM1);
+
+    // keep the branch below from being folded away
+    a.forget_known();
+
+    label done = code.gen_label("done");
+    code.gen_cmp(a, 0);
+    code.gen_je(done);
+
+    // swap registers on the fall through path, the merge at the label must
+    // resolve the cycle without losing any of the updates
+    a.fetch(RDX);
+    b.fetch(RBX);
+    a.fetch(RCX);
+    f.fetch(XMM2);
+    code.gen_add(a, 10);
+    code.gen_add(b, 20);
+    code.gen_add(f, f);
+
+    done.place();
+
+    EXPECT_EQ(a.r(), RBX);
+    EXPECT_EQ(b.r(), RCX);
+    EXPECT_EQ(f.r(), XMM1);
+
+    value fi = code.gen_local_i64("fi");
+    code.gen_cvt(fi, f);
+    code.gen_shl(a, 16);
+    code.gen_shl(b, 8);
+    code.gen_add(a, b);
+    code.gen_add(a, fi);
+    code.gen_ret(a);
+    code.finish();
+
+    EXPECT_EQ(code(), (11 << 16) + (22 << 8) + 3);
+}
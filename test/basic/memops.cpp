@@ -0,0 +1,217 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+typedef void (copy_func)(void* dest, const void* src, u64 n);
+typedef void (store_func)(u64* dest, u64 val);
+typedef void (touch_func)(const void* addr);
+
+TEST(memops, movsb) {
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    copy_func* fn = (copy_func*)code.get_code_ptr();
+
+    emitter.movr(64, RCX, RDX);
+    emitter.rep();
+    emitter.movsb();
+    emitter.ret();
+
+    u8 src[100], dest[100];
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (u8)(i * 7 + 3);
+        dest[i] = 0;
+    }
+
+    fn(dest, src, 77);
+    EXPECT_EQ(memcmp(dest, src, 77), 0);
+    EXPECT_EQ(dest[77], 0);
+}
+
+TEST(memops, stosb) {
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    copy_func* fn = (copy_func*)code.get_code_ptr();
+
+    emitter.movr(64, RAX, RSI);
+    emitter.movr(64, RCX, RDX);
+    emitter.rep();
+    emitter.stosb();
+    emitter.ret();
+
+    u8 dest[64] = { 0 };
+    fn(dest, (void*)0xab, 33);
+    for (size_t i = 0; i < 33; i++)
+        EXPECT_EQ(dest[i], 0xab);
+    EXPECT_EQ(dest[33], 0);
+}
+
+TEST(memops, movnti) {
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    store_func* fn = (store_func*)code.get_code_ptr();
+
+    emitter.movnti(64, memop(RDI, 8), RSI);
+    emitter.movnti(32, memop(RDI, 0), RSI);
+    emitter.sfence();
+    emitter.ret();
+
+    u64 data[2] = { 0, 0 };
+    fn(data, 0x1122334455667788ull);
+    EXPECT_EQ(data[0], 0x55667788ull);
+    EXPECT_EQ(data[1], 0x1122334455667788ull);
+}
+
+TEST(memops, prefetch) {
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    touch_func* fn = (touch_func*)code.get_code_ptr();
+
+    emitter.prefetcht0(memop(RDI, 0));
+    emitter.prefetchnta(memop(RDI, 64));
+    emitter.ret();
+
+    u8 data[128];
+    fn(data);
+}
+
+TEST(memops, encoding) {
+    // independent of what the host supports
+    cpuinfo& cpu = cpuinfo::instance();
+    cpu.mock_feature(CPU_CLFLUSHOPT, true);
+    cpu.mock_feature(CPU_CLWB, true);
+    cpu.set_level(ISA_NATIVE);
+
+    ftl::cbuf code(1 * ftl::KiB);
+    ftl::emitter emitter(code);
+    const u8* ptr = code.get_code_ptr();
+
+    const u8 expect[] = {
+        0x0f, 0x18, 0x0f,             // prefetcht0 [rdi]
+        0x41, 0x0f, 0x18, 0x00,       // prefetchnta [r8]
+        0x66, 0x0f, 0xae, 0x3f,       // clflushopt [rdi]
+        0x66, 0x41, 0x0f, 0xae, 0x71, // clwb [r9 + 16]
+        0x10,
+        0x48, 0x0f, 0xc3, 0x37,       // movnti [rdi], rsi
+        0xf3, 0xa4,                   // rep movsb
+        0xf3, 0xaa,                   // rep stosb
+    };
+
+    size_t len = 0;
+    len += emitter.prefetcht0(memop(RDI, 0));
+    len += emitter.prefetchnta(memop(R8, 0));
+    len += emitter.clflushopt(memop(RDI, 0));
+    len += emitter.clwb(memop(R9, 16));
+    len += emitter.movnti(64, memop(RDI, 0), RSI);
+    len += emitter.rep();
+    len += emitter.movsb();
+    len += emitter.rep();
+    len += emitter.stosb();
+
+    cpu.reset();
+    ASSERT_EQ(len, sizeof(expect));
+    EXPECT_EQ(memcmp(ptr, expect, sizeof(expect)), 0);
+}
+
+TEST(memops, gen_memcpy) {
+    u8 src[64], dest[64];
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (u8)(i ^ 0x5a);
+        dest[i] = 0;
+    }
+
+    func code("memcpy");
+    value d = code.gen_local_i64("dest", (i64)dest, RSI);
+    value s = code.gen_local_i64("src", (i64)src, RDI);
+    value n = code.gen_scratch_i64("count", 40, RCX);
+    code.gen_memcpy(d, s, n);
+    EXPECT_FALSE(n.is_dead());
+    code.gen_ret(n);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), 40);
+    EXPECT_EQ(memcmp(dest, src, 40), 0);
+    EXPECT_EQ(dest[40], 0);
+}
+
+TEST(memops, gen_memset) {
+    u8 dest[64] = { 0 };
+    u32 count = 17;
+
+    func code("memset");
+    value d = code.gen_local_i64("dest", (i64)dest, RCX);
+    value v = code.gen_scratch_i32("val", 0x7e, RDI);
+    value n = code.gen_global_i32("count", &count);
+    code.gen_memset(d, v, n);
+    code.gen_ret(v);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), 0x7e);
+    for (size_t i = 0; i < count; i++)
+        EXPECT_EQ(dest[i], 0x7e);
+    EXPECT_EQ(dest[count], 0);
+}
+
+TEST(memops, globals) {
+    struct { u64 a; u64 b; } g = { 1, 2 };
+    u64 src[2] = { 10, 20 };
+    vector<pinned> pins = { { RBX, 64, &g.b } };
+
+    cbuf buffer(4 * KiB);
+    func code("globals", buffer, &g, pins);
+    value a = code.gen_global_i64("a", &g.a);
+    value b = code.gen_global_i64("b", &g.b);
+    code.gen_add(a, 1);
+    code.gen_add(b, 1);
+
+    // neither the cached nor the pinned global may survive the copy
+    value d = code.gen_local_i64("dest", (i64)&g);
+    value s = code.gen_local_i64("src", (i64)src);
+    value n = code.gen_local_i64("count", sizeof(src));
+    code.gen_memcpy(d, s, n);
+    code.gen_add(a, b);
+
+    value p = code.gen_local_i64("ptr", (i64)&g.b);
+    value v = code.gen_local_i8("val", 1);
+    code.gen_mov(n, sizeof(g.b));
+    code.gen_memset(p, v, n);
+    code.gen_add(b, 1);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ(g.a, 30);
+    EXPECT_EQ(g.b, 0x0101010101010102);
+}
+
+TEST(memops, gen_prefetch) {
+    u64 data[16] = { 0 };
+
+    func code("prefetch");
+    value addr = code.gen_local_i64("addr", (i64)data);
+    code.gen_prefetch(addr);
+    code.gen_prefetch(addr, true);
+    code.gen_ret(addr);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), (i64)data);
+}
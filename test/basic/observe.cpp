@@ -0,0 +1,117 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 pc;
+    u64 seen[4];
+    u64 nseen;
+};
+
+static i64 record(void* ptr) {
+    guest* g = (guest*)ptr;
+    g->seen[g->nseen++] = g->pc;
+    return 0;
+}
+
+static size_t gen_block(guest& g, bool precise, bool observe) {
+    func code("fn");
+    code.set_data_ptr(&g);
+
+    value pc = code.gen_global_i64("pc", &g.pc);
+    if (!precise)
+        pc.mark_imprecise();
+
+    u8* start = code.get_cbuffer().get_code_ptr();
+    for (i64 i = 1; i <= 3; i++) {
+        code.gen_mov(pc, 0x1000 + i * 4);
+        if (observe)
+            code.gen_observe();
+        value ret = code.gen_call(record);
+        code.free_value(ret);
+    }
+
+    code.gen_ret();
+    size_t size = code.get_cbuffer().get_code_ptr() - start;
+    code.finish();
+    code.exec();
+    return size;
+}
+
+TEST(observe, precise) {
+    guest g = {};
+    gen_block(g, true, false);
+    EXPECT_EQ(g.nseen, 3);
+    EXPECT_EQ(g.seen[0], 0x1004);
+    EXPECT_EQ(g.seen[1], 0x1008);
+    EXPECT_EQ(g.seen[2], 0x100c);
+    EXPECT_EQ(g.pc, 0x100c);
+}
+
+TEST(observe, imprecise) {
+    guest g = {};
+    g.pc = 0x1000;
+
+    size_t precise = gen_block(g, true, false);
+    g = {};
+    g.pc = 0x1000;
+    size_t imprecise = gen_block(g, false, false);
+    EXPECT_LT(imprecise, precise) << "intermediate stores not removed";
+
+    EXPECT_EQ(g.nseen, 3);
+    EXPECT_EQ(g.seen[0], 0x1000);
+    EXPECT_EQ(g.seen[1], 0x1000);
+    EXPECT_EQ(g.seen[2], 0x1000);
+    EXPECT_EQ(g.pc, 0x100c) << "final store missing";
+}
+
+TEST(observe, points) {
+    guest g = {};
+    gen_block(g, false, true);
+    EXPECT_EQ(g.nseen, 3);
+    EXPECT_EQ(g.seen[0], 0x1004);
+    EXPECT_EQ(g.seen[1], 0x1008);
+    EXPECT_EQ(g.seen[2], 0x100c);
+    EXPECT_EQ(g.pc, 0x100c);
+}
+
+TEST(observe, helper) {
+    guest g = {};
+
+    func code("fn");
+    code.set_data_ptr(&g);
+
+    value pc = code.gen_global_i64("pc", &g.pc);
+    pc.mark_imprecise();
+    code.gen_mov(pc, 0x2000);
+    EXPECT_TRUE(pc.is_reg());
+
+    value ret = code.gen_call(CALL_STATE_READ, record);
+    code.free_value(ret);
+    code.gen_ret();
+    code.finish();
+    code.exec();
+
+    EXPECT_EQ(g.nseen, 1);
+    EXPECT_EQ(g.seen[0], 0x2000);
+}
@@ -0,0 +1,162 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+typedef i64 (entry_func)(void);
+
+TEST(peephole, selfmov) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+    e.set_peephole(true);
+
+    EXPECT_EQ(e.movr(64, RAX, RAX), 0);
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_SELFMOV), 1);
+}
+
+TEST(peephole, reload) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+    e.set_peephole(true);
+
+    i64 data = 0;
+    entry_func* fn = (entry_func*)code.get_code_ptr();
+    e.movi(64, R8, (i64)&data);
+    e.movi(64, RCX, 42);
+    e.movr(64, memop(R8, 0), RCX);
+    e.movr(64, RAX, memop(R8, 0));
+    e.ret();
+
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_RELOAD), 1);
+    EXPECT_EQ(fn(), 42);
+    EXPECT_EQ(data, 42);
+}
+
+TEST(peephole, reload32) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+    e.set_peephole(true);
+
+    i64 data = 0;
+    entry_func* fn = (entry_func*)code.get_code_ptr();
+    e.movi(64, R8, (i64)&data);
+    e.movi(64, RAX, -1);
+    e.movr(32, memop(R8, 0), RAX);
+    e.movr(32, RAX, memop(R8, 0)); // must clear upper half of rax
+    e.ret();
+
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_RELOAD), 0);
+    EXPECT_EQ(fn(), 0xffffffff);
+}
+
+TEST(peephole, reload_rip) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+    e.set_peephole(true);
+
+    // rip-relative operands only match the same absolute target
+    const u8* slot = code.get_code_ptr() + 512;
+    e.movr(64, rm(slot), RCX);
+    e.movr(64, RAX, rm(slot + 8));
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_RELOAD), 0);
+
+    e.movr(64, rm(slot), RCX);
+    e.movr(64, RAX, rm(slot));
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_RELOAD), 1);
+}
+
+TEST(peephole, flags) {
+    i64 x = 0x100;
+
+    func code("fn");
+    emitter& e = code.get_emitter();
+    e.reset_peephole_hits();
+
+    value a = code.gen_local_i64("a");
+    value g = code.gen_global_i64("x", &x);
+    label zero = code.gen_label("zero");
+
+    code.gen_mov(a, g);
+    code.gen_and(a, 0xff);
+    code.gen_cmp(a, 0);
+    code.gen_jz(zero);
+    code.gen_ret(1);
+    zero.place();
+    code.gen_ret(2);
+
+    code.free_value(a);
+    code.finish();
+
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_FLAGS), 1);
+    EXPECT_EQ(code(), 2);
+}
+
+TEST(peephole, zeroext) {
+    i64 x = 3, y = 3;
+
+    func code("fn");
+    emitter& e = code.get_emitter();
+    e.reset_peephole_hits();
+
+    value a = code.gen_global_i64("x", &x);
+    value b = code.gen_global_i64("y", &y);
+    value r = code.gen_local_i64("r", 1);
+    value s = code.gen_local_i64("s");
+
+    code.gen_mov(s, b);
+    code.gen_mov(r, 0);
+    code.gen_cmp(s, a);
+    code.gen_setz(r);
+    code.gen_ret(r);
+
+    code.free_value(r);
+    code.free_value(s);
+    code.finish();
+
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_ZEROEXT), 1);
+    EXPECT_EQ(code(), 1);
+}
+
+TEST(peephole, barrier) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+    e.set_peephole(true);
+
+    e.andr(64, RAX, RCX);
+    e.barrier(); // e.g. a label placed here
+    EXPECT_NE(e.tstr(64, RAX, RAX), 0);
+
+    e.andr(64, RAX, RCX);
+    e.ret(); // not tracked, ends the window
+    EXPECT_NE(e.tstr(64, RAX, RAX), 0);
+
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_FLAGS), 0);
+}
+
+TEST(peephole, disabled) {
+    cbuf code(1 * KiB);
+    emitter e(code);
+
+    e.andr(64, RAX, RCX);
+    EXPECT_NE(e.tstr(64, RAX, RAX), 0);
+    EXPECT_EQ(e.peephole_hits(PEEPHOLE_FLAGS), 0);
+}
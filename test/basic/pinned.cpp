@@ -0,0 +1,208 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+struct guest {
+    u64 r0;
+    u32 r1;
+    u64 r2;
+};
+
+static vector<pinned> guest_pins(guest& g) {
+    return { { RBX, 64, &g.r0 }, { R12, 32, &g.r1 } };
+}
+
+static i64 peek(void* ptr) {
+    return ((guest*)ptr)->r0;
+}
+
+static i64 poke(void* ptr, i64 val) {
+    ((guest*)ptr)->r0 = val;
+    return 0;
+}
+
+TEST(pinned, regs) {
+    guest g = { 5, 7, 0 };
+    cbuf buffer(4 * KiB);
+    func code("fn", buffer, &g, guest_pins(g));
+
+    value r0 = code.gen_global_i64("r0", &g.r0);
+    value r1 = code.gen_global_i32("r1", &g.r1);
+    value r2 = code.gen_global_i64("r2", &g.r2);
+    EXPECT_EQ(r0.r(), RBX);
+    EXPECT_EQ(r1.r(), R12);
+    EXPECT_TRUE(r2.is_mem());
+
+    // pinned registers are never handed out to other values
+    value t = code.gen_local_i64("t", 1);
+    EXPECT_NE(t.r(), RBX);
+    EXPECT_NE(t.r(), R12);
+
+    u8* start = buffer.get_code_ptr();
+    code.gen_add(r0, r1);
+    EXPECT_EQ(buffer.get_code_ptr() - start, 3) << "add rbx, r12 expected";
+    code.gen_mov(r2, r0);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ(g.r0, 12);
+    EXPECT_EQ(g.r2, 12);
+    EXPECT_EQ(g.r1, 7);
+}
+
+TEST(pinned, chained) {
+    guest g = { 1, 3, 0 };
+    cbuf buffer(4 * KiB);
+
+    func a("a", buffer, &g, guest_pins(g));
+    value r0 = a.gen_global_i64("r0", &g.r0);
+    a.gen_add(r0, 10);
+    a.gen_ret();
+    a.finish();
+
+    func b("b", buffer, &g, guest_pins(g));
+    value r1 = b.gen_global_i32("r1", &g.r1);
+    label loop = b.gen_label("loop");
+    value i = b.gen_local_i32("i", 4);
+    loop.place();
+    b.gen_add(r1, r1);
+    b.gen_sub(i, 1);
+    b.gen_jnz(loop);
+    b.gen_ret();
+    b.finish();
+
+    a.exec(&g);
+    b.exec(&g);
+    a.exec(&g);
+    EXPECT_EQ(g.r0, 21);
+    EXPECT_EQ(g.r1, 3 << 4);
+}
+
+TEST(pinned, helpers) {
+    guest g = { 100, 0, 0 };
+    cbuf buffer(4 * KiB);
+    func code("fn", buffer, &g, guest_pins(g));
+
+    value r0 = code.gen_global_i64("r0", &g.r0);
+    value r2 = code.gen_global_i64("r2", &g.r2);
+    value x = code.gen_local_i64("x", 0);
+    code.gen_add(r0, 1);
+
+    value stale = code.gen_call(peek);
+    code.gen_mov(x, stale);
+    code.free_value(stale);
+
+    value fresh = code.gen_call(CALL_STATE_READ, peek);
+    code.gen_mov(r2, fresh);
+    code.free_value(fresh);
+
+    value v = code.gen_local_i64("v", 7);
+    value dummy = code.gen_call(CALL_STATE_WRITE, poke, v);
+    code.free_value(dummy);
+    code.gen_add(r0, x);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ(g.r2, 101);
+    EXPECT_EQ(g.r0, 7 + 100);
+}
+
+TEST(pinned, fixed) {
+    guest g = { 1000, 3, 0 };
+    cbuf buffer(4 * KiB);
+    func code("fn", buffer, &g, guest_pins(g));
+
+    value r0 = code.gen_global_i64("r0", &g.r0);
+    value r1 = code.gen_global_i32("r1", &g.r1);
+    value r2 = code.gen_global_i64("r2", &g.r2);
+    value b = code.gen_local_i64("b", 5);
+
+    // shift counts must be in rcx, pinned values only lend a copy
+    code.gen_shl(b, r1);
+    code.gen_add(r2, b);
+
+    value q = code.gen_local_i64("q", 1000);
+    code.gen_udiv(q, r1);
+    code.gen_add(r2, q);
+
+    // division results are in rax and rdx, pinned values stay put
+    code.gen_udiv(r0, r1);
+    code.gen_mov(r1, r0);
+    code.gen_umod(r1, q);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ(g.r2, 40 + 333);
+    EXPECT_EQ(g.r0, 333);
+    EXPECT_EQ(g.r1, 0);
+}
+
+TEST(pinned, signed) {
+    guest g = { (u64)-100, 7, 0 };
+    cbuf buffer(4 * KiB);
+    func code("fn", buffer, &g, guest_pins(g));
+
+    value r0 = code.gen_global_i64("r0", &g.r0);
+    value r2 = code.gen_global_i64("r2", &g.r2);
+    value d = code.gen_local_i64("d", 7);
+
+    code.gen_mov(r2, r0);
+    code.gen_imod(r2, d);
+    code.gen_idiv(r0, d);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ((i64)g.r0, -14);
+    EXPECT_EQ((i64)g.r2, -2);
+}
+
+TEST(pinned, multiply) {
+    guest g = { 6, 0, 0 };
+    cbuf buffer(4 * KiB);
+    func code("fn", buffer, &g, guest_pins(g));
+
+    value r0 = code.gen_global_i64("r0", &g.r0);
+    value r1 = code.gen_global_i32("r1", &g.r1);
+    value r2 = code.gen_global_i64("r2", &g.r2);
+    value f = code.gen_local_i64("f", 5);
+
+    // products are in rax and rdx, pinned values stay put
+    code.gen_imul(r0, f);
+    code.gen_mov(r2, r0);
+    code.gen_umul(r2, f);
+
+    value lo = code.gen_local_i32("lo", 0x80000000);
+    value m = code.gen_local_i32("m", 6);
+    code.gen_umul(r1, lo, m);
+    code.gen_ret();
+    code.finish();
+
+    code.exec(&g);
+    EXPECT_EQ(g.r0, 30);
+    EXPECT_EQ(g.r2, 150);
+    EXPECT_EQ(g.r1, 3);
+}
@@ -0,0 +1,154 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+TEST(ralloc, order) {
+    func code("order");
+    alloc& al = code.get_alloc();
+
+    EXPECT_EQ(al.select(), RBX);
+    EXPECT_EQ(al.select_xmm(), XMM8);
+
+    value a = code.gen_local_i64("a", 1);
+    EXPECT_EQ(a.r(), RBX);
+    EXPECT_EQ(al.select(), RCX);
+
+    al.block(RCX);
+    EXPECT_EQ(al.select(), RDX);
+    al.unblock(RCX);
+    EXPECT_EQ(al.select(), RCX);
+
+    scalar s = code.gen_local_f64("s", 1.0);
+    EXPECT_EQ(s.r(), XMM8);
+    EXPECT_EQ(al.select_xmm(), XMM9);
+
+    EXPECT_EQ(al.count_active_regs(), 2);
+    EXPECT_EQ(al.count_dirty_regs(), 2);
+
+    code.gen_ret();
+    code.finish();
+}
+
+TEST(ralloc, lookup) {
+    func code("lookup");
+    alloc& al = code.get_alloc();
+
+    value a = code.gen_local_i64("a", 1);
+    reg r = a.r();
+    EXPECT_EQ(al.lookup(&a), r);
+
+    al.assign(&a, R10);
+    EXPECT_EQ(al.lookup(&a), R10);
+    EXPECT_TRUE(al.is_empty(r));
+    EXPECT_EQ(al.count_active_regs(), 1);
+
+    al.flush(R10);
+    EXPECT_EQ(al.lookup(&a), NREGS);
+    EXPECT_TRUE(a.is_mem());
+    EXPECT_EQ(al.count_active_regs(), 0);
+
+    code.gen_ret();
+    code.finish();
+}
+
+TEST(ralloc, lru) {
+    func code("lru");
+    alloc& al = code.get_alloc();
+
+    std::vector<value> vals;
+    vals.reserve(NREGS);
+    for (int i = 0; i < NREGS - 2; i++)
+        vals.push_back(code.gen_local_i64("v" + std::to_string(i), i));
+
+    EXPECT_EQ(al.count_active_regs(), NREGS - 2);
+    EXPECT_EQ(al.count_dirty_regs(), NREGS - 2);
+
+    // all registers are dirty, so the oldest one should be evicted unless
+    // it has been used recently
+    reg r0 = al.lookup(&vals[0]);
+    reg r1 = al.lookup(&vals[1]);
+    for (size_t i = 2; i < vals.size(); i++)
+        al.lookup(&vals[i]);
+
+    EXPECT_EQ(al.select(), r0);
+    al.lookup(&vals[0]);
+    EXPECT_EQ(al.select(), r1);
+
+    code.gen_ret();
+    code.finish();
+}
+
+TEST(ralloc, move) {
+    func code("move");
+    alloc& al = code.get_alloc();
+
+    value a = code.gen_local_i64("a", 42);
+    reg r = a.r();
+    EXPECT_TRUE(a.is_dirty());
+
+    value b(std::move(a));
+    EXPECT_TRUE(a.is_dead());
+    EXPECT_EQ(b.r(), r);
+    EXPECT_TRUE(b.is_dirty()) << "dirty state lost when moving value";
+
+    code.gen_ret(b);
+    code.finish();
+
+    EXPECT_EQ(code(), 42);
+}
+
+TEST(ralloc, plan) {
+    func code("plan");
+    alloc& al = code.get_alloc();
+
+    std::vector<value> vals;
+    vals.reserve(NREGS);
+    for (int i = 0; i < NREGS - 2; i++)
+        vals.push_back(code.gen_local_i64("v" + std::to_string(i), i));
+
+    regplan<reg> plan;
+    for (size_t i = 0; i < vals.size(); i++)
+        plan.use(&vals[i], 10 + i);
+    plan.use(&vals[5], 100);
+
+    reg r5 = al.lookup(&vals[5]);
+    reg r7 = al.lookup(&vals[7]);
+    reg r13 = al.lookup(&vals[13]);
+
+    al.set_plan(&plan);
+
+    // the last value in the plan is needed furthest in the future
+    plan.advance(8);
+    EXPECT_EQ(al.select(&vals[0]), r13);
+
+    // all but v5 are no longer needed, prefer those that are clean
+    plan.advance(30);
+    EXPECT_NE(al.select(&vals[0]), r5);
+    al.store(r7);
+    EXPECT_EQ(al.select(&vals[0]), r7);
+
+    al.set_plan((const regplan<reg>*)nullptr);
+
+    code.gen_ret();
+    code.finish();
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static i64 helper(void* bptr) {
+    return 0;
+}
+
+TEST(remat, constants) {
+    func code("constants", 4 * KiB);
+    value k = code.gen_scratch_i64("k", 0x123456789abcdefll, RCX);
+    value s = code.gen_scratch_i64("s", -7, RDX);
+
+    // both live in volatile registers, which the call needs to flush
+    code.gen_call(helper);
+    EXPECT_FALSE(k.is_reg());
+    EXPECT_FALSE(k.is_dead()) << "constant lost during flush";
+    EXPECT_FALSE(s.is_dead()) << "constant lost during flush";
+
+    value sum = code.gen_local_i64("sum", 0);
+    code.gen_add(sum, k);
+    code.gen_add(sum, s);
+    code.gen_ret(sum);
+    code.finish();
+
+    // code after returning can only be reached through labels
+    EXPECT_TRUE(k.is_dead());
+    EXPECT_EQ(code(), 0x123456789abcdefll - 7);
+}
+
+TEST(remat, cheapest) {
+    i64 data[4] = { 0 };
+    cbuf buffer(4 * KiB);
+    func code("cheapest", buffer, data);
+    alloc& al = code.get_alloc();
+
+    const i64 near_data = (i64)(data + 2);
+    const i64 near_code = (i64)buffer.get_code_ptr() + 64;
+    const i64 small = 0x7fffffff;
+
+    value a = code.gen_scratch_i64("a", near_data, RCX);
+    value b = code.gen_scratch_i64("b", near_code, RDX);
+    value c = code.gen_scratch_i64("c", small, RSI);
+    code.gen_call(helper);
+
+    // lea rax, [rbp + 16]
+    u8* ptr = buffer.get_code_ptr();
+    EXPECT_EQ(al.fetch(&a, RAX), RAX);
+    EXPECT_EQ(buffer.get_code_ptr() - ptr, 4);
+
+    // lea rcx, [rip + disp32]
+    ptr = buffer.get_code_ptr();
+    EXPECT_EQ(al.fetch(&b, RCX), RCX);
+    EXPECT_EQ(buffer.get_code_ptr() - ptr, 7);
+
+    // mov edx, imm32
+    ptr = buffer.get_code_ptr();
+    EXPECT_EQ(al.fetch(&c, RDX), RDX);
+    EXPECT_EQ(buffer.get_code_ptr() - ptr, 5);
+
+    code.gen_sub(a, b);
+    code.gen_add(a, c);
+    code.gen_ret(a);
+    code.finish();
+
+    EXPECT_EQ(code.exec(), near_data - near_code + small);
+}
+
+static i64 far_globals[4];
+
+TEST(remat, globals) {
+    i64 data = 0;
+    func code("globals", 4 * KiB);
+    code.set_data_ptr(&data);
+
+    far_globals[0] = 40;
+    far_globals[1] = 2;
+
+    value a = code.gen_global_i64("a", &far_globals[0]);
+    value b = code.gen_global_i64("b", &far_globals[1]);
+
+    u8* ptr = code.get_cbuffer().get_code_ptr();
+    a.fetch();
+    size_t first = code.get_cbuffer().get_code_ptr() - ptr;
+
+    // the second global shares the base address of the first one
+    ptr = code.get_cbuffer().get_code_ptr();
+    b.fetch();
+    size_t second = code.get_cbuffer().get_code_ptr() - ptr;
+    EXPECT_LE(second, 4);
+    EXPECT_LE(second, first);
+
+    code.gen_add(a, b);
+    code.gen_ret(a);
+    code.finish();
+
+    EXPECT_EQ(code(), 42);
+    EXPECT_EQ(far_globals[0], 42);
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+// builds a switch over n cases where case i returns 100 + i, cases that are
+// not in 'present' fall through and return -1
+static void build(func& code, void* idx, size_t n, const vector<bool>& present,
+                  int idx_bits = 32) {
+    value v = code.gen_global_val("idx", idx_bits, idx);
+
+    vector<label> cases;
+    cases.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        cases.push_back(code.gen_label("case" + std::to_string(i)));
+
+    vector<label*> targets;
+    for (size_t i = 0; i < n; i++)
+        targets.push_back(present[i] ? &cases[i] : nullptr);
+
+    code.gen_switch(v, targets);
+    code.gen_ret(-1);
+
+    for (size_t i = 0; i < n; i++) {
+        if (!present[i])
+            continue;
+        cases[i].place();
+        code.gen_ret(100 + i);
+    }
+
+    code.finish();
+}
+
+TEST(switch, dense) {
+    u32 idx = 0;
+    const size_t n = 8;
+
+    func code("dense", 4 * KiB);
+    build(code, &idx, n, vector<bool>(n, true));
+
+    for (idx = 0; idx < n; idx++)
+        EXPECT_EQ(code.exec(), 100 + (i64)idx);
+
+    for (u32 oob : { 8u, 9u, 1000u, 0x80000000u, ~0u }) {
+        idx = oob;
+        EXPECT_EQ(code.exec(), -1) << oob;
+    }
+}
+
+TEST(switch, holes) {
+    u32 idx = 0;
+    const size_t n = 12;
+    vector<bool> present(n, true);
+    present[3] = present[7] = present[11] = false;
+
+    func code("holes", 4 * KiB);
+    build(code, &idx, n, present);
+
+    for (idx = 0; idx < n + 2; idx++) {
+        i64 expect = idx < n && present[idx] ? 100 + (i64)idx : -1;
+        EXPECT_EQ(code.exec(), expect) << idx;
+    }
+}
+
+TEST(switch, sparse) {
+    u32 idx = 0;
+    const size_t n = 64;
+    vector<bool> present(n, false);
+    present[1] = present[40] = present[63] = true;
+
+    func code("sparse", 4 * KiB);
+    build(code, &idx, n, present, 16);
+
+    // compare chain instead of a mostly empty table
+    EXPECT_LT(code.size(), n * sizeof(i32));
+
+    for (idx = 0; idx < n + 2; idx++) {
+        i64 expect = idx < n && present[idx] ? 100 + (i64)idx : -1;
+        EXPECT_EQ(code.exec(), expect) << idx;
+    }
+}
+
+TEST(switch, large) {
+    u64 idx = 0;
+    const size_t n = 300;
+
+    func code("large", 16 * KiB);
+    build(code, &idx, n, vector<bool>(n, true), 64);
+
+    for (idx = 0; idx < n + 5; idx++) {
+        i64 expect = idx < n ? 100 + (i64)idx : -1;
+        EXPECT_EQ(code.exec(), expect) << idx;
+    }
+}
+
+// loops back into a label that expects values in registers, which requires
+// the switch to enter it through a stub that reloads them
+static i64 loop_switch(size_t n) {
+    func code("loop", 4 * KiB);
+
+    value i = code.gen_local_i64("i", 0);
+    value acc = code.gen_local_i64("acc", 0);
+
+    label loop = code.gen_label("loop");
+    label out = code.gen_label("out");
+    loop.place();
+
+    code.gen_add(acc, i);
+    code.gen_add(i, 1);
+
+    vector<label*> targets(n + 1, &loop);
+    targets[0] = nullptr;
+    targets[n] = &out;
+    code.gen_switch(i, targets);
+
+    out.place();
+    code.gen_ret(acc);
+    code.finish();
+
+    return code();
+}
+
+TEST(switch, stubs) {
+    EXPECT_EQ(loop_switch(2), 1);
+    EXPECT_EQ(loop_switch(3), 3);
+    EXPECT_EQ(loop_switch(8), 28);
+}
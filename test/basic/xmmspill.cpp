@@ -0,0 +1,194 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright 2019 Jan Henrik Weinstock                                        *
+ *                                                                            *
+ * Licensed under the Apache License, Version 2.0 (the "License");            *
+ * you may not use this file except in compliance with the License.           *
+ * You may obtain a copy of the License at                                    *
+ *                                                                            *
+ *     http://www.apache.org/licenses/LICENSE-2.0                             *
+ *                                                                            *
+ * Unless required by applicable law or agreed to in writing, software        *
+ * distributed under the License is distributed on an "AS IS" BASIS,          *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   *
+ * See the License for the specific language governing permissions and        *
+ * limitations under the License.                                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include "ftl.h"
+
+using namespace ftl;
+
+static i64 data[24];
+
+static i64 total(void* bptr) {
+    i64 sum = 0;
+    for (i64 val : data)
+        sum += val;
+    return sum;
+}
+
+static void setup(vector<value>& vals, func& code, i64 n) {
+    vals.reserve(n);
+    for (i64 i = 0; i < n; i++) {
+        data[i] = i;
+        string name = "g" + std::to_string(i);
+        vals.push_back(code.gen_global_i64(name, &data[i]));
+        code.gen_add(vals.back(), vals.back());
+    }
+}
+
+TEST(xmmspill, pressure) {
+    func code("pressure", 4 * KiB);
+    code.set_data_ptr(data);
+    alloc& al = code.get_alloc();
+    al.set_xmm_spill(true);
+
+    vector<value> vals;
+    setup(vals, code, 24);
+
+    // there are not enough general purpose registers for all values
+    EXPECT_TRUE(al.is_spilled(&vals[0]));
+    EXPECT_GT(al.count_spills(), 0);
+    EXPECT_EQ(al.count_spills() + al.count_dirty_regs(), 24);
+
+    value sum = code.gen_local_i64("sum", 0);
+    for (value& val : vals)
+        code.gen_add(sum, val);
+    code.gen_ret(sum);
+    code.finish();
+
+    EXPECT_EQ(al.count_spills(), 0);
+    EXPECT_EQ(code(), 2 * 23 * 24 / 2);
+    for (i64 i = 0; i < 24; i++)
+        EXPECT_EQ(data[i], 2 * i);
+}
+
+TEST(xmmspill, movq) {
+    func code("movq", 4 * KiB);
+    code.set_data_ptr(data);
+    alloc& al = code.get_alloc();
+    al.set_xmm_spill(true);
+
+    vector<value> vals;
+    setup(vals, code, 8);
+
+    value& val = vals.back();
+    reg r = val.r();
+    ASSERT_TRUE(reg_valid(r));
+    ASSERT_TRUE(al.is_dirty(r));
+
+    // movq xmm, r64 instead of a store to memory
+    u8* ptr = code.get_cbuffer().get_code_ptr();
+    al.flush(r);
+    EXPECT_TRUE(al.is_spilled(&val));
+    EXPECT_TRUE(val.is_dirty());
+    EXPECT_EQ(code.get_cbuffer().get_code_ptr() - ptr, 5);
+    EXPECT_EQ(ptr[0], 0x66);
+    EXPECT_EQ(ptr[3], 0x6e);
+
+    // movq r64, xmm instead of a load from memory
+    ptr = code.get_cbuffer().get_code_ptr();
+    val.fetch();
+    EXPECT_FALSE(al.is_spilled(&val));
+    EXPECT_TRUE(al.is_dirty(val.r()));
+    EXPECT_EQ(code.get_cbuffer().get_code_ptr() - ptr, 5);
+    EXPECT_EQ(ptr[0], 0x66);
+    EXPECT_EQ(ptr[3], 0x7e);
+
+    code.gen_ret();
+    code.finish();
+    code();
+
+    for (i64 i = 0; i < 8; i++)
+        EXPECT_EQ(data[i], 2 * i);
+}
+
+TEST(xmmspill, calls) {
+    func code("calls", 4 * KiB);
+    code.set_data_ptr(data);
+    alloc& al = code.get_alloc();
+    al.set_xmm_spill(true);
+
+    vector<value> vals;
+    setup(vals, code, 24);
+    EXPECT_GT(al.count_spills(), 0);
+
+    // spilled values do not survive calls, the callee reads memory
+    value sum = code.gen_call(CALL_STATE_READ, total);
+    EXPECT_EQ(al.count_spills(), 0);
+
+    code.gen_add(sum, vals[0]);
+    code.gen_ret(sum);
+    code.finish();
+
+    EXPECT_EQ(code(), 2 * 23 * 24 / 2);
+}
+
+TEST(xmmspill, loops) {
+    func code("loops", 4 * KiB);
+    code.set_data_ptr(data);
+    alloc& al = code.get_alloc();
+    al.set_xmm_spill(true);
+
+    vector<value> vals;
+    setup(vals, code, 24);
+
+    value i = code.gen_local_i64("i", 0);
+    label loop = code.gen_label("loop");
+    loop.place();
+
+    for (value& val : vals)
+        code.gen_add(val, 1);
+
+    code.gen_add(i, 1);
+    code.gen_cmp(i, 10);
+    code.gen_jl(loop);
+    code.gen_ret();
+    code.finish();
+
+    code();
+
+    for (i64 j = 0; j < 24; j++)
+        EXPECT_EQ(data[j], 2 * j + 10);
+}
+
+TEST(xmmspill, fpfirst) {
+    func code("fpfirst", 4 * KiB);
+    code.set_data_ptr(data);
+    alloc& al = code.get_alloc();
+    al.set_xmm_spill(true);
+
+    vector<value> vals;
+    setup(vals, code, 24);
+    EXPECT_GT(al.count_spills(), 0);
+
+    // floating point values get all xmm registers back
+    vector<scalar> fps;
+    fps.reserve(NXMM);
+    for (int i = 0; i < NXMM; i++)
+        fps.push_back(code.gen_local_f64("f" + std::to_string(i), 0.5));
+
+    EXPECT_EQ(al.count_spills(), 0);
+    for (const scalar& f : fps)
+        EXPECT_TRUE(f.is_reg());
+
+    value sum = code.gen_local_i64("sum", 0);
+    for (value& val : vals)
+        code.gen_add(sum, val);
+
+    scalar fsum = code.gen_local_f64("fsum", 0.0);
+    for (scalar& f : fps)
+        code.gen_add(fsum, f);
+
+    value conv = code.gen_local_i64("conv");
+    code.gen_cvt(conv, fsum);
+    code.gen_add(sum, conv);
+    code.gen_ret(sum);
+    code.finish();
+
+    EXPECT_EQ(code(), 2 * 23 * 24 / 2 + NXMM / 2);
+}